@@ -2,24 +2,57 @@
 //!
 //! A arena allocator functions allocates objects of a specific size & alignment.
 //!
-//! It keeps track of free slots with a linked lists of pointers, terminated by a null pointer.
-//! Consequently, the minimum alignment is that of an `usize`.
+//! It keeps track of free slots with a linked lists of indices. The head of the list is tagged
+//! with a counter that is incremented on every change to avoid ABA problems. Consequently, the
+//! amount of slots is limited to what fits in half an `usize`.
 //!
 //! The minimum size of a slot is 2 times the size of an `usize` as each slot is an enum. This
 //! is so indexing in the arena is possible.
 //!
-//! If no free slots are available, a new page is allocated & the linked list is repopulated.
+//! If no free slots are available, the next page is allocated & its slots are added to the
+//! free list. Slots never straddle pages, so the arena can grow without moving any items.
 //!
-//! It is currently unable to free pages, so memory peaks have permanent effects.
+//! Each hart keeps a small magazine of free slots so inserting and removing items on the same
+//! hart rarely touches the shared free list. Once a magazine is full, the oldest half of it is
+//! pushed to the free list as a single chain.
+//!
+//! The first pages of the range hold the magazines and a counter for each page of slots. A
+//! counter holds the amount of slots of its page that are not on the free list, i.e. that are
+//! in use or in a magazine, plus the amount of threads briefly pinning the page. A page whose
+//! counter drops to zero only has free slots, so it can be unmapped and given back to
+//! [`memory`]. Enough free slots are kept around to avoid mapping and unmapping the same page
+//! over and over. Reclaimed pages are reused before the arena grows any further.
 
-use crate::arch::vms::VirtualMemorySystem;
+use crate::arch::vms::{PrivateOrShared, VirtualMemorySystem};
 use crate::arch::*;
 use crate::memory;
+use crate::task::Executor;
 use core::mem;
 use core::ops::Deref;
 use core::ptr;
 use core::ptr::NonNull;
-use core::sync::atomic::{AtomicUsize, Ordering};
+use core::sync::atomic::{AtomicBool, AtomicU32, AtomicUsize, Ordering};
+
+/// The amount of bits used for the index in the head of the free list.
+const INDEX_BITS: u32 = usize::BITS / 2;
+
+/// The index marking the end of the free list.
+const END: usize = (1 << INDEX_BITS) - 1;
+
+/// The amount of free slots a single magazine can hold.
+const MAGAZINE_LEN: usize = 15;
+
+/// The amount of magazines, i.e. the amount of harts that can cache free slots.
+const MAGAZINES: usize = Page::SIZE / mem::size_of::<Magazine>();
+
+/// The amount of page counters that fit in a single page.
+const COUNTERS_PER_PAGE: usize = Page::SIZE / mem::size_of::<AtomicU32>();
+
+/// Set in the counter of a page that has been reclaimed.
+const RECLAIMED: u32 = 1 << 31;
+
+/// The maximum amount of pages reclaimed in one go.
+const RECLAIM_BATCH: usize = 8;
 
 /// The value inside a slot.
 union SlotValue<T> {
@@ -35,14 +68,29 @@ struct Slot<T> {
 	value: SlotValue<T>,
 }
 
+/// Free slots cached by a single hart. The newest slot is at the end.
+#[repr(C)]
+struct Magazine {
+	len: u32,
+	slots: [u32; MAGAZINE_LEN],
+}
+
 /// An arena allocator
 pub struct Arena<T> {
-	/// The start pointer to all free slots.
+	/// The start of the range, which holds the magazines followed by the page counters.
+	meta: NonNull<u8>,
+	/// The start pointer to all slots.
 	slots: NonNull<Slot<T>>,
-	/// An index to the next free slot.
+	/// An index to the next free slot in the lower half and a tag in the upper half.
 	next: AtomicUsize,
-	/// The amount of allocated slots.
+	/// The approximate amount of slots on the free list.
+	free: AtomicUsize,
+	/// The amount of allocated slots, including those in reclaimed pages.
 	capacity: AtomicUsize,
+	/// The amount of mapped pages at the start of the range.
+	meta_pages: AtomicUsize,
+	/// Whether a page is being added or reclaimed.
+	growing: AtomicBool,
 	/// The maximum amount of slots.
 	max: usize,
 }
@@ -64,105 +112,427 @@ pub enum RemoveError {
 }
 
 impl<T> Arena<T> {
+	/// The amount of slots in a single page.
+	const SLOTS_PER_PAGE: usize = Page::SIZE / mem::size_of::<Slot<T>>();
+
 	/// Create a new `Arena` with governance over the given range of memory.
 	///
 	/// # Safety
 	///
 	/// The memory range may not be in use by anything else.
 	///
-	/// The `address` must be properly aligned.
+	/// The `address` must be page aligned.
 	pub const unsafe fn new(address: NonNull<T>, bytes: usize) -> Self {
 		// Ensure we can fit T in a single page. This keeps things simple for now.
 		// TODO use `const _: usize = ...` for this somehow.
 		assert!(crate::arch::Page::SIZE >= mem::size_of::<Slot<T>>());
+		let pages = bytes / Page::SIZE;
+		let meta_pages = 1 + (pages + COUNTERS_PER_PAGE - 1) / COUNTERS_PER_PAGE;
+		let max = pages.saturating_sub(meta_pages) * Self::SLOTS_PER_PAGE;
+		let meta = address.cast::<u8>();
 		Self {
-			slots: address.cast(),
-			next: AtomicUsize::new(usize::MAX),
+			meta,
+			slots: NonNull::new_unchecked(meta.as_ptr().add(meta_pages * Page::SIZE)).cast(),
+			next: AtomicUsize::new(END),
+			free: AtomicUsize::new(0),
 			capacity: AtomicUsize::new(0),
-			max: bytes / mem::size_of::<Slot<T>>(),
+			meta_pages: AtomicUsize::new(0),
+			growing: AtomicBool::new(false),
+			max: if max < END { max } else { END },
+		}
+	}
+
+	/// Return a pointer to the slot with the given index.
+	///
+	/// The slot may not be mapped.
+	fn slot(&self, index: usize) -> *mut Slot<T> {
+		let (page, offset) = (index / Self::SLOTS_PER_PAGE, index % Self::SLOTS_PER_PAGE);
+		let offset = page * Page::SIZE + offset * mem::size_of::<Slot<T>>();
+		unsafe { self.slots.as_ptr().cast::<u8>().add(offset).cast() }
+	}
+
+	/// Return the counter of the given page of slots.
+	///
+	/// The page must be below the capacity.
+	fn counter(&self, page: usize) -> &AtomicU32 {
+		// SAFETY: counters are mapped before the capacity covers their pages and are never
+		// unmapped.
+		unsafe {
+			&*self
+				.meta
+				.as_ptr()
+				.add(Page::SIZE)
+				.cast::<AtomicU32>()
+				.add(page)
+		}
+	}
+
+	/// Prevent the page of the given slot from being reclaimed. Returns `false` if it has been
+	/// reclaimed already.
+	fn pin(&self, index: usize) -> bool {
+		let counter = self.counter(index / Self::SLOTS_PER_PAGE);
+		let pinned = counter.fetch_add(1, Ordering::Acquire) & RECLAIMED == 0;
+		if !pinned {
+			counter.fetch_sub(1, Ordering::Relaxed);
 		}
+		pinned
+	}
+
+	/// Undo a pin or account for a slot that has been put on the free list. Returns `true` if
+	/// all slots of the page are on the free list now.
+	fn unpin(&self, index: usize) -> bool {
+		let counter = self.counter(index / Self::SLOTS_PER_PAGE);
+		counter.fetch_sub(1, Ordering::Release) == 1
+	}
+
+	/// Return the magazine of the current hart, if it has one.
+	///
+	/// # Safety
+	///
+	/// The reference may not outlive the caller, as anything else running on this hart may
+	/// use the magazine too.
+	#[allow(clippy::mut_from_ref)]
+	unsafe fn magazine(&self) -> Option<&mut Magazine> {
+		let hart = usize::from(Executor::try_id()?);
+		// The magazines are mapped before the capacity first increases.
+		(hart < MAGAZINES && self.capacity.load(Ordering::Acquire) > 0)
+			.then(|| &mut *self.meta.as_ptr().cast::<Magazine>().add(hart))
+	}
+
+	/// Combine an index with the tag of the given head of the free list.
+	fn tag(head: usize, index: usize) -> usize {
+		((head >> INDEX_BITS).wrapping_add(1) << INDEX_BITS) | index
 	}
 
 	/// Allocate a slot and return the index.
 	pub fn insert<'a>(&'a self, item: T) -> Result<usize, InsertError> {
 		loop {
-			let index = self.next.load(Ordering::Relaxed);
-			if index != usize::MAX {
-				let slot = unsafe { &*self.slots.as_ptr().add(index) };
-				if slot
-					.ref_counter
-					.compare_exchange_weak(usize::MAX, 0, Ordering::Relaxed, Ordering::Relaxed)
-					.is_ok()
-				{
-					// SAFETY: we have exclusive access to the slot.
-					unsafe {
-						let slot = &mut *self.slots.as_ptr().add(index);
-						// Even if another thread would read this value again before we finish
-						// writing, it'll fail the compare_exchange check anyways.
-						self.next.store(slot.value.next, Ordering::Relaxed);
-						slot.value.item = mem::ManuallyDrop::new(item);
-					}
-					return Ok(index);
+			if let Some(index) = self.take() {
+				// SAFETY: we have exclusive access to the slot.
+				unsafe {
+					let slot = &mut *self.slot(index);
+					slot.value.item = mem::ManuallyDrop::new(item);
+					slot.ref_counter.store(0, Ordering::Release);
+				}
+				return Ok(index);
+			} else if self
+				.growing
+				.compare_exchange_weak(false, true, Ordering::Acquire, Ordering::Relaxed)
+				.is_ok()
+			{
+				// Another thread may have freed a slot in the meantime.
+				if self.next.load(Ordering::Relaxed) & END != END {
+					self.growing.store(false, Ordering::Release);
+					continue;
+				}
+				let ret = self.grow(item);
+				self.growing.store(false, Ordering::Release);
+				return ret;
+			}
+			// Something else is already loading or reclaiming a page, just wait & retry.
+		}
+	}
+
+	/// Take a free slot, preferring those in the magazine of the current hart.
+	fn take(&self) -> Option<usize> {
+		// SAFETY: the magazine doesn't escape this function.
+		let magazine = match unsafe { self.magazine() } {
+			Some(m) => m,
+			None => return self.pop_free(),
+		};
+		// Only fill half of the magazine so the next few removals still fit.
+		while (magazine.len as usize) < MAGAZINE_LEN / 2 {
+			match self.pop_free() {
+				Some(i) => {
+					magazine.slots[magazine.len as usize] = i as u32;
+					magazine.len += 1;
+				}
+				None => break,
+			}
+		}
+		(magazine.len > 0).then(|| {
+			magazine.len -= 1;
+			magazine.slots[magazine.len as usize] as usize
+		})
+	}
+
+	/// Take a slot from the free list.
+	fn pop_free(&self) -> Option<usize> {
+		loop {
+			let head = self.next.load(Ordering::Acquire);
+			let index = head & END;
+			if index == END {
+				return None;
+			}
+			// If the page has been reclaimed the head has changed too.
+			if !self.pin(index) {
+				continue;
+			}
+			// This value may be garbage if another thread took the slot in the meantime,
+			// but then the tag will have changed and the compare_exchange fails.
+			let next = unsafe { ptr::addr_of!((*self.slot(index)).value.next).read_volatile() };
+			if self
+				.next
+				.compare_exchange_weak(
+					head,
+					Self::tag(head, next),
+					Ordering::Acquire,
+					Ordering::Relaxed,
+				)
+				.is_ok()
+			{
+				// Keep the pin, as the slot is no longer on the free list.
+				self.free.fetch_sub(1, Ordering::Relaxed);
+				return Some(index);
+			}
+			self.unpin(index);
+		}
+	}
+
+	/// Map a page with slots, put the item in the first slot and add the other slots to the
+	/// free list. Reclaimed pages are reused first.
+	///
+	/// Only one thread may be growing the arena at any time.
+	fn grow(&self, item: T) -> Result<usize, InsertError> {
+		let cap = self.capacity.load(Ordering::Relaxed);
+		let pages = (cap + Self::SLOTS_PER_PAGE - 1) / Self::SLOTS_PER_PAGE;
+		let reclaimed =
+			(0..pages).find(|&p| self.counter(p).load(Ordering::Relaxed) & RECLAIMED != 0);
+		let (first, end) = match reclaimed {
+			Some(p) => (
+				p * Self::SLOTS_PER_PAGE,
+				((p + 1) * Self::SLOTS_PER_PAGE).min(cap),
+			),
+			None if cap < self.max => (cap, (cap + Self::SLOTS_PER_PAGE).min(self.max)),
+			None => return Err(InsertError::NoFreeSlots),
+		};
+		let page = first / Self::SLOTS_PER_PAGE;
+
+		// Map the magazines and the counters of the new page if they aren't yet.
+		let mut mapped = self.meta_pages.load(Ordering::Relaxed);
+		while mapped <= 1 + page / COUNTERS_PER_PAGE {
+			let meta = unsafe { self.meta.as_ptr().add(mapped * Page::SIZE) };
+			Self::map(meta)?;
+			unsafe { meta.write_bytes(0, Page::SIZE) };
+			mapped += 1;
+			self.meta_pages.store(mapped, Ordering::Relaxed);
+		}
+		Self::map(self.slot(first).cast())?;
+
+		unsafe {
+			self.slot(first).write(Slot {
+				ref_counter: AtomicUsize::new(0),
+				value: SlotValue {
+					item: mem::ManuallyDrop::new(item),
+				},
+			});
+			for i in first + 1..end {
+				let next = if i + 1 < end { i + 1 } else { END };
+				self.slot(i).write(Slot {
+					ref_counter: AtomicUsize::new(usize::MAX),
+					value: SlotValue { next },
+				});
+			}
+		}
+		// Only the slot with the item is not on the free list.
+		if reclaimed.is_some() {
+			// Threads may be trying to pin the page right now, so keep their increments.
+			self.counter(page)
+				.fetch_sub(RECLAIMED - 1, Ordering::Release);
+		} else {
+			self.counter(page).store(1, Ordering::Relaxed);
+			self.capacity.store(end, Ordering::Release);
+		}
+
+		if first + 1 < end {
+			self.push_free(first + 1, end - 1);
+			self.free.fetch_add(end - first - 1, Ordering::Relaxed);
+		}
+		Ok(first)
+	}
+
+	/// Map a page at the given address.
+	fn map(address: *mut u8) -> Result<(), InsertError> {
+		let page = memory::allocate().map_err(|_| InsertError::NoMemory)?;
+		VMS::add(
+			Page::new(NonNull::new(address).unwrap().cast()).unwrap(),
+			Map::Private(page),
+			vms::RWX::RW,
+			vms::Accessibility::KernelGlobal,
+		)
+		.expect("Page was already mapped");
+		Ok(())
+	}
+
+	/// Add a chain of free slots to the free list.
+	///
+	/// The `next` field of the last slot is overwritten. The caller must account for the
+	/// slots in [`Self::free`] and the page counters.
+	fn push_free(&self, first: usize, last: usize) {
+		let mut head = self.next.load(Ordering::Relaxed);
+		loop {
+			unsafe { (*self.slot(last)).value.next = head & END };
+			match self.next.compare_exchange_weak(
+				head,
+				Self::tag(head, first),
+				Ordering::Release,
+				Ordering::Relaxed,
+			) {
+				Ok(_) => return,
+				Err(h) => head = h,
+			}
+		}
+	}
+
+	/// Put a slot that has just been freed in the magazine of the current hart or on the free
+	/// list.
+	fn release(&self, index: usize) {
+		// SAFETY: the magazine doesn't escape this function.
+		match unsafe { self.magazine() } {
+			Some(magazine) => {
+				if magazine.len as usize == MAGAZINE_LEN {
+					self.flush(magazine, MAGAZINE_LEN / 2);
+				}
+				magazine.slots[magazine.len as usize] = index as u32;
+				magazine.len += 1;
+			}
+			None => {
+				self.push_free(index, index);
+				self.free.fetch_add(1, Ordering::Relaxed);
+				if self.unpin(index) {
+					self.try_reclaim();
 				}
+			}
+		}
+	}
+
+	/// Move the oldest `count` slots of a magazine to the free list.
+	fn flush(&self, magazine: &mut Magazine, count: usize) {
+		let len = magazine.len as usize;
+		let slots = &magazine.slots[..count];
+		for w in slots.windows(2) {
+			unsafe { (*self.slot(w[0] as usize)).value.next = w[1] as usize };
+		}
+		self.push_free(slots[0] as usize, slots[count - 1] as usize);
+		self.free.fetch_add(count, Ordering::Relaxed);
+		let mut empty = false;
+		for &i in slots {
+			empty |= self.unpin(i as usize);
+		}
+		magazine.slots.copy_within(count..len, 0);
+		magazine.len = (len - count) as u32;
+		if empty {
+			self.try_reclaim();
+		}
+	}
+
+	/// Unmap pages of which all slots are on the free list and give them back to [`memory`].
+	///
+	/// This does nothing if another thread is growing the arena or if there are too few free
+	/// slots.
+	fn try_reclaim(&self) {
+		let keep = 2 * Self::SLOTS_PER_PAGE;
+		if self.free.load(Ordering::Relaxed) < keep
+			|| self
+				.growing
+				.compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
+				.is_err()
+		{
+			return;
+		}
+
+		// Detach the free list so no thread can take slots of pages being reclaimed.
+		let mut head = self.next.load(Ordering::Relaxed);
+		while let Err(h) = self.next.compare_exchange_weak(
+			head,
+			Self::tag(head, END),
+			Ordering::Acquire,
+			Ordering::Relaxed,
+		) {
+			head = h;
+		}
+
+		// Pinned pages or pages with slots in a magazine won't have a zero counter.
+		let cap = self.capacity.load(Ordering::Relaxed);
+		let mut free = self.free.load(Ordering::Relaxed);
+		let (mut pages, mut count) = ([0; RECLAIM_BATCH], 0);
+		for p in 0..(cap + Self::SLOTS_PER_PAGE - 1) / Self::SLOTS_PER_PAGE {
+			if count >= RECLAIM_BATCH || free < keep {
+				break;
+			}
+			if self
+				.counter(p)
+				.compare_exchange(0, RECLAIMED, Ordering::Acquire, Ordering::Relaxed)
+				.is_ok()
+			{
+				pages[count] = p;
+				count += 1;
+				free -= Self::SLOTS_PER_PAGE;
+			}
+		}
+
+		// Put back all slots that aren't in a reclaimed page.
+		let (mut first, mut last, mut removed) = (END, END, 0);
+		let mut index = head & END;
+		while index != END {
+			let next = unsafe { (*self.slot(index)).value.next };
+			let page = index / Self::SLOTS_PER_PAGE;
+			if self.counter(page).load(Ordering::Relaxed) & RECLAIMED != 0 {
+				removed += 1;
 			} else {
-				let cap = self.capacity.load(Ordering::Relaxed);
-				if cap == usize::MAX {
-					// Something else is already loading a page, just wait & retry.
-				} else if cap == self.max {
-					return Err(InsertError::NoFreeSlots);
-				} else if self
-					.capacity
-					.compare_exchange_weak(cap, usize::MAX, Ordering::Relaxed, Ordering::Relaxed)
-					.is_ok()
-				{
-					let page = memory::allocate().map_err(|_| InsertError::NoMemory)?;
-					// FIXME don't allocate just the first page ya fuckwit
-					VMS::add(
-						Page::new(self.slots.cast()).unwrap(),
-						Map::Private(page),
-						vms::RWX::RW,
-						vms::Accessibility::KernelGlobal,
-					)
-					.expect("Page was already mapped");
-					// FIXME *sigh*
-					unsafe {
-						self.slots.as_ptr().write(Slot {
-							ref_counter: AtomicUsize::new(0),
-							value: SlotValue {
-								item: mem::ManuallyDrop::new(item),
-							},
-						})
-					};
-					self.capacity.store(cap + 1, Ordering::Relaxed);
-					return Ok(0); // FIXME WTF
+				if first == END {
+					first = index;
+				} else {
+					unsafe { (*self.slot(last)).value.next = index };
 				}
+				last = index;
+			}
+			index = next;
+		}
+		if first != END {
+			self.push_free(first, last);
+		}
+		self.free.fetch_sub(removed, Ordering::Relaxed);
+
+		for &p in &pages[..count] {
+			let page = NonNull::new(self.slot(p * Self::SLOTS_PER_PAGE)).unwrap();
+			match VMS::remove(Page::new(page.cast()).unwrap()) {
+				// SAFETY: nothing references the slots in the page anymore.
+				Ok(PrivateOrShared::Private(ppn)) => unsafe { memory::deallocate(ppn) },
+				r => panic!("Arena page was not mapped privately: {:?}", r),
 			}
 		}
+		self.growing.store(false, Ordering::Release);
 	}
 
 	/// Attempt to free a slot. Returns the original item if successful.
 	pub fn remove(&self, index: usize) -> Result<T, RemoveError> {
-		(index < self.capacity.load(Ordering::Relaxed))
-			.then(|| ())
-			.ok_or(RemoveError::NoItem)?;
-		loop {
-			let ptr = unsafe { self.slots.as_ptr().add(index) };
-			let slot = unsafe { &*ptr };
+		if index >= self.capacity.load(Ordering::Acquire) || !self.pin(index) {
+			return Err(RemoveError::NoItem);
+		}
+		let ptr = self.slot(index);
+		let slot = unsafe { &*ptr };
+		let ret = loop {
 			let val = slot.ref_counter.load(Ordering::Relaxed);
-			if val > 0 {
-				return Err(RemoveError::Referenced);
-			} else if val == usize::MAX {
-				return Err(RemoveError::NoItem);
+			if val == usize::MAX {
+				break Err(RemoveError::NoItem);
+			} else if val > 0 {
+				break Err(RemoveError::Referenced);
 			} else if slot
 				.ref_counter
-				.compare_exchange_weak(val, usize::MAX, Ordering::Relaxed, Ordering::Relaxed)
+				.compare_exchange_weak(val, usize::MAX, Ordering::Acquire, Ordering::Relaxed)
 				.is_ok()
 			{
 				// SAFETY: we have exclusive access at this point.
 				let item = unsafe { ptr::read(ptr).value.item };
-				return Ok(mem::ManuallyDrop::into_inner(item));
+				self.release(index);
+				break Ok(mem::ManuallyDrop::into_inner(item));
 			}
+		};
+		if self.unpin(index) {
+			self.try_reclaim();
 		}
+		ret
 	}
 }
 
@@ -172,30 +542,32 @@ where
 {
 	/// Return an item at an index, if any.
 	pub fn get<'a>(&'a self, index: usize) -> Option<Guard<'a, T>> {
-		(index < self.capacity.load(Ordering::Relaxed))
-			.then(|| unsafe { &*self.slots.as_ptr().add(index) })
-			.and_then(|slot| loop {
-				let val = slot.ref_counter.load(Ordering::Relaxed);
-				if val != usize::MAX {
-					if slot
-						.ref_counter
-						.compare_exchange_weak(val, val + 1, Ordering::Relaxed, Ordering::Relaxed)
-						.is_ok()
-					{
-						let (item, counter) = (unsafe { &*slot.value.item }, &slot.ref_counter);
-						return Some(Guard { item, counter });
-					}
-				} else {
-					return None;
-				}
-			})
+		if index >= self.capacity.load(Ordering::Acquire) || !self.pin(index) {
+			return None;
+		}
+		let slot = unsafe { &*self.slot(index) };
+		let ret = loop {
+			let val = slot.ref_counter.load(Ordering::Relaxed);
+			if val == usize::MAX {
+				break None;
+			} else if slot
+				.ref_counter
+				.compare_exchange_weak(val, val + 1, Ordering::Acquire, Ordering::Relaxed)
+				.is_ok()
+			{
+				let (item, counter) = (unsafe { &*slot.value.item }, &slot.ref_counter);
+				break Some(Guard { item, counter });
+			}
+		};
+		// A referenced item keeps its page mapped by itself.
+		self.unpin(index);
+		ret
 	}
 
-	/// Iterate over all the elements in the arena.
-	#[allow(dead_code)]
-	pub fn iter<'a>(&'a self) -> impl Iterator<Item = Guard<'a, T>> + 'a {
-		let cap = self.capacity.load(Ordering::Relaxed);
-		(0..cap).flat_map(move |i| self.get(i))
+	/// Iterate over all the elements in the arena along with their indices.
+	pub fn iter<'a>(&'a self) -> impl Iterator<Item = (usize, Guard<'a, T>)> + 'a {
+		let cap = self.capacity.load(Ordering::Acquire);
+		(0..cap).flat_map(move |i| self.get(i).map(|g| (i, g)))
 	}
 }
 
@@ -210,7 +582,7 @@ pub struct Guard<'a, T> {
 
 impl<T> Drop for Guard<'_, T> {
 	fn drop(&mut self) {
-		self.counter.fetch_sub(1, Ordering::Relaxed);
+		self.counter.fetch_sub(1, Ordering::Release);
 	}
 }
 
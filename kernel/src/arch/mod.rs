@@ -147,6 +147,42 @@ pub fn schedule_timer(delay: u64) {
 	riscv::sbi::set_timer(current_time().checked_add(delay).unwrap_or(u64::MAX));
 }
 
+/// Return the IDs of all harts that can be started with [`start_hart`].
+#[inline]
+pub fn stopped_harts() -> impl Iterator<Item = u16> {
+	riscv::smp::stopped_harts()
+}
+
+/// Start another hart, which will call `main_secondary` once the current hart releases the
+/// kernel lock.
+#[inline]
+pub fn start_hart(id: u16) -> Result<(), ()> {
+	riscv::smp::start_hart(id).map_err(|_| ())
+}
+
+/// Mark the current hart as online, i.e. able to receive IPIs.
+#[inline]
+pub fn set_hart_online(id: u16) {
+	riscv::smp::set_online(id)
+}
+
+/// Interrupt another hart so it schedules a task.
+#[inline]
+pub fn send_ipi(id: u16) {
+	riscv::smp::send_ipi(id)
+}
+
+/// Release the kernel lock so other harts can enter the kernel.
+///
+/// # Safety
+///
+/// The current hart must hold the lock and may not touch any kernel state until it takes it
+/// again, which happens on the next trap.
+#[inline]
+pub unsafe fn release_kernel_lock() {
+	riscv::smp::release_kernel_lock()
+}
+
 /// Return the current time in microseconds.
 #[inline]
 pub fn current_time() -> u64 {
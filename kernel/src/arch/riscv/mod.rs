@@ -11,6 +11,7 @@
 pub(super) mod plic;
 pub mod rv64;
 pub mod sbi;
+pub mod smp;
 pub mod vms;
 
 use core::ptr;
@@ -37,6 +38,19 @@ impl RegisterState {
 	pub fn set_stack_pointer(&mut self, address: *const ()) {
 		self.x[2 - 1] = address as usize;
 	}
+
+	/// Set the thread pointer to the given address.
+	#[inline(always)]
+	pub fn set_thread_pointer(&mut self, address: *const ()) {
+		self.x[4 - 1] = address as usize;
+	}
+
+	/// Set the argument register with the given index (i.e. `a0` to `a7`).
+	#[inline(always)]
+	pub fn set_argument(&mut self, index: usize, value: usize) {
+		assert!(index < 8, "argument index out of range");
+		self.x[10 + index - 1] = value;
+	}
 }
 impl Default for RegisterState {
 	fn default() -> Self {
@@ -51,6 +65,9 @@ impl Default for RegisterState {
 /// Initialize arch-specific structures such as the interrupt table
 pub fn init() {
 	trap::init();
+	// Let user tasks read the cycle, time & instret counters.
+	// SAFETY: scounteren only controls access to the counters.
+	unsafe { asm!("csrw scounteren, {0}", in(reg) 0b111) };
 }
 
 const _: usize = 0 - (4096 - super::Page::SIZE); // Page size check
@@ -93,6 +110,7 @@ mod trap {
 
 	global_asm!(include_str!("types.s"));
 	global_asm!(include_str!("registers.s"));
+	global_asm!(include_str!("smp.s"));
 
 	global_asm!(include_str!("trap.s"));
 	global_asm!(include_str!("plic.s"));
@@ -107,6 +125,23 @@ mod trap {
 		unsafe { trap_init() };
 	}
 
+	/// Resolve a page fault of the current task at the given address.
+	///
+	/// Returns `false` if the fault can't be resolved.
+	#[export_name = "trap_fault_in"]
+	extern "C" fn fault_in(address: usize, write: bool) -> bool {
+		use crate::arch::{vms::VirtualMemorySystem, Page, PAGE_MASK, VMS};
+		crate::trace::record(crate::trace::Kind::PageFault, address, write.into());
+		let resolved = Page::from_usize(address & !PAGE_MASK)
+			.ok()
+			.and_then(|page| VMS::fault_in(page, write).ok())
+			.unwrap_or(false);
+		if resolved {
+			crate::task::Executor::current_task().count_mapped_pages(1);
+		}
+		resolved
+	}
+
 	extern "C" {
 		fn trap_init();
 	}
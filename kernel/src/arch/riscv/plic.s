@@ -18,6 +18,8 @@ external_interrupt_handler:
 	csrr			x30, sepc
 	gp_store		x30, 0 * GP_REGBYTES, x31
 
+	kernel_lock_acquire	t0, t1
+
 	# Fix kernel stack, needed for call later
 	# FIXME this causes UB with the pseudo task, as it has no valid stack
 	# pointer
@@ -44,6 +46,9 @@ external_interrupt_handler:
 	# s0 is used as we need to preserve it across a call.
 	lw		s0, 0(a0)
 
+	mv		a0, s0
+	call	trace_interrupt
+
 	# Figure out which task to send a notification to.
 	la		a0, plic_reservations
 	li		a2, GP_REGBYTES
@@ -98,8 +103,7 @@ notification_enter:
 
 	# Load the task's VMS
 	gp_load	t0, TASK_VMS, x31
-	csrw	satp, t0
-	sfence.vma
+	switch_vms	t0, t1
 
 	# Set sepc to that of the notification handler
 	gp_load		t0, 2 * GP_REGBYTES + REGSTATE_SIZE, x31
@@ -132,6 +136,8 @@ notification_enter:
 	csrs	sstatus, t0
 	# ==
 
+	kernel_lock_release	t0
+
 	# Load all registers except the stack pointer (x2), since
 	# the stack pointer is already loaded, and a[017] (x10/11/17).
 	load_gp_regs 1, 1, x31
@@ -25,3 +25,89 @@ pub fn set_timer(value: u64) {
 	}
 	unsafe { asm!("csrs sie, {0}", in(reg) (1 << 5) | (1 << 9)) };
 }
+
+/// The ID of the Hart State Management extension.
+const HSM: usize = 0x48534d;
+/// The ID of the IPI extension.
+const IPI: usize = 0x735049;
+/// The ID of the RFENCE extension.
+const RFENCE: usize = 0x52464e43;
+
+/// The status of a hart that is stopped and can be started with [`hart_start`].
+pub const HART_STOPPED: usize = 1;
+
+/// An error code returned by the SBI.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Error(pub isize);
+
+/// Perform a call with the given extension & function ID and return the value on success.
+///
+/// # Safety
+///
+/// The call must be safe to perform with the given arguments.
+unsafe fn call(eid: usize, fid: usize, args: [usize; 5]) -> Result<usize, Error> {
+	let (error, value): (isize, usize);
+	asm!(
+		"ecall",
+		inlateout("a0") args[0] => error,
+		inlateout("a1") args[1] => value,
+		in("a2") args[2],
+		in("a3") args[3],
+		in("a4") args[4],
+		in("a6") fid,
+		in("a7") eid,
+	);
+	if error == 0 {
+		Ok(value)
+	} else {
+		Err(Error(error))
+	}
+}
+
+/// Start a stopped hart at the given physical address. The hart begins executing in S-mode
+/// with paging disabled, with its ID in `a0` and `opaque` in `a1`.
+///
+/// # Safety
+///
+/// The code at the address must be able to run under these conditions.
+pub unsafe fn hart_start(hart_id: usize, address: usize, opaque: usize) -> Result<(), Error> {
+	call(HSM, 0, [hart_id, address, opaque, 0, 0]).map(|_| ())
+}
+
+/// Return the status of a hart, which fails if there is no hart with the given ID.
+pub fn hart_get_status(hart_id: usize) -> Result<usize, Error> {
+	// SAFETY: getting the status has no side effects.
+	unsafe { call(HSM, 2, [hart_id, 0, 0, 0, 0]) }
+}
+
+/// Send a supervisor software interrupt to all harts in `hart_mask`, which is offset by
+/// `hart_mask_base`.
+pub fn send_ipi(hart_mask: usize, hart_mask_base: usize) -> Result<(), Error> {
+	// SAFETY: software interrupts are handled like any other interrupt.
+	unsafe { call(IPI, 0, [hart_mask, hart_mask_base, 0, 0, 0]).map(|_| ()) }
+}
+
+/// Execute `sfence.vma` for the given range and address space on all harts in `hart_mask`.
+/// The entire address space is flushed if `size` is `usize::MAX`.
+pub fn remote_sfence_vma_asid(
+	hart_mask: usize,
+	hart_mask_base: usize,
+	start: usize,
+	size: usize,
+	asid: usize,
+) -> Result<(), Error> {
+	// SAFETY: flushing TLB entries has no effect other than a loss of performance.
+	unsafe { call(RFENCE, 2, [hart_mask, hart_mask_base, start, size, asid]).map(|_| ()) }
+}
+
+/// Execute `sfence.vma` for the given range of all address spaces on all harts in
+/// `hart_mask`. All entries are flushed if `size` is `usize::MAX`.
+pub fn remote_sfence_vma(
+	hart_mask: usize,
+	hart_mask_base: usize,
+	start: usize,
+	size: usize,
+) -> Result<(), Error> {
+	// SAFETY: ditto
+	unsafe { call(RFENCE, 1, [hart_mask, hart_mask_base, start, size, 0]).map(|_| ()) }
+}
@@ -0,0 +1,107 @@
+//! Support for running the kernel on multiple harts.
+//!
+//! Most of the kernel's state assumes it is only accessed by one hart at a time, so all harts
+//! share a single lock that is held whenever a hart runs kernel code. It is taken on every trap
+//! and released right before returning to a task or when the hart goes idle. Tasks spend most
+//! of their time in userspace, so harts rarely wait on each other.
+//!
+//! Harts other than the boot hart are started with the SBI HSM extension. Running harts are
+//! woken with inter-processor interrupts, which arrive as supervisor software interrupts, and
+//! TLB entries of other harts are flushed with the SBI RFENCE extension.
+
+use super::sbi;
+use crate::arch::vms::VirtualMemorySystem;
+use crate::arch::{Page, PAGE_MASK, VMS};
+use crate::memory::reserved;
+use core::mem;
+use core::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+
+/// The maximum amount of harts that can be used. Harts with a higher ID are ignored.
+pub const MAX_HARTS: u16 = 64;
+
+/// The lock held by the hart that is running kernel code. The boot hart holds it from the
+/// start.
+#[export_name = "smp_kernel_lock"]
+static KERNEL_LOCK: AtomicU32 = AtomicU32::new(1);
+
+/// The start of the stacks of all harts, for use by [`smp_hart_entry`].
+#[export_name = "smp_hart_stacks"]
+static HART_STACKS: usize =
+	unsafe { mem::transmute::<_, usize>(reserved::HART_STACKS.start.as_ptr()) };
+
+/// A bitmap of all harts that are running the kernel.
+static ONLINE: AtomicU64 = AtomicU64::new(0);
+
+extern "C" {
+	/// The entry point of harts started with [`start_hart`].
+	fn smp_hart_entry();
+}
+
+/// Release the kernel lock.
+///
+/// # Safety
+///
+/// The current hart must hold the lock and may not touch any shared state until it takes it
+/// again, which happens on the next trap.
+pub unsafe fn release_kernel_lock() {
+	KERNEL_LOCK.store(0, Ordering::Release);
+}
+
+/// Mark the given hart as online, i.e. able to receive IPIs and remote fences. It must be the
+/// current hart.
+pub fn set_online(hart: u16) {
+	ONLINE.fetch_or(1 << hart, Ordering::Relaxed);
+}
+
+/// Return the IDs of all harts that exist but haven't been started yet.
+pub fn stopped_harts() -> impl Iterator<Item = u16> {
+	(0..MAX_HARTS).filter(|&h| sbi::hart_get_status(h.into()) == Ok(sbi::HART_STOPPED))
+}
+
+/// Start a hart. It uses the VMS of the current hart and the stack at its index in
+/// `HART_STACKS`, which must be mapped already. Once it has taken the kernel lock it calls
+/// `main_secondary` with its ID.
+pub fn start_hart(hart: u16) -> Result<(), sbi::Error> {
+	assert!(hart < MAX_HARTS, "hart ID out of range");
+	// The hart starts with paging disabled, so it needs the physical address.
+	let entry = smp_hart_entry as usize;
+	let page = Page::from_usize(entry & !PAGE_MASK).unwrap();
+	let mut phys = [0];
+	VMS::physical_addresses(page, &mut phys).expect("hart entry point isn't mapped");
+	let satp: usize;
+	unsafe {
+		asm!("csrr {0}, satp", out(reg) satp);
+		sbi::hart_start(hart.into(), phys[0] | (entry & PAGE_MASK), satp)
+	}
+}
+
+/// Send an inter-processor interrupt to a hart.
+pub fn send_ipi(hart: u16) {
+	// The hart may have gone offline, in which case there is nothing to wake.
+	let _ = sbi::send_ipi(1 << hart, 0);
+}
+
+/// Flush `count` pages starting at the given address, or all pages if `None`, from the TLBs of
+/// all other online harts. Only entries of the given address space are flushed, or those of all
+/// address spaces if it is `None`.
+///
+/// This is needed whenever a mapping is changed or removed that may be cached by other harts.
+pub fn remote_flush(address: Option<Page>, count: usize, asid: Option<u16>) {
+	let current = match crate::task::Executor::try_id() {
+		Some(id) => id,
+		// No other harts are running yet.
+		None => return,
+	};
+	let others = ONLINE.load(Ordering::Relaxed) & !(1 << current);
+	if others == 0 {
+		return;
+	}
+	let (start, size) = address.map_or((0, usize::MAX), |p| {
+		(p.as_ptr() as usize, count * Page::SIZE)
+	});
+	let ret = match asid {
+		Some(asid) => sbi::remote_sfence_vma_asid(others as usize, 0, start, size, asid.into()),
+		None => sbi::remote_sfence_vma(others as usize, 0, start, size),
+	};
+	ret.expect("failed to flush TLB of other harts");
+}
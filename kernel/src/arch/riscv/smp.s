@@ -0,0 +1,65 @@
+## Support for running on multiple harts, see smp.rs
+
+# Take the kernel lock, waiting until no other hart holds it.
+.macro kernel_lock_acquire	tmp, tmp2
+	la		\tmp, smp_kernel_lock
+.Lkernel_lock_\@:
+	# Only try to take the lock once it looks free to avoid bouncing it between harts.
+	lw		\tmp2, 0(\tmp)
+	bnez	\tmp2, .Lkernel_lock_\@
+	li		\tmp2, 1
+	amoswap.w.aq	\tmp2, \tmp2, (\tmp)
+	bnez	\tmp2, .Lkernel_lock_\@
+.endm
+
+# Release the kernel lock.
+.macro kernel_lock_release	tmp
+	la		\tmp, smp_kernel_lock
+	amoswap.w.rl	zero, zero, (\tmp)
+.endm
+
+
+## Entry point of harts started with SBI HSM.
+##
+## Harts start with paging disabled. This code is position independent and aligned such that it
+## can't cross a page boundary, so it runs fine from its physical address until the VMS of the
+## boot hart is enabled. stvec then points to the virtual address of the next instruction, so
+## the fetch fault caused by the lack of an identity map lands there.
+##
+## Arguments:
+## - a0: The ID of this hart.
+## - a1: The satp value of the boot hart.
+.section .text
+	.balign	256
+smp_hart_entry:
+	ld		t0, 1f
+	csrw	stvec, t0
+	csrw	satp, a1
+	sfence.vma
+	jr		t0
+
+	.balign	8
+1:
+	.quad	2f
+
+2:
+	.option push
+	.option norelax
+	la		gp, _global_pointer
+	.option pop
+
+	# Use the stack of this hart, which is mapped by the boot hart before starting it.
+	la		t0, smp_hart_stacks
+	ld		t0, 0(t0)
+	addi	t1, a0, 1
+	slli	t1, t1, 12
+	add		sp, t0, t1
+	mv		ra, zero
+
+	# The boot hart keeps the lock until it set up everything.
+	kernel_lock_acquire	t0, t1
+	call	main_secondary
+
+0:
+	wfi
+	j		0b
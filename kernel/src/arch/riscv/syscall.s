@@ -46,8 +46,7 @@ syscall_io_notify_return:
 
 	# Setup the VMS
 	ld		t0, TASK_VMS (x31)
-	csrw	satp, t0
-	sfence.vma
+	switch_vms	t0, t1
 
 	# Setup sscratch
 	csrw	sscratch, x31
@@ -76,6 +75,8 @@ syscall_io_notify_return:
 	csrs	sstatus, t0
 	# ==
 
+	kernel_lock_release	t0
+
 	# Restore all registers except a[017] and sp
 	load_gp_regs	1, 9, x31
 	load_gp_regs	12, 16, x31
@@ -1,3 +1,9 @@
+# Another hart has work for this one, e.g. because it woke a task while this hart was idle.
+# Scheduling is all that needs to be done, just like when the time slice of a task ends.
+software_interrupt_handler:
+	csrci			sip, 1 << 1
+	j				timer_interrupt_handler
+
 timer_interrupt_handler:
 
 	# Save all the general purpose registers.
@@ -10,6 +16,8 @@ timer_interrupt_handler:
 	csrr			x30, sepc
 	gp_store		x30, 0 * GP_REGBYTES, x31
 
+	kernel_lock_acquire	t0, t1
+
 	# Fix kernel stack, needed for call later
 	# FIXME this causes UB with the pseudo task, as it has no valid stack
 	# pointer
@@ -5,7 +5,7 @@
 interrupt_table:
 	jal		zero, trap_handler	# User software interrupt _or_ instruction misaligned
 	.balign 4	# 1
-	j	mini_panic   # Supervisor software interrupt
+	j	software_interrupt_handler	# Supervisor software interrupt
 	.balign 4	# 2
 	j	mini_panic   # Reserved
 	.balign 4	# 3
@@ -54,14 +54,14 @@ sync_trap_table:
 	.balign 4	# 11
 	j	mini_panic # We shouldn't be able to catch M-mode syscalls
 	.balign 4	# 12
-	j	mini_panic
+	j	trap_page_fault
 	#ret
 	.balign 4	# 13
-	j	mini_panic
+	j	trap_page_fault
 	.balign 4	# 14
 	j	mini_panic
 	.balign 4	# 15
-	j	mini_panic
+	j	trap_page_fault
 
 ## Default handler for traps
 trap_handler:
@@ -75,6 +75,13 @@ trap_handler:
 	# Save registers x1 - x30
 	save_gp_regs	1, 30, x31
 
+	# Traps caused by the kernel itself happen with the lock already held.
+	csrr	t0, sstatus
+	andi	t0, t0, 1 << 8
+	bnez	t0, .Ltrap_handler_locked
+	kernel_lock_acquire	t0, t1
+.Ltrap_handler_locked:
+
 	# Save program counter
 	# We increase the counter by 4 bytes as ecall is also 4 bytes long
 	# & we don't want to execute it again.
@@ -114,6 +121,8 @@ trap_handler:
 	#j syscall_return_transparent
 
 syscall_return_transparent:
+	kernel_lock_release	t0
+
 	# Restore all integer registers
 	csrr		x31, sscratch
 	load_gp_regs	1, 31, x31
@@ -154,6 +163,7 @@ trap_syscall:
 
 	# Restore all integer registers except a0 and a1, then return
 0:
+	kernel_lock_release	t0
 	csrr	x31, sscratch
 	load_gp_regs	1, 9, x31
 	# x10 == a0 and x11 == a1, so skip
@@ -167,6 +177,37 @@ trap_syscall:
 	j		0b
 
 
+# Handler for page faults.
+#
+# Accesses to reserved pages are resolved by allocating them and writes to copy-on-write pages
+# by giving the task a private copy, after which the instruction is executed again. Any other
+# fault is fatal.
+trap_page_fault:
+
+	# The kernel itself should never cause page faults.
+	csrr	t0, sstatus
+	andi	t0, t0, 1 << 8
+	bnez	t0, mini_panic
+
+	addi	sp, sp, -1 * GP_REGBYTES
+	sd		ra, 0 * GP_REGBYTES (sp)
+
+	# Only store faults (15) may need a copy.
+	csrr	a0, stval
+	csrr	a1, scause
+	addi	a1, a1, -15
+	seqz	a1, a1
+	call	trap_fault_in
+
+	ld		ra, 0 * GP_REGBYTES (sp)
+	addi	sp, sp, 1 * GP_REGBYTES
+
+	beqz	a0, mini_panic
+
+	# sepc still points to the faulting instruction, so it is retried.
+	ret
+
+
 ## Initialize the trap CSR and the interrupt table
 trap_init:
 	la		t0, interrupt_table
@@ -190,13 +231,13 @@ trap_start_task:
 	# ==
 	# Set up the VMS.
 	ld		t0, REGSTATE_SIZE + 1 * GP_REGBYTES (a0)
-	csrw	satp, t0
-	sfence.vma
+	switch_vms	t0, t1
 	# Setup the scratch register.
 	csrw	sscratch, a0
 	# Restore the program counter
 	ld		t0, 0 * GP_REGBYTES (a0)
 	csrw	sepc, t0
+	kernel_lock_release	t0
 	# Restore all float registers
 	load_fp_regs	a0
 	# Restore all integer registers
@@ -14,6 +14,17 @@
 		sd	\a, \b (\c)
 	.endm
 
+	# Switch to the VMS in \reg. The TLB only needs to be flushed if the VMS has no address
+	# space identifier, as the entries of other VMSes are tagged with theirs.
+	.macro switch_vms	reg, tmp
+		csrw	satp, \reg
+		slli	\tmp, \reg, 4
+		srli	\tmp, \tmp, 48
+		bnez	\tmp, .Lswitch_vms_\@
+		sfence.vma
+	.Lswitch_vms_\@:
+	.endm
+
 .else
 .ifdef	__RISCV32__
 
@@ -28,6 +39,13 @@
 		sw	\a, \b (\c)
 	.endm
 
+	# Switch to the VMS in \reg.
+	# FIXME use the address space identifier.
+	.macro switch_vms	reg, tmp
+		csrw	satp, \reg
+		sfence.vma
+	.endm
+
 .else
 
 	.error	"Neither __RISCV64__ nor __RISCV32__ was defined"
@@ -109,7 +127,7 @@
 .equ		TASK_FLAG_NOTIFIED, 0x2
 
 # The total amount of system calls, including placeholders
-.equ		SYSCALL_MAX,			20
+.equ		SYSCALL_MAX,			31
 
 # The error code for when a syscall was not found.
 .equ		SYSCALL_ERR_NOCALL, 	1
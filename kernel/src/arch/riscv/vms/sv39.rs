@@ -7,10 +7,11 @@
 //!
 //! [rv]: https://riscv.org/wp-content/uploads/2017/05/riscv-privileged-v1.10.pdf
 
+use crate::arch::riscv::smp;
 use crate::arch::vms::*;
 use crate::arch::{self, Map, MapRange, Page};
 use crate::memory::reserved::{self, GLOBAL, VMM_ROOT};
-use crate::memory::{self, AllocateError, PPNBox, PPNDirect, SharedPPN, PPN};
+use crate::memory::{self, AllocateError, HugePage, PPNBox, PPNDirect, SharedPPN, PPN};
 use core::convert::{TryFrom, TryInto};
 use core::mem;
 use core::ops;
@@ -29,6 +30,31 @@ const HIGHMEM_A: Page = reserved::HIGHMEM_A.start;
 /// HIGHMEM_B
 const HIGHMEM_B: Page = reserved::HIGHMEM_B.start;
 
+/// The offset of the address space identifier in `satp`.
+const ASID_SHIFT: u64 = 44;
+
+/// The mask of the address space identifier in `satp`.
+const ASID_MASK: u64 = 0xffff << ASID_SHIFT;
+
+/// The maximum amount of address space identifiers that are handed out.
+///
+/// ASID 0 is never assigned. VMSes with ASID 0 cause a full TLB flush when they are switched
+/// to, so it is used both for VMSes that haven't been activated yet and if the hardware doesn't
+/// support ASIDs.
+const MAX_ASIDS: usize = 256;
+
+/// The PPN of the root table each ASID is assigned to.
+///
+/// VMSes are never freed, so the PPN of a root table can't be reused by another VMS while it
+/// is listed here.
+static mut ASID_OWNERS: [PPNBox; MAX_ASIDS] = [0; MAX_ASIDS];
+
+/// The next ASID to assign. If all ASIDs are in use a new generation is started.
+static mut NEXT_ASID: usize = 1;
+
+/// The amount of usable ASIDs, including ASID 0. Determined on the first assignment.
+static mut ASID_COUNT: Option<usize> = None;
+
 /// Page table entry
 ///
 /// The format from MSb to LSb is:
@@ -161,6 +187,7 @@ impl Entry {
 
 impl Leaf {
 	const VALID_BIT: u64 = 0;
+	const WRITE_MASK: u64 = 0b100;
 	const USERMODE_BIT: u64 = 4;
 	const GLOBAL_BIT: u64 = 5;
 	const ACCESSED_BIT: u64 = 6;
@@ -174,8 +201,9 @@ impl Leaf {
 	fn clear(&mut self) -> Result<PrivateOrShared, ()> {
 		if self.is_valid() {
 			let ppn = unsafe { PPN::from_raw((self.0 >> 10) as u32) };
+			let shared = self.is_shared();
 			self.0 = 0;
-			if self.is_shared() {
+			if shared {
 				Ok(PrivateOrShared::Shared(unsafe { SharedPPN::from_raw(ppn) }))
 			} else {
 				Ok(PrivateOrShared::Private(ppn))
@@ -191,7 +219,7 @@ impl Leaf {
 			Accessibility::KernelLocal => (false, false),
 			Accessibility::KernelGlobal => (false, true),
 		};
-		if !self.is_valid() {
+		if !self.is_valid() && !self.is_reserved() {
 			self.0 = 0;
 			let ppn = match map {
 				Map::Private(ppn) => {
@@ -224,21 +252,30 @@ impl Leaf {
 		}
 	}
 
-	fn share(&self) -> Result<Map, ShareError> {
-		if self.is_valid() {
-			if self.0 & Self::TYPE_MASK == Self::TYPE_DIRECT {
-				Ok(Map::Direct(PPNDirect::from((self.0 >> 10) as u32)))
-			} else {
-				let ppn = unsafe { PPN::from_raw((self.0 >> 10) as u32) };
-				if true || self.is_shared() {
-					Ok(Map::Shared(unsafe { SharedPPN::from_raw(ppn) }))
-				} else {
-					Ok(Map::Shared(SharedPPN::new(ppn).expect("TODO")))
-				}
-			}
-		} else {
-			Err(ShareError::NoEntry)
+	/// Return a mapping of the page of this entry with its own reference.
+	///
+	/// Private pages are turned into shared pages so they are reference counted.
+	fn share(&mut self) -> Result<Map, ShareError> {
+		if !self.is_valid() {
+			return Err(ShareError::NoEntry);
 		}
+		let ppn = (self.0 >> 10) as u32;
+		let shared = match self.0 & Self::TYPE_MASK {
+			Self::TYPE_DIRECT => return Ok(Map::Direct(PPNDirect::from(ppn))),
+			Self::TYPE_PRIVATE => {
+				let shared = SharedPPN::new(unsafe { PPN::from_raw(ppn) })
+					.map_err(ShareError::AllocateError)?;
+				self.0 = (self.0 & !Self::TYPE_MASK) | Self::TYPE_SHARED;
+				shared
+			}
+			// SAFETY: the entry is shared, so the PPN came from a SharedPPN.
+			_ => unsafe { SharedPPN::from_raw(PPN::from_raw(ppn)) },
+		};
+		// The reference of this entry is kept.
+		mem::ManuallyDrop::new(shared)
+			.try_clone()
+			.map(Map::Shared)
+			.map_err(|_| ShareError::ReferenceCountOverflow)
 	}
 
 	#[must_use]
@@ -246,9 +283,76 @@ impl Leaf {
 		self.0 & (1 << Self::VALID_BIT) > 0
 	}
 
+	#[must_use]
+	fn is_global(&self) -> bool {
+		self.0 & (1 << Self::GLOBAL_BIT) > 0
+	}
+
+	#[must_use]
+	fn is_private(&self) -> bool {
+		self.is_valid() && self.0 & Self::TYPE_MASK == Self::TYPE_PRIVATE
+	}
+
 	#[must_use]
 	fn is_shared(&self) -> bool {
-		self.0 & Self::TYPE_SHARED > 0 || self.0 & Self::TYPE_SHARED_LOCKED > 0
+		matches!(
+			self.0 & Self::TYPE_MASK,
+			Self::TYPE_SHARED | Self::TYPE_SHARED_LOCKED
+		)
+	}
+
+	/// Whether this is a copy-on-write mapping.
+	///
+	/// These are user mappings that can't be written to and don't have the dirty flag set.
+	/// The dirty flag has no meaning for pages that can't be written to and all other mappings
+	/// are added with it set, so no RSW bits are needed.
+	#[must_use]
+	fn is_copy_on_write(&self) -> bool {
+		self.is_valid()
+			&& self.0 & (1 << Self::USERMODE_BIT) > 0
+			&& self.0 & (Self::WRITE_MASK | 1 << Self::DIRTY_BIT) == 0
+	}
+
+	/// Make this mapping copy-on-write. The first write to it will fault.
+	fn set_copy_on_write(&mut self) {
+		self.0 &= !(Self::WRITE_MASK | 1 << Self::DIRTY_BIT);
+	}
+
+	/// Whether this entry is reserved for a page that is allocated on first access.
+	///
+	/// These entries aren't valid, so the hardware ignores all other bits and the RWX, user and
+	/// global bits can hold the properties of the page to be allocated.
+	#[must_use]
+	fn is_reserved(&self) -> bool {
+		!self.is_valid() && self.0 & Entry::RWX_MASK > 0
+	}
+
+	/// Reserve this entry for a page that is allocated on first access.
+	fn set_reserved(&mut self, rwx: RWX, accessibility: Accessibility) -> Result<(), AddError> {
+		if self.is_valid() || self.is_reserved() {
+			return Err(AddError::Overlaps);
+		}
+		let (usermode, global) = match accessibility {
+			Accessibility::UserLocal => (true, false),
+			Accessibility::KernelLocal => (false, false),
+			Accessibility::KernelGlobal => (false, true),
+		};
+		self.0 = u64::from(super::from_rwx(rwx));
+		self.0 |= (usermode as u64) << Self::USERMODE_BIT;
+		self.0 |= (global as u64) << Self::GLOBAL_BIT;
+		Ok(())
+	}
+
+	/// Return the accessibility of this entry.
+	#[must_use]
+	fn accessibility(&self) -> Accessibility {
+		if self.0 & (1 << Self::USERMODE_BIT) > 0 {
+			Accessibility::UserLocal
+		} else if self.is_global() {
+			Accessibility::KernelGlobal
+		} else {
+			Accessibility::KernelLocal
+		}
 	}
 }
 
@@ -363,6 +467,117 @@ impl Sv39 {
 		Ok(NonNull::from(pte))
 	}
 
+	/// Find the leaf of a regular page in the current VMS. Unlike [`get_pte`](Self::get_pte)
+	/// this doesn't assume the tables exist.
+	///
+	/// Uses HIGHMEM_A
+	fn find_leaf(address: Page) -> Option<NonNull<Leaf>> {
+		let va = VirtualAddress(address.as_ptr() as u64);
+
+		// VPN[2]
+		let pte = &unsafe { ROOT.as_ref() }[va.ppn_2()];
+		if !pte.is_valid() || !pte.is_table() {
+			return None;
+		}
+
+		// VPN[1]
+		let ppn = (pte.0 >> 10) as PPNBox;
+		unsafe { Self::map_highmem_a(Some(ppn)) };
+		Self::flush_highmem_a();
+		let tbl = unsafe {
+			Self::translate_highmem_a(ppn)
+				.as_non_null_ptr()
+				.cast::<[Entry; 512]>()
+				.as_ref()
+		};
+		let pte = &tbl[va.ppn_1()];
+		if !pte.is_valid() || !pte.is_table() {
+			return None;
+		}
+
+		// VPN[0]
+		let ppn = (pte.0 >> 10) as PPNBox;
+		unsafe { Self::map_highmem_a(Some(ppn)) };
+		Self::flush_highmem_a();
+		let tbl = unsafe {
+			Self::translate_highmem_a(ppn)
+				.as_non_null_ptr()
+				.cast::<[Leaf; 512]>()
+				.as_mut()
+		};
+		Some(NonNull::from(&mut tbl[va.ppn_0()]))
+	}
+
+	/// Return the entry that follows `leaf` if it maps `address`, i.e. if `address` is in the same
+	/// table as the page before it. Walking a range this way only goes through the root once per
+	/// table instead of once per page.
+	///
+	/// `leaf` must still be visible through the highmem window it was found with.
+	fn next_leaf(leaf: Option<NonNull<Leaf>>, address: Page) -> Option<NonNull<Leaf>> {
+		let leaf = leaf?;
+		(VirtualAddress(address.as_ptr() as u64).ppn_0() != 0)
+			.then(|| unsafe { NonNull::new_unchecked(leaf.as_ptr().add(1)) })
+	}
+
+	/// Map the root table of this VMS to HIGHMEM_B and return it.
+	fn root_highmem_b(&self) -> NonNull<[Entry; 512]> {
+		let ppn = unsafe { PPN::from_raw(self.0 as u32) };
+		unsafe { Self::map_highmem_b(Some(&ppn)) };
+		let root = unsafe { Self::translate_highmem_b(ppn.as_raw()) }
+			.as_non_null_ptr()
+			.cast();
+		Self::flush_highmem_b();
+		mem::forget(ppn);
+		root
+	}
+
+	/// Map a page from the current VMS to this VMS and return the new leaf.
+	///
+	/// Uses HIGHMEM_A and HIGHMEM_B
+	fn share_leaf(
+		&self,
+		self_address: Page,
+		from_address: Page,
+		rwx: RWX,
+		accessibility: Accessibility,
+	) -> Result<NonNull<Leaf>, ShareError> {
+		// There must be a page to share. Writes through the new mapping must be visible to the
+		// current VMS and vice versa, which isn't the case if either side gets a copy later.
+		Self::fault_in(from_address, matches!(rwx, RWX::RW | RWX::RWX))
+			.map_err(ShareError::AllocateError)?;
+
+		// Get the PTE to copy from (uses HIGHMEM_A)
+		let from = unsafe { Self::get_pte(from_address)?.as_mut() };
+
+		if !from.is_valid() {
+			return Err(ShareError::NoEntry);
+		}
+
+		// Sharing a private page may map reference counters, which uses HIGHMEM_B, so do it
+		// first.
+		let map = from.share()?;
+
+		// Use HIGHMEM_B
+		let ppn = unsafe { PPN::from_raw(self.0 as u32) };
+		unsafe { Self::map_highmem_b(Some(&ppn)) };
+		let root = unsafe { Self::translate_highmem_b(ppn.as_raw()) }
+			.as_non_null_ptr()
+			.cast();
+		Self::flush_highmem_b();
+		mem::forget(ppn);
+
+		// Get the PTE to copy to
+		let mut to = Self::get_pte_from_alloc(root, self_address)?;
+
+		if unsafe { to.as_ref() }.is_valid() {
+			return Err(ShareError::Overlaps);
+		}
+
+		unsafe { to.as_mut() }.set(map, rwx, accessibility)?;
+
+		Ok(to)
+	}
+
 	/// Uses HIGHMEM_B
 	fn get_pte_from_alloc(
 		root: NonNull<[Entry; 512]>,
@@ -453,12 +668,84 @@ impl Sv39 {
 		Ok(NonNull::from(pte))
 	}
 
+	/// Return the entry and size of the hugepage the given address is part of, if any.
+	///
+	/// Uses HIGHMEM_A
+	fn get_pte_huge(address: Page) -> Option<(NonNull<Leaf>, HugePage)> {
+		let va = VirtualAddress(address.as_ptr() as u64);
+
+		// VPN[2]
+		let pte = &mut unsafe { &mut *ROOT.as_ptr() }[va.ppn_2()];
+		if !pte.is_valid() {
+			return None;
+		} else if !pte.is_table() {
+			return Some((NonNull::from(pte).cast(), HugePage::Giga));
+		}
+
+		// VPN[1]
+		let ppn = (pte.0 >> 10) as u32;
+		unsafe { Self::map_highmem_a(Some(ppn)) };
+		Self::flush_highmem_a();
+		let tbl = unsafe {
+			Self::translate_highmem_a(ppn)
+				.as_non_null_ptr()
+				.cast::<[Entry; 512]>()
+				.as_mut()
+		};
+		let pte = &mut tbl[va.ppn_1()];
+		(pte.is_valid() && !pte.is_table()).then(|| (NonNull::from(pte).cast(), HugePage::Mega))
+	}
+
+	/// Allocate a zeroed hugepage and map it at the given address.
+	///
+	/// Uses HIGHMEM_B
+	fn add_huge(
+		address: Page,
+		size: HugePage,
+		rwx: RWX,
+		accessibility: Accessibility,
+	) -> Result<(), AddError> {
+		let ppn = memory::allocate_huge(size).map_err(AddError::AllocateError)?;
+
+		// The page may hold data of a previous owner. A hugepage never straddles a gigapage
+		// boundary, so it is entirely visible through HIGHMEM_B.
+		unsafe {
+			Self::map_highmem_b(Some(&ppn));
+			Self::flush_highmem_b();
+			Self::translate_highmem_b(ppn.as_raw())
+				.as_ptr()
+				.write_bytes(0, size.pages());
+		}
+
+		let pte = match size {
+			HugePage::Mega => Self::get_pte_alloc_mega(address),
+			HugePage::Giga => Self::get_pte_alloc_giga(address),
+		};
+		match pte {
+			Ok(mut pte) if unsafe { !pte.as_ref().is_valid() } => unsafe {
+				pte.as_mut().set(Map::Private(ppn), rwx, accessibility)
+			},
+			Ok(_) => {
+				unsafe { memory::deallocate_huge(ppn, size) };
+				Err(AddError::Overlaps)
+			}
+			Err(e) => {
+				unsafe { memory::deallocate_huge(ppn, size) };
+				Err(e)
+			}
+		}
+	}
+
 	/// Set HIGHMEM_A to map to the given PPN.
 	///
 	/// ## Safety
 	///
 	/// If HIGHMEM_A is mapped to another address the TLB *must* be flushed after this call.
 	/// There may not be any lingering mappings either for security and performance.
+	///
+	/// The window is an entry in the root table of the current VMS, which may be active on
+	/// several harts at once. This relies on the kernel lock being held from mapping until the
+	/// last access through the window.
 	unsafe fn map_highmem_a(ppn: Option<PPNBox>) {
 		let va = VirtualAddress(HIGHMEM_A.as_ptr() as u64);
 		let root = &mut *ROOT.as_ptr();
@@ -476,6 +763,10 @@ impl Sv39 {
 	///
 	/// If HIGHMEM_B is mapped to another address the TLB *must* be flushed after this call.
 	/// There may not be any lingering mappings either for security and performance.
+	///
+	/// The window is an entry in the root table of the current VMS, which may be active on
+	/// several harts at once. This relies on the kernel lock being held from mapping until the
+	/// last access through the window.
 	unsafe fn map_highmem_b(ppn: Option<&PPN>) {
 		let va = VirtualAddress(HIGHMEM_B.as_ptr() as u64);
 		let root = &mut *ROOT.as_ptr();
@@ -505,25 +796,157 @@ impl Sv39 {
 		HIGHMEM_B.skip(ppn as usize % (1 << 18)).unwrap()
 	}
 
-	/// Flush HIGHMEM_A from the TLB.
+	/// Flush HIGHMEM_A from the TLB of this hart.
+	///
+	/// Other harts may keep stale entries of the window. This is only fine as long as they
+	/// need the kernel lock to use it, as they remap and flush it before every use.
 	fn flush_highmem_a() {
 		Self::flush(Some(HIGHMEM_A));
 	}
 
-	/// Flush HIGHMEM_B from the TLB.
+	/// Flush HIGHMEM_B from the TLB of this hart.
+	///
+	/// Other harts may keep stale entries of the window. This is only fine as long as they
+	/// need the kernel lock to use it, as they remap and flush it before every use.
 	fn flush_highmem_b() {
 		Self::flush(Some(HIGHMEM_B));
 	}
 
-	/// Flush the given address from the TLB. If address is `None`, the entire TLB
-	/// is flushed.
+	/// Flush the given address of the current address space from the TLB. If address is
+	/// `None`, all entries of the current address space are flushed.
+	///
+	/// Global mappings are not affected, use [`flush_global`](Self::flush_global) for those.
 	fn flush(address: Option<Page>) {
-		let address = address
-			.map(|p| p.as_ptr())
-			.unwrap_or_else(core::ptr::null_mut);
+		let satp: u64;
+		unsafe {
+			asm!("csrr {0}, satp", out(reg) satp);
+			let asid = (satp & ASID_MASK) >> ASID_SHIFT;
+			// A register holding 0 only flushes address 0, all addresses are only flushed if
+			// rs1 is x0.
+			match address {
+				Some(a) => asm!("sfence.vma {0}, {1}", in(reg) a.as_ptr(), in(reg) asid),
+				None => asm!("sfence.vma zero, {0}", in(reg) asid),
+			}
+		}
+	}
+
+	/// Flush the given address of all address spaces from the TLB. If address is `None`, the
+	/// entire TLB is flushed.
+	fn flush_global(address: Option<Page>) {
 		unsafe {
-			asm!("sfence.vma {0}, zero", in(reg) address);
+			match address {
+				Some(a) => asm!("sfence.vma {0}, zero", in(reg) a.as_ptr()),
+				None => asm!("sfence.vma zero, zero"),
+			}
+		}
+	}
+
+	/// Flush a range of pages from the TLB of every hart once all of their entries have been
+	/// changed.
+	///
+	/// `sfence.vma` only takes a single address, so large ranges flush the entire address space
+	/// (or the entire TLB if the range is global) with a single fence instead.
+	fn flush_range(address: Page, count: usize, global: bool) {
+		const MAX_PAGE_FENCES: usize = 16;
+		let asid = (!global).then(Self::current_asid);
+		if count > MAX_PAGE_FENCES {
+			if global {
+				Self::flush_global(None);
+			} else {
+				Self::flush(None);
+			}
+			// Other harts also flush everything, regardless of how the SBI implementation
+			// handles large ranges.
+			smp::remote_flush(None, 0, asid);
+		} else {
+			for page in (0..count).filter_map(|i| address.skip(i)) {
+				if global {
+					Self::flush_global(Some(page));
+				} else {
+					Self::flush(Some(page));
+				}
+			}
+			smp::remote_flush(Some(address), count, asid);
+		}
+	}
+
+	/// Flush the given address, or everything if `None`, from the TLB of every hart. Only
+	/// entries of the current address space are flushed unless `global` is set.
+	///
+	/// Mappings that may be used by other harts must be flushed this way when they change. The
+	/// highmem windows are shared by all harts running the same VMS, but are only flushed
+	/// locally as every use remaps and flushes them while holding the kernel lock.
+	fn shootdown(address: Option<Page>, global: bool) {
+		if global {
+			Self::flush_global(address);
+		} else {
+			Self::flush(address);
 		}
+		smp::remote_flush(address, 1, (!global).then(Self::current_asid));
+	}
+
+	/// Return the ASID of the current VMS.
+	fn current_asid() -> u16 {
+		let satp: u64;
+		unsafe { asm!("csrr {0}, satp", out(reg) satp) };
+		((satp & ASID_MASK) >> ASID_SHIFT) as u16
+	}
+
+	/// Determine the amount of ASIDs supported by the hardware by writing all ones to the
+	/// ASID field of `satp` and checking which bits stick.
+	unsafe fn detect_asid_count() -> usize {
+		let satp: u64;
+		let probe: u64;
+		asm!("csrr {0}, satp", out(reg) satp);
+		asm!(
+			"csrw satp, {1}",
+			"csrr {0}, satp",
+			"csrw satp, {2}",
+			out(reg) probe,
+			in(reg) satp | ASID_MASK,
+			in(reg) satp,
+		);
+		// Don't leave any entries behind that are tagged with the probed ASID.
+		Self::flush_global(None);
+		((probe & ASID_MASK) >> ASID_SHIFT) as usize + 1
+	}
+
+	/// Return the ASID assigned to the given root table or assign a new one.
+	///
+	/// Returns `0` if the hardware doesn't support ASIDs.
+	unsafe fn assign_asid(root: PPNBox) -> usize {
+		let count = match ASID_COUNT {
+			Some(c) => c,
+			None => {
+				let c = Self::detect_asid_count().min(MAX_ASIDS);
+				ASID_COUNT = Some(c);
+				c
+			}
+		};
+
+		// Another handle to the same VMS may have been assigned one already.
+		if let Some(i) = ASID_OWNERS[1..count].iter().position(|&r| r == root) {
+			return i + 1;
+		}
+		if count <= 1 {
+			return 0;
+		}
+
+		if NEXT_ASID >= count {
+			// Start a new generation. VMSes will be assigned a new ASID once they are activated
+			// again. The current VMS is moved to ASID 0 so no entries tagged with a reused ASID
+			// can be added before the next switch.
+			ASID_OWNERS = [0; MAX_ASIDS];
+			NEXT_ASID = 1;
+			let satp: u64;
+			asm!("csrr {0}, satp", out(reg) satp);
+			asm!("csrw satp, {0}", in(reg) satp & !ASID_MASK);
+			Self::shootdown(None, true);
+		}
+		let asid = NEXT_ASID;
+		NEXT_ASID += 1;
+		ASID_OWNERS[asid] = root;
+		asid
 	}
 }
 
@@ -601,6 +1024,10 @@ impl VirtualMemorySystem for Sv39 {
 		Ok(s)
 	}
 
+	unsafe fn alias(&self) -> Self {
+		Self(self.0)
+	}
+
 	/// Allocate the given amount of private pages and insert it as virtual memory at the
 	/// given address.
 	fn allocate(
@@ -619,15 +1046,100 @@ impl VirtualMemorySystem for Sv39 {
 		Ok(())
 	}
 
+	/// Allocate the given amount of private pages and insert it as virtual memory at the
+	/// given address, using mega- and gigapages up to `largest` where the address is suitably
+	/// aligned.
+	///
+	/// Single pages are used if no hugepage is available.
+	fn allocate_huge(
+		virtual_address: Page,
+		count: usize,
+		largest: HugePage,
+		rwx: RWX,
+		accessibility: Accessibility,
+	) -> Result<(), AddError> {
+		let mut va = virtual_address;
+		let mut left = count;
+		while left > 0 {
+			let addr = va.as_ptr() as usize;
+			let n = [HugePage::Giga, HugePage::Mega]
+				.iter()
+				.filter(|s| s.pages() <= largest.pages())
+				.filter(|s| left >= s.pages() && addr % (s.pages() * Page::SIZE) == 0)
+				.find(|&&s| Self::add_huge(va, s, rwx, accessibility).is_ok())
+				.map(|s| s.pages());
+			let n = match n {
+				Some(n) => n,
+				None => {
+					Self::allocate(va, 1, rwx, accessibility)?;
+					1
+				}
+			};
+			left -= n;
+			if left > 0 {
+				va = va.skip(n).unwrap();
+			}
+		}
+		Ok(())
+	}
+
 	/// Deallocate the given range of pages.
+	///
+	/// Private hugepages are returned to the memory manager.
 	fn deallocate(virtual_address: Page, count: usize) -> Result<(), ()> {
 		let mut va = virtual_address;
+		let mut left = count;
+		// Regular pages are flushed together once all of them have been cleared.
+		let mut leaf = None;
+		let mut global = false;
+		let mut ret = Ok(());
 		// FIXME deallocate pages on failure.
-		for _ in 0..count {
-			Self::remove(va).unwrap();
-			va = va.next().unwrap();
+		while left > 0 {
+			// A page in the same table as the previous one can't be part of a hugepage.
+			leaf = Self::next_leaf(leaf, va);
+			let huge = leaf.is_none().then(|| Self::get_pte_huge(va)).flatten();
+			let n = match huge {
+				Some((mut pte, size)) => {
+					let addr = va.as_ptr() as usize;
+					if left < size.pages() || addr % (size.pages() * Page::SIZE) != 0 {
+						return Err(());
+					}
+					let pte = unsafe { pte.as_mut() };
+					let (global, private) = (pte.is_global(), pte.is_private());
+					if let (true, PrivateOrShared::Private(ppn)) = (private, pte.clear()?) {
+						unsafe { memory::deallocate_huge(ppn, size) };
+					}
+					// Fencing any address of a hugepage flushes the entire hugepage.
+					Self::shootdown(Some(va), global);
+					size.pages()
+				}
+				None => {
+					leaf = leaf.or_else(|| Self::find_leaf(va));
+					let l = match leaf {
+						Some(mut l) => unsafe { l.as_mut() },
+						None => {
+							ret = Err(());
+							break;
+						}
+					};
+					global |= l.is_global();
+					if l.is_reserved() {
+						// Pages that were never accessed have nothing to free.
+						*l = Leaf(0);
+					} else if l.clear().is_err() {
+						ret = Err(());
+						break;
+					}
+					1
+				}
+			};
+			left -= n;
+			if left > 0 {
+				va = va.skip(n).unwrap();
+			}
 		}
-		Ok(())
+		Self::flush_range(virtual_address, count - left, global);
+		ret
 	}
 
 	/// Add a single page mapping.
@@ -724,16 +1236,20 @@ impl VirtualMemorySystem for Sv39 {
 		} else {
 			let undo = #[cold]
 			|err: AddError| todo!("{:?}", err);
+			let mut leaf = None;
 			while let Some(map) = map_range.pop_base() {
-				match Self::get_pte_alloc(address) {
-					Ok(mut pte) => unsafe {
-						if let Err(e) = pte.as_mut().set(map, rwx, accessibility) {
-							return undo(e);
-						}
-						address = address.next().unwrap();
+				let mut pte = match Self::next_leaf(leaf, address) {
+					Some(pte) => pte,
+					None => match Self::get_pte_alloc(address) {
+						Ok(pte) => pte,
+						Err(e) => return undo(e),
 					},
-					Err(e) => return undo(e),
+				};
+				if let Err(e) = unsafe { pte.as_mut() }.set(map, rwx, accessibility) {
+					return undo(e);
 				}
+				leaf = Some(pte);
+				address = address.next().unwrap();
 			}
 		}
 		Ok(())
@@ -747,57 +1263,44 @@ impl VirtualMemorySystem for Sv39 {
 	/// * `Err(())` if the mapping doesn't exist.
 	#[allow(dead_code)]
 	fn remove(address: Page) -> Result<PrivateOrShared, ()> {
-		unsafe { Self::get_pte(address).map_err(|_| ())?.as_mut().clear() }
+		let pte = unsafe { Self::get_pte(address).map_err(|_| ())?.as_mut() };
+		let global = pte.is_global();
+		let ppn = pte.clear()?;
+		Self::shootdown(Some(address), global);
+		Ok(ppn)
 	}
 
 	/// Write the physical *addresses* from the start of the virtual address into the given slice.
+	///
+	/// Uses HIGHMEM_A
 	fn physical_addresses(address: Page, store: &mut [usize]) -> Result<(), ()> {
-		let mut address = Some(address);
-		for s in store.iter_mut() {
-			let addr = address.unwrap();
-			let va = VirtualAddress(addr.as_ptr() as u64);
-
-			// VPN[2]
-			let pte = &unsafe { ROOT.as_ref() }[va.ppn_2()];
-			if !pte.is_valid() {
-				return Err(());
-			} else if !pte.is_table() {
-				*s = (((pte.0 & !0x3ff) << 2) | (va.0 & ((1 << 30) - 1))) as usize;
-				continue;
+		let mut leaf = None;
+		for (i, s) in store.iter_mut().enumerate() {
+			let addr = address.skip(i).ok_or(())?;
+			leaf = Self::next_leaf(leaf, addr);
+			if leaf.is_none() {
+				if let Some((pte, size)) = Self::get_pte_huge(addr) {
+					let offset = addr.as_ptr() as usize & (size.pages() * Page::SIZE - 1);
+					*s = ((unsafe { pte.as_ref() }.0 & !0x3ff) << 2) as usize | offset;
+					continue;
+				}
+				leaf = Self::find_leaf(addr);
 			}
-
-			// VPN[1]
-			let ppn = unsafe { PPN::from_raw((pte.0 >> 10) as u32) };
-			unsafe { Self::map_highmem_a(Some(ppn.as_raw())) };
-			Self::flush_highmem_a();
-			let tbl = unsafe {
-				Self::translate_highmem_a(ppn.as_raw())
-					.as_non_null_ptr()
-					.cast::<[Entry; 512]>()
-			};
-			let tbl = &mut unsafe { &mut *tbl.as_ptr() };
-			let pte = &mut tbl[va.ppn_1()];
-			if !pte.is_valid() {
+			let mut pte = leaf.ok_or(())?;
+
+			// Physical addresses are handed to devices and used as futex keys, so the page
+			// must exist and may not change when it is written to later.
+			let l = unsafe { pte.as_ref() };
+			if l.is_reserved() || l.is_copy_on_write() {
+				Self::fault_in(addr, true).map_err(|_| ())?;
+				pte = Self::find_leaf(addr).ok_or(())?;
+				leaf = Some(pte);
+			}
+			let l = unsafe { pte.as_ref() };
+			if !l.is_valid() {
 				return Err(());
-			} else if !pte.is_table() {
-				*s = (((pte.0 & !0x3ff) << 2) | (va.0 & ((1 << 21) - 1))) as usize;
-				continue;
 			}
-
-			// VPN[0]
-			let ppn = unsafe { PPN::from_raw((pte.0 >> 10) as u32) };
-			unsafe { Self::map_highmem_a(Some(ppn.as_raw())) };
-			Self::flush_highmem_a();
-			let tbl = unsafe {
-				Self::translate_highmem_a(ppn.as_raw())
-					.as_non_null_ptr()
-					.cast::<[Leaf; 512]>()
-			};
-			let tbl = &mut unsafe { &mut *tbl.as_ptr() };
-			let pte = &mut tbl[va.ppn_0()];
-			*s = ((pte.0 & !0x3ff) << 2) as usize;
-
-			address = addr.next();
+			*s = ((l.0 & !0x3ff) << 2) as usize;
 		}
 		Ok(())
 	}
@@ -814,7 +1317,7 @@ impl VirtualMemorySystem for Sv39 {
 	where
 		F: FnMut() -> PPN,
 	{
-		// Map the root table
+		// Map the root table unless a previous call did so already.
 		unsafe {
 			let va = VirtualAddress(ROOT.as_ptr() as u64);
 
@@ -824,30 +1327,32 @@ impl VirtualMemorySystem for Sv39 {
 				slli	{0}, {0}, 12
 			", out(reg) root);
 
-			let ppn_0 = f();
-			let ppn_1 = f();
-			let ppn_2 = PPN::from_ptr(root);
-
-			let ppn_0_ptr = ppn_0.as_ptr();
-			let ppn_1_ptr = ppn_1.as_ptr();
-			let ppn_2_ptr = ppn_2.as_ptr();
-
-			let mut leaf = Leaf(0);
-			leaf.set(
-				Map::Private(PPN::from_ptr(root)),
-				RWX::RW,
-				Accessibility::KernelLocal,
-			)
-			.unwrap();
-			ppn_0_ptr.cast::<Leaf>().add(va.ppn_0()).write(leaf);
-			ppn_1_ptr
-				.cast::<Entry>()
-				.add(va.ppn_1())
-				.write(Entry::new_table(ppn_0));
-			ppn_2_ptr
-				.cast::<Entry>()
-				.add(va.ppn_2())
-				.write(Entry::new_table(ppn_1));
+			if !(*(root as *const Entry).add(va.ppn_2())).is_valid() {
+				let ppn_0 = f();
+				let ppn_1 = f();
+				let ppn_2 = PPN::from_ptr(root);
+
+				let ppn_0_ptr = ppn_0.as_ptr();
+				let ppn_1_ptr = ppn_1.as_ptr();
+				let ppn_2_ptr = ppn_2.as_ptr();
+
+				let mut leaf = Leaf(0);
+				leaf.set(
+					Map::Private(PPN::from_ptr(root)),
+					RWX::RW,
+					Accessibility::KernelLocal,
+				)
+				.unwrap();
+				ppn_0_ptr.cast::<Leaf>().add(va.ppn_0()).write(leaf);
+				ppn_1_ptr
+					.cast::<Entry>()
+					.add(va.ppn_1())
+					.write(Entry::new_table(ppn_0));
+				ppn_2_ptr
+					.cast::<Entry>()
+					.add(va.ppn_2())
+					.write(Entry::new_table(ppn_1));
+			}
 		}
 
 		// Begin allocating pages now.
@@ -930,39 +1435,200 @@ impl VirtualMemorySystem for Sv39 {
 		rwx: RWX,
 		accessibility: Accessibility,
 	) -> Result<(), ShareError> {
-		// Get the PTE to copy from (uses HIGHMEM_A)
-		let from = unsafe { Self::get_pte(from_address)?.as_ref() };
+		self.share_leaf(self_address, from_address, rwx, accessibility)
+			.map(|_| ())
+	}
 
-		if !from.is_valid() {
-			return Err(ShareError::NoEntry);
+	/// Map a page from the current VMS to this VMS as copy-on-write.
+	///
+	/// The page is mapped without write access at first. The first write to it replaces it
+	/// with a private copy that has the given permissions.
+	///
+	/// A writable user page in the current VMS is made copy-on-write too, so writes from
+	/// either side are never visible to the other.
+	fn share_copy_on_write(
+		&self,
+		self_address: Page,
+		from_address: Page,
+		rwx: RWX,
+		accessibility: Accessibility,
+	) -> Result<(), ShareError> {
+		let (rwx, writable) = match rwx {
+			RWX::RW => (RWX::R, true),
+			RWX::RWX => (RWX::RX, true),
+			rwx => (rwx, false),
+		};
+		let mut to = self.share_leaf(self_address, from_address, rwx, accessibility)?;
+		if writable {
+			unsafe { to.as_mut() }.set_copy_on_write();
 		}
 
-		// Use HIGHMEM_B
-		let ppn = unsafe { PPN::from_raw(self.0 as u32) };
-		unsafe { Self::map_highmem_b(Some(&ppn)) };
-		let root = unsafe { Self::translate_highmem_b(ppn.as_raw()) }
-			.as_non_null_ptr()
-			.cast();
-		Self::flush_highmem_b();
-		mem::forget(ppn);
+		// share_leaf ensured the page exists (uses HIGHMEM_A)
+		let from = unsafe { Self::find_leaf(from_address).unwrap().as_mut() };
+		let from_writable = matches!(super::to_rwx(from.0), Some(RWX::RW) | Some(RWX::RWX));
+		if from_writable && matches!(from.accessibility(), Accessibility::UserLocal) {
+			from.set_copy_on_write();
+			Self::shootdown(Some(from_address), false);
+		}
+		Ok(())
+	}
 
-		// Get the PTE to copy to
-		let to = unsafe { Self::get_pte_from_alloc(root, self_address)?.as_mut() };
+	/// Map a range of pages from the current VMS to this VMS.
+	///
+	/// Uses HIGHMEM_A and HIGHMEM_B
+	fn share_range(
+		&self,
+		self_address: Page,
+		from_address: Page,
+		count: usize,
+		rwx: RWX,
+		accessibility: Accessibility,
+	) -> Result<(), ShareError> {
+		let writable = matches!(rwx, RWX::RW | RWX::RWX);
+		// The entries of the previous page, which are still mapped in HIGHMEM_A and HIGHMEM_B.
+		let (mut from, mut to) = (None, None);
+		for i in 0..count {
+			let from_addr = from_address.skip(i).ok_or(ShareError::OutOfRange)?;
+			let self_addr = self_address.skip(i).ok_or(ShareError::OutOfRange)?;
+
+			// There must be a page to share, see share_leaf.
+			let mut f = match Self::next_leaf(from, from_addr) {
+				Some(f) => f,
+				None => Self::find_leaf(from_addr).ok_or(ShareError::NoEntry)?,
+			};
+			let l = unsafe { f.as_ref() };
+			if l.is_reserved() || (writable && l.is_copy_on_write()) {
+				// This remaps both windows.
+				Self::fault_in(from_addr, writable).map_err(ShareError::AllocateError)?;
+				f = Self::find_leaf(from_addr).ok_or(ShareError::NoEntry)?;
+				to = None;
+			}
+			// Sharing a private page may map reference counters, which remaps HIGHMEM_B.
+			if unsafe { f.as_ref() }.is_private() {
+				to = None;
+			}
+			let map = unsafe { f.as_mut() }.share()?;
+			let mut t = match Self::next_leaf(to, self_addr) {
+				Some(t) => t,
+				None => Self::get_pte_from_alloc(self.root_highmem_b(), self_addr)?,
+			};
+			if unsafe { t.as_ref() }.is_valid() {
+				return Err(ShareError::Overlaps);
+			}
+			unsafe { t.as_mut() }.set(map, rwx, accessibility)?;
+			from = Some(f);
+			to = Some(t);
+		}
+		Ok(())
+	}
 
-		if to.is_valid() {
-			return Err(ShareError::Overlaps);
+	/// Reserve a range of pages in this VMS. Each page is allocated and zeroed when it is
+	/// first accessed.
+	fn reserve(
+		&self,
+		address: Page,
+		count: usize,
+		rwx: RWX,
+		accessibility: Accessibility,
+	) -> Result<(), AddError> {
+		// FIXME unreserve pages on failure.
+		let mut leaf = None;
+		for i in 0..count {
+			let addr = address.skip(i).ok_or(AddError::OutOfRange)?;
+			let mut pte = match Self::next_leaf(leaf, addr) {
+				Some(pte) => pte,
+				None => Self::get_pte_from_alloc(self.root_highmem_b(), addr)?,
+			};
+			unsafe { pte.as_mut() }.set_reserved(rwx, accessibility)?;
+			leaf = Some(pte);
+		}
+		Ok(())
+	}
+
+	/// Do what a page fault at the given address of the current VMS would do.
+	///
+	/// Reserved pages are allocated and zeroed. If `write` is set, copy-on-write pages are
+	/// replaced with a private, writable copy. Returns `false` if there was nothing to do.
+	fn fault_in(address: Page, write: bool) -> Result<bool, AllocateError> {
+		let leaf = match Self::find_leaf(address) {
+			Some(leaf) => unsafe { leaf.as_ref() },
+			None => return Ok(false),
+		};
+		let (from, rwx) = if leaf.is_reserved() {
+			(None, super::to_rwx(leaf.0).unwrap())
+		} else if write && leaf.is_copy_on_write() {
+			let rwx = match super::to_rwx(leaf.0) {
+				Some(RWX::R) => RWX::RW,
+				Some(RWX::RX) => RWX::RWX,
+				_ => unreachable!("copy-on-write page with bad permissions"),
+			};
+			(Some((leaf.0 >> 10) as PPNBox), rwx)
+		} else {
+			return Ok(false);
+		};
+		let accessibility = leaf.accessibility();
+
+		// Fill the page through the highmem windows, which doesn't depend on the task having
+		// access to it or SUM being set.
+		let to = memory::allocate()?;
+		unsafe {
+			Self::map_highmem_b(Some(&to));
+			Self::flush_highmem_b();
+			let dst = Self::translate_highmem_b(to.as_raw()).as_ptr().cast::<u8>();
+			match from {
+				Some(from) => {
+					Self::map_highmem_a(Some(from));
+					Self::flush_highmem_a();
+					let src = Self::translate_highmem_a(from).as_ptr().cast::<u8>();
+					core::ptr::copy_nonoverlapping(src, dst, Page::SIZE);
+				}
+				None => dst.write_bytes(0, Page::SIZE),
+			}
 		}
 
-		to.set(from.share()?, rwx, accessibility)?;
+		// The reference to the original page of a copy-on-write mapping is only dropped once
+		// no TLB can refer to it anymore.
+		let leaf = unsafe { Self::find_leaf(address).unwrap().as_mut() };
+		let original = leaf.clear();
+		*leaf = Leaf(0);
+		leaf.set(Map::Private(to), rwx, accessibility)
+			.expect("leaf was cleared");
+		Self::shootdown(Some(address), false);
+		drop(original);
+		Ok(true)
+	}
 
-		Ok(())
+	fn user_rwx(address: Page) -> Option<RWX> {
+		let leaf = unsafe { Self::find_leaf(address)?.as_ref() };
+		let user = matches!(leaf.accessibility(), Accessibility::UserLocal);
+		(user && (leaf.is_valid() || leaf.is_reserved()))
+			.then(|| super::to_rwx(leaf.0))
+			.flatten()
+	}
+
+	/// Make sure this VMS has a valid ASID, assigning a new one if necessary.
+	fn prepare(&mut self) {
+		let root = self.0 as PPNBox;
+		let asid = ((self.0 & ASID_MASK) >> ASID_SHIFT) as usize;
+		unsafe {
+			if asid != 0 && ASID_OWNERS.get(asid) == Some(&root) {
+				return;
+			}
+			let asid = Self::assign_asid(root) as u64;
+			self.0 = (self.0 & !ASID_MASK) | (asid << ASID_SHIFT);
+		}
 	}
 
 	/// Activate this VMS, deactivating the current one.
-	fn activate(&self) {
+	///
+	/// The TLB is only flushed if this VMS has no ASID.
+	fn activate(&mut self) {
+		self.prepare();
 		unsafe {
 			asm!("csrw      satp, {0}", in(reg) self.0);
-			asm!("sfence.vma");
+			if self.0 & ASID_MASK == 0 {
+				asm!("sfence.vma");
+			}
 		}
 	}
 }
@@ -4,7 +4,7 @@
 //! all the methods that must be present for a VMS to be useable.
 
 use super::*;
-use crate::memory::{AllocateError, SharedPPN, PPN};
+use crate::memory::{AllocateError, HugePage, SharedPPN, PPN};
 
 /// The accessibility of the mapping to be added.
 #[derive(Clone, Copy)]
@@ -51,6 +51,8 @@ pub enum ShareError {
 	OutOfRange,
 	AllocateError(AllocateError),
 	NoEntry,
+	/// The page is shared too often
+	ReferenceCountOverflow,
 }
 
 impl From<AddError> for ShareError {
@@ -71,6 +73,13 @@ where
 	/// Create a new VMS.
 	fn new() -> Result<Self, AllocateError>;
 
+	/// Create another handle to this VMS so it can be used by multiple tasks.
+	///
+	/// ## Safety
+	///
+	/// The VMS must not be freed while any handle is still in use.
+	unsafe fn alias(&self) -> Self;
+
 	/// Allocate the given amount of private pages and insert it as virtual memory at the
 	/// given address.
 	fn allocate(
@@ -80,7 +89,21 @@ where
 		accessibility: Accessibility,
 	) -> Result<(), AddError>;
 
-	/// Allocate the given range of pages.
+	/// Allocate the given amount of private, zeroed pages like [`allocate`](Self::allocate) but
+	/// use hugepages up to the given size for the parts of the range that are suitably aligned.
+	///
+	/// Hugepages can only be deallocated as a whole.
+	fn allocate_huge(
+		virtual_address: Page,
+		count: usize,
+		largest: HugePage,
+		rwx: RWX,
+		accessibility: Accessibility,
+	) -> Result<(), AddError>;
+
+	/// Deallocate the given range of pages.
+	///
+	/// Fails if the range covers only part of a hugepage.
 	fn deallocate(virtual_address: Page, count: usize) -> Result<(), ()>;
 
 	/// Add a single page mapping to a specific VMS.
@@ -147,6 +170,61 @@ where
 		accessibility: Accessibility,
 	) -> Result<(), ShareError>;
 
+	/// Map a range of pages from the current VMS to this VMS like [`share`](Self::share).
+	fn share_range(
+		&self,
+		self_address: Page,
+		from_address: Page,
+		count: usize,
+		rwx: RWX,
+		accessibility: Accessibility,
+	) -> Result<(), ShareError>;
+
+	/// Map a page from the current VMS to this VMS as copy-on-write.
+	///
+	/// The page is shared until either VMS writes to it, at which point
+	/// [`fault_in`](Self::fault_in) gives the writer a private copy. This VMS gets the given
+	/// permissions.
+	fn share_copy_on_write(
+		&self,
+		self_address: Page,
+		from_address: Page,
+		rwx: RWX,
+		accessibility: Accessibility,
+	) -> Result<(), ShareError>;
+
+	/// Reserve a range of pages in this VMS. Each page is allocated and zeroed when it is
+	/// first accessed.
+	fn reserve(
+		&self,
+		address: Page,
+		count: usize,
+		rwx: RWX,
+		accessibility: Accessibility,
+	) -> Result<(), AddError>;
+
+	/// Do what a page fault at the given address of the current VMS would do: allocate a
+	/// zeroed page if it is reserved and, if `write` is set, give the VMS a private copy if it
+	/// is copy-on-write.
+	///
+	/// The kernel can't handle page faults itself, so this must be used before it accesses
+	/// such pages directly.
+	///
+	/// ## Returns
+	///
+	/// * `Ok(true)` if a page was allocated.
+	/// * `Ok(false)` if there was nothing to do.
+	fn fault_in(address: Page, write: bool) -> Result<bool, AllocateError>;
+
+	/// Return the permissions of the page at the given address of the current VMS if it is
+	/// accessible by userland, whether it has been allocated yet or not. Copy-on-write pages
+	/// are reported as read-only.
+	fn user_rwx(address: Page) -> Option<RWX>;
+
+	/// Make sure the VMS can be switched to directly by loading it from a task, e.g. by
+	/// assigning a new address space identifier.
+	fn prepare(&mut self);
+
 	/// Activate this VMS, deactivating the current one.
-	fn activate(&self);
+	fn activate(&mut self);
 }
@@ -1,15 +1,263 @@
 //! Basic logging facilities
 //!
 //! These are all globally accessible for ease of use
+//!
+//! Messages are appended to a byte ring of the current hart, which never waits on the console.
+//! The rings are written to the console a bit at a time whenever a task is scheduled and in
+//! larger chunks when a hart has nothing else to do. Tasks can also take the contents of the
+//! rings with `sys_log_read`, e.g. to send them elsewhere. If a message doesn't fit in a ring
+//! it is dropped and the amount of dropped bytes is reported instead.
+//!
+//! Messages are written to the console directly before any executor is started and after a
+//! panic, so nothing is lost if the kernel can't continue.
+//!
+//! Messages with a level above the maximum level are skipped before they are formatted.
 
+use crate::arch::vms::{self, VirtualMemorySystem, RWX};
+use crate::arch::{self, Map, Page};
+use crate::memory::{self, reserved};
+use crate::task::Executor;
+use core::cell::UnsafeCell;
 use core::fmt;
+use core::mem;
+use core::ptr;
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicU8, Ordering};
+
+/// The amount of pages of the ring of each hart.
+const RING_PAGES: usize = 4;
+
+/// The amount of bytes that fit in a ring.
+const RING_BYTES: usize = RING_PAGES * Page::SIZE - mem::size_of::<[u64; 4]>();
+
+/// The maximum amount of harts with a ring.
+const MAX_RINGS: usize = 64;
+
+/// A bitmap of all harts with an initialized ring.
+static READY: AtomicU64 = AtomicU64::new(0);
+
+/// Whether messages bypass the rings.
+static SYNCHRONOUS: AtomicBool = AtomicBool::new(false);
+
+/// The maximum level of messages that are logged.
+static MAX_LEVEL: AtomicU8 = AtomicU8::new(Level::Info as u8);
+
+/// The importance of a message. Lower levels are more important.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, PartialOrd, Ord)]
+#[repr(u8)]
+pub enum Level {
+	Error = 1,
+	Warn = 2,
+	Info = 3,
+	Debug = 4,
+	Trace = 5,
+}
+
+impl Level {
+	/// Convert a raw level, clamping it to the valid range.
+	pub fn clamp(level: usize) -> Self {
+		match level {
+			0 | 1 => Self::Error,
+			2 => Self::Warn,
+			3 => Self::Info,
+			4 => Self::Debug,
+			_ => Self::Trace,
+		}
+	}
+}
+
+/// The ring of a single hart. It spans [`RING_PAGES`] pages.
+#[repr(C)]
+struct Ring {
+	/// The total amount of bytes ever written.
+	head: AtomicU64,
+	/// The total amount of bytes ever read.
+	tail: AtomicU64,
+	/// The amount of bytes dropped since they were last reported.
+	lost: AtomicU64,
+	_padding: u64,
+	/// Bytes may be written while they are being read, e.g. if the reader causes a page fault.
+	bytes: UnsafeCell<[u8; RING_BYTES]>,
+}
+
+const _: usize = RING_PAGES * Page::SIZE - mem::size_of::<Ring>(); // Size check
+const _: usize = reserved::LOG.byte_count() - MAX_RINGS * RING_PAGES * Page::SIZE; // Ditto
+
+impl Ring {
+	/// # Safety
+	///
+	/// The ring must be initialized.
+	unsafe fn get(hart: u16) -> &'static Self {
+		let offset = usize::from(hart) * RING_PAGES * Page::SIZE;
+		&*reserved::LOG
+			.start
+			.as_ptr()
+			.cast::<u8>()
+			.add(offset)
+			.cast::<Self>()
+	}
+
+	/// Append bytes to the ring or drop them if there isn't enough room. Only the hart owning
+	/// the ring may call this.
+	fn write(&self, data: &[u8]) {
+		let head = self.head.load(Ordering::Relaxed);
+		let tail = self.tail.load(Ordering::Acquire);
+		if RING_BYTES - ((head - tail) as usize) < data.len() {
+			self.lost.fetch_add(data.len() as u64, Ordering::Relaxed);
+			return;
+		}
+		let start = head as usize % RING_BYTES;
+		let (a, b) = data.split_at(data.len().min(RING_BYTES - start));
+		let bytes = self.bytes.get().cast::<u8>();
+		// SAFETY: both ranges are in bounds and don't hold unread bytes.
+		unsafe {
+			ptr::copy_nonoverlapping(a.as_ptr(), bytes.add(start), a.len());
+			ptr::copy_nonoverlapping(b.as_ptr(), bytes, b.len());
+		}
+		self.head.store(head + data.len() as u64, Ordering::Release);
+	}
+
+	/// Move the oldest unread bytes to `buffer` and return the amount of bytes moved.
+	fn read(&self, buffer: &mut [u8]) -> usize {
+		let head = self.head.load(Ordering::Acquire);
+		let tail = self.tail.load(Ordering::Relaxed);
+		let len = buffer.len().min((head - tail) as usize);
+		let start = tail as usize % RING_BYTES;
+		let first = len.min(RING_BYTES - start);
+		let bytes = self.bytes.get().cast::<u8>();
+		// SAFETY: both ranges are in bounds and hold unread bytes, which aren't overwritten
+		// until the tail is advanced.
+		unsafe {
+			ptr::copy_nonoverlapping(bytes.add(start), buffer.as_mut_ptr(), first);
+			ptr::copy_nonoverlapping(bytes, buffer.as_mut_ptr().add(first), len - first);
+		}
+		self.tail.store(tail + len as u64, Ordering::Release);
+		len
+	}
+}
+
+/// Map and clear the ring of the given hart.
+///
+/// # Panics
+///
+/// If it failed to allocate memory or if the hart ID is out of range.
+pub fn init(hart: u16) {
+	assert!(usize::from(hart) < MAX_RINGS, "hart ID out of range");
+	let address = reserved::LOG
+		.start
+		.skip(usize::from(hart) * RING_PAGES)
+		.unwrap();
+	for i in 0..RING_PAGES {
+		let page = Map::Private(memory::allocate().unwrap());
+		arch::VMS::add(
+			address.skip(i).unwrap(),
+			page,
+			RWX::RW,
+			vms::Accessibility::KernelGlobal,
+		)
+		.unwrap();
+	}
+	unsafe { ptr::write_bytes(address.as_ptr().cast::<u8>(), 0, RING_PAGES * Page::SIZE) };
+	READY.fetch_or(1 << hart, Ordering::Release);
+}
+
+/// Whether messages of the given level are logged.
+#[inline]
+pub fn enabled(level: Level) -> bool {
+	level as u8 <= MAX_LEVEL.load(Ordering::Relaxed)
+}
+
+/// Return the maximum level of messages that are logged.
+pub fn max_level() -> Level {
+	Level::clamp(MAX_LEVEL.load(Ordering::Relaxed).into())
+}
+
+/// Set the maximum level of messages that are logged.
+pub fn set_max_level(level: Level) {
+	MAX_LEVEL.store(level as u8, Ordering::Relaxed);
+}
+
+/// Write all buffered messages to the console and write all further messages directly, at any
+/// level. Intended for use when the kernel panics.
+pub fn synchronous() {
+	drain(usize::MAX);
+	SYNCHRONOUS.store(true, Ordering::Relaxed);
+	set_max_level(Level::Trace);
+}
+
+/// Move the oldest unread bytes of all harts to `buffer`. Returns the amount of bytes written,
+/// which is less than the length of `buffer` only if there are no more bytes.
+///
+/// Only one hart may read at a time, which is ensured by the kernel lock.
+pub fn read(buffer: &mut [u8]) -> usize {
+	let ready = READY.load(Ordering::Acquire);
+	let mut written = 0;
+	for hart in (0..MAX_RINGS as u16).filter(|h| ready & (1 << h) != 0) {
+		// SAFETY: the ring is initialized.
+		let ring = unsafe { Ring::get(hart) };
+		if ring.lost.load(Ordering::Relaxed) > 0 {
+			let mut notice = Cursor(&mut buffer[written..], 0);
+			let lost = ring.lost.load(Ordering::Relaxed);
+			if fmt::Write::write_fmt(&mut notice, format_args!("[{} bytes lost]\n", lost)).is_err()
+			{
+				// Report it once there is enough room.
+				return written;
+			}
+			written += notice.1;
+			ring.lost.fetch_sub(lost, Ordering::Relaxed);
+		}
+		written += ring.read(&mut buffer[written..]);
+	}
+	written
+}
+
+/// Write at most `max` bytes of buffered messages to the console. Returns the amount of bytes
+/// written, which is less than `max` only if there are no more bytes.
+pub fn drain(max: usize) -> usize {
+	let mut buffer = [0; 64];
+	let mut written = 0;
+	while written < max {
+		let len = buffer.len().min(max - written);
+		let n = read(&mut buffer[..len]);
+		buffer[..n].iter().copied().for_each(console_write);
+		written += n;
+		if n < len {
+			break;
+		}
+	}
+	written
+}
+
+fn console_write(b: u8) {
+	crate::arch::riscv::sbi::console_putchar(b);
+}
+
+/// A writer to a byte slice that fails if the slice is full.
+struct Cursor<'a>(&'a mut [u8], usize);
+
+impl fmt::Write for Cursor<'_> {
+	fn write_str(&mut self, string: &str) -> fmt::Result {
+		let end = self.1 + string.len();
+		self.0
+			.get_mut(self.1..end)
+			.ok_or(fmt::Error)?
+			.copy_from_slice(string.as_bytes());
+		self.1 = end;
+		Ok(())
+	}
+}
 
 pub struct Log;
 
 impl fmt::Write for Log {
 	fn write_str(&mut self, string: &str) -> fmt::Result {
-		for b in string.bytes() {
-			crate::arch::riscv::sbi::console_putchar(b);
+		let hart = Executor::try_id()
+			.filter(|&h| usize::from(h) < MAX_RINGS)
+			.filter(|&h| READY.load(Ordering::Acquire) & (1 << h) != 0)
+			.filter(|_| !SYNCHRONOUS.load(Ordering::Relaxed));
+		match hart {
+			// SAFETY: the ring is initialized.
+			Some(hart) => unsafe { Ring::get(hart) }.write(string.as_bytes()),
+			None => string.bytes().for_each(console_write),
 		}
 		Ok(())
 	}
@@ -17,10 +265,20 @@ impl fmt::Write for Log {
 
 #[macro_export]
 macro_rules! log {
-	($($args:tt)*) => {{
-		#[allow(unused_imports)]
-		use core::fmt::Write;
-		writeln!($crate::log::Log, $($args)*).unwrap();
+	($($args:tt)*) => {
+		$crate::log_at!($crate::log::Level::Info, $($args)*)
+	}
+}
+
+/// Log a message with the given [`Level`](crate::log::Level).
+#[macro_export]
+macro_rules! log_at {
+	($level:expr, $($args:tt)*) => {{
+		if $crate::log::enabled($level) {
+			#[allow(unused_imports)]
+			use core::fmt::Write;
+			writeln!($crate::log::Log, $($args)*).unwrap();
+		}
 	}}
 }
 
@@ -45,3 +303,16 @@ macro_rules! dbg {
         ($($crate::dbg!($val)),+,)
     };
 }
+
+#[cfg(test)]
+mod test {
+	use super::*;
+
+	test!(cursor_full() {
+		let mut buffer = [0; 8];
+		let mut c = Cursor(&mut buffer, 0);
+		assert!(fmt::Write::write_str(&mut c, "12345").is_ok());
+		assert!(fmt::Write::write_str(&mut c, "6789").is_err());
+		assert_eq!(c.1, 5);
+	});
+}
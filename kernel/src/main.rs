@@ -47,6 +47,7 @@ mod powerstate;
 mod sync;
 mod syscall;
 mod task;
+mod trace;
 
 use core::convert::TryInto;
 use core::{mem, panic, ptr};
@@ -57,6 +58,7 @@ static PLATFORM_INFO_PHYS_PTR: OnceCell<usize> = OnceCell::new(0);
 
 #[panic_handler]
 fn panic(info: &panic::PanicInfo) -> ! {
+	log::synchronous();
 	log!("Kernel panicked!");
 	if let Some(msg) = info.message() {
 		log!("  Message:  {:?}", msg);
@@ -410,6 +412,31 @@ extern "C" fn main(
 	let _ = (boot_args, stdout, model);
 
 	arch::enable_interrupts(true);
-	task::Executor::init(hart_id.try_into().expect("hart id higher than supported"));
+	let hart_id: u16 = hart_id.try_into().expect("hart id higher than supported");
+	task::Executor::init(hart_id);
+	task::Executor::start(hart_id);
+
+	// Other harts only take the kernel lock once this hart goes idle, so they can be started
+	// before the init task is woken.
+	for id in arch::stopped_harts() {
+		task::Executor::init(id);
+		if arch::start_hart(id).is_err() {
+			log!("failed to start hart {}", id);
+		}
+	}
+
+	// The init task is the first task of the root group.
+	task::Executor::wake(task::Address::todo(0));
+	task::Executor::next();
+}
+
+/// The entry point of all harts other than the boot hart. The boot hart has already set up
+/// the executor of this hart.
+#[no_mangle]
+#[cfg(not(test))]
+extern "C" fn main_secondary(hart_id: usize) -> ! {
+	arch::init();
+	arch::enable_interrupts(true);
+	task::Executor::start(hart_id as u16);
 	task::Executor::next();
 }
@@ -16,20 +16,39 @@
 //! * The frontend is simply a stack with physical addresses (as PPNs). Popping and pushing onto it
 //!   is very fast. Each hart has a separate stack to improve cache efficiency.
 //!
-//! * The backend is a tree structure that is very similar to VMA tables: The upper bits are the
-//!   PPN of each page. The main difference is that the lower bits are used as a counter indicating
-//!   how many pages are free. If the counter is 0, the table can be removed. If the counter is
-//!   `Page::SIZE / PTE_SIZE`, the table can be merged into a hugepage.
+//! * The backend is a tree structure that is very similar to VMA tables: each level splits the
+//!   pages of the level above in `512` parts. Instead of PPNs each node holds a counter indicating
+//!   how many pages below it are free. If the counter of a node is equal to the amount of pages
+//!   it covers, the node can be handed out as a single hugepage. Freed pages are counted up
+//!   again, so hugepages are merged automatically once all of their pages are back in the tree.
+//!
+//!   The tree is implicit: the counters of each level are stored in a flat array and the lowest
+//!   level is a bitmap with one bit per page.
+//!
+//! The stacks are refilled from the tree when they run empty and return their oldest pages to
+//! the tree when they are full. When no free hugepage is left the stacks are drained completely
+//! so their pages can be merged.
 //!
 //! Using a VMS-like tree structure makes it trivial to support hugepages of any size.
+//!
+//! Devices need physically contiguous memory. These ranges are taken straight from the tree
+//! in power-of-two size classes up to a megapage, so each range is aligned to its class and
+//! found by scanning the bitmap of a single megapage. Any pages beyond the requested amount
+//! are returned to the tree immediately.
 
-use super::reserved::PMM_STACK;
-use super::{PPNBox, PPNRange, PPN};
+use super::reserved::{PMM_BITMAP, PMM_STACK};
+use super::{HugePage, PPNBox, PPNRange, PPN};
 use crate::arch;
 use crate::arch::vms::VirtualMemorySystem;
 use core::mem;
 use core::slice;
 
+/// The amount of pages covered by a node in the middle level of the tree.
+const MEGA: usize = HugePage::Mega.pages();
+
+/// The amount of pages covered by a node in the top level of the tree.
+const GIGA: usize = HugePage::Giga.pages();
+
 /// Stacks of PPNs for fast allocation. The stack also act as a ring buffer when moving PPNs
 /// to the tree.
 pub(super) struct Stacks {
@@ -39,9 +58,24 @@ pub(super) struct Stacks {
 	top_base: *mut (u16, u16),
 }
 
-/// An allocator including a bitmap and a stack.
+/// The backend of the allocator. Each node counts the free pages below it.
+struct Tree {
+	/// The PPN of the first page covered by the tree. It is aligned to a megapage.
+	base: PPNBox,
+	/// A bit for each page, which is set if the page is free.
+	free: &'static mut [u64],
+	/// The amount of free pages in each megapage.
+	mega: &'static mut [u16],
+	/// The amount of free pages in each gigapage.
+	giga: &'static mut [u32],
+	/// The megapage single pages were last allocated from.
+	hint: usize,
+}
+
+/// An allocator including a tree and a stack.
 pub struct Allocator {
 	stacks: Stacks,
+	tree: Tree,
 }
 
 impl Stacks {
@@ -92,7 +126,6 @@ impl Stacks {
 	/// Note that PPNs at the bottom are older than higher PPNs and are less likely to be in
 	/// cache. This makes them better candidates for insertion in the tree.
 	#[must_use]
-	#[allow(dead_code)]
 	fn pop_base(&mut self, stack_index: usize) -> Option<PPN> {
 		let stack = &mut self.stacks[stack_index];
 		// SAFETY: the pointers point to arrays at least as large as stacks, and if the index
@@ -109,63 +142,228 @@ impl Stacks {
 	}
 }
 
-#[cfg(fals)]
 impl Tree {
-	/// The maximum depths of the tree.
-	const LEVELS: usize = 3;
+	/// Return the amount of bytes needed for a tree covering the given amount of pages
+	/// starting at the given PPN. The base is rounded down, the count is rounded up.
+	fn byte_count(base: PPNBox, count: usize) -> usize {
+		let (_, _, giga) = Self::layout(base, count);
+		giga + Self::giga_count(base, count) * mem::size_of::<u32>()
+	}
+
+	/// Return the offsets of the bitmap, the mega counters and the giga counters.
+	fn layout(base: PPNBox, count: usize) -> (usize, usize, usize) {
+		let (_, count) = Self::bounds(base, count);
+		let mega = count / 8;
+		let giga = mega + (count / MEGA) * mem::size_of::<u16>();
+		let giga = (giga + mem::align_of::<u32>() - 1) & !(mem::align_of::<u32>() - 1);
+		(0, mega, giga)
+	}
+
+	/// Return the base and amount of pages rounded to megapages.
+	fn bounds(base: PPNBox, count: usize) -> (PPNBox, usize) {
+		let start = base as usize & !(MEGA - 1);
+		let end = (base as usize + count + MEGA - 1) & !(MEGA - 1);
+		(start as PPNBox, end - start)
+	}
+
+	/// Return the amount of gigapages the given range of pages touches.
+	fn giga_count(base: PPNBox, count: usize) -> usize {
+		let (base, count) = Self::bounds(base, count);
+		(base as usize + count - 1) / GIGA - base as usize / GIGA + 1
+	}
+
+	/// Create a tree with no free pages.
+	///
+	/// ## Safety
+	///
+	/// The address must point to at least `byte_count(base, count)` zeroed bytes that are not
+	/// used by anything else.
+	unsafe fn new(address: *mut u8, base: PPNBox, count: usize) -> Self {
+		let (free, mega, giga) = Self::layout(base, count);
+		let giga_count = Self::giga_count(base, count);
+		let (base, count) = Self::bounds(base, count);
+		Self {
+			base,
+			free: slice::from_raw_parts_mut(address.add(free).cast(), count / 64),
+			mega: slice::from_raw_parts_mut(address.add(mega).cast(), count / MEGA),
+			giga: slice::from_raw_parts_mut(address.add(giga).cast(), giga_count),
+			hint: 0,
+		}
+	}
+
+	/// Return the index of the gigapage counter of the given page index.
+	fn giga_index(&self, index: usize) -> usize {
+		(self.base as usize + index) / GIGA - self.base as usize / GIGA
+	}
 
 	/// Inserts a page into the tree.
-	fn insert(&mut self, page: PPN) {}
+	fn insert(&mut self, page: PPN) {
+		let i = (page.into_raw() - self.base) as usize;
+		debug_assert_eq!(self.free[i / 64] & (1 << (i % 64)), 0, "page already free");
+		self.free[i / 64] |= 1 << (i % 64);
+		self.mega[i / MEGA] += 1;
+		let g = self.giga_index(i);
+		self.giga[g] += 1;
+	}
 
-	/// Remove and return a set of pages from the tree.
-	/// It is a megapage except that some of the pages may already be allocated.
-	fn batch_allocate(&mut self) -> Result<PPNBatch, ()> {
-		let mut tbl = self.0;
-		for _ in 0..LEVELS - 1 {
-			let pte = tbl[0];
+	/// Inserts a hugepage into the tree.
+	fn insert_huge(&mut self, page: PPN, size: HugePage) {
+		let start = page.into_raw();
+		for i in 0..size.pages() as PPNBox {
+			self.insert(unsafe { PPN::from_raw(start + i) });
 		}
 	}
-}
 
-#[cfg(fals)]
-impl Tree {
-	// /// Inserts a megapage into the tree.
-}
+	/// Remove and return a single page from the tree.
+	///
+	/// Pages are taken from partially allocated hugepages when possible to keep free hugepages
+	/// intact.
+	fn allocate(&mut self) -> Option<PPN> {
+		let m = if self.rank(self.hint) == Some(0) {
+			self.hint
+		} else {
+			let mut best = None;
+			for m in 0..self.mega.len() {
+				match (self.rank(m), best) {
+					(Some(0), _) => {
+						best = Some((0, m));
+						break;
+					}
+					(Some(r), Some((b, _))) if r < b => best = Some((r, m)),
+					(Some(r), None) => best = Some((r, m)),
+					_ => (),
+				}
+			}
+			best?.1
+		};
+		self.hint = m;
 
-#[cfg(fals)]
-impl Tree {
-	// /// Inserts a gigapage into the tree.
-}
+		let words = &mut self.free[m * MEGA / 64..(m + 1) * MEGA / 64];
+		let (w, word) = words.iter_mut().enumerate().find(|(_, w)| **w != 0)?;
+		let bit = word.trailing_zeros() as usize;
+		*word &= !(1 << bit);
+		let i = m * MEGA + w * 64 + bit;
+		self.mega[m] -= 1;
+		let g = self.giga_index(i);
+		self.giga[g] -= 1;
+		Some(unsafe { PPN::from_raw(self.base + i as PPNBox) })
+	}
 
-#[cfg(fals)]
-impl Tree {
-	// /// Inserts a terapage into the tree.
+	/// Return how much allocating a single page from the given megapage would break up free
+	/// hugepages. Lower is better. Returns `None` if there are no free pages.
+	fn rank(&self, mega: usize) -> Option<u8> {
+		let free = usize::from(*self.mega.get(mega)?);
+		let giga = self.giga[self.giga_index(mega * MEGA)] as usize;
+		(free > 0).then(|| u8::from(free == MEGA) + u8::from(giga == GIGA) * 2)
+	}
+
+	/// Remove and return `count` physically contiguous pages from the tree. `count` must be a
+	/// power of two no larger than a megapage. The first page is aligned to `count`.
+	///
+	/// Megapages that are partially allocated are searched first to keep free hugepages intact.
+	fn allocate_contiguous(&mut self, count: usize) -> Option<PPN> {
+		debug_assert!(count.is_power_of_two() && count <= MEGA);
+		for rank in 0..4 {
+			for m in 0..self.mega.len() {
+				if self.rank(m) != Some(rank) || usize::from(self.mega[m]) < count {
+					continue;
+				}
+				if let Some(i) = self.find_contiguous(m, count) {
+					let start = m * MEGA + i;
+					for i in start..start + count {
+						self.free[i / 64] &= !(1 << (i % 64));
+					}
+					self.mega[m] -= count as u16;
+					let g = self.giga_index(start);
+					self.giga[g] -= count as u32;
+					return Some(unsafe { PPN::from_raw(self.base + start as PPNBox) });
+				}
+			}
+		}
+		None
+	}
+
+	/// Find an aligned range of `count` free pages in a megapage and return the index of its
+	/// first page in the megapage.
+	fn find_contiguous(&self, mega: usize, count: usize) -> Option<usize> {
+		let words = &self.free[mega * MEGA / 64..(mega + 1) * MEGA / 64];
+		if count <= 64 {
+			let mask = u64::MAX >> (64 - count);
+			words.iter().enumerate().find_map(|(w, &word)| {
+				(0..64)
+					.step_by(count)
+					.find(|&b| (word >> b) & mask == mask)
+					.map(|b| w * 64 + b)
+			})
+		} else {
+			words
+				.chunks_exact(count / 64)
+				.position(|c| c.iter().all(|&w| w == u64::MAX))
+				.map(|c| c * count)
+		}
+	}
+
+	/// Remove and return a free hugepage from the tree.
+	fn allocate_huge(&mut self, size: HugePage) -> Option<PPN> {
+		let start = match size {
+			HugePage::Mega => {
+				// Prefer megapages in partially allocated gigapages.
+				let m = (0..self.mega.len())
+					.filter(|&m| usize::from(self.mega[m]) == MEGA)
+					.min_by_key(|&m| self.giga[self.giga_index(m * MEGA)] as usize == GIGA)?;
+				m * MEGA
+			}
+			HugePage::Giga => {
+				let g = self.giga.iter().position(|&c| c as usize == GIGA)?;
+				(self.base as usize / GIGA + g) * GIGA - self.base as usize
+			}
+		};
+		let count = size.pages();
+		self.free[start / 64..(start + count) / 64]
+			.iter_mut()
+			.for_each(|w| *w = 0);
+		self.mega[start / MEGA..(start + count) / MEGA]
+			.iter_mut()
+			.for_each(|c| *c -= MEGA as u16);
+		let g = self.giga_index(start);
+		self.giga[g] -= count as u32;
+		Some(unsafe { PPN::from_raw(self.base + start as PPNBox) })
+	}
 }
 
 impl Allocator {
+	/// The amount of pages moved between a stack and the tree at once.
+	const BATCH_SIZE: u16 = Stacks::STACK_SIZE / 4;
+
 	/// Creates a new `Allocator` with the given pages.
 	pub fn new(pages: &mut [PPNRange]) -> Result<Self, ()> {
 		// TODO zero out memory before handing it to the VMS.
+		// Determine the range of pages the tree needs to cover.
+		let base = pages.iter().map(PPNRange::start).min().ok_or(())?;
+		let end = pages
+			.iter()
+			.map(|p| p.start() as usize + p.len())
+			.max()
+			.unwrap();
+		let tree_bytes = Tree::byte_count(base, end - base as usize);
+		assert!(tree_bytes <= PMM_BITMAP.byte_count(), "too much memory");
+
+		let mut i = 0;
+		let mut next = || loop {
+			if let Some(p) = pages[i].pop() {
+				break p;
+			} else {
+				i += 1;
+			}
+		};
+
 		// Get minimum needed pages
 		let hc = 1; // TODO
 		let count = hc * Stacks::MEM_TOTAL_SIZE;
 		let count = (count + arch::PAGE_MASK) & !arch::PAGE_MASK;
 		let count = count / arch::Page::SIZE;
-		let stacks = {
-			let mut i = 0;
-			arch::VMS::allocate_pages(
-				|| loop {
-					if let Some(p) = pages[i].pop() {
-						break p;
-					} else {
-						i += 1;
-					}
-				},
-				PMM_STACK.start,
-				count as usize,
-			);
-			PMM_STACK.start
-		};
+		arch::VMS::allocate_pages(&mut next, PMM_STACK.start, count as usize);
+		let stacks = PMM_STACK.start;
 		let stacks = unsafe {
 			Stacks {
 				stacks: slice::from_raw_parts_mut(stacks.as_ptr().cast(), hc),
@@ -176,7 +374,23 @@ impl Allocator {
 					.cast(),
 			}
 		};
-		let mut s = Self { stacks };
+		// The pages may not be zeroed.
+		unsafe {
+			stacks
+				.top_base
+				.cast::<u8>()
+				.write_bytes(0, mem::size_of::<(u16, u16)>() * hc)
+		};
+
+		let count = arch::Page::min_pages_for_byte_count(tree_bytes);
+		arch::VMS::allocate_pages(&mut next, PMM_BITMAP.start, count);
+		let tree = unsafe {
+			let address = PMM_BITMAP.start.as_ptr().cast::<u8>();
+			address.write_bytes(0, tree_bytes);
+			Tree::new(address, base, end - base as usize)
+		};
+
+		let mut s = Self { stacks, tree };
 
 		for p in pages {
 			while let Some(p) = p.pop() {
@@ -190,21 +404,83 @@ impl Allocator {
 	/// Allocate a page.
 	pub fn alloc(&mut self) -> Result<PPN, ()> {
 		// FIXME use hart IDs.
-		Ok(self.stacks.pop(0).expect("TODO"))
+		if let Some(ppn) = self.stacks.pop(0) {
+			return Ok(ppn);
+		}
+		for _ in 0..Self::BATCH_SIZE {
+			match self.tree.allocate() {
+				Some(ppn) => self.stacks.push(0, ppn).unwrap(),
+				None => break,
+			}
+		}
+		self.stacks.pop(0).ok_or(())
 	}
 
 	/// Free a page.
 	pub fn free(&mut self, page: PPN) {
 		// FIXME use hart IDs.
-		match self.stacks.push(0, page) {
-			Ok(()) => (),
-			Err(_) => todo!(),
+		if let Err(page) = self.stacks.push(0, page) {
+			// Move the oldest pages to the tree to make room.
+			for _ in 0..Self::BATCH_SIZE {
+				let ppn = self.stacks.pop_base(0).unwrap();
+				self.tree.insert(ppn);
+			}
+			self.stacks.push(0, page).unwrap();
+		}
+	}
+
+	/// Allocate a hugepage.
+	pub fn alloc_huge(&mut self, size: HugePage) -> Result<PPN, ()> {
+		if let Some(ppn) = self.tree.allocate_huge(size) {
+			return Ok(ppn);
+		}
+		// Pages in the stacks may complete a hugepage, so move them back to the tree.
+		while let Some(ppn) = self.stacks.pop_base(0) {
+			self.tree.insert(ppn);
+		}
+		self.tree.allocate_huge(size).ok_or(())
+	}
+
+	/// Free a hugepage.
+	pub fn free_huge(&mut self, page: PPN, size: HugePage) {
+		self.tree.insert_huge(page, size);
+	}
+
+	/// Allocate a range of physically contiguous pages.
+	pub fn alloc_contiguous(&mut self, count: usize) -> Result<PPN, ()> {
+		if count == 0 || count > MEGA {
+			return Err(());
+		}
+		let class = count.next_power_of_two();
+		let ppn = match self.tree.allocate_contiguous(class) {
+			Some(ppn) => ppn,
+			None => {
+				// Pages in the stacks may complete a range, so move them back to the tree.
+				while let Some(ppn) = self.stacks.pop_base(0) {
+					self.tree.insert(ppn);
+				}
+				self.tree.allocate_contiguous(class).ok_or(())?
+			}
+		};
+		let start = ppn.into_raw();
+		for i in count..class {
+			self.tree
+				.insert(unsafe { PPN::from_raw(start + i as PPNBox) });
+		}
+		Ok(unsafe { PPN::from_raw(start) })
+	}
+
+	/// Free a range of physically contiguous pages.
+	pub fn free_contiguous(&mut self, page: PPN, count: usize) {
+		let start = page.into_raw();
+		for i in 0..count as PPNBox {
+			self.tree.insert(unsafe { PPN::from_raw(start + i) });
 		}
 	}
 
 	/// Inserts an untracked page.
 	pub fn insert(&mut self, page: PPN) {
-		self.free(page)
+		self.tree.insert(page)
 	}
 }
 
@@ -23,6 +23,25 @@ use allocator::Allocator;
 #[derive(Debug)]
 pub struct AllocateError;
 
+/// The size of a hugepage.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum HugePage {
+	/// `512` pages, i.e. 2 MiB with 4 KiB pages.
+	Mega,
+	/// `512 * 512` pages, i.e. 1 GiB with 4 KiB pages.
+	Giga,
+}
+
+impl HugePage {
+	/// Return the amount of pages in a hugepage of this size.
+	pub const fn pages(self) -> usize {
+		match self {
+			Self::Mega => 1 << 9,
+			Self::Giga => 1 << 18,
+		}
+	}
+}
+
 /// The global memory allocator.
 ///
 /// The maximum area order varies for each architecture depending on hugepage support and practical
@@ -88,6 +107,37 @@ pub fn allocate() -> Result<PPN, AllocateError> {
 	}
 }
 
+/// Allocate a physically contiguous hugepage. The PPN is aligned to the size of the hugepage.
+#[optimize(speed)]
+pub fn allocate_huge(size: HugePage) -> Result<PPN, AllocateError> {
+	#[cfg(debug_assertions)]
+	let mut a = unsafe {
+		ALLOCATOR
+			.as_ref()
+			.expect("No initialized buddy allocator")
+			.lock()
+	};
+	#[cfg(not(debug_assertions))]
+	let mut a = unsafe { ALLOCATOR.as_ref().unwrap_unchecked().lock() };
+	a.alloc_huge(size).map_err(|()| AllocateError)
+}
+
+/// Allocate a range of physically contiguous pages, e.g. for use by devices. Ranges of up to a
+/// megapage can be allocated.
+#[optimize(speed)]
+pub fn allocate_contiguous(count: usize) -> Result<PPN, AllocateError> {
+	#[cfg(debug_assertions)]
+	let mut a = unsafe {
+		ALLOCATOR
+			.as_ref()
+			.expect("No initialized buddy allocator")
+			.lock()
+	};
+	#[cfg(not(debug_assertions))]
+	let mut a = unsafe { ALLOCATOR.as_ref().unwrap_unchecked().lock() };
+	a.alloc_contiguous(count).map_err(|()| AllocateError)
+}
+
 /// Allocate a number of pages. The pages are not necessarily contiguous. To avoid needing to
 /// lock once per page returned or needing an array to write out to, a closure must be passed
 /// instead which can write the allocated pages out directly to whatever structure.
@@ -133,3 +183,44 @@ pub unsafe fn deallocate(page: PPN) {
 	#[cfg(not(debug_assertions))]
 	ALLOCATOR.as_ref().unwrap_unchecked().lock().free(page);
 }
+
+/// Deallocate a range of physically contiguous pages.
+///
+/// ## Safety
+///
+/// The pages are no longer in use and haven't been freed yet.
+pub unsafe fn deallocate_contiguous(page: PPN, count: usize) {
+	#[cfg(debug_assertions)]
+	ALLOCATOR
+		.as_ref()
+		.expect("No initialized PMM")
+		.lock()
+		.free_contiguous(page, count);
+	#[cfg(not(debug_assertions))]
+	ALLOCATOR
+		.as_ref()
+		.unwrap_unchecked()
+		.lock()
+		.free_contiguous(page, count);
+}
+
+/// Deallocate a hugepage
+///
+/// ## Safety
+///
+/// The hugepage is no longer in use and hasn't been freed yet.
+#[optimize(speed)]
+pub unsafe fn deallocate_huge(page: PPN, size: HugePage) {
+	#[cfg(debug_assertions)]
+	ALLOCATOR
+		.as_ref()
+		.expect("No initialized PMM")
+		.lock()
+		.free_huge(page, size);
+	#[cfg(not(debug_assertions))]
+	ALLOCATOR
+		.as_ref()
+		.unwrap_unchecked()
+		.lock()
+		.free_huge(page, size);
+}
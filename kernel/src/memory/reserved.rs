@@ -225,9 +225,15 @@ range! {
 	SHARED_COUNTERS => (1 << (44 + 2)) / Page::SIZE,
 	SHARED_ALLOC => (1 << (44 - 12 + 1)) / Page::SIZE,
 	HART_STACKS => MAX_HARTS * Page::SIZE,
+	EXECUTORS => MAX_HARTS * 4 * Page::SIZE,
+	TRACE => MAX_HARTS * 4 * Page::SIZE,
+	LOG => MAX_HARTS * 4 * Page::SIZE,
 	DEVICE_TREE => 1 << 16,
 	TASK_GROUPS => 1 << 20,
+	TASK_TABLES => 1 << 30,
 	TASK_DATA => 1 << 30,
+	IPC_QUEUES => 1 << 30,
+	CHANNELS => 1 << 20,
 	// https://github.com/riscv/riscv-plic-spec/blob/master/riscv-plic.adoc
 	PLIC => 0x4000000,
 	REGISTRY => 1 << 20,
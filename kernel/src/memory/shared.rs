@@ -2,15 +2,21 @@
 
 use super::reserved::{SHARED_ALLOC, SHARED_COUNTERS};
 use super::{AllocateError, PPNBox, PPN};
-use crate::arch::PAGE_BITS;
+use crate::arch::vms::{Accessibility, VirtualMemorySystem, RWX};
+use crate::arch::{Map, Page, PAGE_BITS, VMS};
 use core::fmt;
 use core::mem;
 use core::ptr::NonNull;
 use core::sync::atomic::{AtomicI16, AtomicU32, Ordering};
 
 const COUNTERS: NonNull<AtomicU32> = SHARED_COUNTERS.start.as_non_null_ptr().cast();
+/// Whether the counters of a group of `1 << PAGE_BITS` PPNs are mapped: `0` if not, `-1` if
+/// they are being mapped and `1` if they are.
 const ALLOC: NonNull<AtomicI16> = SHARED_ALLOC.start.as_non_null_ptr().cast();
 
+/// The amount of pages holding the counters of a group of PPNs.
+const COUNTER_PAGES: usize = (mem::size_of::<AtomicU32>() << PAGE_BITS) / Page::SIZE;
+
 /// Representation of a physical page that can be safely shared.
 pub struct SharedPPN(u32);
 
@@ -22,29 +28,23 @@ impl SharedPPN {
 	/// Create a new shared page.
 	pub fn new(ppn: PPN) -> Result<Self, AllocateError> {
 		let ppn = ppn.into_raw();
-		// Ensure the underlying page is allocated.
+		// Ensure the pages with the counters are allocated.
 		let counter = unsafe { &mut *ALLOC.as_ptr().add(ppn as usize >> PAGE_BITS) };
 		loop {
 			// Try to get an allocation lock.
-			match counter.compare_exchange_weak(0, -1, Ordering::Relaxed, Ordering::Relaxed) {
+			match counter.compare_exchange_weak(0, -1, Ordering::Acquire, Ordering::Acquire) {
 				// We got the lock and need to allocate
 				Ok(_) => {
-					todo!()
-				}
-				// Another hart is already allocating, so try again.
-				// Retrying is necessary in case the hart drops the page immediately after,
-				// requiring an allocation regardless.
-				Err(-1) => (),
-				// The page is already allocated, so try to increase.
-				// Trying is necessary in case the page just got dropped.
-				Err(c) => {
-					if counter
-						.compare_exchange_weak(c, c + 1, Ordering::Relaxed, Ordering::Relaxed)
-						.is_err()
-					{
-						break;
-					}
+					let ret = Self::map_counters(ppn);
+					counter.store(if ret.is_ok() { 1 } else { 0 }, Ordering::Release);
+					ret?;
+					break;
 				}
+				// Another hart is already allocating or the exchange failed spuriously, so try
+				// again.
+				Err(-1) | Err(0) => (),
+				// The counters are already allocated. They are never freed.
+				Err(_) => break,
 			}
 		}
 		// Set counter to 0 from -1 or any garbage value.
@@ -54,6 +54,23 @@ impl SharedPPN {
 		Ok(Self(ppn))
 	}
 
+	/// Map the pages with the counters of the given PPN and its neighbours.
+	fn map_counters(ppn: PPNBox) -> Result<(), AllocateError> {
+		let first = ppn as usize & !((1 << PAGE_BITS) - 1);
+		let start = unsafe { NonNull::new_unchecked(COUNTERS.as_ptr().add(first)) };
+		let start = Page::new(start.cast()).unwrap();
+		for i in 0..COUNTER_PAGES {
+			VMS::add(
+				start.skip(i).unwrap(),
+				Map::Private(super::allocate()?),
+				RWX::RW,
+				Accessibility::KernelGlobal,
+			)
+			.expect("counter page was already mapped");
+		}
+		Ok(())
+	}
+
 	/// Attempt to increase the reference count of this page. It may fail if the counter would
 	/// overflow.
 	#[allow(dead_code)]
@@ -104,10 +121,8 @@ impl Drop for SharedPPN {
 		// Underflow cannot happen unless we're the only owner, so fetch_sub can safely be used.
 		// Note that fetch_sub returns the value from _before_ the substraction.
 		if counter.fetch_sub(1, Ordering::Relaxed) == 0 {
-			// Free the page.
+			// Free the page. The counter is kept as neighbouring pages likely use it.
 			let _ = unsafe { PPN::from_raw(self.0) };
-			// Free the counter
-			todo!();
 		}
 	}
 }
@@ -5,6 +5,7 @@
 use crate::arch::vms::{self, VirtualMemorySystem, RWX};
 use crate::arch::{self, Map, MapRange, Page, PageData};
 use crate::memory::ppn::*;
+use crate::memory::HugePage;
 use crate::task;
 use core::convert::TryFrom;
 use core::mem;
@@ -29,7 +30,7 @@ pub type Syscall = extern "C" fn(
 pub struct Return(Status, usize);
 
 /// The length of the table as a separate constant because Rust is a little dum dum.
-pub const TABLE_LEN: usize = 20;
+pub const TABLE_LEN: usize = 31;
 
 /// Table with all syscalls.
 #[export_name = "syscall_table"]
@@ -52,8 +53,19 @@ pub static TABLE: [Syscall; TABLE_LEN] = [
 	sys::sys_log,                      // 15
 	sys::sys_registry_add,             // 16
 	sys::sys_registry_get,             // 17
-	sys::placeholder,                  // 18
-	sys::placeholder,                  // 19
+	sys::task_futex,                   // 18
+	sys::task_spawn_thread,            // 19
+	sys::task_exit,                    // 20
+	sys::task_set_priority,            // 21
+	sys::io_submit,                    // 22
+	sys::chan_create,                  // 23
+	sys::chan_open,                    // 24
+	sys::sys_registry_wait,            // 25
+	sys::sys_trace_read,               // 26
+	sys::task_counters,                // 27
+	sys::sys_log_read,                 // 28
+	sys::sys_log_level,                // 29
+	sys::placeholder,                  // 30
 ];
 
 /// Enum representing whether a syscall was successfull or failed.
@@ -82,6 +94,8 @@ pub enum Status {
 	TooLong = 10,
 	Occupied = 11,
 	Unavailable = 12,
+	/// The state changed before the operation could be performed. Try again.
+	Retry = 13,
 }
 
 impl From<Status> for u8 {
@@ -108,12 +122,51 @@ mod sys {
 	const PROTECT_R: usize = 0x1;
 	const PROTECT_W: usize = 0x2;
 	const PROTECT_X: usize = 0x4;
-	#[allow(dead_code)]
 	const MEGAPAGE: usize = 0x10;
-	#[allow(dead_code)]
 	const GIGAPAGE: usize = 0x20;
-	#[allow(dead_code)]
 	const TERAPAGE: usize = 0x30;
+	const PREFAULT: usize = 0x40;
+
+	/// Make sure a range is writable memory of the current task and fault in all of its pages,
+	/// as the kernel can't handle page faults itself.
+	fn prepare_user_buffer(address: usize, length: usize) -> Result<(), Status> {
+		prepare_user_range(address, length, true)
+	}
+
+	/// Make sure a range is readable memory of the current task and fault in all of its pages.
+	///
+	/// Pages that were never accessed aren't allocated yet, which would fault.
+	fn prepare_user_input(address: usize, length: usize) -> Result<(), Status> {
+		prepare_user_range(address, length, false)
+	}
+
+	fn prepare_user_range(address: usize, length: usize, write: bool) -> Result<(), Status> {
+		let end = address
+			.checked_add(length)
+			.ok_or(Status::MemoryNotAllocated)?;
+		for page in (address & !arch::PAGE_MASK..end).step_by(arch::Page::SIZE) {
+			let page = arch::Page::from_usize(page).map_err(|_| Status::MemoryNotAllocated)?;
+			arch::VMS::user_rwx(page).ok_or(Status::MemoryNotAllocated)?;
+			arch::VMS::fault_in(page, write).map_err(|_| Status::MemoryUnavailable)?;
+			match (write, arch::VMS::user_rwx(page)) {
+				(_, Some(RWX::RW)) | (_, Some(RWX::RWX)) => (),
+				(false, Some(RWX::R)) | (false, Some(RWX::RX)) => (),
+				_ => return Err(Status::MemoryInvalidProtectionFlags),
+			}
+		}
+		Ok(())
+	}
+
+	/// Decode the largest page size a range of memory may be mapped with.
+	///
+	/// There are no terapages in Sv39, so gigapages are used instead.
+	fn decode_page_size(flags: usize) -> Option<HugePage> {
+		match flags & TERAPAGE {
+			MEGAPAGE => Some(HugePage::Mega),
+			GIGAPAGE | TERAPAGE => Some(HugePage::Giga),
+			_ => None,
+		}
+	}
 
 	#[derive(Debug)]
 	struct InvalidPageFlags;
@@ -147,7 +200,9 @@ mod sys {
 			$block:block
 		} => {
 			$(#[$outer])*
-			pub extern "C" fn $fn($a0: usize, $a1: usize, $a2: usize, $a3: usize, $a4: usize, $a5: usize, $task: task::Task) -> Return {
+			pub extern "C" fn $fn($a0: usize, $a1: usize, $a2: usize, $a3: usize, $a4: usize, $a5: usize, task: task::Task) -> Return {
+				crate::trace::record(crate::trace::Kind::Syscall, task.syscall_id(), 0);
+				let $task = task;
 				$block
 			}
 		};
@@ -209,15 +264,58 @@ mod sys {
 				unsafe { syscall_return_transparent() };
 			}
 
-			task.wait_duration(time);
-			task.process_io(task::Executor::current_address());
+			// Retry as soon as possible if a receiver isn't ready yet.
+			use crate::task::ipc::TransmitError;
+			task.wait_for_received(0);
+			match task.process_io(task::Executor::current_address(), usize::MAX) {
+				Err((_, TransmitError::NoQueues)) | Err((_, TransmitError::Full)) => {
+					task.wait_duration(0)
+				}
+				_ => task.wait_duration(time),
+			}
 
 			crate::task::Executor::next()
 		}
 	}
 
+	sys! {
+		/// Deliver at most `count` packets in the transmit ring and return the amount of
+		/// packets delivered.
+		///
+		/// If `wait` is not `0` and all packets could be delivered, the task sleeps until
+		/// `wait` more packets have been received or `time` has passed.
+		///
+		/// If a packet could not be delivered, `NotFound` is returned if the receiver doesn't
+		/// exist, in which case the packet is dropped, or `Unavailable` if the receiver has
+		/// no queues or no room left in them, in which case the packet is left in the ring.
+		[task] io_submit(count, wait, time) {
+			logcall!("io_submit {}, {}, {}", count, wait, time);
+			use crate::task::ipc::TransmitError;
+			let wait = match u16::try_from(wait) {
+				Ok(wait) => wait,
+				Err(_) => return Return(Status::TooLong, 0),
+			};
+			task.wait_for_received(0);
+			let delivered = match task.process_io(task::Executor::current_address(), count) {
+				Ok(n) => n,
+				Err((n, TransmitError::NoReceiver)) => return Return(Status::NotFound, n),
+				Err((n, TransmitError::NoQueues)) | Err((n, TransmitError::Full)) => {
+					return Return(Status::Unavailable, n)
+				}
+			};
+			if wait == 0 || task.was_notified() {
+				return Return(Status::Ok, delivered);
+			}
+			task.wait_for_received(wait);
+			task.wait_submitted(delivered, time as u64);
+			crate::task::Executor::next()
+		}
+	}
+
 	sys! {
 		/// Resize the task's IPC buffers to be able to hold the given amount of entries.
+		///
+		/// The previous queues, if any, are unmapped from the kernel.
 		[task] io_set_queues(packet_table, mask_bits, free_pages, free_pages_size) {
 			logcall!(
 				"io_set_queues 0x{:x}, {}, 0x{:x}, {}",
@@ -226,16 +324,22 @@ mod sys {
 				free_pages,
 				free_pages_size,
 			);
+			use crate::task::ipc::{NewError, IPC};
 			let a = match NonNull::new(packet_table as *mut _) {
 				Some(pt) => {
 					let mb = mask_bits as u8;
-					let fp = NonNull::new(free_pages as *mut _);
+					let fp = match NonNull::new(free_pages as *mut _) {
+						Some(fp) => fp,
+						None => return Return(Status::NullArgument, 0),
+					};
 					let fs = free_pages_size;
-					let r = fp.map(|fp| unsafe { crate::task::ipc::IPC::new(pt, mb, fp, fs).unwrap() });
-					if r.is_none() {
-						return Return(Status::NullArgument, 0);
+					let vms = arch::VMS::current();
+					match unsafe { IPC::new(&vms, pt, mb, fp, fs) } {
+						Ok(ipc) => Some(ipc),
+						Err(NewError::TooLarge) => return Return(Status::TooLong, 0),
+						Err(NewError::NotMapped) => return Return(Status::MemoryNotAllocated, 0),
+						Err(NewError::WindowFull) => return Return(Status::MemoryUnavailable, 0),
 					}
-					r
 				}
 				None => None,
 			};
@@ -281,12 +385,18 @@ mod sys {
 
 	sys! {
 		/// Allocates a range of private or shared pages for the current task.
-		[_] mem_alloc(address, count, flags) {
+		[task] mem_alloc(address, count, flags) {
 			logcall!("mem_alloc 0x{:x}, {}, 0b{:b}", address, count, flags);
 			match arch::Page::try_from(address as *mut _) {
 				Ok(address) => match decode_rwx_flags(flags) {
 					Ok(rwx) => {
-						task::Task::allocate_memory(address, count, rwx).unwrap();
+						let largest = decode_page_size(flags);
+						let prefault = flags & PREFAULT > 0;
+						task::Task::allocate_memory(address, count, largest, prefault, rwx).unwrap();
+						// Other pages are counted when they are faulted in.
+						if largest.is_some() || prefault {
+							task.count_mapped_pages(count);
+						}
 						Return(Status::Ok, address.as_ptr() as usize)
 					}
 					Err(InvalidPageFlags) => Return(Status::MemoryInvalidProtectionFlags, 0),
@@ -306,8 +416,11 @@ mod sys {
 				Err(arch::page::FromPointerError::Null) => return Return(Status::NullArgument, 0),
 				Err(arch::page::FromPointerError::BadAlignment) => return Return(Status::BadAlignment, 0),
 			};
-			task::Task::deallocate_memory(address, count).unwrap();
-			Return(Status::Ok, 0)
+			match task::Task::deallocate_memory(address, count) {
+				Ok(()) => Return(Status::Ok, 0),
+				// Part of a hugepage can't be freed.
+				Err(()) => Return(Status::MemoryNotAllocated, 0),
+			}
 		}
 	}
 
@@ -329,6 +442,13 @@ mod sys {
 			if address & arch::PAGE_MASK != 0 {
 				return Return(Status::BadAlignment, 0);
 			}
+			let size = match count.checked_mul(mem::size_of::<usize>()) {
+				Some(size) => size,
+				None => return Return(Status::MemoryNotAllocated, 0),
+			};
+			if let Err(status) = prepare_user_buffer(store, size) {
+				return Return(status, 0);
+			}
 			let store = unsafe { core::slice::from_raw_parts_mut(store as *mut _, count) };
 			let address = arch::Page::try_from(address as *mut _).unwrap();
 			arch::set_supervisor_userpage_access(true);
@@ -341,6 +461,13 @@ mod sys {
 	sys! {
 		[_] task_spawn(mappings, mappings_count, program_counter, stack_pointer) {
 			logcall!("task_spawn 0x{:x}, {}, 0x{:x}, 0x{:x}", mappings, mappings_count, program_counter, stack_pointer);
+			let size = match mappings_count.checked_mul(mem::size_of::<Mapping>()) {
+				Some(size) => size,
+				None => return Return(Status::TooLong, 0),
+			};
+			if let Err(status) = prepare_user_input(mappings, size) {
+				return Return(status, 0);
+			}
 			let mappings = unsafe { core::slice::from_raw_parts(mappings as *const Mapping, mappings_count) };
 			use crate::task::*;
 			let vms = arch::VMS::new().unwrap();
@@ -358,6 +485,29 @@ mod sys {
 							vms::Accessibility::UserLocal,
 						).unwrap()
 					}
+					// Share mapping from current process, but give the new task a private copy
+					// once it writes to it.
+					1 => {
+						let rwx = decode_rwx_flags(map.flags.into()).unwrap();
+						logcall!("  cow_map    {:p} -> {:p} ({:?})", map.self_address, map.task_address, rwx);
+						vms.share_copy_on_write(
+							arch::Page::try_from(map.task_address).unwrap(),
+							arch::Page::try_from(map.self_address).unwrap(),
+							rwx,
+							vms::Accessibility::UserLocal,
+						).unwrap()
+					}
+					// Reserve a zeroed page that is allocated when the new task first accesses it.
+					2 => {
+						let rwx = decode_rwx_flags(map.flags.into()).unwrap();
+						logcall!("  reserve    {:p} ({:?})", map.task_address, rwx);
+						vms.reserve(
+							arch::Page::try_from(map.task_address).unwrap(),
+							1,
+							rwx,
+							vms::Accessibility::UserLocal,
+						).unwrap()
+					}
 					// Invalid type
 					_ => todo!(),
 				}
@@ -370,39 +520,101 @@ mod sys {
 			task.set_stack_pointer(stack_pointer as *const ());
 			let group = Group::get(0).unwrap();
 			let id = group.insert(task).unwrap();
+			task::Executor::wake(task::Address::todo(id));
 			Return(Status::Ok, id)
 		}
 	}
 
 	sys! {
-		[_] dev_dma_alloc(address, size, _flags) {
+		/// Spawn a thread that shares the address space of the current task.
+		///
+		/// The thread starts with `argument` in the first argument register and the thread
+		/// pointer set to `thread_pointer`. It must set up its own IPC queues.
+		[task] task_spawn_thread(program_counter, stack_pointer, argument, thread_pointer) {
+			logcall!(
+				"task_spawn_thread 0x{:x}, 0x{:x}, 0x{:x}, 0x{:x}",
+				program_counter,
+				stack_pointer,
+				argument,
+				thread_pointer,
+			);
+			let thread = match task.new_thread() {
+				Ok(t) => t,
+				Err(_) => return Return(Status::MemoryUnavailable, 0),
+			};
+			thread.set_pc(program_counter as *const ());
+			thread.set_stack_pointer(stack_pointer as *const ());
+			thread.set_thread_pointer(thread_pointer as *const ());
+			thread.set_argument(0, argument);
+			match task::Group::get(0).unwrap().insert(thread) {
+				Ok(id) => {
+					task::Executor::wake(task::Address::todo(id));
+					Return(Status::Ok, id)
+				}
+				Err(_) => Return(Status::Unavailable, 0),
+			}
+		}
+	}
+
+	sys! {
+		/// Stop the current task. It will never be scheduled again.
+		// TODO free the task data & the VMS if no other task uses it.
+		[task] task_exit() {
+			logcall!("task_exit");
+			// Release the range of the queues in the kernel window.
+			task.set_queues(None);
+			let address = task::Executor::current_address();
+			let group = task::Group::get(address.group().into()).unwrap();
+			let _ = group.remove_task(address.task().into());
+			crate::task::Executor::next()
+		}
+	}
+
+	sys! {
+		/// Allocate physically contiguous, zeroed memory for use by devices and map it at the
+		/// given address. Returns the physical address of the memory.
+		[task] dev_dma_alloc(address, size, _flags) {
 			logcall!("dev_dma_alloc 0x{:x}, {}, 0b{:b}", address, size, _flags);
-			assert_ne!(size, 0, "TODO just return an error doof");
-			// FIXME this should be in the PMM
-			let mut ppns = [None, None, None, None, None, None, None, None];
+			let address = match Page::from_usize(address) {
+				Ok(a) => a,
+				Err(arch::page::FromPointerError::Null) => return Return(Status::NullArgument, 0),
+				Err(arch::page::FromPointerError::BadAlignment) => return Return(Status::BadAlignment, 0),
+			};
 			let count = (size + arch::Page::SIZE - 1) / arch::Page::SIZE;
-			use crate::memory;
-			ppns[0] = Some(memory::allocate().unwrap());
-			for i in 1..count {
-				ppns[i] = Some(memory::allocate().unwrap());
+			if count == 0 {
+				return Return(Status::NullArgument, 0);
 			}
-			if let Some(addr) = NonNull::new(address as *mut _) {
-				let mut addr = arch::Page::new(addr).ok();
-				for i in 0..count {
-					if let Some(a) = addr {
-						let p = core::mem::replace(&mut ppns[i], None).unwrap();
-						let p = Map::Private(p);
-						arch::VMS::add(a, p, vms::RWX::RW, vms::Accessibility::UserLocal)
-							.unwrap();
-						addr = a.next();
-					} else {
-						todo!();
+			let base = match crate::memory::allocate_contiguous(count) {
+				Ok(ppn) => ppn.into_raw(),
+				Err(_) => return Return(Status::MemoryUnavailable, 0),
+			};
+			let mut addr = Some(address);
+			for i in 0..count {
+				// SAFETY: the range was allocated above and each page is handed out once.
+				let ppn = unsafe { PPN::from_raw(base + i as PPNBox) };
+				match addr.map(|a| arch::VMS::add(a, Map::Private(ppn), vms::RWX::RW, vms::Accessibility::UserLocal)) {
+					Some(Ok(())) => addr = addr.and_then(|a| a.next()),
+					_ => {
+						// Undo the mappings of the previous pages so the caller isn't left with
+						// part of the range.
+						if i > 0 {
+							arch::VMS::deallocate(address, i).expect("failed to unmap DMA pages");
+						}
+						// SAFETY: none of the pages are mapped anymore.
+						unsafe {
+							let ppn = PPN::from_raw(base);
+							crate::memory::deallocate_contiguous(ppn, count);
+						}
+						return Return(Status::MemoryOverlap, 0);
 					}
 				}
-				Return(Status::Ok, address)
-			} else {
-				todo!()
 			}
+			// The pages may hold data of a previous owner.
+			arch::set_supervisor_userpage_access(true);
+			unsafe { address.as_ptr().cast::<u8>().write_bytes(0, count * arch::Page::SIZE) };
+			arch::set_supervisor_userpage_access(false);
+			task.count_mapped_pages(count);
+			Return(Status::Ok, (base as usize) << arch::PAGE_BITS)
 		}
 	}
 
@@ -430,7 +642,7 @@ mod sys {
 	}
 
 	sys! {
-		[_] sys_direct_alloc(address, ppn, count, _flags) {
+		[task] sys_direct_alloc(address, ppn, count, _flags) {
 			logcall!("sys_direct_alloc 0x{:x}, 0x{:x}, {}, 0b{:b}", address, ppn << arch::PAGE_BITS, count, _flags);
 			if let Some(addr) = NonNull::new(address as *mut _) {
 				if let Ok(addr) = arch::Page::new(addr) {
@@ -438,7 +650,10 @@ mod sys {
 						if let Ok(ppn) = PPNDirectRange::new(ppn, count) {
 							let map = MapRange::Direct(ppn);
 							match arch::VMS::add_range(addr, map, RWX::RW, vms::Accessibility::UserLocal) {
-								Ok(()) => Return(Status::Ok, 0),
+								Ok(()) => {
+									task.count_mapped_pages(count);
+									Return(Status::Ok, 0)
+								}
 								Err(_) => Return(Status::MemoryOverlap, 0),
 							}
 						} else {
@@ -460,11 +675,18 @@ mod sys {
 	sys! {
 		/// Reserve an interrupt source. This will cause any interrupts from the given sources to
 		/// cause a notification to be sent to the calling task.
-		[_] sys_reserve_interrupt(interrupt) {
+		///
+		/// Tasks handling interrupts are drivers, so the priority of the task is raised to at
+		/// least [`Priority::HIGH`](task::Priority::HIGH).
+		[task] sys_reserve_interrupt(interrupt) {
 			let address = task::Executor::current_address();
 			use arch::interrupts::{self, ReserveError};
 			match interrupts::reserve(interrupt as u16, address) {
-				Ok(()) => Return(Status::Ok, 0),
+				Ok(()) => {
+					let priority = task.priority().max(task::Priority::HIGH);
+					task.set_priority(priority).unwrap();
+					Return(Status::Ok, 0)
+				}
 				Err(ReserveError::Occupied) => Return(Status::Occupied, 0),
 				Err(ReserveError::NonExistent) => Return(Status::Unavailable, 0),
 			}
@@ -473,8 +695,15 @@ mod sys {
 
 	sys! {
 		/// Put a message in the kernel's stdout. Intended for low-level debugging.
+		///
+		/// The message is buffered, so this doesn't wait for the console. Returns the maximum
+		/// log level, which tasks can use to skip formatting messages that would be dropped.
 		[_] sys_log(address, length) {
 			logcall!("sys_log 0x{:x}, {}", address, length);
+			use crate::log::{self, Level};
+			if !log::enabled(Level::Info) {
+				return Return(Status::Ok, log::max_level() as usize);
+			}
 			// Replace any non-valid UTF-8 characters
 			struct BrokenStr<'a>(&'a [u8]);
 
@@ -504,14 +733,16 @@ mod sys {
 				}
 			}
 
-			// TODO handle pagefaults
+			if let Err(status) = prepare_user_input(address, length) {
+				return Return(status, 0);
+			}
 			arch::set_supervisor_userpage_access(true);
 			use crate::log::Log;
 			use core::fmt::Write;
 			let _ = write!(Log, "{:?}", BrokenStr(unsafe { slice::from_raw_parts(address as *const _, length) }));
 			arch::set_supervisor_userpage_access(false);
 
-			Return(Status::Ok, 0)
+			Return(Status::Ok, log::max_level() as usize)
 		}
 	}
 
@@ -539,6 +770,9 @@ mod sys {
 			let address = (address == usize::MAX)
 				.then(task::Executor::current_address)
 				.unwrap_or(task::Address::todo(address));
+			if let Err(status) = prepare_user_input(name, name_len) {
+				return Return(status, 0);
+			}
 			arch::set_supervisor_userpage_access(true);
 			let name = unsafe { core::slice::from_raw_parts(name as *const u8, name_len.into()) };
 			let ret = match registry::add(name, address) {
@@ -554,17 +788,228 @@ mod sys {
 
 	sys! {
 		/// Get an entry in the registry and return the address if found.
+		///
+		/// If it isn't found the current generation of the registry is returned, which can be
+		/// passed to `sys_registry_wait`.
 		[_] sys_registry_get(name, name_len) {
+			let generation = task::registry::generation();
+			if let Err(status) = prepare_user_input(name, name_len) {
+				return Return(status, 0);
+			}
 			arch::set_supervisor_userpage_access(true);
 			let name = unsafe { core::slice::from_raw_parts(name as *const u8, name_len.into()) };
 			let ret = task::registry::get(name)
 				.map(|addr| Return(Status::Ok, addr.into()))
-				.unwrap_or(Return(Status::NotFound, 0));
+				.unwrap_or(Return(Status::NotFound, generation));
 			arch::set_supervisor_userpage_access(false);
 			ret
 		}
 	}
 
+	sys! {
+		/// Sleep until an entry is added to the registry or until `time` has passed, but only
+		/// if no entry has been added since `sys_registry_get` returned `generation`.
+		/// Otherwise `Retry` is returned immediately. Tasks may be woken up spuriously.
+		[task] sys_registry_wait(generation, time) {
+			logcall!("sys_registry_wait {}, {}", generation, time);
+			let key = task::futex::Key::REGISTRY;
+			let ready = || task::registry::generation() == generation;
+			if !task.futex_wait_if(key, time as u64, ready) {
+				return Return(Status::Retry, 0);
+			}
+			crate::task::Executor::next()
+		}
+	}
+
+	sys! {
+		/// Wait on or wake tasks waiting on a 32-bit value in memory.
+		///
+		/// With `op` 0 the task sleeps until another task wakes it or until `time` has
+		/// passed, but only if the value at `address` still equals `value`. Otherwise
+		/// `Retry` is returned immediately. Tasks may be woken up spuriously.
+		///
+		/// With `op` 1 at most `value` tasks waiting on `address` are woken and the amount
+		/// of woken tasks is returned.
+		[task] task_futex(op, address, value, time) {
+			logcall!("task_futex {}, 0x{:x}, {}, {}", op, address, value, time);
+			if address & 3 != 0 {
+				return Return(Status::BadAlignment, 0);
+			}
+			let key = match task::futex::Key::new(address) {
+				Ok(key) => key,
+				Err(task::futex::NotMapped) => return Return(Status::MemoryNotAllocated, 0),
+			};
+			match op {
+				0 => {
+					if let Err(status) = prepare_user_input(address, mem::size_of::<u32>()) {
+						return Return(status, 0);
+					}
+					// Compare under the futex lock so a wake in between can't be missed.
+					let ready = || {
+						arch::set_supervisor_userpage_access(true);
+						let current = unsafe { core::ptr::read_volatile(address as *const u32) };
+						arch::set_supervisor_userpage_access(false);
+						current == value as u32
+					};
+					if !task.futex_wait_if(key, time as u64, ready) {
+						return Return(Status::Retry, 0);
+					}
+					crate::task::Executor::next()
+				}
+				1 => Return(Status::Ok, task::futex::wake(key, value)),
+				_ => Return(Status::InvalidCall, 0),
+			}
+		}
+	}
+
+	sys! {
+		/// Set the priority class of the current task.
+		///
+		/// Ready tasks with a higher priority always run before those with a lower priority
+		/// and preempt them when they are woken.
+		[task] task_set_priority(priority) {
+			logcall!("task_set_priority {}", priority);
+			match u16::try_from(priority).ok().map(|p| task.set_priority(p)) {
+				Some(Ok(())) => Return(Status::Ok, 0),
+				_ => Return(Status::TooLong, 0),
+			}
+		}
+	}
+
+	sys! {
+		/// Create a channel of `count` zeroed pages shared with the task at `peer` and map it
+		/// at `address`. Returns the ID of the channel, which the peer needs to open it.
+		[_] chan_create(address, count, peer) {
+			logcall!("chan_create 0x{:x}, {}, {}", address, count, peer);
+			use task::channel::CreateError;
+			let address = match Page::from_usize(address) {
+				Ok(a) => a,
+				Err(arch::page::FromPointerError::Null) => return Return(Status::NullArgument, 0),
+				Err(arch::page::FromPointerError::BadAlignment) => return Return(Status::BadAlignment, 0),
+			};
+			match task::channel::create(address, count, task::Address::from(peer)) {
+				Ok(id) => Return(Status::Ok, id),
+				Err(CreateError::BadSize) => Return(Status::TooLong, 0),
+				Err(CreateError::Overlaps) => Return(Status::MemoryOverlap, 0),
+				Err(CreateError::NoMemory) => Return(Status::MemoryUnavailable, 0),
+				Err(CreateError::Full) => Return(Status::Unavailable, 0),
+			}
+		}
+	}
+
+	sys! {
+		/// Map the channel with the given ID and amount of pages at `address`. The channel
+		/// must have been created for the current task.
+		[_] chan_open(id, address, count) {
+			logcall!("chan_open {}, 0x{:x}, {}", id, address, count);
+			use task::channel::OpenError;
+			let address = match Page::from_usize(address) {
+				Ok(a) => a,
+				Err(arch::page::FromPointerError::Null) => return Return(Status::NullArgument, 0),
+				Err(arch::page::FromPointerError::BadAlignment) => return Return(Status::BadAlignment, 0),
+			};
+			let slf = task::Executor::current_address();
+			match task::channel::open(id, address, count, slf) {
+				Ok(()) => Return(Status::Ok, 0),
+				Err(OpenError::NotFound) => Return(Status::NotFound, 0),
+				Err(OpenError::BadSize) => Return(Status::TooLong, 0),
+				Err(OpenError::Overlaps) => Return(Status::MemoryOverlap, 0),
+			}
+		}
+	}
+
+	sys! {
+		/// Move at most `count` of the oldest events in the trace buffers of all harts to
+		/// `address`. Returns the amount of events moved.
+		///
+		/// Events of different harts are not ordered relative to each other.
+		[_] sys_trace_read(address, count) {
+			logcall!("sys_trace_read 0x{:x}, {}", address, count);
+			use crate::trace::Event;
+			if address == 0 {
+				return Return(Status::NullArgument, 0);
+			}
+			if address % mem::align_of::<Event>() != 0 {
+				return Return(Status::BadAlignment, 0);
+			}
+			let length = match count.checked_mul(mem::size_of::<Event>()) {
+				Some(length) => length,
+				None => return Return(Status::TooLong, 0),
+			};
+			if let Err(e) = prepare_user_buffer(address, length) {
+				return Return(e, 0);
+			}
+			arch::set_supervisor_userpage_access(true);
+			let buffer = unsafe { core::slice::from_raw_parts_mut(address as *mut Event, count) };
+			let n = crate::trace::read(buffer);
+			arch::set_supervisor_userpage_access(false);
+			Return(Status::Ok, n)
+		}
+	}
+
+	sys! {
+		/// Write the statistics of the task with the given address, or the current task if it
+		/// is `usize::MAX`, to `address`.
+		[_] task_counters(task_address, address) {
+			logcall!("task_counters {}, 0x{:x}", task_address, address);
+			use task::Counters;
+			if address == 0 {
+				return Return(Status::NullArgument, 0);
+			}
+			if address % mem::align_of::<Counters>() != 0 {
+				return Return(Status::BadAlignment, 0);
+			}
+			let task_address = (task_address == usize::MAX)
+				.then(task::Executor::current_address)
+				.unwrap_or(task::Address::from(task_address));
+			let group = task::Group::get(task_address.group().into());
+			let counters = match group.and_then(|g| g.task(task_address.task().into()).ok()) {
+				Some(task) => task.counters(),
+				None => return Return(Status::NotFound, 0),
+			};
+			if let Err(e) = prepare_user_buffer(address, mem::size_of::<Counters>()) {
+				return Return(e, 0);
+			}
+			arch::set_supervisor_userpage_access(true);
+			unsafe { (address as *mut Counters).write(counters) };
+			arch::set_supervisor_userpage_access(false);
+			Return(Status::Ok, 0)
+		}
+	}
+
+	sys! {
+		/// Move buffered log messages to the given buffer instead of writing them to the
+		/// console. Returns the amount of bytes written, which is less than `length` only if
+		/// there are no more messages.
+		[_] sys_log_read(address, length) {
+			logcall!("sys_log_read 0x{:x}, {}", address, length);
+			if address == 0 {
+				return Return(Status::NullArgument, 0);
+			}
+			if let Err(e) = prepare_user_buffer(address, length) {
+				return Return(e, 0);
+			}
+			arch::set_supervisor_userpage_access(true);
+			let buffer = unsafe { core::slice::from_raw_parts_mut(address as *mut u8, length) };
+			let n = crate::log::read(buffer);
+			arch::set_supervisor_userpage_access(false);
+			Return(Status::Ok, n)
+		}
+	}
+
+	sys! {
+		/// Set the maximum level of messages that are logged, unless `level` is `usize::MAX`.
+		/// Levels out of range are clamped. Returns the maximum level.
+		[_] sys_log_level(level) {
+			logcall!("sys_log_level {}", level);
+			use crate::log;
+			if level != usize::MAX {
+				log::set_max_level(log::Level::clamp(level));
+			}
+			Return(Status::Ok, log::max_level() as usize)
+		}
+	}
+
 	sys! {
 		/// Placeholder so that I don't need to update TABLE_LEN constantly.
 		[_] placeholder() {
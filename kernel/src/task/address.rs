@@ -46,7 +46,7 @@ pub struct GroupID(u32);
 pub struct GroupID(u64);
 
 /// An address, which is composed of a task group ID and a group-local task ID
-#[derive(Clone, Copy, Eq, PartialEq, Debug)]
+#[derive(Clone, Copy, Eq, PartialEq, Ord, PartialOrd, Debug)]
 #[repr(transparent)]
 pub struct Address(usize);
 
@@ -56,6 +56,12 @@ impl Address {
 		Self(task.0 as usize | (group.0 << (mem::size_of::<usize>() * 4)) as usize)
 	}
 
+	/// Create an address from the ID of a group and of a task in it, as returned by
+	/// [`Group::id`](super::Group::id) and [`Group::tasks`](super::Group::tasks).
+	pub fn from_ids(group: usize, task: usize) -> Self {
+		Self(task | (group << (mem::size_of::<usize>() * 4)))
+	}
+
 	pub fn task(&self) -> TaskID {
 		TaskID(
 			(self.0 & ((0x100 << mem::size_of::<TaskID>()) - 1))
@@ -0,0 +1,135 @@
+//! # Shared-memory channels
+//!
+//! A channel is a set of pages shared between two tasks, usually holding a ring buffer. The
+//! pages are mapped once in both tasks, so data can be streamed without mapping pages for each
+//! message like regular IPC does.
+//!
+//! The kernel only hands out the pages. Tasks use [`futex`](super::futex) words inside the
+//! channel as doorbells, which works as futexes are keyed by physical address.
+//!
+//! A channel is created by one task for a specific peer, which then opens it with the ID it
+//! got from the creator, e.g. through an IPC packet. Opening a channel removes it from the
+//! list, so each channel has exactly two ends.
+
+use super::Address;
+use crate::allocator::arena;
+use crate::arch::vms::{Accessibility, VirtualMemorySystem, RWX};
+use crate::arch::{self, Map, Page};
+use crate::memory::{self, reserved, PPNBox, SharedPPN, PPN};
+use core::mem;
+
+/// The maximum amount of pages in a single channel.
+pub const MAX_PAGES: usize = 64;
+
+/// Channels that have been created but not opened yet.
+static CHANNELS: arena::Arena<Channel> = unsafe {
+	arena::Arena::new(
+		reserved::CHANNELS.start.as_non_null_ptr().cast(),
+		reserved::CHANNELS.byte_count(),
+	)
+};
+
+/// A channel waiting to be opened by its peer.
+struct Channel {
+	/// The task that may open this channel.
+	peer: Address,
+	/// The pages of this channel. Each holds a reference for this structure.
+	pages: [PPNBox; MAX_PAGES],
+	/// The amount of pages.
+	count: usize,
+}
+
+#[derive(Debug)]
+pub enum CreateError {
+	/// There are no pages or too many.
+	BadSize,
+	/// Part of the range is already mapped.
+	Overlaps,
+	/// There is no more memory available.
+	NoMemory,
+	/// There are too many unopened channels.
+	Full,
+}
+
+#[derive(Debug)]
+pub enum OpenError {
+	/// There is no channel with the given ID for this task.
+	NotFound,
+	/// The channel has a different amount of pages.
+	BadSize,
+	/// Part of the range is already mapped.
+	Overlaps,
+}
+
+/// Create a channel of `count` zeroed pages, map it at `address` in the current VMS and return
+/// its ID.
+///
+/// Only the task at `peer` can open it. On failure any pages that have been mapped already
+/// stay mapped.
+pub fn create(address: Page, count: usize, peer: Address) -> Result<usize, CreateError> {
+	if count == 0 || count > MAX_PAGES {
+		return Err(CreateError::BadSize);
+	}
+	let mut channel = Channel {
+		peer,
+		pages: [0; MAX_PAGES],
+		count: 0,
+	};
+	for i in 0..count {
+		let ppn = memory::allocate().map_err(|_| CreateError::NoMemory)?;
+		let ppn = SharedPPN::new(ppn).map_err(|_| CreateError::NoMemory)?;
+		// A new page can't have so many references it would overflow.
+		let map = Map::Shared(ppn.try_clone().unwrap());
+		channel.pages[i] = ppn.into_raw().into_raw();
+		channel.count = i + 1;
+		arch::VMS::add(
+			address.skip(i).unwrap(),
+			map,
+			RWX::RW,
+			Accessibility::UserLocal,
+		)
+		.map_err(|_| CreateError::Overlaps)?;
+	}
+	// Tasks expect the ring indices to start at zero.
+	arch::set_supervisor_userpage_access(true);
+	unsafe { address.as_ptr().write_bytes(0, count) };
+	arch::set_supervisor_userpage_access(false);
+	CHANNELS.insert(channel).map_err(|_| CreateError::Full)
+}
+
+/// Map the channel with the given ID and amount of pages at `address` in the current VMS.
+///
+/// `slf` is the address of the current task, which must be the peer the channel was created
+/// for. The channel is removed from the list even if mapping fails.
+pub fn open(id: usize, address: Page, count: usize, slf: Address) -> Result<(), OpenError> {
+	match CHANNELS.get(id).map(|c| (c.peer, c.count)) {
+		Some((peer, _)) if peer != slf => return Err(OpenError::NotFound),
+		Some((_, c)) if c != count => return Err(OpenError::BadSize),
+		Some(_) => (),
+		None => return Err(OpenError::NotFound),
+	}
+	let channel = CHANNELS.remove(id).map_err(|_| OpenError::NotFound)?;
+	for (i, &ppn) in channel.pages[..channel.count].iter().enumerate() {
+		// SAFETY: the PPN came from a SharedPPN and the channel still holds a reference.
+		let ppn = mem::ManuallyDrop::new(unsafe { SharedPPN::from_raw(PPN::from_raw(ppn)) });
+		// Only two tasks ever map a channel.
+		let map = Map::Shared(ppn.try_clone().unwrap());
+		arch::VMS::add(
+			address.skip(i).unwrap(),
+			map,
+			RWX::RW,
+			Accessibility::UserLocal,
+		)
+		.map_err(|_| OpenError::Overlaps)?;
+	}
+	Ok(())
+}
+
+impl Drop for Channel {
+	fn drop(&mut self) {
+		for &ppn in &self.pages[..self.count] {
+			// SAFETY: the PPN came from a SharedPPN.
+			drop(unsafe { SharedPPN::from_raw(PPN::from_raw(ppn)) });
+		}
+	}
+}
@@ -1,27 +1,21 @@
 //! # Executor
 //!
-//! An executor schedules & runs tasks. Normally, there is exactly one executor per hart.
+//! An executor schedules & runs tasks. There is exactly one executor per hart, with the same
+//! ID as the hart.
+//!
+//! Tasks that are woken are queued on the executor of the hart that wakes them. Idle executors
+//! steal tasks from the others and are interrupted when a task is woken so they don't have to
+//! wait for their timer to find it.
 
 use super::*;
 use crate::arch;
+use crate::memory::reserved;
 use crate::task::Task;
+use crate::trace;
 use core::cell::UnsafeCell;
-use core::mem::MaybeUninit;
-use core::sync::atomic::Ordering;
-
-/// The idle "task".
-///
-/// This is not a real task. It is simply used as a buffer so trap handlers don't need yet
-/// another branch to ensure no memory is improperly overwritten.
-///
-/// While writing to data from multiple harts without synchronization may technically be
-/// UB, it is unlikely to be an issue since we normally don't read from the written data.
-static IDLE_TASK_STUB: WriteOnly<UnsafeCell<MaybeUninit<TaskData>>> =
-	WriteOnly(UnsafeCell::new(MaybeUninit::uninit()));
-
-struct WriteOnly<T>(T);
-
-unsafe impl<T> Sync for WriteOnly<T> {}
+use core::mem::{self, MaybeUninit};
+use core::ptr;
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
 
 #[repr(C)]
 pub struct Executor<'a> {
@@ -34,105 +28,365 @@ pub struct Executor<'a> {
 #[derive(Debug)]
 pub struct NoTask;
 
-// FIXME lol wtf
-// FIXME this really needs to be fixed, it just got out of sync due to an interrupt which caused
-// some very strange buggy behaviour.
-static mut NEXT_ID: usize = 0;
+/// The maximum amount of executors that can steal work from each other.
+const MAX_EXECUTORS: usize = 64;
+
+/// The amount of pages of the state of each executor.
+const LOCAL_PAGES: usize = 4;
+
+/// The time a task may run before another task is scheduled.
+const TIME_SLICE: u64 = 10_000_000 / 10;
+
+/// The maximum amount of bytes of the log written to the console each time a task is
+/// scheduled, which keeps the log going even if harts never go idle.
+const SWITCH_LOG_BUDGET: usize = 64;
+
+/// The maximum amount of bytes of the log written to the console at once while idle. The
+/// executor checks for tasks in between.
+const IDLE_LOG_BUDGET: usize = 1024;
+
+/// Value of [`Local::current`] if the executor is idle.
+const NO_TASK: usize = usize::MAX;
+
+/// A bitmap of all executors that have been started.
+static ONLINE: AtomicU64 = AtomicU64::new(0);
+
+/// A bitmap of all executors that are idle and haven't been interrupted yet.
+static IDLE: AtomicU64 = AtomicU64::new(0);
+
+/// Whether a task couldn't be added to a full queue. Such tasks are found again by
+/// [`Executor::requeue_overflowed`] once an executor runs out of tasks.
+static OVERFLOW: AtomicBool = AtomicBool::new(false);
+
+/// The state of a single executor.
+///
+/// It is mapped globally so other executors can steal tasks from it.
+#[repr(C)]
+struct Local {
+	/// The idle "task".
+	///
+	/// This is not a real task. It is simply used as a buffer so trap handlers don't need yet
+	/// another branch to ensure no memory is improperly overwritten.
+	idle: UnsafeCell<MaybeUninit<TaskData>>,
+	/// The address of the task being executed or [`NO_TASK`].
+	current: AtomicUsize,
+	/// Tasks that can run right away, one queue per priority class.
+	ready: [queue::Ready; Priority::COUNT],
+	/// Tasks that wait until a certain time.
+	sleeping: queue::Sleeping,
+	/// The time the current task started running.
+	since: AtomicU64,
+}
+
+const _: usize = LOCAL_PAGES * Page::SIZE - mem::size_of::<Local>(); // Size check
+const _: usize = reserved::EXECUTORS.byte_count() - MAX_EXECUTORS * LOCAL_PAGES * Page::SIZE; // Ditto
+
+impl Local {
+	/// Return the state of the executor with the given ID.
+	///
+	/// # Safety
+	///
+	/// The executor must be initialized.
+	unsafe fn get(id: u16) -> &'static Self {
+		let offset = usize::from(id) * LOCAL_PAGES * Page::SIZE;
+		&*reserved::EXECUTORS
+			.start
+			.as_ptr()
+			.cast::<u8>()
+			.add(offset)
+			.cast::<Self>()
+	}
+
+	/// Return the state of the executor running on this hart.
+	fn current() -> &'static Self {
+		// SAFETY: only initialized executors can run code.
+		unsafe { Self::get(Executor::id()) }
+	}
+}
 
 impl Executor<'_> {
 	/// Suspend the current task (if any) and begin executing another task.
 	pub fn next() -> ! {
-		// Unclaim the current task
-		Self::current_task()
-			.inner()
-			.executor_id
-			.store(u16::MAX, Ordering::Relaxed);
+		let id = Self::id();
+		let local = Local::current();
+		IDLE.fetch_and(!(1 << id), Ordering::Relaxed);
+		let now = arch::current_time();
+
+		// Unclaim & requeue the current task
+		let current = local.current.swap(NO_TASK, Ordering::Relaxed);
+		if current != NO_TASK {
+			let task = Self::current_task();
+			Self::account(local, &task, now);
+			task.inner().executor_id.store(u16::MAX, Ordering::Relaxed);
+			Self::requeue(local, Address::from(current));
+		}
+
+		Self::wake_expired(local, now);
+		crate::log::drain(SWITCH_LOG_BUDGET);
+
+		while let Some(address) = Self::pop(local, id) {
+			let address = Address::from(address);
+			if let Some(task) = get(address) {
+				task.inner().queued.store(false, Ordering::Relaxed);
+				local.current.store(address.into(), Ordering::Relaxed);
+				local.since.store(now, Ordering::Relaxed);
+				// The previous task no longer belongs to this executor, so pass the ID along.
+				trace::record_on(id, address.into(), trace::Kind::Switch, current, 0);
+				let slice = local
+					.sleeping
+					.earliest()
+					.map_or(TIME_SLICE, |t| t.saturating_sub(now).min(TIME_SLICE));
+				arch::schedule_timer(slice);
+				arch::enable_interrupts(true);
+				// If the task is already claimed, just try again.
+				let _ = task.execute(id);
+				local.current.store(NO_TASK, Ordering::Relaxed);
+			}
+		}
+
+		// Pick up tasks that didn't fit in a queue now that there is room.
+		if Self::requeue_overflowed(local, now) {
+			Self::idle(now);
+		}
 
-		// TODO lol, lmao
+		// Write out the log while there is nothing else to do. If there is more left, check
+		// for tasks and continue right away.
+		if crate::log::drain(IDLE_LOG_BUDGET) == IDLE_LOG_BUDGET {
+			Self::idle(now);
+		}
+
+		// Check again in a while as other executors may get more tasks in the meantime.
+		let until = local.sleeping.earliest().unwrap_or(u64::MAX);
+		Self::idle(until.min(now.saturating_add(TIME_SLICE)))
+	}
+
+	/// Make the task with the given address ready to run, cancelling whatever it is waiting on.
+	///
+	/// If the task has a higher priority than the current task, the current task is preempted
+	/// as soon as it returns to userspace.
+	pub fn wake(address: Address) {
+		if let Some(task) = get(address) {
+			// Clear the tasks wait time so it will be rescheduled
+			task.inner().wait_time = 0;
+			let local = Local::current();
+			Self::enqueue(local, address, &task);
+			if local.current.load(Ordering::Relaxed) != NO_TASK
+				&& task.priority() > Self::current_task().priority()
+			{
+				// The timer interrupt will call `next`.
+				arch::schedule_timer(0);
+			}
+			Self::interrupt_idle(Self::id());
+		}
+	}
+
+	/// Add the time since the current task started running to its run time.
+	fn account(local: &Local, task: &Task, now: u64) {
+		let since = local.since.load(Ordering::Relaxed);
+		task.inner().counters.run_time += now.saturating_sub(since);
+	}
+
+	/// Interrupt an idle executor other than the given one so it can steal a task.
+	fn interrupt_idle(id: u16) {
+		let mut idle = IDLE.load(Ordering::Relaxed) & !(1 << id);
+		while idle != 0 {
+			let other = idle.trailing_zeros() as u16;
+			// Don't interrupt the same executor twice if more tasks are woken.
+			let prev = IDLE.fetch_and(!(1 << other), Ordering::Relaxed);
+			if prev & (1 << other) != 0 {
+				arch::send_ipi(other);
+				return;
+			}
+			idle &= !(1 << other);
+		}
+	}
 
-		let group = group::Group::get(0).expect("No root group");
+	/// Get the next task to run, preferring tasks of this executor within the same priority.
+	fn pop(local: &Local, id: u16) -> Option<usize> {
+		(0..Priority::COUNT)
+			.rev()
+			.find_map(|p| local.ready[p].pop().or_else(|| Self::steal(id, p)))
+	}
 
-		let prev_id = unsafe { NEXT_ID };
-		// Incrementing by prime numbers because I'm a genius hacker hmmm yes yes
-		let mut id = (prev_id + 7) & 0xf;
+	/// Put a task that stopped running in the appropriate queue.
+	fn requeue(local: &Local, address: Address) {
+		let task = match get(address) {
+			Some(task) => task,
+			// The task exited.
+			None => return,
+		};
+		let wait_time = task.inner().wait_time;
+		if wait_time <= arch::current_time() {
+			Self::enqueue(local, address, &task);
+		} else if wait_time != u64::MAX {
+			Self::sleep(local, address, &task, wait_time);
+		}
+		// Tasks waiting forever can only be resumed with `wake`.
+	}
 
-		let mut min_time = u64::MAX;
-		let curr_time = arch::current_time();
-		let mut stop_next = false;
+	/// Add a task to the ready queue if it isn't in any ready queue yet.
+	///
+	/// If the queue is full the task is left out and found again later.
+	fn enqueue(local: &Local, address: Address, task: &Task) {
+		if !task.inner().queued.swap(true, Ordering::Relaxed) {
+			let queue = &local.ready[usize::from(task.priority())];
+			if queue.push(address.into()).is_err() {
+				task.inner().queued.store(false, Ordering::Relaxed);
+				OVERFLOW.store(true, Ordering::Relaxed);
+			}
+		}
+	}
 
+	/// Add a task to the sleep queue.
+	fn sleep(local: &Local, address: Address, task: &Task, time: u64) {
+		// The task may have an entry already. If it expires earlier it will requeue the task
+		// and no new entry is needed, otherwise the entry becomes stale.
+		let key = &task.inner().sleep_key;
+		let mut k = key.load(Ordering::Relaxed);
 		loop {
-			if let Ok(task) = group.task(id) {
-				let wait_time = task.inner().wait_time;
-				if wait_time < curr_time {
-					unsafe { NEXT_ID = id };
-					arch::schedule_timer(10_000_000 / 10);
-					// If the task is already claimed, just try again.
-					arch::enable_interrupts(true);
-					let _ = task.execute(Self::id());
+			if k <= time {
+				return;
+			}
+			match key.compare_exchange_weak(k, time, Ordering::Relaxed, Ordering::Relaxed) {
+				Ok(_) => break,
+				Err(v) => k = v,
+			}
+		}
+		if local.sleeping.push(time, address.into()).is_err() {
+			// Let requeue_overflowed add an entry later.
+			let _ = key.compare_exchange(time, u64::MAX, Ordering::Relaxed, Ordering::Relaxed);
+			OVERFLOW.store(true, Ordering::Relaxed);
+		}
+	}
+
+	/// If tasks were left out of a full queue, scan all tasks and add those that are ready or
+	/// sleeping but not in any queue to the queues of this executor. Returns `true` if any
+	/// task was made ready.
+	fn requeue_overflowed(local: &Local, now: u64) -> bool {
+		if !OVERFLOW.swap(false, Ordering::Relaxed) {
+			return false;
+		}
+		let mut ready = false;
+		for group in group::Group::all() {
+			for (id, task) in group.tasks() {
+				let inner = task.inner();
+				// Running tasks are requeued when they stop running.
+				if inner.queued.load(Ordering::Relaxed)
+					|| inner.executor_id.load(Ordering::Relaxed) != u16::MAX
+				{
+					continue;
 				}
-				min_time = min_time.min(wait_time);
+				let address = Address::from_ids(group.id(), id);
+				let wait_time = inner.wait_time;
+				if wait_time <= now {
+					Self::enqueue(local, address, &task);
+					ready = true;
+				} else if wait_time != u64::MAX
+					&& inner.sleep_key.load(Ordering::Relaxed) == u64::MAX
+				{
+					Self::sleep(local, address, &task, wait_time);
+				}
+			}
+		}
+		ready
+	}
+
+	/// Move all tasks whose wait time has passed to the ready queue.
+	fn wake_expired(local: &Local, now: u64) {
+		while let Some((time, address)) = local.sleeping.pop_expired(now) {
+			let address = Address::from(address);
+			let task = match get(address) {
+				Some(task) => task,
+				None => continue,
 			};
-			id = id.wrapping_add(7) & 0xf;
-			if id == prev_id {
-				stop_next = true;
-			} else if stop_next {
-				break;
+			let key = &task.inner().sleep_key;
+			if key
+				.compare_exchange(time, u64::MAX, Ordering::Relaxed, Ordering::Relaxed)
+				.is_err()
+			{
+				// Stale entry.
+				continue;
 			}
+			Self::requeue(local, address);
 		}
+	}
 
-		Self::idle(min_time)
+	/// Try to steal a task with the given priority from any other executor.
+	fn steal(id: u16, priority: usize) -> Option<usize> {
+		let online = ONLINE.load(Ordering::Relaxed);
+		// Start after this executor so not all executors try to steal from the same one.
+		(1..MAX_EXECUTORS)
+			.map(|i| (usize::from(id) + i) % MAX_EXECUTORS)
+			.filter(|i| online & (1 << i) > 0)
+			.find_map(|i| unsafe { Local::get(i as u16) }.ready[priority].steal())
 	}
 
 	/// Returns the address of the current task
 	pub fn current_address() -> Address {
-		// FIXME
-		Address::todo(unsafe { NEXT_ID })
+		Address::from(Local::current().current.load(Ordering::Relaxed))
 	}
 
 	/// Begin idling, i.e. do nothing until the given time.
 	#[allow(dead_code)]
 	pub fn idle(time: u64) -> ! {
+		let local = Local::current();
 		unsafe {
 			// TODO move this to arch::
-			asm!("csrw sscratch, {0}", in(reg) IDLE_TASK_STUB.0.get());
+			asm!("csrw sscratch, {0}", in(reg) local.idle.get());
 		}
 		arch::set_timer(time);
+		let id = unsafe { &*(&*local.idle.get()).as_ptr() }
+			.executor_id
+			.load(Ordering::Relaxed);
+		IDLE.fetch_or(1 << id, Ordering::Relaxed);
+		// SAFETY: nothing is touched until the next interrupt, which takes the lock again.
+		unsafe { arch::release_kernel_lock() };
 		arch::enable_kernel_interrupts(true);
 		loop {
 			crate::powerstate::halt();
 		}
 	}
 
-	/// Initializes the executor for a given hart.
-	///
-	/// # Safety
+	/// Initializes the state and stack of the executor for a given hart.
 	///
-	/// It must only be called once per hart and only by the hart that will use
-	/// this executor.
+	/// It must only be called once per hart, but may be called by any hart. The hart can start
+	/// using it with [`start`](Self::start).
 	///
 	/// # Panics
 	///
 	/// If it failed to allocate memory or if the stack address is out of range.
 	pub fn init(id: u16) {
-		const STACK_ADDRESS: Page = crate::memory::reserved::HART_STACKS.start;
+		assert!(usize::from(id) < MAX_EXECUTORS, "executor ID out of range");
 
-		// FIXME HACK
-		unsafe {
-			(&mut *(&mut *IDLE_TASK_STUB.0.get()).as_mut_ptr()).stack =
-				crate::memory::reserved::HART_STACKS.start.skip(1).unwrap()
-		};
-		unsafe {
-			(&mut *(&mut *IDLE_TASK_STUB.0.get()).as_mut_ptr())
-				.executor_id
-				.store(id, Ordering::Relaxed)
-		};
+		// Map & clear the state. Zeroes are a valid, empty state.
+		let address = reserved::EXECUTORS
+			.start
+			.skip(usize::from(id) * LOCAL_PAGES)
+			.unwrap();
+		for i in 0..LOCAL_PAGES {
+			let page = Map::Private(memory::allocate().unwrap());
+			arch::VMS::add(
+				address.skip(i).unwrap(),
+				page,
+				RWX::RW,
+				vms::Accessibility::KernelGlobal,
+			)
+			.unwrap();
+		}
+		unsafe { ptr::write_bytes(address.as_ptr().cast::<u8>(), 0, LOCAL_PAGES * Page::SIZE) };
+		let local = unsafe { Local::get(id) };
+		local.current.store(NO_TASK, Ordering::Relaxed);
+		trace::init(id);
+		crate::log::init(id);
 
-		// TODO should be moved to arch::
-		unsafe { asm!("csrw sscratch, {0}", in(reg) IDLE_TASK_STUB.0.get()) };
+		// FIXME HACK
+		let idle = unsafe { &mut *(&mut *local.idle.get()).as_mut_ptr() };
+		idle.stack = Self::stack(id);
+		idle.executor_id.store(id, Ordering::Relaxed);
 
 		let stack = Map::Private(memory::allocate().unwrap());
 		arch::VMS::add(
-			STACK_ADDRESS,
+			reserved::HART_STACKS.start.skip(id.into()).unwrap(),
 			stack,
 			RWX::RW,
 			vms::Accessibility::KernelGlobal,
@@ -140,6 +394,29 @@ impl Executor<'_> {
 		.unwrap();
 	}
 
+	/// Begin using the executor for the current hart, after which tasks can be woken.
+	///
+	/// # Safety
+	///
+	/// The executor must have been initialized with [`init`](Self::init). It must only be
+	/// called once and only by the hart that will use this executor.
+	pub fn start(id: u16) {
+		let local = unsafe { Local::get(id) };
+		// TODO should be moved to arch::
+		unsafe { asm!("csrw sscratch, {0}", in(reg) local.idle.get()) };
+		arch::set_hart_online(id);
+		ONLINE.fetch_or(1 << id, Ordering::Relaxed);
+	}
+
+	/// Return the top of the kernel stack of the given executor, which is used by any task it
+	/// runs.
+	pub(super) fn stack(id: u16) -> Page {
+		reserved::HART_STACKS
+			.start
+			.skip(usize::from(id) + 1)
+			.unwrap()
+	}
+
 	/// Return the ID of this executor, which corresponds to the hart ID.
 	pub fn id() -> u16 {
 		Self::current_task()
@@ -148,6 +425,12 @@ impl Executor<'_> {
 			.load(Ordering::Relaxed)
 	}
 
+	/// Return the ID of this executor or `None` if no executor has been initialized yet,
+	/// which is only the case while the boot hart sets up the kernel.
+	pub fn try_id() -> Option<u16> {
+		(ONLINE.load(Ordering::Relaxed) != 0).then(Self::id)
+	}
+
 	/// Return the current task claimed by this executor.
 	pub fn current_task() -> Task {
 		// TODO should be moved partially to arch::
@@ -171,12 +454,36 @@ impl super::Task {
 	}
 }
 
+/// Return the task with the given address.
+fn get(address: Address) -> Option<Task> {
+	group::Group::get(address.group().into()).and_then(|g| g.task(address.task().into()).ok())
+}
+
 /// Helper function primarily intended to be called from assembly.
+///
+/// The caller switches to the returned task directly, so the current task is requeued and the
+/// returned task is claimed by this executor.
 #[export_name = "executor_get_task"]
 extern "C" fn get_task(address: Address) -> Option<Task> {
-	// FIXME *puke*
-	unsafe { NEXT_ID = address.into() };
-	group::Group::get(address.group().into()).and_then(|g| g.task(address.task().into()).ok())
+	let id = Executor::id();
+	let local = Local::current();
+	let task = get(address)?;
+	let current = local.current.swap(address.into(), Ordering::Relaxed);
+	if current != usize::from(address) {
+		let now = arch::current_time();
+		if current != NO_TASK {
+			let prev = Executor::current_task();
+			Executor::account(local, &prev, now);
+			prev.inner().executor_id.store(u16::MAX, Ordering::Relaxed);
+			Executor::requeue(local, Address::from(current));
+		}
+		task.inner().executor_id.store(id, Ordering::Relaxed);
+		task.inner().stack = Executor::stack(id);
+		local.since.store(now, Ordering::Relaxed);
+		trace::record_on(id, address.into(), trace::Kind::Switch, current, 0);
+	}
+	task.inner().shared_state.virtual_memory.prepare();
+	Some(task)
 }
 
 /// Helper function primarily intended to be called from assembly.
@@ -0,0 +1,112 @@
+//! # Wait-on-address
+//!
+//! Tasks can sleep until another task signals a change at an address. Waiters are identified
+//! by the *physical* address they wait on so that tasks sharing memory but not a VMS can still
+//! wake each other.
+//!
+//! The kernel never stores any state besides the key in the waiting task itself. Waking
+//! walks the task list of every group, which is cheap as long as the task list is small.
+//!
+//! Checking the condition and going to sleep is done under the same lock as waking so no
+//! wakeup can be missed in between.
+
+use super::{Address, Executor, Group, Task};
+use crate::arch::vms::VirtualMemorySystem;
+use crate::arch::{self, Page};
+use core::sync::atomic::{AtomicBool, Ordering};
+
+/// Lock held while checking the condition of a waiter and while waking tasks.
+static LOCK: AtomicBool = AtomicBool::new(false);
+
+/// The physical address a task is waiting on.
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub struct Key(usize);
+
+#[derive(Debug)]
+pub struct NotMapped;
+
+impl Key {
+	/// The key tasks waiting for an entry to be added to the [registry](super::registry) use.
+	/// Keys of addresses are always aligned, so it can't collide with any of them.
+	pub const REGISTRY: Self = Self(usize::MAX);
+
+	/// Determine the key for the given address in the current VMS.
+	pub fn new(address: usize) -> Result<Self, NotMapped> {
+		let page = Page::from_usize(address & !arch::PAGE_MASK).map_err(|_| NotMapped)?;
+		let mut store = [0];
+		arch::VMS::physical_addresses(page, &mut store).map_err(|_| NotMapped)?;
+		Ok(Self(store[0] | (address & arch::PAGE_MASK)))
+	}
+}
+
+impl Task {
+	/// Put this task to sleep until it is woken with the given key or until the given
+	/// duration has passed.
+	///
+	/// The syscall will return `0, 0` when the task is resumed. There is no way to tell
+	/// whether the task was woken up or timed out, so callers must check their condition
+	/// again.
+	pub fn futex_wait(&self, key: Key, duration: u64) {
+		let inner = self.inner();
+		inner.futex_key = Some(key);
+		// Registers are restored as they were when the syscall was made, so write out
+		// the return values now.
+		inner.register_state.x[10 - 1] = 0;
+		inner.register_state.x[11 - 1] = 0;
+		self.wait_duration(duration);
+	}
+
+	/// Put this task to sleep like [`futex_wait`](Self::futex_wait), but only if `ready`
+	/// returns `true`. Returns whether the task is going to sleep.
+	///
+	/// `ready` is called under the same lock as [`wake`], so a task that wakes with this key
+	/// after changing the condition can't be missed.
+	pub fn futex_wait_if(&self, key: Key, duration: u64, ready: impl FnOnce() -> bool) -> bool {
+		locked(|| {
+			let ready = ready();
+			if ready {
+				self.futex_wait(key, duration);
+			}
+			ready
+		})
+	}
+
+	/// Clear the key this task is waiting on, if any.
+	pub(super) fn futex_clear(&self) {
+		self.inner().futex_key = None;
+	}
+}
+
+/// Wake at most `count` tasks waiting on the given key. Returns the amount of tasks woken.
+pub fn wake(key: Key, count: usize) -> usize {
+	locked(|| {
+		let mut woken = 0;
+		for group in Group::all() {
+			for (id, task) in group.tasks() {
+				if woken >= count {
+					return woken;
+				}
+				let inner = task.inner();
+				if inner.futex_key == Some(key) {
+					inner.futex_key = None;
+					Executor::wake(Address::from_ids(group.id(), id));
+					woken += 1;
+				}
+			}
+		}
+		woken
+	})
+}
+
+/// Run `f` with [`LOCK`] held.
+fn locked<R>(f: impl FnOnce() -> R) -> R {
+	while LOCK
+		.compare_exchange_weak(false, true, Ordering::Acquire, Ordering::Relaxed)
+		.is_err()
+	{
+		core::hint::spin_loop();
+	}
+	let ret = f();
+	LOCK.store(false, Ordering::Release);
+	ret
+}
@@ -4,13 +4,12 @@
 //! resources in a single task group are accessible to all processes in that
 //! group. Resources can further be reserved per task.
 
-use super::Task;
+use super::{Task, TaskData};
 use crate::allocator::arena;
 use crate::memory::reserved;
 use core::ops::Deref;
-use core::ptr;
 use core::ptr::NonNull;
-use core::sync::atomic::{AtomicPtr, Ordering};
+use core::sync::atomic::{AtomicUsize, Ordering};
 
 /// The start of the task group list.
 static GROUPS: arena::Arena<GroupData> = unsafe {
@@ -20,12 +19,33 @@ static GROUPS: arena::Arena<GroupData> = unsafe {
 	)
 };
 
+/// The amount of virtual memory reserved for the task table of a single group.
+const TABLE_SIZE: usize = 1 << 22;
+
+/// The index of the next unused task table.
+///
+/// Tables are never reused as the arena can't free pages anyways.
+static NEXT_TABLE: AtomicUsize = AtomicUsize::new(0);
+
+/// An entry in the task table of a group.
+///
+/// It is padded so that together with the reference counter of the arena slot it takes up
+/// exactly one cache line, which prevents executors looking up different tasks from
+/// contending.
+struct Entry {
+	task: NonNull<TaskData>,
+	_padding: [usize; 6],
+}
+
+// FIXME Task is not sync yet.
+unsafe impl Sync for Entry {}
+
 /// A group of tasks
 pub struct GroupData {
-	/// A list of tasks. This is currently hardcoded to 16 because I'm lazy.
-	///
-	/// Increment as needed until it's no longer manageable.
-	tasks: [AtomicPtr<super::TaskData>; 16],
+	/// A table of tasks, indexed by task ID. It grows a page at a time as needed.
+	tasks: arena::Arena<Entry>,
+	/// The amount of tasks in the table.
+	count: AtomicUsize,
 }
 
 // FIXME Task is not sync yet. We also need to ensure tasks can't be removed/freed while referenced.
@@ -52,57 +72,55 @@ impl Group<'_> {
 	/// Create a new task group & insert the given task.
 	///
 	/// Returns the group ID.
-	// TODO avoid using NonNull
 	pub fn new(task: Task) -> Result<usize, arena::InsertError> {
+		let table = NEXT_TABLE.fetch_add(1, Ordering::Relaxed);
+		if table >= reserved::TASK_TABLES.byte_count() / TABLE_SIZE {
+			return Err(arena::InsertError::NoFreeSlots);
+		}
+		// SAFETY: each table gets a distinct, page-aligned range.
+		let tasks = unsafe {
+			let address = reserved::TASK_TABLES.start.as_ptr().cast::<u8>();
+			let address = address.add(table * TABLE_SIZE);
+			arena::Arena::new(NonNull::new_unchecked(address).cast(), TABLE_SIZE)
+		};
+		// The table is empty, so the first task always gets ID 0.
+		tasks.insert(Entry::new(task))?;
 		GROUPS.insert(GroupData {
-			tasks: [
-				AtomicPtr::new(task.ptr.as_ptr()),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-				AtomicPtr::default(),
-			],
+			tasks,
+			count: AtomicUsize::new(1),
 		})
 	}
 
 	/// Get a reference to a task in this group
 	pub fn task(&self, id: usize) -> Result<Task, NoTask> {
-		let tasks = &self.data.tasks;
-		tasks
+		self.data
+			.tasks
 			.get(id)
-			.and_then(|ptr| unsafe { ptr.load(Ordering::Relaxed).as_ref() })
-			.map(|t| Task {
-				ptr: NonNull::from(t),
-			})
+			.map(|e| Task { ptr: e.task })
 			.ok_or(NoTask)
 	}
 
+	/// Iterate over all tasks in this group along with their IDs.
+	pub fn tasks<'a>(&'a self) -> impl Iterator<Item = (usize, Task)> + 'a {
+		self.data
+			.tasks
+			.iter()
+			.map(|(i, e)| (i, Task { ptr: e.task }))
+	}
+
 	/// Remove a task. This frees the group if no task are left.
 	///
 	/// If any tasks are left, the group itself is returned.
-	// FIXME this isn't thread-safe
-	#[allow(dead_code)]
 	pub fn remove_task(self, id: usize) -> Result<Option<Self>, NoTask> {
-		let tasks = &self.data.tasks;
-		tasks
-			.get(id)
-			.map(|t| t.store(ptr::null_mut(), Ordering::Relaxed));
-		// FIXME this is not sound
-		if tasks
-			.iter()
-			.all(|ptr| ptr.load(Ordering::Relaxed).is_null())
-		{
+		loop {
+			match self.data.tasks.remove(id) {
+				Ok(_) => break,
+				Err(arena::RemoveError::NoItem) => return Err(NoTask),
+				// Lookups only hold a reference briefly, so just try again.
+				Err(arena::RemoveError::Referenced) => core::hint::spin_loop(),
+			}
+		}
+		if self.data.count.fetch_sub(1, Ordering::Relaxed) == 1 {
 			// TODO I'm not using unwrap because it's possible
 			// for other harts to have a reference to this group.
 			let index = self.index;
@@ -115,28 +133,26 @@ impl Group<'_> {
 	}
 
 	/// Returns the ID of this group.
-	#[allow(dead_code)]
 	pub fn id(&self) -> usize {
 		self.index
 	}
 
 	/// Insert a new task.
+	///
+	/// IDs of removed tasks are reused.
 	pub fn insert(&self, task: Task) -> Result<usize, Full> {
-		for (i, s) in self.data.tasks.iter().enumerate() {
-			if s.load(Ordering::Relaxed).is_null() {
-				if s.compare_exchange(
-					ptr::null_mut(),
-					task.ptr.as_ptr(),
-					Ordering::Relaxed,
-					Ordering::Relaxed,
-				)
-				.is_ok()
-				{
-					return Ok(i);
-				}
-			}
+		let id = self.data.tasks.insert(Entry::new(task)).map_err(|_| Full)?;
+		self.data.count.fetch_add(1, Ordering::Relaxed);
+		Ok(id)
+	}
+}
+
+impl Entry {
+	fn new(task: Task) -> Self {
+		Self {
+			task: task.ptr,
+			_padding: [0; 6],
 		}
-		Err(Full)
 	}
 }
 
@@ -146,6 +162,11 @@ impl Group<'static> {
 		let index = id;
 		GROUPS.get(id).map(|data| Self { data, index })
 	}
+
+	/// Iterate over all groups.
+	pub fn all() -> impl Iterator<Item = Self> {
+		GROUPS.iter().map(|(index, data)| Self { data, index })
+	}
 }
 
 /// A guard around a task structure
@@ -2,8 +2,11 @@
 
 use super::group::Group;
 use super::Address;
+use crate::arch::vms::{Accessibility, VirtualMemorySystem, RWX};
 use crate::arch::{self, Page, PageData};
+use crate::memory;
 use core::cell::Cell;
+use core::mem;
 use core::num::NonZeroU8;
 use core::ptr::NonNull;
 use core::slice;
@@ -64,8 +67,44 @@ impl Flags {
 #[derive(Debug)]
 struct InvalidOp;
 
+/// An error that occured while setting up the queues of a task.
 #[derive(Debug)]
-pub struct TooLarge;
+pub enum NewError {
+	/// The mask is larger than `15` bits.
+	TooLarge,
+	/// Part of the queues is not mapped in the current VMS.
+	NotMapped,
+	/// There is no more room in the kernel window.
+	WindowFull,
+}
+
+/// An error that occured while transmitting a packet.
+#[derive(Debug)]
+pub enum TransmitError {
+	/// The receiving task doesn't exist. The packet has been dropped.
+	NoReceiver,
+	/// The receiving task has no queues set up. The packet is left in the ring.
+	NoQueues,
+	/// The receiving task has no free slots or address ranges left. The packet is left in the
+	/// ring.
+	Full,
+}
+
+/// The slot and address ranges of a receiver reserved for a single packet.
+#[derive(Clone, Copy)]
+struct Reserved {
+	slot: u16,
+	data: Option<Page>,
+	name: Option<Page>,
+}
+
+impl Reserved {
+	const NONE: Self = Self {
+		slot: 0,
+		data: None,
+		name: None,
+	};
+}
 
 #[derive(Debug)]
 enum PopFreeSlotError {
@@ -79,105 +118,257 @@ enum PushFreeSlotError {
 	Full,
 }
 
+/// The maximum amount of packets that are grouped by destination at once.
+const BATCH_SIZE: usize = 16;
+
+/// The value of a transmit ring entry that has been reserved but not written yet.
+///
+/// Consumed entries are reset to this value so tasks can publish entries out of order.
+const TRANSMIT_EMPTY: u16 = u16::MAX;
+
+/// The amount of pages in the kernel window for IPC queues.
+const WINDOW_PAGES: usize = memory::reserved::IPC_QUEUES.byte_count() / Page::SIZE;
+
+/// The maximum amount of ranges in the kernel window in use at once. Each task with queues
+/// uses two.
+const MAX_WINDOW_RANGES: usize = 1024;
+
+/// The ranges in use in the kernel window for IPC queues.
+///
+/// The queues of every task are mapped in this window so packets can be delivered without
+/// switching to the VMS of the receiver. A range is released when the queues of the task are
+/// replaced or the task exits.
+static mut WINDOW: Window = Window {
+	ranges: [WindowRange::EMPTY; MAX_WINDOW_RANGES],
+	len: 0,
+};
+
+/// The ranges in use in the kernel window, sorted by offset.
+struct Window {
+	ranges: [WindowRange; MAX_WINDOW_RANGES],
+	len: usize,
+}
+
+/// A range of pages in the kernel window.
+#[derive(Clone, Copy)]
+struct WindowRange {
+	/// The offset in pages from the start of the window.
+	offset: u32,
+	count: u32,
+}
+
 /// A structure used for handling IPC.
 pub struct IPC {
-	/// The address of the packets buffer.
+	/// The address of the packets buffer in the kernel window.
 	packets: NonNull<Packet>,
 	/// The index of the last processed transmit entry.
 	last_transmit_index: Cell<u16>,
 	/// The mask of the ring buffers, which is `packet_count - 1`.
 	ring_mask: u16,
-	/// A list of address that can be freely mapped for IPC.
+	/// A list of address that can be freely mapped for IPC, in the kernel window.
 	free_pages: NonNull<FreePage>,
 	/// The maximum amount of free pages.
 	max_free_pages: usize,
+	/// The index the received ring must reach before this task is woken, if any.
+	wait_target: Cell<Option<u16>>,
+	/// The ranges of the packets buffer and the free pages list in the kernel window.
+	windows: [WindowRange; 2],
 }
 
 impl IPC {
-	/// Create a new IPC structure.
+	/// Create a new IPC structure and map the queues into the kernel window.
 	///
 	/// # Safety
 	///
-	/// The address *must* point to user-owned memory and may never point to kernel-owned
-	/// memory.
-	///
-	/// # Returns
-	///
-	/// `Err(TooLarge)` if `mask_bits` is larger than `15`.
+	/// The address *must* point to user-owned memory in the current VMS and may never point
+	/// to kernel-owned memory.
 	pub unsafe fn new(
+		vms: &arch::VMS,
 		packets: NonNull<Packet>,
 		mask_bits: u8,
 		free_pages: NonNull<FreePage>,
 		max_free_pages: usize,
-	) -> Result<Self, TooLarge> {
-		(mask_bits <= 15)
-			.then(|| Self {
-				packets,
-				last_transmit_index: Cell::new(0),
-				ring_mask: (1 << mask_bits) - 1,
-				free_pages,
-				max_free_pages,
-			})
-			.ok_or(TooLarge)
+	) -> Result<Self, NewError> {
+		if mask_bits > 15 {
+			return Err(NewError::TooLarge);
+		}
+		let count = 1usize << mask_bits;
+		// The packet table is followed by the transmit ring, the received ring and the free
+		// stack, all of which are prefixed with an index.
+		let size = count * mem::size_of::<Packet>() + (1 + count) * 3 * mem::size_of::<u16>();
+		let (packets, packets_window) = map_into_window(vms, packets.cast(), size)?;
+		let size = max_free_pages
+			.checked_mul(mem::size_of::<FreePage>())
+			.ok_or(NewError::WindowFull)?;
+		let (free_pages, free_pages_window) = match map_into_window(vms, free_pages.cast(), size) {
+			Ok(w) => w,
+			Err(e) => {
+				unmap_window(packets_window);
+				return Err(e);
+			}
+		};
+		Ok(Self {
+			packets: packets.cast(),
+			last_transmit_index: Cell::new(0),
+			ring_mask: (count - 1) as u16,
+			free_pages: free_pages.cast(),
+			max_free_pages,
+			wait_target: Cell::new(None),
+			windows: [packets_window, free_pages_window],
+		})
 	}
 
-	/// Process IPC packets to be transmitted.
-	pub fn process_packets(&mut self, slf_task: &super::Task, slf_address: Address) {
-		use crate::arch::vms::VirtualMemorySystem;
-		slf_task.inner().shared_state.virtual_memory.activate(); // TODO do this beforehand and once only
-		arch::set_supervisor_userpage_access(true);
+	/// Process at most `max` IPC packets to be transmitted.
+	///
+	/// Processing stops early at the first packet that can't be delivered.
+	pub fn process_packets(
+		&mut self,
+		slf_address: Address,
+		max: usize,
+	) -> Result<usize, (usize, TransmitError)> {
 		let (tx_index, tx_slots) = self.transmit_ring();
 		let mut last_transmit_index = self.last_transmit_index.get();
-		while last_transmit_index != tx_index {
-			let tx_pkt_slot = last_transmit_index & self.ring_mask;
-			let tx_pkt = unsafe { *self.packet(tx_slots[usize::from(tx_pkt_slot)]).unwrap() };
-
-			// Disallow sending packets to self since it's pointless + leads to potential aliasing
-			// bugs.
-			assert_ne!(tx_pkt.address, slf_address, "can't transmit to self");
-
-			let (group, task) = (tx_pkt.address.group(), tx_pkt.address.task());
-			let task = Group::get(group.into()).unwrap().task(task.into()).unwrap();
-
-			// TODO this is potentially terribly inefficient
-			//
-			// If ASIDs are available, then the impact is likely _okay_, but if there are
-			// no ASIDs then this has a huge context switching cost.
-			//
-			// It may be worth mapping the packet tables into kernel space.
-			task.inner().shared_state.virtual_memory.activate();
-
-			let task_ipc = match task.inner().ipc.as_mut() {
-				Some(ipc) => ipc,
-				None => {
-					// TODO instead of waking up the task, we should just process it's entries
-					// without explicitly scheduling it.
-					slf_task.inner().wait_time = 0;
-					break;
-				}
-			};
-			let (rx_index, rx_slots) = task_ipc.received_ring();
-			let rx_pkt_slot = task_ipc.pop_free_slot().unwrap();
+		let mut delivered = 0;
+		let mut error = None;
+		while last_transmit_index != tx_index && delivered < max && error.is_none() {
+			// Collect packets up to the first one whose receiver isn't ready yet.
+			let mut batch = [(Address::todo(0), 0, 0, Reserved::NONE); BATCH_SIZE];
+			let mut len = 0;
+			while len < BATCH_SIZE.min(max - delivered) && last_transmit_index != tx_index {
+				let entry = &tx_slots[usize::from(last_transmit_index & self.ring_mask)];
+				let slot = entry.load(Ordering::Acquire);
+				// The ring is writable by the task, so the slot may be out of range. There is
+				// no packet to deliver or slot to free then, so just drop the entry.
+				let packet = match unsafe { self.packet(slot) } {
+					Some(packet) => *packet,
+					None => {
+						entry.store(TRANSMIT_EMPTY, Ordering::Relaxed);
+						last_transmit_index = last_transmit_index.wrapping_add(1);
+						continue;
+					}
+				};
+				let address = packet.address;
+
+				// Disallow sending packets to self since it's pointless + leads to potential
+				// aliasing bugs.
+				assert_ne!(address, slf_address, "can't transmit to self");
+
+				// Reserve room in the queues of the receiver before taking the packet out of the
+				// ring so it can be left there if there is none.
+				let reserved = match receiver(address) {
+					Some(task) => match task.inner().ipc.as_ref().map(|ipc| ipc.reserve(&packet)) {
+						Some(Some(reserved)) => reserved,
+						Some(None) => {
+							// Leave the packet in the ring so it can be retried later.
+							error = Some(TransmitError::Full);
+							break;
+						}
+						None => {
+							// Ditto
+							error = Some(TransmitError::NoQueues);
+							break;
+						}
+					},
+					None => {
+						// The receiver will never exist, so drop the packet.
+						entry.store(TRANSMIT_EMPTY, Ordering::Relaxed);
+						self.push_free_slot(slot).unwrap();
+						last_transmit_index = last_transmit_index.wrapping_add(1);
+						error = Some(TransmitError::NoReceiver);
+						break;
+					}
+				};
+				entry.store(TRANSMIT_EMPTY, Ordering::Relaxed);
+				batch[len] = (address, len, slot, reserved);
+				len += 1;
+				last_transmit_index = last_transmit_index.wrapping_add(1);
+			}
+
+			// Group the packets by receiver so each is only touched once. The position is part
+			// of the key so packets to the same receiver stay in order.
+			let batch = &mut batch[..len];
+			batch.sort_unstable_by_key(|&(address, position, _, _)| (address, position));
+			let mut start = 0;
+			while start < batch.len() {
+				let address = batch[start].0;
+				let end = batch[start..]
+					.iter()
+					.position(|e| e.0 != address)
+					.map_or(batch.len(), |n| start + n);
+				self.deliver(address, slf_address, &batch[start..end]);
+				start = end;
+			}
+			delivered += len;
+		}
+		self.last_transmit_index.set(last_transmit_index);
+		error.map_or(Ok(delivered), |e| Err((delivered, e)))
+	}
+
+	/// Wake this task only once the received ring has advanced by `count` entries from now.
+	/// A `count` of `0` removes the condition.
+	pub fn wait_for_received(&self, count: u16) {
+		let (rx_index, _) = self.received_ring();
+		let target = rx_index.load(Ordering::Acquire).wrapping_add(count);
+		self.wait_target.set((count > 0).then(|| target));
+	}
+
+	/// Deliver the packets in the given slots to a single receiver.
+	fn deliver(
+		&self,
+		address: Address,
+		slf_address: Address,
+		slots: &[(Address, usize, u16, Reserved)],
+	) {
+		let task = receiver(address).unwrap();
+		crate::trace::record(crate::trace::Kind::Ipc, address.into(), slots.len() as u32);
+		let task_ipc = task.inner().ipc.as_ref().unwrap();
+		let vm = &task.inner().shared_state.virtual_memory;
+		let (rx_index, rx_slots) = task_ipc.received_ring();
+		let mut index = rx_index.load(Ordering::Acquire);
+
+		for &(_, _, tx_pkt_slot, reserved) in slots {
+			let tx_pkt = unsafe { *self.packet(tx_pkt_slot).unwrap() };
+			let rx_pkt_slot = reserved.slot;
 
 			// Get address range to map the data
-			let tx_rx_data = tx_pkt.data.map(|data| {
+			let tx_rx_data = tx_pkt.data.zip(reserved.data).map(|(data, rx)| {
 				let page = Page::new(data).unwrap();
 				let count = Page::min_pages_for_byte_count(tx_pkt.data_length);
-				(page, task_ipc.pop_free_range(count).unwrap(), count)
+				(page, rx, count)
 			});
 
 			// Get address range to map the name
-			let tx_rx_name = tx_pkt.name.map(|name| {
+			let tx_rx_name = tx_pkt.name.zip(reserved.name).map(|(name, rx)| {
 				let page = Page::new(name).unwrap();
 				let count = Page::min_pages_for_byte_count(usize::from(tx_pkt.name_length));
-				(page, task_ipc.pop_free_range(count).unwrap(), count)
+				(page, rx, count)
 			});
 
-			rx_slots[usize::from(rx_index.load(Ordering::Acquire) & task_ipc.ring_mask)]
-				.set(rx_pkt_slot);
+			let mut mapped = 0;
+			if let Some((tx_data, rx_data, count)) = tx_rx_data {
+				mapped += count;
+				vm.share_range(
+					rx_data,
+					tx_data,
+					count,
+					arch::vms::RWX::RW, // TODO use flags field for this
+					arch::vms::Accessibility::UserLocal,
+				)
+				.unwrap();
+			}
+			if let Some((tx_name, rx_name, count)) = tx_rx_name {
+				mapped += count;
+				vm.share_range(
+					rx_name,
+					tx_name,
+					count,
+					arch::vms::RWX::R,
+					arch::vms::Accessibility::UserLocal,
+				)
+				.unwrap();
+			}
 
 			let rx_pkt = unsafe { task_ipc.packet(rx_pkt_slot).unwrap() };
-
 			*rx_pkt = Packet {
 				uuid: tx_pkt.uuid,
 				data: tx_rx_data.map(|(_, p, _)| p.as_non_null_ptr()),
@@ -190,46 +381,65 @@ impl IPC {
 				opcode: tx_pkt.opcode,
 				id: tx_pkt.id,
 			};
+			rx_slots[usize::from(index & task_ipc.ring_mask)].set(rx_pkt_slot);
+			index = index.wrapping_add(1);
+			task.count_mapped_pages(mapped);
 
-			rx_index.fetch_add(1, Ordering::Release);
+			self.push_free_slot(tx_pkt_slot).unwrap();
+		}
 
-			// Clear the tasks wait time so it will be rescheduled
-			task.inner().wait_time = 0;
+		// Publish all packets at once.
+		rx_index.store(index, Ordering::Release);
+		task.inner().counters.ipc_received += slots.len() as u64;
 
-			// TODO ditto
-			slf_task.inner().shared_state.virtual_memory.activate();
-			let vm = &mut task.inner().shared_state.virtual_memory;
+		// Don't wake the receiver if it's waiting for more packets.
+		if let Some(target) = task_ipc.wait_target.get() {
+			if (target.wrapping_sub(index) as i16) > 0 {
+				return;
+			}
+			task_ipc.wait_target.set(None);
+		}
+		super::Executor::wake(address);
+	}
 
-			// FIXME map the entire range of pages instead of just one.
-			if let Some((tx_data, rx_data, count)) = tx_rx_data {
-				for i in 0..count {
-					vm.share(
-						rx_data.skip(i).unwrap(),
-						tx_data.skip(i).unwrap(),
-						arch::vms::RWX::RW, // TODO use flags field for this
-						arch::vms::Accessibility::UserLocal,
-					)
-					.unwrap();
-				}
+	/// Reserve a slot and address ranges for receiving the given packet. Returns `None` if
+	/// there isn't enough room, in which case nothing is reserved.
+	fn reserve(&self, packet: &Packet) -> Option<Reserved> {
+		let slot = self.pop_free_slot().ok()?;
+		let data_count = Page::min_pages_for_byte_count(packet.data_length);
+		let data = match packet.data.map(|_| self.pop_free_range(data_count)) {
+			Some(None) => {
+				self.push_free_slot(slot).unwrap();
+				return None;
 			}
-			if let Some((tx_name, rx_name, count)) = tx_rx_name {
-				for i in 0..count {
-					vm.share(
-						rx_name.skip(i).unwrap(),
-						tx_name.skip(i).unwrap(),
-						arch::vms::RWX::R,
-						arch::vms::Accessibility::UserLocal,
-					)
-					.unwrap();
+			data => data.flatten(),
+		};
+		let name_count = Page::min_pages_for_byte_count(usize::from(packet.name_length));
+		let name = match packet.name.map(|_| self.pop_free_range(name_count)) {
+			Some(None) => {
+				if let Some(data) = data {
+					self.unpop_free_range(data, data_count);
 				}
+				self.push_free_slot(slot).unwrap();
+				return None;
 			}
+			name => name.flatten(),
+		};
+		Some(Reserved { slot, data, name })
+	}
 
-			self.push_free_slot(tx_pkt_slot).unwrap();
-
-			last_transmit_index = last_transmit_index.wrapping_add(1);
+	/// Return a range of `size` pages that was just taken with
+	/// [`pop_free_range`](Self::pop_free_range).
+	fn unpop_free_range(&self, page: Page, size: usize) {
+		let free_pages =
+			unsafe { slice::from_raw_parts_mut(self.free_pages.as_ptr(), self.max_free_pages) };
+		for fp in free_pages.iter_mut() {
+			let end = fp.address.and_then(|a| Page::new(a).ok()?.skip(fp.count));
+			if end.map(|e| e.as_ptr()) == Some(page.as_ptr()) {
+				fp.count += size;
+				return;
+			}
 		}
-		self.last_transmit_index.set(last_transmit_index);
-		arch::set_supervisor_userpage_access(false);
 	}
 
 	/// Pop an address range from the free ranges list.
@@ -258,12 +468,15 @@ impl IPC {
 	}
 
 	/// Return the transmit ring buffer list.
+	///
+	/// The task may publish entries from multiple threads concurrently, so the entries are
+	/// atomic. Entries before the index are always fully written.
 	#[must_use]
-	fn transmit_ring(&self) -> (u16, &[u16]) {
+	fn transmit_ring(&self) -> (u16, &[AtomicU16]) {
 		unsafe {
 			let count = usize::from(self.len());
-			let addr = self.packets.as_ptr().add(count).cast::<u16>();
-			let index = *addr;
+			let addr = self.packets.as_ptr().add(count).cast::<AtomicU16>();
+			let index = (*addr).load(Ordering::Acquire);
 			let slice = slice::from_raw_parts(addr.add(1), count);
 			(index, slice)
 		}
@@ -367,11 +580,158 @@ pub struct FreePage {
 }
 
 impl super::Task {
-	/// Process IPC packets to be transmitted.
-	pub fn process_io(&self, slf_address: Address) {
-		self.inner()
+	/// Process at most `max` IPC packets to be transmitted. Returns the amount of packets
+	/// delivered.
+	///
+	/// A task without queues has nothing to transmit.
+	pub fn process_io(
+		&self,
+		slf_address: Address,
+		max: usize,
+	) -> Result<usize, (usize, TransmitError)> {
+		let ret = self
+			.inner()
 			.ipc
 			.as_mut()
-			.map(|ipc| ipc.process_packets(self, slf_address));
+			.map_or(Ok(0), |ipc| ipc.process_packets(slf_address, max));
+		let delivered = match ret {
+			Ok(n) | Err((n, _)) => n,
+		};
+		self.inner().counters.ipc_sent += delivered as u64;
+		ret
+	}
+
+	/// Wake this task only once `count` more packets have been received. A `count` of `0`
+	/// removes the condition.
+	pub fn wait_for_received(&self, count: u16) {
+		self.inner()
+			.ipc
+			.as_ref()
+			.map(|ipc| ipc.wait_for_received(count));
+	}
+
+	/// Put this task to sleep after submitting `delivered` packets until it is woken or
+	/// until the given duration has passed.
+	pub fn wait_submitted(&self, delivered: usize, duration: u64) {
+		let inner = self.inner();
+		// Registers are restored as they were when the syscall was made, so write out
+		// the return values now.
+		inner.register_state.x[10 - 1] = 0;
+		inner.register_state.x[11 - 1] = delivered;
+		self.wait_duration(duration);
+	}
+}
+
+/// Return the task with the given address, if it exists.
+fn receiver(address: Address) -> Option<super::Task> {
+	let (group, task) = (address.group(), address.task());
+	Group::get(group.into())?.task(task.into()).ok()
+}
+
+/// Map `size` bytes of user memory at the given address in the current VMS into the kernel
+/// window and return the address in the window.
+///
+/// # Safety
+///
+/// The VMS must be the active one.
+unsafe fn map_into_window(
+	vms: &arch::VMS,
+	address: NonNull<u8>,
+	size: usize,
+) -> Result<(NonNull<u8>, WindowRange), NewError> {
+	let address = address.as_ptr() as usize;
+	let offset = address & arch::PAGE_MASK;
+	let user = Page::from_usize(address - offset).map_err(|_| NewError::NotMapped)?;
+	let count = offset
+		.checked_add(size)
+		.map(Page::min_pages_for_byte_count)
+		.ok_or(NewError::WindowFull)?;
+
+	let range = WINDOW.claim(count).ok_or(NewError::WindowFull)?;
+	let window = window_page(range);
+	if vms
+		.share_range(window, user, count, RWX::RW, Accessibility::KernelGlobal)
+		.is_err()
+	{
+		unmap_window(range);
+		return Err(NewError::NotMapped);
+	}
+	Ok((
+		NonNull::new_unchecked(window.as_ptr().cast::<u8>().add(offset)),
+		range,
+	))
+}
+
+/// Unmap a range of the kernel window and release it.
+///
+/// # Safety
+///
+/// Nothing may refer to the range anymore.
+unsafe fn unmap_window(range: WindowRange) {
+	// A range that failed to be shared is only mapped up to the page that failed, which is
+	// where deallocate stops.
+	let _ = arch::VMS::deallocate(window_page(range), range.count as usize);
+	WINDOW.release(range);
+}
+
+impl WindowRange {
+	const EMPTY: Self = Self {
+		offset: 0,
+		count: 0,
+	};
+}
+
+/// Return the first page of a range of the kernel window.
+fn window_page(range: WindowRange) -> Page {
+	memory::reserved::IPC_QUEUES
+		.start
+		.skip(range.offset as usize)
+		.unwrap()
+}
+
+impl Window {
+	/// Claim the first free range of `count` pages.
+	fn claim(&mut self, count: usize) -> Option<WindowRange> {
+		if self.len >= MAX_WINDOW_RANGES || count > WINDOW_PAGES {
+			return None;
+		}
+		let (mut index, mut start) = (self.len, 0);
+		for (i, r) in self.ranges[..self.len].iter().enumerate() {
+			if r.offset as usize - start >= count {
+				index = i;
+				break;
+			}
+			start = (r.offset + r.count) as usize;
+		}
+		if index == self.len && WINDOW_PAGES - start < count {
+			return None;
+		}
+		let range = WindowRange {
+			offset: start as u32,
+			count: count as u32,
+		};
+		self.ranges.copy_within(index..self.len, index + 1);
+		self.ranges[index] = range;
+		self.len += 1;
+		Some(range)
+	}
+
+	/// Release a range claimed with [`claim`](Self::claim).
+	fn release(&mut self, range: WindowRange) {
+		let ranges = &self.ranges[..self.len];
+		if let Some(i) = ranges.iter().position(|r| r.offset == range.offset) {
+			self.ranges.copy_within(i + 1..self.len, i);
+			self.len -= 1;
+		}
+	}
+}
+
+impl Drop for IPC {
+	fn drop(&mut self) {
+		// SAFETY: the queues are only referred to through this structure.
+		unsafe {
+			unmap_window(self.windows[0]);
+			unmap_window(self.windows[1]);
+		}
 	}
 }
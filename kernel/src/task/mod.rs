@@ -17,6 +17,8 @@
 //! highest level. This does sacrifice some security but there is not much that can be done about
 //! it.
 
+pub mod channel;
+pub mod futex;
 pub mod ipc;
 pub mod notification;
 pub mod registry;
@@ -24,6 +26,7 @@ pub mod registry;
 mod address;
 mod executor;
 mod group;
+mod queue;
 
 pub use address::*;
 pub use executor::Executor;
@@ -33,11 +36,29 @@ use crate::arch::vms::{self, VirtualMemorySystem, RWX};
 use crate::arch::{self, Map, Page};
 use crate::memory::{self, AllocateError};
 use core::ptr::NonNull;
-use core::sync::atomic::{AtomicU16, AtomicU32, Ordering};
+use core::sync::atomic::{AtomicBool, AtomicU16, AtomicU32, AtomicU64, Ordering};
 
 #[derive(Debug)]
 struct Claimed(u16);
 
+#[derive(Debug)]
+pub struct InvalidPriority;
+
+/// Priority classes of tasks.
+pub struct Priority;
+
+impl Priority {
+	/// Tasks that should only run if nothing else can.
+	#[allow(dead_code)]
+	pub const LOW: u16 = 0;
+	/// The default priority.
+	pub const NORMAL: u16 = 1;
+	/// Tasks that should run as soon as possible, such as drivers.
+	pub const HIGH: u16 = 2;
+	/// The amount of priority classes.
+	pub const COUNT: usize = 3;
+}
+
 /// Various flags indicating a task's state.
 #[repr(transparent)]
 struct Flags(u16);
@@ -98,7 +119,7 @@ pub struct TaskData {
 	///
 	/// This value is u16::MAX if no executor has claimed it.
 	executor_id: AtomicU16,
-	/// An accumulator that determines the priority of a task.
+	/// The priority class of this task. Ready tasks of a higher class always run first.
 	priority: u16,
 	/// A factor that scales the value of the priority.
 	priority_factor: u16,
@@ -106,9 +127,31 @@ pub struct TaskData {
 	wait_time: u64,
 	/// IPC state to communicate with other tasks.
 	ipc: Option<ipc::IPC>,
+	/// The address this task is waiting on, if any.
+	futex_key: Option<futex::Key>,
+	/// Whether this task is in the ready queue of any executor.
+	queued: AtomicBool,
+	/// The time of the entry of this task in a sleep queue, or `u64::MAX` if there is none.
+	sleep_key: AtomicU64,
+	/// Statistics about this task.
+	counters: Counters,
+}
+
+/// Statistics about a task, which can be read with the `task_counters` syscall.
+#[derive(Clone, Copy, Default)]
+#[repr(C)]
+pub struct Counters {
+	/// The time the task has been running in microseconds, including time spent in the kernel
+	/// on its behalf.
+	pub run_time: u64,
+	/// The amount of IPC packets delivered from this task.
+	pub ipc_sent: u64,
+	/// The amount of IPC packets delivered to this task.
+	pub ipc_received: u64,
+	/// The amount of pages mapped into this task's address space.
+	pub pages_mapped: u64,
 }
 
-const STACK_ADDRESS: Page = memory::reserved::HART_STACKS.start;
 static mut TASK_DATA_ADDRESS: Page = memory::reserved::TASK_DATA.start;
 
 impl Task {
@@ -132,7 +175,8 @@ impl Task {
 		unsafe {
 			task.ptr.as_ptr().write(TaskData {
 				register_state: Default::default(),
-				stack: STACK_ADDRESS.next().unwrap(),
+				// Set to the stack of an executor once it runs the task.
+				stack: memory::reserved::HART_STACKS.start.next().unwrap(),
 				shared_state: SharedState {
 					virtual_memory: vms,
 				},
@@ -140,16 +184,55 @@ impl Task {
 				current_irq: IRQ::default(),
 				flags: Flags(0),
 				executor_id: AtomicU16::new(u16::MAX),
-				priority: 0,
+				priority: Priority::NORMAL,
 				priority_factor: 0,
 				wait_time: 0,
 				ipc: None,
+				futex_key: None,
+				queued: AtomicBool::new(false),
+				sleep_key: AtomicU64::new(u64::MAX),
+				counters: Counters::default(),
 			});
 		}
 		unsafe { TASK_DATA_ADDRESS = TASK_DATA_ADDRESS.next().unwrap() };
 		Ok(task)
 	}
 
+	/// Create a new empty task that shares the VMS and priority of this task.
+	pub fn new_thread(&self) -> Result<Self, AllocateError> {
+		// SAFETY: tasks are never freed, so the VMS outlives both tasks.
+		let thread = Self::new(unsafe { self.inner().shared_state.virtual_memory.alias() })?;
+		thread.inner().priority = self.inner().priority;
+		Ok(thread)
+	}
+
+	/// Return the priority class of this task.
+	pub fn priority(&self) -> u16 {
+		self.inner().priority
+	}
+
+	/// Set the priority class of this task.
+	pub fn set_priority(&self, priority: u16) -> Result<(), InvalidPriority> {
+		(usize::from(priority) < Priority::COUNT)
+			.then(|| self.inner().priority = priority)
+			.ok_or(InvalidPriority)
+	}
+
+	/// Return the statistics of this task.
+	pub fn counters(&self) -> Counters {
+		self.inner().counters
+	}
+
+	/// Count pages that were mapped into this task's address space.
+	pub fn count_mapped_pages(&self, count: usize) {
+		self.inner().counters.pages_mapped += count as u64;
+	}
+
+	/// Return the ID of the syscall this task is making. Only meaningful during a syscall.
+	pub fn syscall_id(&self) -> usize {
+		self.inner().register_state.x[17 - 1]
+	}
+
 	/// Set the program counter of this task to the given address.
 	pub fn set_pc(&self, address: *const ()) {
 		self.inner().register_state.set_pc(address);
@@ -160,24 +243,58 @@ impl Task {
 		self.inner().register_state.set_stack_pointer(address);
 	}
 
+	/// Set the thread pointer of this task to the given address.
+	pub fn set_thread_pointer(&self, address: *const ()) {
+		self.inner().register_state.set_thread_pointer(address);
+	}
+
+	/// Set an argument register of this task.
+	pub fn set_argument(&self, index: usize, value: usize) {
+		self.inner().register_state.set_argument(index, value);
+	}
+
 	/// Begin executing this task.
 	fn execute(&self, executor_id: u16) -> Result<!, Claimed> {
 		self.inner().shared_state.virtual_memory.activate();
 		self.inner()
 			.executor_id
 			.compare_exchange(u16::MAX, executor_id, Ordering::Relaxed, Ordering::Relaxed)
-			.map(|_| unsafe { arch::trap_start_task(self.clone()) })
+			.map(|_| {
+				// Traps are handled on the stack of the hart the task runs on.
+				self.inner().stack = Executor::stack(executor_id);
+				// Whatever the task was waiting on, it is running now.
+				self.futex_clear();
+				unsafe { arch::trap_start_task(self.clone()) }
+			})
 			.map_err(Claimed)
 	}
 
-	/// Allocate private memory at the given virtual address for the current task.
+	/// Allocate private, zeroed memory at the given virtual address for the current task.
+	///
+	/// If `largest` is set, hugepages up to that size are used where possible. Otherwise pages
+	/// are only allocated when they are first accessed, unless `prefault` is set.
 	pub fn allocate_memory(
 		address: Page,
 		count: usize,
+		largest: Option<memory::HugePage>,
+		prefault: bool,
 		rwx: vms::RWX,
 	) -> Result<(), vms::AddError> {
 		//self.inner().shared_state.virtual_memory
-		arch::VMS::allocate(address, count, rwx, vms::Accessibility::UserLocal)
+		let access = vms::Accessibility::UserLocal;
+		match largest {
+			Some(l) => arch::VMS::allocate_huge(address, count, l, rwx, access),
+			None => {
+				arch::VMS::current().reserve(address, count, rwx, access)?;
+				if prefault {
+					for i in 0..count {
+						arch::VMS::fault_in(address.skip(i).unwrap(), false)
+							.map_err(vms::AddError::AllocateError)?;
+					}
+				}
+				Ok(())
+			}
+		}
 	}
 
 	/// Deallocate memory for the current task
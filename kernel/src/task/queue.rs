@@ -0,0 +1,171 @@
+//! # Scheduler queues
+//!
+//! Each executor has a queue of tasks that are ready to run and a queue of tasks that are
+//! sleeping until a certain time.
+//!
+//! The ready queue is a bounded [Chase-Lev deque][cl]: the owning executor pushes and pops at
+//! the bottom while other executors can steal from the top without taking any locks. The sleep
+//! queue is a binary heap ordered by wake-up time and is only ever touched by its owner.
+//!
+//! Both queues are bounded. Tasks that don't fit are left to the executor to find again.
+//!
+//! [cl]: https://www.dre.vanderbilt.edu/~schmidt/PDF/work-stealing-dequeue.pdf
+
+use core::cell::Cell;
+use core::sync::atomic::{self, AtomicUsize, Ordering};
+
+/// The amount of entries in a ready queue. Must be a power of two.
+const READY_LEN: usize = 256;
+
+/// The amount of entries in a sleep queue.
+const SLEEP_LEN: usize = 192;
+
+#[derive(Debug)]
+pub struct Full;
+
+/// A queue of tasks ready to run.
+///
+/// An all-zero queue is empty.
+#[repr(C)]
+pub struct Ready {
+	/// The index of the oldest entry, which is the next to be stolen.
+	top: AtomicUsize,
+	/// The index after the newest entry.
+	bottom: AtomicUsize,
+	entries: [AtomicUsize; READY_LEN],
+}
+
+impl Ready {
+	/// Add an entry to the bottom of the queue.
+	///
+	/// This may only be called by the owner of the queue.
+	pub fn push(&self, value: usize) -> Result<(), Full> {
+		let b = self.bottom.load(Ordering::Relaxed);
+		let t = self.top.load(Ordering::Acquire);
+		if b.wrapping_sub(t) >= READY_LEN {
+			return Err(Full);
+		}
+		self.entries[b % READY_LEN].store(value, Ordering::Relaxed);
+		self.bottom.store(b.wrapping_add(1), Ordering::Release);
+		Ok(())
+	}
+
+	/// Remove the newest entry from the queue.
+	///
+	/// This may only be called by the owner of the queue.
+	pub fn pop(&self) -> Option<usize> {
+		let b = self.bottom.load(Ordering::Relaxed).wrapping_sub(1);
+		self.bottom.store(b, Ordering::Relaxed);
+		atomic::fence(Ordering::SeqCst);
+		let t = self.top.load(Ordering::Relaxed);
+
+		if (b.wrapping_sub(t) as isize) < 0 {
+			// The queue is empty.
+			self.bottom.store(t, Ordering::Relaxed);
+			return None;
+		}
+
+		let value = self.entries[b % READY_LEN].load(Ordering::Relaxed);
+		if b != t {
+			return Some(value);
+		}
+
+		// This is the last entry, so race against thieves for it.
+		let won = self
+			.top
+			.compare_exchange(t, t.wrapping_add(1), Ordering::SeqCst, Ordering::Relaxed)
+			.is_ok();
+		self.bottom.store(t.wrapping_add(1), Ordering::Relaxed);
+		won.then(|| value)
+	}
+
+	/// Remove the oldest entry from the queue.
+	///
+	/// This may be called by any executor. It fails if the queue is empty or if another
+	/// executor took the entry first.
+	pub fn steal(&self) -> Option<usize> {
+		let t = self.top.load(Ordering::Acquire);
+		atomic::fence(Ordering::SeqCst);
+		let b = self.bottom.load(Ordering::Acquire);
+
+		if (b.wrapping_sub(t) as isize) <= 0 {
+			return None;
+		}
+
+		let value = self.entries[t % READY_LEN].load(Ordering::Relaxed);
+		self.top
+			.compare_exchange(t, t.wrapping_add(1), Ordering::SeqCst, Ordering::Relaxed)
+			.ok()
+			.map(|_| value)
+	}
+}
+
+/// A queue of tasks sleeping until a certain time, earliest first.
+///
+/// An all-zero queue is empty.
+#[repr(C)]
+pub struct Sleeping {
+	len: Cell<usize>,
+	entries: [Cell<(u64, usize)>; SLEEP_LEN],
+}
+
+impl Sleeping {
+	/// Add an entry that expires at the given time.
+	pub fn push(&self, time: u64, value: usize) -> Result<(), Full> {
+		let mut i = self.len.get();
+		if i >= SLEEP_LEN {
+			return Err(Full);
+		}
+		self.len.set(i + 1);
+
+		// Sift up
+		while i > 0 {
+			let parent = (i - 1) / 2;
+			let p = self.entries[parent].get();
+			if p.0 <= time {
+				break;
+			}
+			self.entries[i].set(p);
+			i = parent;
+		}
+		self.entries[i].set((time, value));
+		Ok(())
+	}
+
+	/// Return the time of the earliest entry.
+	pub fn earliest(&self) -> Option<u64> {
+		(self.len.get() > 0).then(|| self.entries[0].get().0)
+	}
+
+	/// Remove the earliest entry if it expires at or before the given time.
+	pub fn pop_expired(&self, now: u64) -> Option<(u64, usize)> {
+		let len = self.len.get();
+		let first = self.entries[0].get();
+		if len == 0 || first.0 > now {
+			return None;
+		}
+		let len = len - 1;
+		self.len.set(len);
+
+		// Sift down the last entry from the root.
+		let last = self.entries[len].get();
+		let mut i = 0;
+		loop {
+			let mut c = i * 2 + 1;
+			if c >= len {
+				break;
+			}
+			if c + 1 < len && self.entries[c + 1].get().0 < self.entries[c].get().0 {
+				c += 1;
+			}
+			let child = self.entries[c].get();
+			if last.0 <= child.0 {
+				break;
+			}
+			self.entries[i].set(child);
+			i = c;
+		}
+		self.entries[i].set(last);
+		Some(first)
+	}
+}
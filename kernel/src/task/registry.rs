@@ -1,101 +1,170 @@
 //! # Task registry
 //!
 //! This is used as a way to identify tasks with human-readable names.
+//!
+//! Entries are kept in an open-addressed hash table keyed by a hash of the name. Entries are
+//! never removed and a slot is never changed once its hash is published, which is done last.
+//! Lookups thus don't need any lock and never wait on writers, which are serialized with a
+//! separate lock.
+//!
+//! Every addition increments a generation counter and wakes all tasks waiting on it, so tasks
+//! can sleep until the entry they need is added instead of polling.
 
-use super::Address;
+use super::{futex, Address};
 use core::cell::UnsafeCell;
-use core::sync::atomic::{AtomicUsize, Ordering};
-
-// TODO use a radix tree instead of a dumb list.
-
-/// -1 means it's locked.
-static REGISTRY_ENTRY_COUNT: AtomicUsize = AtomicUsize::new(0);
-static REGISTRY: LOL = LOL([
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-	UnsafeCell::new(None),
-]);
-
-struct LOL([UnsafeCell<Option<Entry>>; 16]);
-
-unsafe impl Sync for LOL {}
-
-struct Entry {
-	name_len: u8,
-	name: [u8; 31],
-	address: Address,
+use core::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, AtomicUsize, Ordering};
+
+/// The amount of slots in the table. Must be a power of two.
+const CAPACITY: usize = 64;
+
+/// The maximum length of a name.
+const MAX_NAME_LEN: usize = 255;
+
+/// The total amount of bytes available for names.
+const NAMES_SIZE: usize = 4096;
+
+static SLOTS: [Slot; CAPACITY] = [Slot::EMPTY; CAPACITY];
+static NAMES: Names = Names(UnsafeCell::new([0; NAMES_SIZE]));
+/// The amount of bytes in `NAMES` in use. Only accessed by writers.
+static NAMES_USED: AtomicUsize = AtomicUsize::new(0);
+static WRITER: AtomicBool = AtomicBool::new(false);
+static GENERATION: AtomicUsize = AtomicUsize::new(0);
+
+struct Slot {
+	/// The hash of the name, or 0 if the slot is empty.
+	hash: AtomicU64,
+	/// The offset of the name in `NAMES` in the upper bits and its length in the lower 8 bits.
+	name: AtomicU32,
+	address: AtomicUsize,
 }
 
+/// Storage for names, which are only written by writers before the slot is published.
+struct Names(UnsafeCell<[u8; NAMES_SIZE]>);
+
+unsafe impl Sync for Names {}
+
 pub enum AddError {
-	#[allow(dead_code)]
 	Occupied,
 	NameTooLong,
 	RegistryFull,
 }
 
+impl Slot {
+	const EMPTY: Self = Self {
+		hash: AtomicU64::new(0),
+		name: AtomicU32::new(0),
+		address: AtomicUsize::new(0),
+	};
+
+	/// The name of a published slot.
+	fn name(&self) -> &'static [u8] {
+		let name = self.name.load(Ordering::Relaxed) as usize;
+		let (offset, len) = (name >> 8, name & 0xff);
+		// SAFETY: the name is in range and is never written again once published.
+		unsafe { &(*NAMES.0.get())[offset..offset + len] }
+	}
+}
+
+/// Add an entry to the registry. Names must be unique.
 pub fn add(name: &[u8], address: Address) -> Result<(), AddError> {
-	if name.len() > 31 {
+	if name.len() > MAX_NAME_LEN {
 		return Err(AddError::NameTooLong);
 	}
-	let len = lock();
-	if len < REGISTRY.0.len() {
-		let mut n = [0; 31];
-		n[..name.len()].copy_from_slice(name);
-		unsafe {
-			REGISTRY.0[len].get().write(Some(Entry {
-				name_len: name.len() as u8,
-				name: n,
-				address,
-			}));
-		}
-		unlock(len + 1);
-		Ok(())
-	} else {
-		unlock(len);
-		Err(AddError::RegistryFull)
+	let hash = hash(name);
+
+	while WRITER
+		.compare_exchange_weak(false, true, Ordering::Acquire, Ordering::Relaxed)
+		.is_err()
+	{
+		core::hint::spin_loop();
 	}
+	let ret = insert(name, hash, address);
+	WRITER.store(false, Ordering::Release);
+
+	if ret.is_ok() {
+		GENERATION.fetch_add(1, Ordering::Release);
+		futex::wake(futex::Key::REGISTRY, usize::MAX);
+	}
+	ret
 }
 
+/// Get the address of the entry with the given name.
 pub fn get(name: &[u8]) -> Option<Address> {
-	let len = lock();
-	let e = REGISTRY.0[..len]
-		.iter()
-		.map(|e| unsafe { &*e.get() })
-		.filter_map(Option::as_ref)
-		.find(|e| &e.name[..usize::from(e.name_len)] == name)
-		.map(|e| e.address);
-	unlock(len);
-	e
+	let hash = hash(name);
+	for slot in probe(hash) {
+		match slot.hash.load(Ordering::Acquire) {
+			0 => break,
+			h if h == hash && slot.name() == name => {
+				return Some(slot.address.load(Ordering::Relaxed).into());
+			}
+			_ => (),
+		}
+	}
+	None
 }
 
-fn lock() -> usize {
-	let mut len = REGISTRY_ENTRY_COUNT.load(Ordering::Relaxed);
-	loop {
-		match REGISTRY_ENTRY_COUNT.compare_exchange_weak(
-			len,
-			usize::MAX,
-			Ordering::Acquire,
-			Ordering::Relaxed,
-		) {
-			Ok(_) => break len,
-			Err(v) => len = v,
+/// Return the current generation of the registry, which changes whenever an entry is added.
+///
+/// It must be read before a lookup so that no addition can be missed when waiting for the
+/// next one.
+pub fn generation() -> usize {
+	GENERATION.load(Ordering::Acquire)
+}
+
+/// Insert an entry while holding the writer lock.
+fn insert(name: &[u8], hash: u64, address: Address) -> Result<(), AddError> {
+	let mut free = None;
+	for slot in probe(hash) {
+		match slot.hash.load(Ordering::Relaxed) {
+			0 => {
+				free = Some(slot);
+				break;
+			}
+			h if h == hash && slot.name() == name => return Err(AddError::Occupied),
+			_ => (),
 		}
 	}
+	let slot = free.ok_or(AddError::RegistryFull)?;
+
+	let offset = NAMES_USED.load(Ordering::Relaxed);
+	if offset + name.len() > NAMES_SIZE {
+		return Err(AddError::RegistryFull);
+	}
+	// SAFETY: only the writer touches the unused part of the names.
+	unsafe { (*NAMES.0.get())[offset..offset + name.len()].copy_from_slice(name) };
+	NAMES_USED.store(offset + name.len(), Ordering::Relaxed);
+
+	slot.name
+		.store(((offset << 8) | name.len()) as u32, Ordering::Relaxed);
+	slot.address.store(address.into(), Ordering::Relaxed);
+	slot.hash.store(hash, Ordering::Release);
+	Ok(())
+}
+
+/// Iterate over all slots in the order they are probed for the given hash.
+fn probe(hash: u64) -> impl Iterator<Item = &'static Slot> {
+	let start = hash as usize;
+	(0..CAPACITY).map(move |i| &SLOTS[start.wrapping_add(i) & (CAPACITY - 1)])
 }
 
-fn unlock(len: usize) {
-	REGISTRY_ENTRY_COUNT.store(len, Ordering::Release);
+/// Hash a name with FNV-1a. 0 is used to mark empty slots, so it is never returned.
+fn hash(name: &[u8]) -> u64 {
+	let h = name.iter().fold(0xcbf29ce484222325, |h, &b| {
+		(h ^ u64::from(b)).wrapping_mul(0x100000001b3)
+	});
+	h.max(1)
+}
+
+#[cfg(test)]
+mod test {
+	use super::*;
+
+	test!(add_get() {
+		let generation = generation();
+		assert!(add(b"registry_test", Address::from(42)).is_ok());
+		assert_ne!(generation, super::generation());
+		assert_eq!(get(b"registry_test"), Some(Address::from(42)));
+		assert_eq!(get(b"registry_tes"), None);
+		assert!(matches!(add(b"registry_test", Address::from(43)), Err(AddError::Occupied)));
+	});
 }
@@ -0,0 +1,201 @@
+//! # Trace buffer
+//!
+//! Each hart records events in its own ring of fixed-size binary records. Recording an event
+//! is a handful of stores without any formatting or locking, so it is cheap enough to leave
+//! enabled everywhere. If a ring is full the oldest events are overwritten.
+//!
+//! The rings are drained with the `sys_trace_read` syscall. Events that were overwritten
+//! before they could be read are reported with a single [`Kind::Lost`] event.
+
+use crate::arch::vms::{self, VirtualMemorySystem, RWX};
+use crate::arch::{self, Map, Page};
+use crate::memory::{self, reserved};
+use crate::task::Executor;
+use core::cell::UnsafeCell;
+use core::mem;
+use core::sync::atomic::{AtomicU64, Ordering};
+
+/// The amount of pages of the ring of each hart.
+const RING_PAGES: usize = 4;
+
+/// The amount of events that fit in a ring. The first slot is used for the header.
+const RING_EVENTS: usize = RING_PAGES * Page::SIZE / mem::size_of::<Event>() - 1;
+
+/// The maximum amount of harts with a ring.
+const MAX_RINGS: usize = 64;
+
+/// A bitmap of all harts with an initialized ring.
+static READY: AtomicU64 = AtomicU64::new(0);
+
+/// The type of an event.
+#[derive(Clone, Copy)]
+#[repr(u16)]
+pub enum Kind {
+	/// `a` is the syscall ID.
+	Syscall = 0,
+	/// `a` is the address of the receiver, `b` the amount of packets.
+	Ipc = 1,
+	/// `task` is the task that will run, `a` the task that ran before.
+	Switch = 2,
+	/// `a` is the address of the fault, `b` is `1` if it was a write.
+	PageFault = 3,
+	/// `a` is the interrupt source.
+	Interrupt = 4,
+	/// `b` is the amount of events that were overwritten before they were read.
+	Lost = 5,
+}
+
+/// A single event.
+#[derive(Clone, Copy)]
+#[repr(C)]
+pub struct Event {
+	/// When the event occured, as returned by [`arch::current_time`].
+	time: u64,
+	/// The task running at the time of the event or `usize::MAX` if there is none.
+	task: usize,
+	a: usize,
+	b: u32,
+	kind: Kind,
+	hart: u16,
+}
+
+/// The ring of a single hart. It spans [`RING_PAGES`] pages.
+#[repr(C)]
+struct Ring {
+	/// The total amount of events ever recorded.
+	head: AtomicU64,
+	/// The total amount of events ever read.
+	tail: AtomicU64,
+	_padding: [u64; 2],
+	/// Events may be recorded while they are being read, e.g. if the reader causes a page
+	/// fault.
+	events: UnsafeCell<[Event; RING_EVENTS]>,
+}
+
+const _: usize = RING_PAGES * Page::SIZE - mem::size_of::<Ring>(); // Size check
+const _: usize = reserved::TRACE.byte_count() - MAX_RINGS * RING_PAGES * Page::SIZE; // Ditto
+
+impl Ring {
+	/// # Safety
+	///
+	/// The ring must be initialized.
+	unsafe fn get(hart: u16) -> &'static Self {
+		let offset = usize::from(hart) * RING_PAGES * Page::SIZE;
+		&*reserved::TRACE
+			.start
+			.as_ptr()
+			.cast::<u8>()
+			.add(offset)
+			.cast::<Self>()
+	}
+
+	/// Return a pointer to the slot of the event with the given index.
+	fn slot(&self, index: u64) -> *mut Event {
+		// SAFETY: the index is in range.
+		unsafe {
+			self.events
+				.get()
+				.cast::<Event>()
+				.add(index as usize % RING_EVENTS)
+		}
+	}
+}
+
+/// Map and clear the ring of the given hart.
+///
+/// # Panics
+///
+/// If it failed to allocate memory or if the hart ID is out of range.
+pub fn init(hart: u16) {
+	assert!(usize::from(hart) < MAX_RINGS, "hart ID out of range");
+	let address = reserved::TRACE
+		.start
+		.skip(usize::from(hart) * RING_PAGES)
+		.unwrap();
+	for i in 0..RING_PAGES {
+		let page = Map::Private(memory::allocate().unwrap());
+		arch::VMS::add(
+			address.skip(i).unwrap(),
+			page,
+			RWX::RW,
+			vms::Accessibility::KernelGlobal,
+		)
+		.unwrap();
+	}
+	unsafe { core::ptr::write_bytes(address.as_ptr().cast::<u8>(), 0, RING_PAGES * Page::SIZE) };
+	READY.fetch_or(1 << hart, Ordering::Release);
+}
+
+/// Record an event on the ring of the current hart.
+///
+/// Events during early boot, before any executor is started, are dropped.
+pub fn record(kind: Kind, a: usize, b: u32) {
+	if let Some(hart) = Executor::try_id() {
+		record_on(hart, Executor::current_address().into(), kind, a, b);
+	}
+}
+
+/// Record an event on the ring of the given hart, which must be the current hart. This is
+/// intended for when the current task is being switched and may not be used to determine the
+/// hart.
+///
+/// Events for harts without an initialized ring are dropped.
+pub fn record_on(hart: u16, task: usize, kind: Kind, a: usize, b: u32) {
+	if usize::from(hart) >= MAX_RINGS || READY.load(Ordering::Acquire) & (1 << hart) == 0 {
+		return;
+	}
+	// SAFETY: the ring is initialized and only the current hart writes to its ring.
+	let ring = unsafe { Ring::get(hart) };
+	let head = ring.head.load(Ordering::Relaxed);
+	let event = Event {
+		time: arch::current_time(),
+		task,
+		a,
+		b,
+		kind,
+		hart,
+	};
+	// SAFETY: the slot is in range and nothing else writes to it.
+	unsafe { ring.slot(head).write(event) };
+	ring.head.store(head + 1, Ordering::Release);
+}
+
+/// Helper function intended to be called from assembly.
+#[export_name = "trace_interrupt"]
+extern "C" fn interrupt(source: u32) {
+	record(Kind::Interrupt, source as usize, 0);
+}
+
+/// Move the oldest unread events of all harts to `buffer`. Returns the amount of events
+/// written, which is less than the length of `buffer` only if there are no more events.
+pub fn read(buffer: &mut [Event]) -> usize {
+	let ready = READY.load(Ordering::Acquire);
+	let mut written = 0;
+	for hart in (0..MAX_RINGS as u16).filter(|h| ready & (1 << h) != 0) {
+		// SAFETY: the ring is initialized.
+		let ring = unsafe { Ring::get(hart) };
+		let head = ring.head.load(Ordering::Acquire);
+		let mut tail = ring.tail.load(Ordering::Relaxed);
+		let oldest = head.saturating_sub(RING_EVENTS as u64);
+		if tail < oldest && written < buffer.len() {
+			buffer[written] = Event {
+				time: arch::current_time(),
+				task: usize::MAX,
+				a: 0,
+				b: (oldest - tail).min(u32::MAX.into()) as u32,
+				kind: Kind::Lost,
+				hart,
+			};
+			written += 1;
+			tail = oldest;
+		}
+		while tail < head && written < buffer.len() {
+			// SAFETY: the slot is in range and holds an event that hasn't been overwritten.
+			buffer[written] = unsafe { ring.slot(tail).read() };
+			written += 1;
+			tail += 1;
+		}
+		ring.tail.store(tail, Ordering::Relaxed);
+	}
+	written
+}
@@ -7,19 +7,29 @@
 #include <kernel.h>
 #include <limits.h>
 
+struct dirent {
+	ino_t d_ino;
+	char d_name[NAME_MAX];
+};
+
+/**
+ * An open directory stream.
+ *
+ * Entries are fetched in batches of at most DUX_IPC_LIST_BATCH entries. _list
+ * holds the current batch, which starts at entry _base. _next is the offset
+ * to request the next batch with.
+ */
 typedef struct {
 	kernel_uuid_t uuid;
 	pid_t _address;
 	struct dux_ipc_list _list;
 	size_t _index;
+	size_t _base;
+	uint64_t _next;
 	int _fd;
+	struct dirent _ent;
 } DIR;
 
-struct dirent {
-	ino_t d_ino;
-	char d_name[NAME_MAX];
-};
-
 int alphasort(const struct dirent **lhs, const struct dirent **rhs);
 
 int closedir(DIR * dir);
@@ -34,9 +44,23 @@ struct dirent *readdir(DIR * dir);
 
 void rewinddir(DIR * dir);
 
-int scandir(const char *, struct dirent **, int (*)(const struct dirent *),
+/**
+ * Read the next entry without copying it. The name is not null-terminated and
+ * remains valid until the next call to any function with the same stream.
+ *
+ * Returns 0 on success or -1 if there are no more entries.
+ */
+int readdir_view(DIR * dir, struct dux_ipc_list_entry *entry);
+
+int scandir(const char *, struct dirent ***, int (*)(const struct dirent *),
 	    int (*)(const struct dirent **, const struct dirent **));
 
+/**
+ * Release a list returned by scandir. The entries are stored along with the
+ * list itself, so this must be used instead of free.
+ */
+void scandir_free(struct dirent **namelist);
+
 void seekdir(DIR * dir, long loc);
 
 long telldir(DIR * dir);
@@ -46,12 +46,50 @@ struct dux_ipc_list_entry {
 
 /**
  * A list of child objects.
+ *
+ * data_len is the amount of pages the list spans.
  */
 struct dux_ipc_list {
 	void *data;
 	size_t data_len;
 };
 
+/**
+ * The offset returned in response to a LIST request if there are no more
+ * entries. Any other offset is the index of the first entry that has not been
+ * returned yet and should be passed in the next request.
+ */
+#define DUX_IPC_LIST_END (UINT64_MAX)
+
+/**
+ * The maximum amount of entries returned by a single LIST request.
+ */
+#define DUX_IPC_LIST_BATCH (64)
+
+/**
+ * The IPC queues of a thread. The thread pointer of each thread except the
+ * main thread must point to one of these structures, which must be zeroed
+ * before dux_init_thread is called.
+ */
+struct dux_thread_queues {
+	void *_packets;
+	uint16_t _ring_mask;
+	uint16_t _last_received_index;
+	uint16_t _transmit_reserved;
+	uint8_t _received_lock;
+};
+
+/**
+ * Set up the IPC queues of the current thread and register them with the
+ * kernel. All threads share the same free ranges.
+ *
+ * This must be called once by each thread before any IPC is performed,
+ * except by the main thread.
+ *
+ * Returns 0 on success, -1 if no memory could be allocated.
+ */
+int dux_init_thread(void);
+
 /**
  * Returns a slot with an empty client request entry. Returns -1 if none
  * are available.
@@ -89,6 +127,34 @@ void dux_pop_received_entry(uint16_t slot);
  */
 void dux_defer_received_entry(uint16_t slot);
 
+/**
+ * Submit a request. The id field of the packet is overwritten with a tag
+ * which identifies the request. The tag is returned to the submitter with the
+ * completion, so multiple requests can be in flight at once. Only packets
+ * from the task the request was sent to match the tag. The completion must be
+ * retrieved by the same thread.
+ *
+ * This blocks if no transmit slots are available.
+ *
+ * Returns the tag or -1 if all tags are in use.
+ */
+int dux_ipc_submit(const struct kernel_ipc_packet *packet);
+
+/**
+ * Check if the completion for the given tag has been received. If so, it is
+ * copied to `completion`, removed from the received list and the tag is
+ * released.
+ *
+ * Returns 0 if the completion was received, otherwise -1.
+ */
+int dux_ipc_poll(uint8_t tag, struct kernel_ipc_packet *completion);
+
+/**
+ * Wait until the completion for the given tag has been received. Besides
+ * blocking this is equivalent to `dux_ipc_poll`.
+ */
+void dux_ipc_wait(uint8_t tag, struct kernel_ipc_packet *completion);
+
 /**
  * Reserves a range of memory pages. If the address is NULL, the best fitting address is used and
  * returned. If the range cannot be reserved, NULL is returned.
@@ -115,6 +181,62 @@ int dux_unreserve_pages(void *address, size_t count);
  */
 int dux_add_free_range(void *address, size_t count);
 
+/**
+ * One end of a shared-memory channel, which is a byte ring buffer in pages
+ * shared between two tasks. One end only writes and the other only reads.
+ */
+struct dux_channel {
+	void *_header;
+	size_t _capacity;
+	size_t _pages;
+};
+
+/**
+ * Create a channel of `pages` pages that can be opened by the task at `peer`.
+ * The ID the peer needs to open it is written to `id`.
+ *
+ * Returns 0 on success, -1 if there is not enough memory, -2 if the amount of
+ * pages is invalid or -3 if the kernel can't create any more channels.
+ */
+int dux_channel_create(struct dux_channel *channel, size_t pages, pid_t peer,
+		       size_t *id);
+
+/**
+ * Open the channel with the given ID and amount of pages, which must have
+ * been created for the current task.
+ *
+ * Returns 0 on success, -1 if there is not enough memory, -2 if the amount of
+ * pages doesn't match or -3 if there is no such channel.
+ */
+int dux_channel_open(struct dux_channel *channel, size_t id, size_t pages);
+
+/**
+ * Write all bytes to the channel, waiting whenever it is full.
+ */
+void dux_channel_write(const struct dux_channel *channel, const void *data,
+		       size_t length);
+
+/**
+ * Write as many bytes as fit without waiting. Returns the amount of bytes
+ * written.
+ */
+size_t dux_channel_try_write(const struct dux_channel *channel,
+			     const void *data, size_t length);
+
+/**
+ * Read at least one byte from the channel, waiting if it is empty. Returns the
+ * amount of bytes read.
+ */
+size_t dux_channel_read(const struct dux_channel *channel, void *buffer,
+			size_t length);
+
+/**
+ * Read as many bytes as are available without waiting. Returns the amount of
+ * bytes read.
+ */
+size_t dux_channel_try_read(const struct dux_channel *channel, void *buffer,
+			    size_t length);
+
 /**
  * Return the entry at the given index in this list.
  *
@@ -8,6 +8,15 @@
 #define PROT_WRITE (0x2)
 #define PROT_EXEC  (0x4)
 
+// Flags for kernel_mem_alloc to allow mapping aligned parts of the range with
+// hugepages, which must then be freed as a whole. Memory allocated with these
+// is always zeroed.
+#define MEM_MEGAPAGE (0x10)
+#define MEM_GIGAPAGE (0x20)
+// Flag for kernel_mem_alloc to allocate all pages immediately instead of when
+// they are first accessed. Memory allocated without hugepages is always zeroed.
+#define MEM_PREFAULT (0x40)
+
 #define PAGE_SIZE (0x1000)
 
 /**
@@ -76,6 +85,33 @@ enum {
 	KERNEL_IPC_OP_MAP_READ_EXEC_COW = 12,
 };
 
+/**
+ * Operations for kernel_task_futex
+ */
+enum {
+	KERNEL_FUTEX_WAIT = 0,
+	KERNEL_FUTEX_WAKE = 1,
+};
+
+/**
+ * Status returned by kernel_io_submit if a receiver has no queues.
+ */
+#define KERNEL_STATUS_UNAVAILABLE (12)
+
+/**
+ * Status returned by kernel_task_futex if the value didn't match.
+ */
+#define KERNEL_STATUS_RETRY (13)
+
+/**
+ * Priority classes for kernel_task_set_priority
+ */
+enum {
+	KERNEL_PRIORITY_LOW = 0,
+	KERNEL_PRIORITY_NORMAL = 1,
+	KERNEL_PRIORITY_HIGH = 2,
+};
+
 /**
  * Structure used to indicate IPC ranges where pages can be mapped into.
  */
@@ -175,6 +211,8 @@ SYSCALL_6(kernel_io_set_queues, 1, void * /* requests */ ,
 	      void * /* completions */ , size_t /* completion_sizes */ ,
 	      void * /* free_pages */ , size_t /* free_pages_size */ )
 
+SYSCALL_1(kernel_io_set_notify_handler, 2, void * /* handler */ )
+
 SYSCALL_3(kernel_mem_alloc, 3, void * /* address */ , size_t /* count */ ,
 	  uint8_t /* flags */ ) SYSCALL_2(kernel_mem_dealloc, 4,
 					  void * /* address */ ,
@@ -184,6 +222,19 @@ SYSCALL_1(kernel_mem_get_flags, 5,
 					   void * /* address */ ,
 					   size_t /* count */ )
 SYSCALL_2(kernel_sys_log, 15, const char * /* address */ , size_t /* length */ )
+
+SYSCALL_4(kernel_task_futex, 18, size_t /* op */ ,
+	  volatile uint32_t * /* address */ , size_t /* value */ ,
+	  uint64_t /* time */ )
+SYSCALL_4(kernel_task_spawn_thread, 19, void * /* program_counter */ ,
+	  void * /* stack_pointer */ , void * /* argument */ ,
+	  void * /* thread_pointer */ )
+SYSCALL_0(kernel_task_exit, 20)
+SYSCALL_1(kernel_task_set_priority, 21, size_t /* priority */ )
+SYSCALL_3(kernel_io_submit, 22, size_t /* count */ , size_t /* wait */ ,
+	  uint64_t /* time */ )
+SYSCALL_2(kernel_sys_log_read, 28, char * /* address */ , size_t /* length */ )
+SYSCALL_1(kernel_sys_log_level, 29, size_t /* level */ )
 #undef SYSCALL_4
 #undef SYSCALL_3
 #undef SYSCALL_2
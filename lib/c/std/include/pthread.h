@@ -5,14 +5,18 @@
 
 typedef size_t pthread_t;
 
-/* Boolean value used to ensure a function is executed only once */
-// FIXME should be atomic
-typedef unsigned char pthread_once_t;
+/* State used to ensure a function is executed only once */
+typedef unsigned int pthread_once_t;
+
+#define PTHREAD_ONCE_INIT (0)
 
 struct sched_param {
 };
 
 typedef struct {
+	size_t _stacksize;
+	size_t _guardsize;
+	int _detachstate;
 } pthread_attr_t;
 
 typedef size_t clockid_t;
@@ -20,6 +24,7 @@ typedef size_t clockid_t;
 #include "pthread/barrier.h"
 #include "pthread/cond.h"
 #include "pthread/mutex.h"
+#include "pthread/pool.h"
 #include "pthread/rwlock.h"
 #include "pthread/spinlock.h"
 #include "pthread/storage.h"
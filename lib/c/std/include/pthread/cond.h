@@ -4,10 +4,16 @@
 #include "mutex.h"
 
 typedef struct {
+	// Incremented on each signal. Waiters sleep until it changes.
+	volatile uint32_t _sequence;
 } pthread_cond_t;
 typedef struct {
+	int _pshared;
+	clockid_t _clock;
 } pthread_condattr_t;
 
+#define PTHREAD_COND_INITIALIZER { 0 }
+
 extern int pthread_cond_init(pthread_cond_t * restrict cond,
 			     const pthread_condattr_t * restrict cond_attr);
 
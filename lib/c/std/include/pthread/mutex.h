@@ -1,11 +1,22 @@
 #ifndef __POSIX_PTHREAD_MUTEX_H
 #define __POSIX_PTHREAD_MUTEX_H
 
+#include <stdint.h>
 #include "sys/time.h"
 
 typedef struct {
+	// 0 if unlocked, 1 if locked, 2 if locked and there may be waiters.
+	volatile uint32_t _state;
+	// The amount of times a recursive mutex has been locked.
+	unsigned int _count;
+	pthread_t _owner;
+	int _type;
 } pthread_mutex_t;
 typedef struct {
+	int _type;
+	int _pshared;
+	int _protocol;
+	int _robust;
 } pthread_mutexattr_t;
 
 enum {
@@ -20,6 +31,8 @@ enum {
 	PTHREAD_MUTEX_ROBUST,
 };
 
+#define PTHREAD_MUTEX_INITIALIZER { 0, 0, 0, PTHREAD_MUTEX_DEFAULT }
+
 extern int pthread_mutex_init(pthread_mutex_t * mutex,
 			      const pthread_mutexattr_t * mutexattr);
 
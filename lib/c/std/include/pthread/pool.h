@@ -0,0 +1,63 @@
+#ifndef __POSIX_PTHREAD_POOL_H
+#define __POSIX_PTHREAD_POOL_H
+
+#include "cond.h"
+#include "mutex.h"
+
+/*
+ * A fixed set of worker threads that run submitted jobs in parallel. This is
+ * not part of POSIX, hence the _np suffix.
+ */
+
+// The maximum amount of threads in a pool.
+#define PTHREAD_POOL_THREADS_MAX_NP (8)
+
+// The maximum amount of jobs that can be queued. Must be a power of two.
+#define PTHREAD_POOL_QUEUE_NP (64)
+
+struct __pthread_pool_job {
+	void (*_routine)(void *);
+	void *_arg;
+};
+
+typedef struct {
+	pthread_mutex_t _lock;
+	// Signaled when a job is queued or the pool is stopped.
+	pthread_cond_t _queued;
+	// Signaled when a job is taken or finished.
+	pthread_cond_t _done;
+	struct __pthread_pool_job _jobs[PTHREAD_POOL_QUEUE_NP];
+	unsigned int _head;
+	unsigned int _tail;
+	// The amount of jobs currently being run.
+	unsigned int _active;
+	unsigned int _thread_count;
+	int _stop;
+	pthread_t _threads[PTHREAD_POOL_THREADS_MAX_NP];
+} pthread_pool_np_t;
+
+/**
+ * Start a pool with the given amount of worker threads.
+ *
+ * Returns EINVAL if the amount is 0 or too large, or any error returned by
+ * pthread_create.
+ */
+extern int pthread_pool_init_np(pthread_pool_np_t * pool, unsigned int threads);
+
+/**
+ * Queue a job. This blocks while the queue is full.
+ */
+extern int pthread_pool_submit_np(pthread_pool_np_t * pool,
+				  void (*routine)(void *), void *arg);
+
+/**
+ * Wait until all queued jobs have finished.
+ */
+extern int pthread_pool_wait_np(pthread_pool_np_t * pool);
+
+/**
+ * Finish all queued jobs and stop the worker threads.
+ */
+extern int pthread_pool_destroy_np(pthread_pool_np_t * pool);
+
+#endif
@@ -1,5 +1,18 @@
-#ifndef __POSIX_PTHREAD_H
-#define __POSIX_PTHREAD_H
+#ifndef __POSIX_PTHREAD_RWLOCK_H
+#define __POSIX_PTHREAD_RWLOCK_H
+
+#include <stdint.h>
+#include "sys/time.h"
+
+typedef struct {
+	// The amount of readers, a writer bit and a waiters bit.
+	volatile uint32_t _state;
+} pthread_rwlock_t;
+typedef struct {
+	int _pshared;
+} pthread_rwlockattr_t;
+
+#define PTHREAD_RWLOCK_INITIALIZER { 0 }
 
 extern int pthread_rwlock_init(pthread_rwlock_t * restrict rwlock,
 			       const pthread_rwlockattr_t * restrict attr);
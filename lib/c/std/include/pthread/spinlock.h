@@ -1,7 +1,10 @@
 #ifndef __POSIX_PTHREAD_SPINLOCK_H
 #define __POSIX_PTHREAD_SPINLOCK_H
 
+#include <stdint.h>
+
 typedef struct {
+	volatile uint32_t _lock;
 } pthread_spinlock_t;
 
 extern int pthread_spin_init(pthread_spinlock_t * lock, int pshared);
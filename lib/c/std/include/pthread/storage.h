@@ -1,9 +1,13 @@
 #ifndef __POSIX_PTHREAD_STORAGE_H
 #define __POSIX_PTHREAD_STORAGE_H
 
-typedef struct {
+typedef unsigned int pthread_key_t;
 
-} pthread_key_t;
+// The maximum amount of keys that can exist at once.
+#define PTHREAD_KEYS_MAX (32)
+
+// The maximum amount of times destructors are called if values are set again.
+#define PTHREAD_DESTRUCTOR_ITERATIONS (4)
 
 extern int pthread_key_create(pthread_key_t * key,
 			      void (*destr_function)(void *));
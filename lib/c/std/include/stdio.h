@@ -10,11 +10,42 @@ enum {
 	SEEK_SET,
 };
 
+#define EOF (-1)
+
+/**
+ * Buffering modes accepted by setvbuf.
+ */
+#define _IOFBF (0)
+#define _IOLBF (1)
+#define _IONBF (2)
+
+/**
+ * The default size of a stream buffer. Buffers allocated by the library
+ * itself always span exactly one page so they can be passed to IPC directly.
+ */
+#define BUFSIZ (PAGE_SIZE)
+
+/**
+ * An open stream.
+ *
+ * The first four fields are also accessed in crt0, so the layout of those
+ * must be kept in sync.
+ *
+ * _buffer_index is the amount of pending bytes when writing and the offset of
+ * the next byte to return when reading. _buffer_length is the amount of valid
+ * bytes in the buffer when reading.
+ */
 typedef struct {
 	kernel_uuid_t _uuid;
 	uint64_t _position;
 	pid_t _address;
 	const char *_path;
+	char *_buffer;
+	size_t _buffer_size;
+	size_t _buffer_index;
+	size_t _buffer_length;
+	uint8_t _buffer_mode;
+	uint8_t _flags;
 } FILE;
 
 extern FILE *__files_list;
@@ -60,6 +91,14 @@ FILE *fopen(const char *, const char *);
 
 void setbuf(FILE *, char *);
 
+int setvbuf(FILE *, char *, int, size_t);
+
+int feof(FILE *);
+
+int ferror(FILE *);
+
+void clearerr(FILE *);
+
 int fclose(FILE *);
 
 size_t fread(void *, size_t, size_t, FILE *);
@@ -68,8 +107,16 @@ size_t fwrite(const void *, size_t, size_t, FILE *);
 
 int sprintf(char *, const char *, ...);
 
+int snprintf(char *, size_t, const char *, ...);
+
+int vprintf(const char *, va_list);
+
 int vfprintf(FILE *, const char *, va_list);
 
+int vsprintf(char *, const char *, va_list);
+
+int vsnprintf(char *, size_t, const char *, va_list);
+
 size_t ftell(FILE *);
 
 #endif
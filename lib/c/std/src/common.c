@@ -2,10 +2,25 @@
 #include "kernel.h"
 #include "sys/mman.h"
 #include "dux.h"
+#include "string.h"
 
 void *universal_buffer;
 size_t universal_buffer_size;
 
+volatile size_t __std_notification_count;
+
+// Defined in crt0
+void __std_notification_entry(void);
+
+/**
+ * Called by __std_notification_entry whenever the kernel sends a
+ * notification.
+ */
+void __std_notification(size_t type, size_t value, size_t address)
+{
+	__std_notification_count++;
+}
+
 void __posix_init(void)
 {
 #define NULL ((void *)0)
@@ -17,8 +32,10 @@ void __posix_init(void)
 		}		// TODO
 	}
 	asm volatile ("fence");
+	// Pages of the buffer are only backed by memory once they are touched
+	// or shared with another task.
 	kernel_return_t kret =
-	    kernel_mem_alloc(dret.address, 1, PROT_READ | PROT_WRITE);
+	    kernel_mem_alloc(dret.address, 16, PROT_READ | PROT_WRITE);
 	asm volatile ("fence");
 	if (kret.status != 0) {
 		for (;;) {
@@ -29,4 +46,177 @@ void __posix_init(void)
 	asm volatile ("fence");
 	universal_buffer_size = 16 * PAGE_SIZE;
 	asm volatile ("fence");
+
+	// Notifications wake up __std_wait.
+	kernel_io_set_notify_handler(__std_notification_entry);
+}
+
+/**
+ * Deliver queued requests to free up transmit slots. Only wait for an event if
+ * none could be delivered.
+ */
+static void __std_flush(void)
+{
+	if (kernel_io_submit(SIZE_MAX, 0, 0).value == 0) {
+		kernel_io_wait(-1);
+	}
+}
+
+void __std_wait(int (*done)(void *), void *arg)
+{
+	while (!done(arg)) {
+		kernel_io_wait(-1);
+	}
+}
+
+struct __std_wait_tag_args {
+	uint8_t tag;
+	struct kernel_ipc_packet *completion;
+};
+
+static int __std_wait_tag_done(void *arg)
+{
+	struct __std_wait_tag_args *a = arg;
+	return dux_ipc_poll(a->tag, a->completion) == 0;
+}
+
+void __std_wait_tag(uint8_t tag, struct kernel_ipc_packet *completion)
+{
+	struct __std_wait_tag_args args = {
+		.tag = tag,
+		.completion = completion,
+	};
+	__std_wait(__std_wait_tag_done, &args);
+}
+
+void __std_request(struct kernel_ipc_packet *packet)
+{
+	int tag = dux_ipc_submit(packet);
+	while (tag < 0) {
+		__std_flush();
+		tag = dux_ipc_submit(packet);
+	}
+	__std_wait_tag(tag, packet);
+}
+
+size_t __std_transfer(pid_t address, kernel_uuid_t uuid, const char *name,
+		      uint64_t offset, uint8_t opcode, void *data,
+		      size_t length)
+{
+	struct kernel_ipc_packet pkt = {
+		.uuid = uuid,
+		.data.raw = data,
+		.name = (void *)name,
+		.offset = offset,
+		.length = length,
+		.address = address,
+		.flags = 0,
+		.name_len = name != NULL ? strlen(name) : 0,
+		.opcode = opcode,
+	};
+
+	__std_request(&pkt);
+	return pkt.length;
+}
+
+size_t __std_transfer_buffer(pid_t address, kernel_uuid_t uuid,
+			     const char *name, uint64_t offset, uint8_t opcode,
+			     void *ptr, size_t length)
+{
+	struct {
+		char *ptr;
+		void *data;
+		size_t length;
+		int direct;
+		int tag;
+	} chunks[__STD_IPC_IN_FLIGHT];
+
+	// Chunks in flight are in the range [tail, head)
+	size_t head = 0, tail = 0;
+	char *p = ptr;
+	size_t left = length;
+	size_t total = 0;
+	int done = 0;
+
+	struct kernel_ipc_packet pkt = {
+		.uuid = uuid,
+		.name = (void *)name,
+		.address = address,
+		.flags = 0,
+		.name_len = name != NULL ? strlen(name) : 0,
+		.opcode = opcode,
+	};
+
+	while (tail != head || (left > 0 && !done)) {
+		// Keep as many requests in flight as possible.
+		while (left > 0 && !done && head - tail < __STD_IPC_IN_FLIGHT) {
+			size_t i = head % __STD_IPC_IN_FLIGHT;
+			int direct;
+			size_t n = __std_next_chunk(p, left, &direct);
+			void *data = direct ? (void *)p :
+			    (char *)universal_buffer + i * __STD_IPC_CHUNK_SIZE;
+			if (!direct && opcode == KERNEL_IPC_OP_WRITE) {
+				memcpy(data, p, n);
+			}
+
+			pkt.data.raw = data;
+			pkt.offset = offset + (p - (char *)ptr);
+			pkt.length = n;
+			int tag = dux_ipc_submit(&pkt);
+			if (tag < 0) {
+				if (head == tail) {
+					__std_flush();
+					continue;
+				}
+				break;
+			}
+
+			chunks[i].ptr = p;
+			chunks[i].data = data;
+			chunks[i].length = n;
+			chunks[i].direct = direct;
+			chunks[i].tag = tag;
+			p += n;
+			left -= n;
+			head++;
+		}
+
+		// Complete the oldest request.
+		size_t i = tail % __STD_IPC_IN_FLIGHT;
+		struct kernel_ipc_packet cce;
+		__std_wait_tag(chunks[i].tag, &cce);
+		tail++;
+
+		// Anything after a short transfer is discarded.
+		if (done) {
+			continue;
+		}
+		size_t len =
+		    cce.length < chunks[i].length ? cce.length : chunks[i].length;
+		if (!chunks[i].direct && opcode == KERNEL_IPC_OP_READ) {
+			memcpy(chunks[i].ptr, chunks[i].data, len);
+		}
+		total += len;
+		done = len < chunks[i].length;
+	}
+
+	return total;
+}
+
+size_t __std_next_chunk(const void *ptr, size_t length, int *direct)
+{
+	size_t head = -(size_t) ptr & (PAGE_SIZE - 1);
+	size_t n = length < __STD_IPC_CHUNK_SIZE ? length : __STD_IPC_CHUNK_SIZE;
+
+	if (head == 0 && n >= PAGE_SIZE) {
+		*direct = 1;
+		return n & ~(PAGE_SIZE - 1);
+	}
+
+	*direct = 0;
+	// Stop at the page boundary if whole pages follow it.
+	if (head < n && length - head >= PAGE_SIZE) {
+		n = head;
+	}
+	return n;
 }
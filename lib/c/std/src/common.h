@@ -2,10 +2,80 @@
 #define __POSIX_COMMON_H
 
 #include "stddef.h"
+#include "kernel.h"
 
 extern void *universal_buffer;
 extern size_t universal_buffer_size;
 
+// The maximum amount of requests __std_transfer_buffer keeps in flight.
+#define __STD_IPC_IN_FLIGHT (4)
+
+// The maximum size of a single request. The universal buffer is split in
+// equally sized parts for each request in flight.
+#define __STD_IPC_CHUNK_SIZE (4 * PAGE_SIZE)
+
 void __posix_init(void);
 
+/**
+ * The amount of notifications received by this task so far.
+ */
+extern volatile size_t __std_notification_count;
+
+/**
+ * Block until `done` returns a non-zero value.
+ *
+ * The condition is checked again each time the task is woken up, either by
+ * received packets or by notifications. This is the only place where the
+ * libc should wait for anything.
+ */
+void __std_wait(int (*done)(void *), void *arg);
+
+/**
+ * Wait for the completion of the request with the given tag and copy it to
+ * `completion`. The tag is released afterwards.
+ */
+void __std_wait_tag(uint8_t tag, struct kernel_ipc_packet *completion);
+
+/**
+ * Submit a single request and wait for its completion, which is written back
+ * to `packet`.
+ */
+void __std_request(struct kernel_ipc_packet *packet);
+
+/**
+ * Send a single request and wait for the response with the same opcode. The
+ * data and name **must** be page-aligned as their pages are shared with the
+ * receiver.
+ *
+ * Returns the length field of the response.
+ */
+size_t __std_transfer(pid_t address, kernel_uuid_t uuid, const char *name,
+		      uint64_t offset, uint8_t opcode, void *data,
+		      size_t length);
+
+/**
+ * Transfer a buffer of any size and alignment, keeping multiple requests in
+ * flight at once. Whole pages are shared with the receiver directly, see
+ * __std_next_chunk.
+ *
+ * The transfer stops at the first short response. Returns the amount of
+ * bytes transferred.
+ */
+size_t __std_transfer_buffer(pid_t address, kernel_uuid_t uuid,
+			     const char *name, uint64_t offset, uint8_t opcode,
+			     void *ptr, size_t length);
+
+/**
+ * Determine how the next part of a user buffer should be transferred.
+ *
+ * Whole pages are shared with the receiver directly, in which case direct is
+ * set to 1. Anything else has to be bounced through universal_buffer, in
+ * which case direct is set to 0. Unaligned heads are split off so that the
+ * following part can be sent directly.
+ *
+ * Returns the amount of bytes to transfer, which is at most
+ * __STD_IPC_CHUNK_SIZE.
+ */
+size_t __std_next_chunk(const void *ptr, size_t length, int *direct);
+
 #endif
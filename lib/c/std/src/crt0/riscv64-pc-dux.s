@@ -1,6 +1,7 @@
 ## crt0 used when linking against this library only.
 
 .globl _start
+.globl __std_notification_entry
 
 ## Definition of FILE in stdio.h at the time of writing:
 # typedef struct {
@@ -8,7 +9,16 @@
 # 	uint64_t _position;
 #	pid_t _address;
 #	const char *_path;
+#	char *_buffer;
+#	size_t _buffer_size;
+#	size_t _buffer_index;
+#	size_t _buffer_length;
+#	uint8_t _buffer_mode;
+#	uint8_t _flags;
 # } FILE;
+#
+# Only the first four fields are set here. The buffer fields are left zeroed
+# and are initialized lazily by stdio.
 
 .struct	0
 
@@ -17,13 +27,15 @@
 .equ	FILE_POSITION_SIZE, 8
 .equ	FILE_ADDRESS_SIZE, 8
 .equ	FILE_PATH_SIZE, 8
+.equ	FILE_BUFFER_SIZE, 8 * 4 + 8
 
 .equ	FILE_UUID, 0
 .equ	FILE_POSITION, (FILE_UUID + FILE_UUID_SIZE)
 .equ	FILE_ADDRESS, (FILE_POSITION + FILE_POSITION_SIZE)
 .equ	FILE_PATH, (FILE_ADDRESS + FILE_ADDRESS_SIZE)
+.equ	FILE_BUFFER, (FILE_PATH + FILE_PATH_SIZE)
 
-.equ	SIZEOF_FILE, (FILE_PATH + FILE_PATH_SIZE)
+.equ	SIZEOF_FILE, (FILE_BUFFER + FILE_BUFFER_SIZE)
 
 # The actual address of the files list that will be stored in __files_list
 .equ	__FILES_LIST, 0x87650000
@@ -179,8 +191,58 @@ _start:
 	mv		a1, s4
 	call	main
 
+	## Write out any buffered data
+	li		a0, 0
+	call	fflush
+
 	## Exit (TODO)
 0:
 	wfi
 	j		0b
     .cfi_endproc
+
+
+## Entry point for notifications sent by the kernel.
+#
+# a0: type
+# a1: value
+# a7: address
+#
+# The original a[0-2] are stored on the stack by the kernel. All other
+# registers a C function may clobber are saved here.
+.equ	GP_REGBYTES, 8
+.equ	NOTIFY_RETURN, 9
+__std_notification_entry:
+	addi	sp, sp, -16 * GP_REGBYTES
+	sd		t0, 0 * GP_REGBYTES (sp)
+	sd		t1, 1 * GP_REGBYTES (sp)
+	sd		t2, 2 * GP_REGBYTES (sp)
+	sd		t3, 3 * GP_REGBYTES (sp)
+	sd		t4, 4 * GP_REGBYTES (sp)
+	sd		t5, 5 * GP_REGBYTES (sp)
+	sd		t6, 6 * GP_REGBYTES (sp)
+	sd		a3, 7 * GP_REGBYTES (sp)
+	sd		a4, 8 * GP_REGBYTES (sp)
+	sd		a5, 9 * GP_REGBYTES (sp)
+	sd		a6, 10 * GP_REGBYTES (sp)
+	sd		a7, 11 * GP_REGBYTES (sp)
+	sd		ra, 12 * GP_REGBYTES (sp)
+	mv		a2, a7
+	call	__std_notification
+	ld		t0, 0 * GP_REGBYTES (sp)
+	ld		t1, 1 * GP_REGBYTES (sp)
+	ld		t2, 2 * GP_REGBYTES (sp)
+	ld		t3, 3 * GP_REGBYTES (sp)
+	ld		t4, 4 * GP_REGBYTES (sp)
+	ld		t5, 5 * GP_REGBYTES (sp)
+	ld		t6, 6 * GP_REGBYTES (sp)
+	ld		a3, 7 * GP_REGBYTES (sp)
+	ld		a4, 8 * GP_REGBYTES (sp)
+	ld		a5, 9 * GP_REGBYTES (sp)
+	ld		a6, 10 * GP_REGBYTES (sp)
+	ld		a7, 11 * GP_REGBYTES (sp)
+	ld		ra, 12 * GP_REGBYTES (sp)
+	addi	sp, sp, 16 * GP_REGBYTES
+	li		a7, NOTIFY_RETURN
+	li		a0, -1
+	ecall
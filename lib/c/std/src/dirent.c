@@ -5,131 +5,338 @@
 #include <errno.h>
 #include <kernel.h>
 #include <string.h>
+#include <sys/mman.h>
+
+// The maximum amount of directory streams that can be open at once.
+#define __STD_DIR_MAX (32)
+
+// The amount of pages reserved for a list returned by scandir.
+#define __STD_SCANDIR_PAGES (256)
+
+static DIR __std_dirs[__STD_DIR_MAX];
+static uint32_t __std_dirs_used;
+
+/**
+ * Header stored right in front of the list returned by scandir.
+ */
+struct __std_scandir_header {
+	void *base;
+	size_t committed;
+};
 
 int alphasort(const struct dirent **lhs, const struct dirent **rhs)
 {
 	return strncmp((*lhs)->d_name, (*rhs)->d_name, sizeof((*lhs)->d_name));
 }
 
+/**
+ * Unmap the current batch of entries, if any.
+ */
+static void __std_dir_release_batch(DIR * dir)
+{
+	if (dir->_list.data != NULL) {
+		kernel_mem_dealloc(dir->_list.data, dir->_list.data_len);
+		dux_add_free_range(dir->_list.data, dir->_list.data_len);
+	}
+	dir->_list.data = NULL;
+	dir->_list.data_len = 0;
+}
+
+/**
+ * Fetch the batch of entries starting at the given index.
+ */
+static void __std_dir_fetch(DIR * dir, uint64_t cursor)
+{
+	__std_dir_release_batch(dir);
+
+	// The path page of the slot can be shared as is.
+	const char *path = __files_list[dir->_fd]._path;
+	struct kernel_ipc_packet pkt = {
+		.flags = 0,
+		.address = dir->_address,
+		.uuid = dir->uuid,
+		.offset = cursor,
+		// The kernel only maps the name read-only.
+		.name = (void *)path,
+		.name_len = path != NULL ? strlen(path) : 0,
+		.data.raw = NULL,
+		.length = 0,
+		.opcode = KERNEL_IPC_OP_LIST,
+	};
+	__std_request(&pkt);
+
+	if (pkt.data.raw != NULL && pkt.length > 0) {
+		dir->_list.data = pkt.data.raw;
+		dir->_list.data_len = (pkt.length + PAGE_SIZE - 1) / PAGE_SIZE;
+	}
+	dir->_base = cursor;
+	dir->_next = pkt.offset;
+}
+
 int closedir(DIR * dir)
 {
-	size_t page_count = (dir->_list.data_len + PAGE_SIZE - 1) / PAGE_SIZE;
-	kernel_mem_dealloc(dir->_list.data, page_count);
-	dux_add_free_range(dir->_list.data, page_count);
+	__std_dir_release_batch(dir);
+	if (__std_is_open_file(dir->_fd)) {
+		__std_push_free_file(dir->_fd);
+	}
+	__std_dirs_used &= ~(1 << (dir - __std_dirs));
 	return (errno = 0);
 }
 
 int dirfd(DIR * dir)
 {
-	if (dir->_fd == -1) {
-		// TODO
-	}
 	return dir->_fd;
 }
 
 DIR *fdopendir(int fd)
 {
-	// FIXME SCHTOOOOOOOOOPID
-	// We need to implement an allocator at some point.
-	static DIR dir = { };
-	dir._fd = fd;
-	return &dir;
+	if (!__std_is_open_file(fd)) {
+		errno = EBADF;
+		return NULL;
+	}
+	if (__std_dirs_used == UINT32_MAX) {
+		errno = EMFILE;
+		return NULL;
+	}
+	int i = __builtin_ctz(~__std_dirs_used);
+	__std_dirs_used |= 1 << i;
+
+	DIR *dir = &__std_dirs[i];
+	dir->uuid = __files_list[fd]._uuid;
+	dir->_address = __files_list[fd]._address;
+	dir->_list.data = NULL;
+	dir->_list.data_len = 0;
+	dir->_index = 0;
+	// The first batch is fetched on the first read.
+	dir->_base = 0;
+	dir->_next = 0;
+	dir->_fd = fd;
+	return dir;
 }
 
 DIR *opendir(const char *path)
 {
-	char *out = universal_buffer;
-
-	// Fill out the path
-	char *ptr = out;
-	char *end = out + universal_buffer_size;
-	const char *c = path;
-	while (ptr != end && *c != '\0') {
-		*ptr++ = *c++;
+	FILE *f = __std_pop_free_file();
+	if (f == NULL) {
+		return NULL;
 	}
-
-	// Get a request entry
-	struct kernel_ipc_packet *pkt = NULL;
-	uint16_t slot = dux_reserve_transmit_entry(&pkt);
-	while (slot == -1) {
-		kernel_io_wait(-1);
-		slot = dux_reserve_transmit_entry(&pkt);
+	if (__std_set_file_path(f, path) < 0) {
+		__std_push_free_file(fileno(f));
+		return NULL;
 	}
+	f->_address = __files_list[3]._address;
+	f->_uuid = kernel_uuid(0, 0);
 
-	// Fill out the request entry
-	pkt->flags = 0;
-	pkt->address = __files_list[3]._address;
-	pkt->uuid = kernel_uuid(0, 0);
-	pkt->offset = 0;
-	pkt->name = NULL;
-	pkt->name_len = 0;
-	pkt->data.raw = universal_buffer;
-	pkt->length = ptr - out;
-	pkt->opcode = KERNEL_IPC_OP_LIST;
-
-	// Submit the entry
-	dux_submit_transmit_entry(slot);
-
-	void *data;
-	size_t data_len;
+	DIR *dir = fdopendir(fileno(f));
+	if (dir == NULL) {
+		__std_push_free_file(fileno(f));
+	}
+	return dir;
+}
 
+int readdir_view(DIR * dir, struct dux_ipc_list_entry *entry)
+{
 	for (;;) {
-		const struct kernel_ipc_packet *cce;
-		slot = dux_get_received_entry(&cce);
-		if (slot == -1) {
-			// Do nothing
-		} else if (cce->opcode == KERNEL_IPC_OP_LIST) {
-			data = cce->data.raw;
-			data_len = cce->length;
-			dux_pop_received_entry(slot);
-			break;
-		} else {
-			dux_defer_received_entry(slot);
+		if (dir->_list.data != NULL
+		    && dux_ipc_list_get(&dir->_list, dir->_index - dir->_base,
+					entry) == 0) {
+			dir->_index += 1;
+			return 0;
 		}
-		kernel_io_wait(-1);
+		if (dir->_next == DUX_IPC_LIST_END) {
+			return -1;
+		}
+		// Batches are contiguous, so the entry is in a following one.
+		__std_dir_fetch(dir, dir->_next);
 	}
-
-	static DIR dir = {
-		._index = 0,
-	};
-	dir._list.data = data;
-	dir._list.data_len = data_len;
-	dir._index = 0;
-	return &dir;
 }
 
 struct dirent *readdir(DIR * dir)
 {
 	struct dux_ipc_list_entry e;
-	if (dux_ipc_list_get(&dir->_list, dir->_index, &e) < 0) {
+	if (readdir_view(dir, &e) < 0) {
 		return NULL;
 	}
-	dir->_index += 1;
 
-	static struct dirent ent = { };	// FIXME
-	ent.d_ino = kernel_uuid(0, 0);
-	size_t max_len = sizeof(ent.d_name) - 1;	// Account of mandatory null terminator
+	struct dirent *ent = &dir->_ent;
+	ent->d_ino = e.uuid;
+	size_t max_len = sizeof(ent->d_name) - 1;	// Account of mandatory null terminator
 	max_len = max_len < e.name_len ? max_len : e.name_len;
-	memcpy(ent.d_name, e.name, max_len);
-	ent.d_name[max_len] = '\0';
+	memcpy(ent->d_name, e.name, max_len);
+	ent->d_name[max_len] = '\0';
 
-	return &ent;
+	return ent;
 }
 
 void rewinddir(DIR * dir)
 {
-	dir->_index = 0;
+	seekdir(dir, 0);
 }
 
-int scandir(const char *, struct dirent **,
-	    int (*)(const struct dirent *),
-	    int (*)(const struct dirent **, const struct dirent **))
+/**
+ * Make sure the first `size` bytes of a scandir list are backed by memory.
+ */
+static int __std_scandir_commit(char *base, size_t * committed, size_t size)
 {
-	return (errno = ENOSYS);
+	size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (pages <= *committed) {
+		return 0;
+	}
+	if (pages > __STD_SCANDIR_PAGES) {
+		return -1;
+	}
+	kernel_return_t kret =
+	    kernel_mem_alloc(base + *committed * PAGE_SIZE, pages - *committed,
+			     PROT_READ | PROT_WRITE);
+	if (kret.status != 0) {
+		return -1;
+	}
+	*committed = pages;
+	return 0;
+}
+
+/**
+ * Sift down the element at i within the first n elements of the heap.
+ */
+static void __std_scandir_sift(const struct dirent **l, size_t i, size_t n,
+			       int (*compar)(const struct dirent **,
+					     const struct dirent **))
+{
+	for (;;) {
+		size_t c = i * 2 + 1;
+		if (c >= n) {
+			return;
+		}
+		if (c + 1 < n && compar(&l[c], &l[c + 1]) < 0) {
+			c++;
+		}
+		if (compar(&l[i], &l[c]) >= 0) {
+			return;
+		}
+		const struct dirent *t = l[i];
+		l[i] = l[c];
+		l[c] = t;
+		i = c;
+	}
+}
+
+/**
+ * Heapsort the list, as it needs no extra memory.
+ */
+static void __std_scandir_sort(struct dirent **list, size_t count,
+			       int (*compar)(const struct dirent **,
+					     const struct dirent **))
+{
+	const struct dirent **l = (const struct dirent **)list;
+	for (size_t i = count / 2; i-- > 0;) {
+		__std_scandir_sift(l, i, count, compar);
+	}
+	for (size_t n = count; n-- > 1;) {
+		const struct dirent *t = l[0];
+		l[0] = l[n];
+		l[n] = t;
+		__std_scandir_sift(l, 0, n, compar);
+	}
+}
+
+int scandir(const char *path, struct dirent ***namelist,
+	    int (*filter)(const struct dirent *),
+	    int (*compar)(const struct dirent **, const struct dirent **))
+{
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return -1;
+	}
+
+	struct dux_reserve_pages dret =
+	    dux_reserve_pages(NULL, __STD_SCANDIR_PAGES);
+	if (dret.status != 0) {
+		closedir(dir);
+		errno = ENOMEM;
+		return -1;
+	}
+	char *base = dret.address;
+	size_t committed = 0;
+
+	// Entries are packed and only as large as their name requires.
+	size_t offset = 0;
+	size_t count = 0;
+	struct dux_ipc_list_entry e;
+	while (readdir_view(dir, &e) == 0) {
+		size_t len = e.name_len < NAME_MAX - 1 ? e.name_len : NAME_MAX - 1;
+		size_t size = offsetof(struct dirent, d_name) + len + 1;
+		if (__std_scandir_commit(base, &committed, offset + size) < 0) {
+			goto fail;
+		}
+		struct dirent *ent = (struct dirent *)(base + offset);
+		ent->d_ino = e.uuid;
+		memcpy(ent->d_name, e.name, len);
+		ent->d_name[len] = '\0';
+		if (filter == NULL || filter(ent)) {
+			// The list is rebuilt from the names later, so they must
+			// agree on the size.
+			size = offsetof(struct dirent, d_name)
+			    + strlen(ent->d_name) + 1;
+			offset += (size + 7) & ~7;
+			count++;
+		}
+	}
+	closedir(dir);
+	dir = NULL;
+
+	// Put the list itself after the entries.
+	size_t list_offset = offset + sizeof(struct __std_scandir_header);
+	size_t end = list_offset + count * sizeof(struct dirent *);
+	if (__std_scandir_commit(base, &committed, end) < 0) {
+		goto fail;
+	}
+	struct __std_scandir_header *hdr =
+	    (struct __std_scandir_header *)(base + offset);
+	hdr->base = base;
+	hdr->committed = committed;
+	struct dirent **list = (struct dirent **)(base + list_offset);
+	for (size_t i = 0, o = 0; i < count; i++) {
+		list[i] = (struct dirent *)(base + o);
+		size_t size = offsetof(struct dirent, d_name)
+		    + strlen(list[i]->d_name) + 1;
+		o += (size + 7) & ~7;
+	}
+
+	if (compar != NULL) {
+		__std_scandir_sort(list, count, compar);
+	}
+	*namelist = list;
+	return count;
+
+ fail:
+	if (dir != NULL) {
+		closedir(dir);
+	}
+	if (committed > 0) {
+		kernel_mem_dealloc(base, committed);
+	}
+	dux_unreserve_pages(base, __STD_SCANDIR_PAGES);
+	errno = ENOMEM;
+	return -1;
+}
+
+void scandir_free(struct dirent **namelist)
+{
+	struct __std_scandir_header *hdr =
+	    (struct __std_scandir_header *)namelist - 1;
+	void *base = hdr->base;
+	kernel_mem_dealloc(base, hdr->committed);
+	dux_unreserve_pages(base, __STD_SCANDIR_PAGES);
 }
 
 void seekdir(DIR * dir, long loc)
 {
+	// Batches can only be walked forward.
+	if ((size_t)loc < dir->_base) {
+		__std_dir_release_batch(dir);
+		dir->_base = loc;
+		dir->_next = loc;
+	}
 	dir->_index = loc;
 }
 
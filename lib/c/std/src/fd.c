@@ -1,6 +1,184 @@
 /* List of "opened" files */
 
+#include <dux.h>
+#include <errno.h>
+#include <kernel.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "fd.h"
 
 size_t __files_count;
 FILE *__files_list;
+
+// The amount of pages mapped for the files list.
+static size_t __files_pages;
+static int __files_initialized;
+
+// The index of the first free slot or SIZE_MAX if there is none. Free slots
+// are linked through their _position field.
+static size_t __files_free = SIZE_MAX;
+
+/**
+ * Determine the size of the list set up by crt0.
+ */
+static void __std_files_init(void)
+{
+	if (__files_initialized) {
+		return;
+	}
+	__files_initialized = 1;
+	if (__files_list == NULL) {
+		// crt0 didn't map anything as no files were passed.
+		__files_list = (FILE *) __STD_FILES_LIST;
+		__files_count = 0;
+	} else {
+		__files_pages =
+		    (__files_count * sizeof(FILE) + PAGE_SIZE - 1) / PAGE_SIZE;
+		__files_pages = __files_pages > 0 ? __files_pages : 1;
+		// stdout, stderr and cwd may be aliased without being counted.
+		__files_count = __files_count < 4 ? 4 : __files_count;
+	}
+}
+
+/**
+ * Map another page at the end of the files list.
+ */
+static int __std_files_grow(void)
+{
+	void *end = (char *)__files_list + __files_pages * PAGE_SIZE;
+	struct dux_reserve_pages dret = dux_reserve_pages(end, 1);
+	if (dret.status != 0) {
+		return -1;
+	}
+	kernel_return_t kret =
+	    kernel_mem_alloc(end, 1, PROT_READ | PROT_WRITE);
+	if (kret.status != 0) {
+		dux_unreserve_pages(end, 1);
+		return -1;
+	}
+	__files_pages++;
+	return 0;
+}
+
+FILE *__std_pop_free_file(void)
+{
+	__std_files_init();
+
+	FILE *f;
+	if (__files_free != SIZE_MAX) {
+		f = &__files_list[__files_free];
+		__files_free = f->_position;
+	} else {
+		size_t capacity = __files_pages * PAGE_SIZE / sizeof(FILE);
+		if (__files_count == capacity && __std_files_grow() < 0) {
+			errno = EMFILE;
+			return NULL;
+		}
+		f = &__files_list[__files_count++];
+		// Fresh pages are zeroed, so there is no path storage yet.
+		f->_path = NULL;
+	}
+
+	const char *path = f->_path;
+	memset(f, 0, sizeof(*f));
+	f->_path = path;
+	return f;
+}
+
+void __std_push_free_file(int fd)
+{
+	__std_files_init();
+
+	FILE *f = &__files_list[fd];
+	// Keep the path storage around for the next user of the slot.
+	const char *path = f->_path;
+	memset(f, 0, sizeof(*f));
+	f->_path = path;
+	f->_flags = __STD_FILE_FREE;
+	f->_position = __files_free;
+	__files_free = fd;
+}
+
+int __std_is_open_file(int fd)
+{
+	__std_files_init();
+	return fd >= 0 && (size_t)fd < __files_count
+	    && !(__files_list[fd]._flags & __STD_FILE_FREE);
+}
+
+int __std_set_file_path(FILE * f, const char *path)
+{
+	size_t len = 0;
+	while (path[len] != '\0') {
+		if (++len >= __STD_PATH_MAX) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+	}
+
+	if (f->_path == NULL) {
+		struct dux_reserve_pages dret = dux_reserve_pages(NULL, 1);
+		if (dret.status != 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+		kernel_return_t kret =
+		    kernel_mem_alloc(dret.address, 1, PROT_READ | PROT_WRITE);
+		if (kret.status != 0) {
+			dux_unreserve_pages(dret.address, 1);
+			errno = ENOMEM;
+			return -1;
+		}
+		f->_path = dret.address;
+	}
+
+	char *p = (char *)f->_path;
+	for (size_t i = 0; i < len; i++) {
+		p[i] = path[i];
+	}
+	p[len] = '\0';
+	return 0;
+}
+
+#ifdef __STD_TEST
+
+/**
+ * Open and close files repeatedly and check that slots are reused and that
+ * each slot keeps its own path.
+ */
+void __std_test_fd_reuse(void)
+{
+	FILE *a = fopen("a", "r");
+	FILE *b = fopen("b", "r");
+	if (a == NULL || b == NULL) {
+		puts("fopen failed");
+		return;
+	}
+	if (a->_path[0] != 'a' || b->_path[0] != 'b') {
+		puts("paths are not stored per file");
+	}
+
+	size_t count = __files_count;
+	for (int i = 0; i < 1000; i++) {
+		FILE *f = fopen("c", "r");
+		if (f == NULL || fclose(f) != 0) {
+			printf("iteration %d failed\n", i);
+			return;
+		}
+	}
+	if (__files_count != count) {
+		printf("slots leaked: %zu != %zu\n", __files_count, count);
+	}
+
+	fclose(b);
+	if (fopen("d", "r") != b) {
+		puts("freed slot was not reused");
+	}
+	if (fclose(b) != 0 || fclose(b) != EOF) {
+		puts("double fclose was not rejected");
+	}
+	fclose(a);
+}
+
+#endif
@@ -4,16 +4,49 @@
 #include <stdint.h>
 #include <stdio.h>
 
-// FIXME some kind of free file descriptor stack is necessary
+// Flags stored in FILE::_flags
+#define __STD_FILE_INITIALIZED (0x1)	// The buffer mode has been determined
+#define __STD_FILE_OWN_BUFFER  (0x2)	// The buffer was allocated by us
+#define __STD_FILE_READING     (0x4)	// The buffer holds read-ahead data
+#define __STD_FILE_WRITING     (0x8)	// The buffer holds pending writes
+#define __STD_FILE_EOF         (0x10)
+#define __STD_FILE_ERROR       (0x20)
+#define __STD_FILE_SHORT       (0x40)	// The last read returned less than requested
+#define __STD_FILE_FREE        (0x80)	// The slot is on the free list
 
-static FILE *__std_pop_free_file(void) {
-	FILE *f = &__files_list[__files_count];
-	__files_count += 1;
-	return f;
-}
+// The address of the files list. Must be kept in sync with __FILES_LIST in crt0.
+#define __STD_FILES_LIST (0x87650000)
 
-static void __std_push_free_file(int fd) {
-	/* TODO */
-}
+// The maximum length of a path including the null terminator. Each slot has
+// its own page to store the path in so it can be shared with IPC directly.
+#define __STD_PATH_MAX (PAGE_SIZE)
+
+/**
+ * Take a free slot from the files list, growing it if necessary. The slot
+ * is cleared except for the path storage.
+ *
+ * Returns NULL and sets errno if no slot can be allocated.
+ */
+FILE *__std_pop_free_file(void);
+
+/**
+ * Return the slot of the given file descriptor to the free list.
+ *
+ * The buffer must already have been released.
+ */
+void __std_push_free_file(int fd);
+
+/**
+ * Check whether the given file descriptor refers to an open slot.
+ */
+int __std_is_open_file(int fd);
+
+/**
+ * Copy the given path to the per-slot path storage of the file, allocating
+ * the storage if necessary.
+ *
+ * Returns 0 on success, otherwise sets errno and returns -1.
+ */
+int __std_set_file_path(FILE * f, const char *path);
 
 #endif
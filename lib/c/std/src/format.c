@@ -3,143 +3,244 @@
 #include "format.h"
 
 /**
- * Inserts the given null-terminated string or inserts '(null)' if value is NULL.
+ * All two-digit decimal numbers, used to emit two digits per division.
+ */
+static const char format_digit_pairs[200] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// Enough for a 64-bit integer in octal.
+#define FORMAT_DIGITS_MAX (24)
+
+/**
+ * Make room in the sink. Returns 0 if there is space available.
  *
- * Returns NULL if the buffer isn't large enough.
+ * If the sink can't be flushed any further output is discarded.
  */
-static inline char *format_str(const char *value, char *str, size_t size,
-			       size_t max)
+static inline int format_reserve(struct std_format_sink *sink)
 {
-	value = value ? value : "(null)";
+	if (sink->buffer != sink->end) {
+		return 0;
+	}
+	if (sink->flush == NULL || sink->flush(sink) < 0) {
+		sink->flush = NULL;
+		return -1;
+	}
+	return sink->buffer != sink->end ? 0 : -1;
+}
 
-	while (*value != '\0') {
-		if (max-- == 0) {
-			return str;
+/**
+ * Write a single character to the sink.
+ */
+static inline void format_put(struct std_format_sink *sink, char c)
+{
+	sink->count++;
+	if (format_reserve(sink) == 0) {
+		*sink->buffer++ = c;
+	}
+}
+
+/**
+ * Write a string of the given length to the sink.
+ */
+static void format_write(struct std_format_sink *sink, const char *str,
+			 size_t len)
+{
+	sink->count += len;
+	while (len > 0) {
+		if (format_reserve(sink) < 0) {
+			return;
 		}
-		if (size == 0) {
-			return NULL;
+		size_t space = sink->end - sink->buffer;
+		size_t n = space < len ? space : len;
+		for (size_t i = 0; i < n; i++) {
+			sink->buffer[i] = str[i];
 		}
-		*str++ = *value++;
-		size--;
+		sink->buffer += n;
+		str += n;
+		len -= n;
 	}
-
-	return str;
 }
 
 /**
- * Formats the given unsigned number with the given base and modifiers as a human-readable string.
- *
- * Returns NULL if the buffer isn't large enough.
+ * Write the given character to the sink repeatedly.
  */
-static inline char *format_unsigned_int(uintmax_t value, char *str, size_t size,
-					unsigned char base,
-					unsigned char modifiers)
+static void format_pad(struct std_format_sink *sink, char c, int count)
 {
-	char *end = str + size;
-	if (modifiers & STD_FORMAT_SIGNED) {
-		if (str != end) {
-			*str++ = '+';
-		} else {
-			return NULL;
+	if (count <= 0) {
+		return;
+	}
+	size_t len = count;
+	sink->count += len;
+	while (len > 0) {
+		if (format_reserve(sink) < 0) {
+			return;
 		}
-	} else if (modifiers & STD_FORMAT_SPACE) {
-		if (str != end) {
-			*str++ = ' ';
-		} else {
-			return NULL;
+		size_t space = sink->end - sink->buffer;
+		size_t n = space < len ? space : len;
+		for (size_t i = 0; i < n; i++) {
+			sink->buffer[i] = c;
 		}
+		sink->buffer += n;
+		len -= n;
 	}
-	// Write out in reverse
-	char *start = str;
-	do {
-		if (str == end) {
-			return NULL;
+}
+
+/**
+ * Convert the given number to digits with the given base. The digits are
+ * written backwards starting from the end of the buffer.
+ *
+ * Returns a pointer to the first digit.
+ */
+static inline char *format_digits(uintmax_t value, char *end,
+				  unsigned char base, unsigned char modifiers)
+{
+	char *str = end;
+	switch (base) {
+	case 10:
+		// Divisions are expensive, so emit two digits at a time.
+		while (value >= 100) {
+			unsigned int i = (value % 100) * 2;
+			value /= 100;
+			*--str = format_digit_pairs[i + 1];
+			*--str = format_digit_pairs[i];
 		}
-		unsigned int c = value % base;
-		if (c >= 10) {
-			c += (modifiers & STD_FORMAT_UPPER ? 'A' : 'a') - 10;
+		if (value >= 10) {
+			unsigned int i = value * 2;
+			*--str = format_digit_pairs[i + 1];
+			*--str = format_digit_pairs[i];
 		} else {
-			c += '0';
+			*--str = '0' + value;
 		}
-		value /= base;
-		*str++ = c;
-	} while (value != 0);
-
-	// Reverse chars to put the digits in the correct order
-	end = str - 1;
-	for (; end > start;) {
-		char t = *end;
-		*end-- = *start;
-		*start++ = t;
+		break;
+	case 16:{
+			const char *digits = modifiers & STD_FORMAT_UPPER
+			    ? "0123456789ABCDEF" : "0123456789abcdef";
+			do {
+				*--str = digits[value & 0xf];
+				value >>= 4;
+			} while (value != 0);
+			break;
+		}
+	case 8:
+		do {
+			*--str = '0' + (value & 0x7);
+			value >>= 3;
+		} while (value != 0);
+		break;
 	}
-
 	return str;
 }
 
 /**
- * Formats the given signed number with the given base and modifiers as a human-readable string.
+ * Formats the given number with the given base and modifiers as a human-readable string.
  *
- * Returns NULL if the buffer isn't large enough.
+ * sign is either '\0' or the character to put in front of the number.
  */
-static inline char *format_signed_int(intmax_t value, char *str, size_t size,
-				      unsigned char base,
-				      unsigned char modifiers)
+static void format_int(struct std_format_sink *sink, uintmax_t value,
+		       char sign, unsigned char base,
+		       const struct std_format_type *type)
 {
-	if (value < 0) {
-		if (size > 0) {
-			*str++ = '-';
-			size -= 1;
-			value = -value;
-		} else {
-			return NULL;
+	char buf[FORMAT_DIGITS_MAX];
+	char *end = buf + sizeof(buf);
+	char *digits = end;
+
+	// A precision of zero means zero is printed as nothing at all.
+	if (value != 0 || type->precision != 0) {
+		digits = format_digits(value, end, base, type->modifiers);
+	}
+	int len = end - digits;
+
+	char prefix[2];
+	int prefix_len = 0;
+	if (sign != '\0') {
+		prefix[prefix_len++] = sign;
+	}
+
+	int zeroes = type->precision > len ? type->precision - len : 0;
+	if (type->modifiers & STD_FORMAT_PREFIX_OR_DECIMAL) {
+		if (base == 16 && (value != 0 || type->specifier == STD_FORMAT_POINTER)) {
+			prefix[prefix_len++] = '0';
+			prefix[prefix_len++] =
+			    type->modifiers & STD_FORMAT_UPPER ? 'X' : 'x';
+		} else if (base == 8 && zeroes == 0
+			   && (len == 0 || *digits != '0')) {
+			zeroes = 1;
 		}
-	} else if (modifiers & STD_FORMAT_SIGNED) {
-		// Make sure format_unsigned_int doesn't insert yet another sign
-		modifiers &= ~STD_FORMAT_SIGNED;
-		if (size > 0) {
-			*str++ = '+';
-			size -= 1;
-		} else {
-			return NULL;
+	}
+	// Zero padding is ignored if a precision is given.
+	if ((type->modifiers & (STD_FORMAT_ZEROES | STD_FORMAT_LJUST)) ==
+	    STD_FORMAT_ZEROES && type->precision < 0) {
+		int fill = type->width - prefix_len - len;
+		zeroes = fill > zeroes ? fill : zeroes;
+	}
+
+	int pad = type->width - prefix_len - zeroes - len;
+	if (!(type->modifiers & STD_FORMAT_LJUST)) {
+		format_pad(sink, ' ', pad);
+	}
+	format_write(sink, prefix, prefix_len);
+	format_pad(sink, '0', zeroes);
+	format_write(sink, digits, len);
+	if (type->modifiers & STD_FORMAT_LJUST) {
+		format_pad(sink, ' ', pad);
+	}
+}
+
+/**
+ * Inserts the given string with the given width and precision or inserts
+ * '(null)' if value is NULL.
+ */
+static void format_str(struct std_format_sink *sink, const char *value,
+		       const struct std_format_type *type)
+{
+	value = value ? value : "(null)";
+
+	size_t len = 0;
+	if (type->precision < 0) {
+		while (value[len] != '\0') {
+			len++;
 		}
-	} else if (modifiers & STD_FORMAT_SPACE) {
-		// Make sure format_unsigned_int doesn't insert yet another space
-		modifiers &= ~STD_FORMAT_SPACE;
-		if (size > 0) {
-			*str++ = ' ';
-			size -= 1;
-		} else {
-			return NULL;
+	} else {
+		while (len < (size_t)type->precision && value[len] != '\0') {
+			len++;
 		}
 	}
 
-	return format_unsigned_int((uintmax_t) value, str, size, base,
-				   modifiers);
+	int pad = type->width > (int)len ? type->width - (int)len : 0;
+	if (!(type->modifiers & STD_FORMAT_LJUST)) {
+		format_pad(sink, ' ', pad);
+	}
+	format_write(sink, value, len);
+	if (type->modifiers & STD_FORMAT_LJUST) {
+		format_pad(sink, ' ', pad);
+	}
 }
 
-const char *__std_determine_format(const char *input,
-				   struct std_format_type *type)
+/**
+ * Parses a single conversion specification.
+ *
+ * Returns a pointer to the character after the specification or NULL if it
+ * is invalid.
+ */
+static const char *format_parse(const char *input,
+				struct std_format_type *type, va_list * args)
 {
-
 	// Don't do anything if this isn't an argument
 	if (*input++ != '%') {
 		return NULL;
 	}
 	// Ensure there will be no unitialized values
 	type->width = 0;
-	type->precision = 0;
+	type->precision = -1;
 	type->modifiers = 0;
-	type->size = 0;
-	type->type = STD_FORMAT_TYPE_NONE;
+	type->type = STD_FORMAT_TYPE_INT;
 
-	// Check if we should just print a '%'
-	if (*input == '%') {
-		type->specifier = STD_FORMAT_PERCENT;
-		type->size = 1;
-		return input + 1;
-	}
 	// Check if there are any modifiers to apply
-	for (;;) {
+	for (;; input++) {
 		switch (*input) {
 		case '-':
 			type->modifiers |= STD_FORMAT_LJUST;
@@ -164,23 +265,36 @@ const char *__std_determine_format(const char *input,
 
 	// Check if a width has been specified
 	if (*input == '*') {
+		input++;
 		type->modifiers |= STD_FORMAT_VAR_WIDTH;
+		type->width = va_arg(*args, int);
+		if (type->width < 0) {
+			type->modifiers |= STD_FORMAT_LJUST;
+			type->width = -type->width;
+		}
 	} else {
 		while ('0' <= *input && *input <= '9') {
 			type->width *= 10;
-			type->width += *input - '0';
+			type->width += *input++ - '0';
 		}
 	}
 
 	// Check if a precision has been specified
 	if (*input == '.') {
 		input++;
+		type->precision = 0;
 		if (*input == '*') {
+			input++;
 			type->modifiers |= STD_FORMAT_VAR_PRECISION;
+			type->precision = va_arg(*args, int);
+			// A negative precision is taken as if it were omitted.
+			if (type->precision < 0) {
+				type->precision = -1;
+			}
 		} else {
 			while ('0' <= *input && *input <= '9') {
 				type->precision *= 10;
-				type->precision += *input - '0';
+				type->precision += *input++ - '0';
 			}
 		}
 	}
@@ -213,8 +327,8 @@ const char *__std_determine_format(const char *input,
 		break;
 	case 'L':
 		type->type = STD_FORMAT_TYPE_LONG_DOUBLE;
+		break;
 	default:
-		type->type = STD_FORMAT_TYPE_INT;
 		// Undo so we read the specifier correctly later
 		input--;
 		break;
@@ -261,10 +375,15 @@ const char *__std_determine_format(const char *input,
 		break;
 	case 'p':
 		type->specifier = STD_FORMAT_POINTER;
+		type->type = STD_FORMAT_TYPE_POINTER;
+		type->modifiers |= STD_FORMAT_PREFIX_OR_DECIMAL;
 		break;
 	case 'n':
 		type->specifier = STD_FORMAT_COUNT;
 		break;
+	case '%':
+		type->specifier = STD_FORMAT_PERCENT;
+		break;
 	default:
 		// The specifier is invalid, so return NULL and let the caller handle it.
 		return NULL;
@@ -273,97 +392,204 @@ const char *__std_determine_format(const char *input,
 	return input;
 }
 
-char *__std_format(char *out, size_t size, struct std_format_type *type,
-		   va_list * args)
+/**
+ * Load a signed integer argument of the given type.
+ */
+static inline intmax_t format_load_signed(unsigned char type, va_list * args)
 {
-	intmax_t sval = 0;
-	uintmax_t val = 0;
-
-	int sign = type->specifier == STD_FORMAT_DEC;
+	switch (type) {
+	case STD_FORMAT_TYPE_CHAR:
+		// Arguments are promoted to int, so narrow them back here.
+		return (signed char) va_arg(*args, signed int);
+	case STD_FORMAT_TYPE_SHORT:
+		return (signed short) va_arg(*args, signed int);
+	case STD_FORMAT_TYPE_LONG:
+		return va_arg(*args, signed long);
+	case STD_FORMAT_TYPE_LONG_LONG:
+		return va_arg(*args, signed long long);
+	case STD_FORMAT_TYPE_INTMAX_T:
+		return va_arg(*args, intmax_t);
+	case STD_FORMAT_TYPE_SIZE_T:
+		// There is technically no ssize_t in standard C.
+		return (ptrdiff_t) va_arg(*args, size_t);
+	case STD_FORMAT_TYPE_PTRDIFF_T:
+		return va_arg(*args, ptrdiff_t);
+	case STD_FORMAT_TYPE_INT:
+	default:
+		return va_arg(*args, signed int);
+	}
+}
 
-	// Load based on type
-	switch (type->type) {
-		//case STD_FORMAT_TYPE_CHAR:
-		//case STD_FORMAT_TYPE_SHORT:
+/**
+ * Load an unsigned integer argument of the given type.
+ */
+static inline uintmax_t format_load_unsigned(unsigned char type,
+					     va_list * args)
+{
+	switch (type) {
+	case STD_FORMAT_TYPE_CHAR:
+		// Ditto
+		return (unsigned char) va_arg(*args, unsigned int);
+	case STD_FORMAT_TYPE_SHORT:
+		return (unsigned short) va_arg(*args, unsigned int);
+	case STD_FORMAT_TYPE_LONG:
+		return va_arg(*args, unsigned long);
+	case STD_FORMAT_TYPE_LONG_LONG:
+		return va_arg(*args, unsigned long long);
+	case STD_FORMAT_TYPE_INTMAX_T:
+		return va_arg(*args, uintmax_t);
+	case STD_FORMAT_TYPE_SIZE_T:
+		return va_arg(*args, size_t);
+	case STD_FORMAT_TYPE_PTRDIFF_T:
+		// Ditto
+		return va_arg(*args, ptrdiff_t);
+	case STD_FORMAT_TYPE_POINTER:
+		// FIXME void * may be larger than uintmax_t! see https://stackoverflow.com/a/1572189
+		return (uintptr_t) va_arg(*args, void *);
 	case STD_FORMAT_TYPE_INT:
-		sign ? (sval = va_arg(*args, signed int)) : (val = va_arg(*args, unsigned
-									  int));
+	default:
+		return va_arg(*args, unsigned int);
+	}
+}
+
+/**
+ * Store the amount of characters written so far for '%n'.
+ */
+static inline void format_store_count(unsigned char type, size_t count,
+				      va_list * args)
+{
+	switch (type) {
+	case STD_FORMAT_TYPE_CHAR:
+		*va_arg(*args, signed char *) = count;
+		break;
+	case STD_FORMAT_TYPE_SHORT:
+		*va_arg(*args, short *) = count;
 		break;
 	case STD_FORMAT_TYPE_LONG:
-		sign ? (sval = va_arg(*args, signed long)) : (val =
-							      va_arg(*args,
-								     unsigned
-								     long));
+		*va_arg(*args, long *) = count;
 		break;
 	case STD_FORMAT_TYPE_LONG_LONG:
-		sign ? (sval = va_arg(*args, signed long long)) : (val =
-								   va_arg(*args,
-									  unsigned
-									  long
-									  long));
+		*va_arg(*args, long long *) = count;
 		break;
 	case STD_FORMAT_TYPE_INTMAX_T:
-		sign ? (sval = va_arg(*args, intmax_t)) : (val =
-							   va_arg(*args,
-								  uintmax_t));
+		*va_arg(*args, intmax_t *) = count;
 		break;
 	case STD_FORMAT_TYPE_SIZE_T:
-		// There is technically no ssize_t in standard C.
-		val = va_arg(*args, size_t);
+		*va_arg(*args, size_t *) = count;
 		break;
 	case STD_FORMAT_TYPE_PTRDIFF_T:
-		// Ditto
-		sval = va_arg(*args, ptrdiff_t);
-		break;
-	case STD_FORMAT_TYPE_POINTER:
-		// FIXME void * may be larger than uintmax_t! see https://stackoverflow.com/a/1572189
-		// It may be worth to add a special type that switches between uintmax_t and uintptr_t
-		// depending on largest size.
-		val = (uintmax_t) va_arg(*args, void *);
+		*va_arg(*args, ptrdiff_t *) = count;
 		break;
-	case STD_FORMAT_TYPE_NONE:
+	case STD_FORMAT_TYPE_INT:
 	default:
+		*va_arg(*args, int *) = count;
 		break;
 	}
+}
 
-	// Format based on specifier
+/**
+ * Format a single argument.
+ */
+static void format_arg(struct std_format_sink *sink,
+		       const struct std_format_type *type, va_list * args)
+{
 	switch (type->specifier) {
-	case STD_FORMAT_DEC:
-		return format_signed_int(sval, out, size, 10, type->modifiers);
+	case STD_FORMAT_DEC:{
+			intmax_t sval = format_load_signed(type->type, args);
+			char sign = '\0';
+			if (sval < 0) {
+				sign = '-';
+			} else if (type->modifiers & STD_FORMAT_SIGNED) {
+				sign = '+';
+			} else if (type->modifiers & STD_FORMAT_SPACE) {
+				sign = ' ';
+			}
+			// Negate as unsigned so INTMAX_MIN doesn't overflow.
+			uintmax_t val = sval < 0 ? -(uintmax_t) sval : sval;
+			format_int(sink, val, sign, 10, type);
+			break;
+		}
 	case STD_FORMAT_UDEC:
-		return format_unsigned_int(val, out, size, 10, type->modifiers);
+		format_int(sink, format_load_unsigned(type->type, args), '\0',
+			   10, type);
+		break;
 	case STD_FORMAT_OCTAL:
-		return format_unsigned_int(val, out, size, 8, type->modifiers);
+		format_int(sink, format_load_unsigned(type->type, args), '\0',
+			   8, type);
+		break;
 	case STD_FORMAT_HEX:
-		return format_unsigned_int(val, out, size, 16, type->modifiers);
+	case STD_FORMAT_POINTER:
+		format_int(sink, format_load_unsigned(type->type, args), '\0',
+			   16, type);
+		break;
 	case STD_FORMAT_FLOAT:
-		return format_str("(todo)", out, size, -1);
 	case STD_FORMAT_SCIENCE:
-		return format_str("(todo)", out, size, -1);
 	case STD_FORMAT_FLOAT_OR_SCIENCE:
-		return format_str("(todo)", out, size, -1);
-	case STD_FORMAT_HEX_FLOAT:
-		return format_str("(todo)", out, size, -1);
-	case STD_FORMAT_CHAR:
-		return format_str("(todo)", out, size, -1);
+	case STD_FORMAT_HEX_FLOAT:{
+			// Consume the argument so any following ones are read correctly.
+			if (type->type == STD_FORMAT_TYPE_LONG_DOUBLE) {
+				(void)va_arg(*args, long double);
+			} else {
+				(void)va_arg(*args, double);
+			}
+			struct std_format_type t = *type;
+			t.precision = -1;
+			format_str(sink, "(todo)", &t);
+			break;
+		}
+	case STD_FORMAT_CHAR:{
+			char c = va_arg(*args, int);
+			int pad = type->width - 1;
+			if (!(type->modifiers & STD_FORMAT_LJUST)) {
+				format_pad(sink, ' ', pad);
+			}
+			format_put(sink, c);
+			if (type->modifiers & STD_FORMAT_LJUST) {
+				format_pad(sink, ' ', pad);
+			}
+			break;
+		}
 	case STD_FORMAT_STRING:
-		return format_str(va_arg(*args, const char *), out, size, -1);
-	case STD_FORMAT_POINTER:
-		return ((out = format_str("0x", out, size, -1)) != NULL)
-		    ? format_unsigned_int(val, out, size - 2, 16,
-					  type->modifiers)
-		    : NULL;
+		format_str(sink, va_arg(*args, const char *), type);
+		break;
 	case STD_FORMAT_COUNT:
-		// TODO set the pointer thingie
-		return out;
+		format_store_count(type->type, sink->count, args);
+		break;
 	case STD_FORMAT_PERCENT:
-		if (size > 0) {
-			*out++ = '%';
-			return out;
+		format_put(sink, '%');
+		break;
+	}
+}
+
+size_t __std_format(struct std_format_sink *sink, const char *format,
+		    va_list * args)
+{
+	const char *c = format;
+	size_t start = sink->count;
+
+	while (*c != '\0') {
+		// Copy regular ol' chars in bulk
+		const char *lit = c;
+		while (*c != '\0' && *c != '%') {
+			c++;
+		}
+		if (c != lit) {
+			format_write(sink, lit, c - lit);
+		}
+		if (*c == '\0') {
+			break;
+		}
+
+		struct std_format_type fty;
+		const char *end = format_parse(c, &fty, args);
+		if (end != NULL) {
+			format_arg(sink, &fty, args);
+			c = end;
 		} else {
-			return NULL;
+			// Print invalid arguments normally
+			format_put(sink, *c++);
 		}
-	default:
-		return NULL;
 	}
+
+	return sink->count - start;
 }
@@ -2,6 +2,7 @@
 #define _STD_FORMAT_H
 
 #include <stdarg.h>
+#include <stddef.h>
 
 enum {
 	STD_FORMAT_DEC,
@@ -32,9 +33,10 @@ enum {
 
 enum {
 	STD_FORMAT_TYPE_INT,
-	// char and short are upcasted to int when used in va_list
-	STD_FORMAT_TYPE_CHAR = STD_FORMAT_TYPE_INT,
-	STD_FORMAT_TYPE_SHORT = STD_FORMAT_TYPE_INT,
+	// char and short are upcasted to int when used in va_list but must be
+	// narrowed again when formatted.
+	STD_FORMAT_TYPE_CHAR,
+	STD_FORMAT_TYPE_SHORT,
 	STD_FORMAT_TYPE_LONG,
 	STD_FORMAT_TYPE_LONG_LONG,
 	STD_FORMAT_TYPE_INTMAX_T,
@@ -47,13 +49,11 @@ enum {
 };
 
 struct std_format_type {
-	// The expected amount of buffer space needed.
-	unsigned short size;
 	// The minimum amount of characters to be printed
-	// Limited to 255 for pragmatic reasons
-	unsigned char width;
-	// TODO describe
-	unsigned char precision;
+	int width;
+	// The minimum amount of digits or the maximum amount of characters of a
+	// string. Negative if not specified.
+	int precision;
 	// The type of the argument to format
 	unsigned char specifier;
 	// Any modifiers
@@ -63,22 +63,29 @@ struct std_format_type {
 };
 
 /**
- * Determines how to format a variable according to a format string argument.
+ * The destination of formatted output.
  *
- * This *includes* the preceding '%'.
- *
- * On success, the pointer after the consumed characters is returned.
+ * Characters are written to [buffer, end). When the buffer is full, flush is
+ * called, which must either make room by updating buffer and end or return
+ * a negative value, in which case any further output is discarded.
  */
-const char *__std_determine_format(const char *input,
-				   struct std_format_type *type);
+struct std_format_sink {
+	char *buffer;
+	char *end;
+	int (*flush)(struct std_format_sink *);
+	// The amount of characters that have been (or would have been) written.
+	size_t count;
+};
 
 /**
- * Formats an argument in the format string given to e.g. printf & writes it to a buffer.
- *
- * On success, returns the pointer after the characters that have been written.
+ * Formats the arguments according to the given format string and writes the
+ * result to the sink. The output is streamed, so arguments of any size can
+ * be formatted regardless of the size of the sink buffer.
  *
- * If the buffer is too small, NULL is returned. The output may have been written regardless.
+ * Returns the amount of characters that would have been written if no output
+ * was discarded.
  */
-char *__std_format(char *out, size_t size, struct std_format_type *type, va_list * args);
+size_t __std_format(struct std_format_sink *sink, const char *format,
+		    va_list * args);
 
 #endif
@@ -0,0 +1,123 @@
+#include "pthread.h"
+
+#include "errno.h"
+#include "futex.h"
+
+/**
+ * Release the mutex, wait for a signal and take the mutex again.
+ */
+static int __std_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex,
+			   const struct timespec *abstime)
+{
+	// Any signal sent after the mutex is released changes the sequence, in
+	// which case the kernel won't put us to sleep.
+	uint32_t seq = __atomic_load_n(&cond->_sequence, __ATOMIC_RELAXED);
+
+	// Recursive mutexes must be released fully.
+	unsigned int count = mutex->_count;
+	mutex->_count = 1;
+	int ret = pthread_mutex_unlock(mutex);
+	if (ret != 0) {
+		mutex->_count = count;
+		return ret;
+	}
+
+	ret = __std_futex_wait_until(&cond->_sequence, seq, abstime);
+	if (ret == 0 && abstime != NULL
+	    && __atomic_load_n(&cond->_sequence, __ATOMIC_RELAXED) == seq
+	    && __std_time_now() >= __std_deadline(abstime)) {
+		ret = ETIMEDOUT;
+	}
+
+	pthread_mutex_lock(mutex);
+	mutex->_count = count;
+	return ret;
+}
+
+int pthread_cond_init(pthread_cond_t * restrict cond,
+		      const pthread_condattr_t * restrict cond_attr)
+{
+	cond->_sequence = 0;
+	return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t * cond)
+{
+	return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t * cond)
+{
+	__atomic_fetch_add(&cond->_sequence, 1, __ATOMIC_RELEASE);
+	__std_futex_wake(&cond->_sequence, 1);
+	return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t * cond)
+{
+	__atomic_fetch_add(&cond->_sequence, 1, __ATOMIC_RELEASE);
+	__std_futex_wake(&cond->_sequence, SIZE_MAX);
+	return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t * restrict cond,
+		      pthread_mutex_t * restrict mutex)
+{
+	return __std_cond_wait(cond, mutex, NULL);
+}
+
+int pthread_cond_timedwait(pthread_cond_t * restrict cond,
+			   pthread_mutex_t * restrict mutex,
+			   const struct timespec *restrict abstime)
+{
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+	return __std_cond_wait(cond, mutex, abstime);
+}
+
+int pthread_condattr_init(pthread_condattr_t * attr)
+{
+	attr->_pshared = PTHREAD_PROCESS_PRIVATE;
+	attr->_clock = 0;
+	return 0;
+}
+
+int pthread_condattr_destroy(pthread_condattr_t * attr)
+{
+	return 0;
+}
+
+int pthread_condattr_getpshared(const pthread_condattr_t *
+				restrict attr, int *restrict pshared)
+{
+	*pshared = attr->_pshared;
+	return 0;
+}
+
+int pthread_condattr_setpshared(pthread_condattr_t * attr, int pshared)
+{
+	if (pshared != PTHREAD_PROCESS_PRIVATE
+	    && pshared != PTHREAD_PROCESS_SHARED) {
+		return EINVAL;
+	}
+	attr->_pshared = pshared;
+	return 0;
+}
+
+int pthread_condattr_getclock(const pthread_condattr_t *
+			      restrict attr, clockid_t * restrict clock_id)
+{
+	*clock_id = attr->_clock;
+	return 0;
+}
+
+int pthread_condattr_setclock(pthread_condattr_t * attr, clockid_t clock_id)
+{
+	// There is only one clock: the time CSR.
+	if (clock_id != 0) {
+		return EINVAL;
+	}
+	attr->_clock = clock_id;
+	return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef __STD_PTHREAD_FUTEX_H
+#define __STD_PTHREAD_FUTEX_H
+
+#include <errno.h>
+#include <kernel.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+// The frequency of the time CSR.
+// FIXME get this from the device tree. 10MHz is what QEMU uses.
+#define __STD_TIMEBASE_FREQUENCY (10000000)
+
+// The amount of times a lock is retried before going to sleep.
+#define __STD_SPIN_COUNT (100)
+
+/**
+ * Hint to the CPU that we're busy waiting.
+ */
+static inline void __std_cpu_relax(void)
+{
+	__asm__ __volatile__("nop":::"memory");
+}
+
+/**
+ * Sleep while the value at the address equals `value` or until `time` ticks
+ * have passed. The task may be woken up spuriously, so the condition must
+ * always be checked again.
+ */
+static inline void __std_futex_wait(volatile uint32_t * address,
+				    uint32_t value, uint64_t time)
+{
+	kernel_task_futex(KERNEL_FUTEX_WAIT, address, value, time);
+}
+
+/**
+ * Wake up at most `count` tasks waiting on the address.
+ */
+static inline void __std_futex_wake(volatile uint32_t * address, size_t count)
+{
+	kernel_task_futex(KERNEL_FUTEX_WAKE, address, count, 0);
+}
+
+/**
+ * Read the time CSR.
+ */
+static inline uint64_t __std_time_now(void)
+{
+	uint64_t t;
+	__asm__ __volatile__("rdtime %0":"=r"(t));
+	return t;
+}
+
+/**
+ * Convert an absolute time to ticks of the time CSR. The time is relative to
+ * the start of the time CSR.
+ */
+static inline uint64_t __std_deadline(const struct timespec *abstime)
+{
+	return abstime->tv_sec * __STD_TIMEBASE_FREQUENCY
+	    + abstime->tv_nsec / (1000000000 / __STD_TIMEBASE_FREQUENCY);
+}
+
+/**
+ * Sleep like __std_futex_wait but until the given absolute time.
+ *
+ * Returns ETIMEDOUT if the time has already passed, otherwise 0.
+ */
+static inline int __std_futex_wait_until(volatile uint32_t * address,
+					 uint32_t value,
+					 const struct timespec *abstime)
+{
+	if (abstime == NULL) {
+		__std_futex_wait(address, value, UINT64_MAX);
+		return 0;
+	}
+	uint64_t deadline = __std_deadline(abstime);
+	uint64_t now = __std_time_now();
+	if (deadline <= now) {
+		return ETIMEDOUT;
+	}
+	__std_futex_wait(address, value, deadline - now);
+	return 0;
+}
+
+#endif
@@ -1,37 +1,141 @@
-#include "pthread/mutex.h"
+#include "pthread.h"
 
 #include "errno.h"
+#include "futex.h"
+
+/**
+ * Try to take the lock without waiting.
+ */
+static int __std_mutex_try_acquire(pthread_mutex_t * mutex)
+{
+	uint32_t c = 0;
+	return __atomic_compare_exchange_n(&mutex->_state, &c, 1, 0,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take the lock, spinning for a short while before going to sleep.
+ *
+ * Returns ETIMEDOUT if abstime is not NULL and has passed, otherwise 0.
+ */
+static int __std_mutex_acquire(pthread_mutex_t * mutex,
+			       const struct timespec *abstime)
+{
+	// The lock is usually held only briefly, so avoid a syscall if possible
+	for (int i = 0; i < __STD_SPIN_COUNT; i++) {
+		if (mutex->_state == 0 && __std_mutex_try_acquire(mutex)) {
+			return 0;
+		}
+		__std_cpu_relax();
+	}
+
+	// Mark the lock as contended so the owner knows it has to wake us.
+	while (__atomic_exchange_n(&mutex->_state, 2, __ATOMIC_ACQUIRE) != 0) {
+		if (__std_futex_wait_until(&mutex->_state, 2, abstime) != 0) {
+			return ETIMEDOUT;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Check whether the calling thread owns the mutex, if the type of the mutex
+ * keeps track of it.
+ */
+static int __std_mutex_owned(pthread_mutex_t * mutex)
+{
+	return mutex->_state != 0 && mutex->_owner == pthread_self();
+}
+
+/**
+ * Common part of the lock functions.
+ */
+static int __std_mutex_lock(pthread_mutex_t * mutex,
+			    const struct timespec *abstime, int try)
+{
+	switch (mutex->_type) {
+	case PTHREAD_MUTEX_RECURSIVE:
+		if (__std_mutex_owned(mutex)) {
+			if (mutex->_count == UINT32_MAX) {
+				return EAGAIN;
+			}
+			mutex->_count++;
+			return 0;
+		}
+		break;
+	case PTHREAD_MUTEX_ERRORCHECK:
+		if (__std_mutex_owned(mutex)) {
+			return EDEADLK;
+		}
+		break;
+	}
+
+	if (!__std_mutex_try_acquire(mutex)) {
+		if (try) {
+			return EBUSY;
+		}
+		int ret = __std_mutex_acquire(mutex, abstime);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	mutex->_owner = pthread_self();
+	mutex->_count = 1;
+	return 0;
+}
 
 int pthread_mutex_init(pthread_mutex_t * mutex,
 		       const pthread_mutexattr_t * mutexattr)
 {
-	return ENOSYS;
+	mutex->_state = 0;
+	mutex->_count = 0;
+	mutex->_owner = 0;
+	mutex->_type =
+	    mutexattr != NULL ? mutexattr->_type : PTHREAD_MUTEX_DEFAULT;
+	return 0;
 }
 
 int pthread_mutex_destroy(pthread_mutex_t * mutex)
 {
-	return ENOSYS;
+	return mutex->_state != 0 ? EBUSY : 0;
 }
 
 int pthread_mutex_trylock(pthread_mutex_t * mutex)
 {
-	return ENOSYS;
+	return __std_mutex_lock(mutex, NULL, 1);
 }
 
 int pthread_mutex_lock(pthread_mutex_t * mutex)
 {
-	return ENOSYS;
+	return __std_mutex_lock(mutex, NULL, 0);
 }
 
 int pthread_mutex_timedlock(pthread_mutex_t * restrict mutex,
 			    const struct timespec *restrict abstime)
 {
-	return ENOSYS;
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+	return __std_mutex_lock(mutex, abstime, 0);
 }
 
 int pthread_mutex_unlock(pthread_mutex_t * mutex)
 {
-	return ENOSYS;
+	if (mutex->_type == PTHREAD_MUTEX_RECURSIVE
+	    || mutex->_type == PTHREAD_MUTEX_ERRORCHECK) {
+		if (!__std_mutex_owned(mutex)) {
+			return EPERM;
+		}
+		if (--mutex->_count > 0) {
+			return 0;
+		}
+	}
+
+	mutex->_owner = 0;
+	if (__atomic_exchange_n(&mutex->_state, 0, __ATOMIC_RELEASE) == 2) {
+		__std_futex_wake(&mutex->_state, 1);
+	}
+	return 0;
 }
 
 int pthread_mutex_getprioceiling(const pthread_mutex_t *
@@ -48,50 +152,73 @@ int pthread_mutex_setprioceiling(pthread_mutex_t * restrict mutex,
 
 int pthread_mutex_consistent(pthread_mutex_t * mutex)
 {
-	return ENOSYS;
+	// Robust mutexes are not supported, so no mutex can become inconsistent.
+	return EINVAL;
 }
 
 int pthread_mutexattr_init(pthread_mutexattr_t * attr)
 {
-	return ENOSYS;
+	attr->_type = PTHREAD_MUTEX_DEFAULT;
+	attr->_pshared = PTHREAD_PROCESS_PRIVATE;
+	attr->_protocol = PTHREAD_PRIO_NONE;
+	attr->_robust = PTHREAD_MUTEX_STALLED;
+	return 0;
 }
 
 int pthread_mutexattr_destroy(pthread_mutexattr_t * attr)
 {
-	return ENOSYS;
+	return 0;
 }
 
 int pthread_mutexattr_getpshared(const pthread_mutexattr_t *
 				 restrict attr, int *restrict pshared)
 {
-	return ENOSYS;
+	*pshared = attr->_pshared;
+	return 0;
 }
 
 int pthread_mutexattr_setpshared(pthread_mutexattr_t * attr, int pshared)
 {
-	return ENOSYS;
+	// The kernel identifies waiters by physical address, so shared
+	// mutexes need no special handling.
+	if (pshared != PTHREAD_PROCESS_PRIVATE
+	    && pshared != PTHREAD_PROCESS_SHARED) {
+		return EINVAL;
+	}
+	attr->_pshared = pshared;
+	return 0;
 }
 
 int pthread_mutexattr_gettype(const pthread_mutexattr_t * restrict
 			      attr, int *restrict kind)
 {
-	return ENOSYS;
+	*kind = attr->_type;
+	return 0;
 }
 
 int pthread_mutexattr_settype(pthread_mutexattr_t * attr, int kind)
 {
-	return ENOSYS;
+	if (kind < PTHREAD_MUTEX_NORMAL || kind > PTHREAD_MUTEX_DEFAULT) {
+		return EINVAL;
+	}
+	attr->_type = kind;
+	return 0;
 }
 
 int pthread_mutexattr_getprotocol(const pthread_mutexattr_t *
 				  restrict attr, int *restrict protocol)
 {
-	return ENOSYS;
+	*protocol = attr->_protocol;
+	return 0;
 }
 
 int pthread_mutexattr_setprotocol(pthread_mutexattr_t * attr, int protocol)
 {
-	return ENOSYS;
+	if (protocol != PTHREAD_PRIO_NONE) {
+		return ENOTSUP;
+	}
+	attr->_protocol = protocol;
+	return 0;
 }
 
 int pthread_mutexattr_getprioceiling(const pthread_mutexattr_t *
@@ -109,10 +236,64 @@ int pthread_mutexattr_setprioceiling(pthread_mutexattr_t * attr,
 int pthread_mutexattr_getrobust(const pthread_mutexattr_t * attr,
 				int *robustness)
 {
-	return ENOSYS;
+	*robustness = attr->_robust;
+	return 0;
 }
 
 int pthread_mutexattr_setrobust(pthread_mutexattr_t * attr, int robustness)
 {
-	return ENOSYS;
+	if (robustness == PTHREAD_MUTEX_ROBUST) {
+		return ENOTSUP;
+	}
+	if (robustness != PTHREAD_MUTEX_STALLED) {
+		return EINVAL;
+	}
+	attr->_robust = robustness;
+	return 0;
+}
+
+#ifdef __STD_TEST
+
+#include <stdio.h>
+
+/**
+ * Check the single threaded behaviour of the different mutex types.
+ */
+void __std_test_pthread_mutex(void)
+{
+	pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+	if (pthread_mutex_lock(&m) != 0 || pthread_mutex_trylock(&m) != EBUSY) {
+		puts("normal mutex is not exclusive");
+	}
+	pthread_mutex_unlock(&m);
+	if (pthread_mutex_trylock(&m) != 0) {
+		puts("normal mutex was not released");
+	}
+	pthread_mutex_unlock(&m);
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&m, &attr);
+	for (int i = 0; i < 3; i++) {
+		if (pthread_mutex_lock(&m) != 0) {
+			puts("recursive mutex can't be relocked");
+		}
+	}
+	for (int i = 0; i < 3; i++) {
+		pthread_mutex_unlock(&m);
+	}
+	if (m._state != 0 || pthread_mutex_unlock(&m) != EPERM) {
+		puts("recursive mutex was not released properly");
+	}
+
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+	pthread_mutex_init(&m, &attr);
+	pthread_mutex_lock(&m);
+	if (pthread_mutex_lock(&m) != EDEADLK) {
+		puts("errorcheck mutex didn't detect deadlock");
+	}
+	pthread_mutex_unlock(&m);
 }
+
+#endif
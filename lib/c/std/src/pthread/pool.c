@@ -0,0 +1,107 @@
+#include "pthread.h"
+
+#include "errno.h"
+
+#define __STD_POOL_MASK (PTHREAD_POOL_QUEUE_NP - 1)
+
+/**
+ * Take jobs from the queue and run them until the pool is stopped.
+ */
+static void *__std_pool_worker(void *arg)
+{
+	pthread_pool_np_t *pool = arg;
+	pthread_mutex_lock(&pool->_lock);
+	for (;;) {
+		while (pool->_head == pool->_tail && !pool->_stop) {
+			pthread_cond_wait(&pool->_queued, &pool->_lock);
+		}
+		if (pool->_head == pool->_tail) {
+			// Stopped and all jobs are done.
+			break;
+		}
+		struct __pthread_pool_job job =
+		    pool->_jobs[pool->_head++ & __STD_POOL_MASK];
+		pool->_active++;
+		// Wake submitters waiting for a free entry.
+		pthread_cond_broadcast(&pool->_done);
+		pthread_mutex_unlock(&pool->_lock);
+
+		job._routine(job._arg);
+
+		pthread_mutex_lock(&pool->_lock);
+		pool->_active--;
+		if (pool->_active == 0 && pool->_head == pool->_tail) {
+			pthread_cond_broadcast(&pool->_done);
+		}
+	}
+	pthread_mutex_unlock(&pool->_lock);
+	return NULL;
+}
+
+int pthread_pool_init_np(pthread_pool_np_t * pool, unsigned int threads)
+{
+	if (threads == 0 || threads > PTHREAD_POOL_THREADS_MAX_NP) {
+		return EINVAL;
+	}
+	pthread_mutex_init(&pool->_lock, NULL);
+	pthread_cond_init(&pool->_queued, NULL);
+	pthread_cond_init(&pool->_done, NULL);
+	pool->_head = 0;
+	pool->_tail = 0;
+	pool->_active = 0;
+	pool->_stop = 0;
+	pool->_thread_count = 0;
+	for (unsigned int i = 0; i < threads; i++) {
+		int ret = pthread_create(&pool->_threads[i], NULL,
+					 __std_pool_worker, pool);
+		if (ret != 0) {
+			pthread_pool_destroy_np(pool);
+			return ret;
+		}
+		pool->_thread_count++;
+	}
+	return 0;
+}
+
+int pthread_pool_submit_np(pthread_pool_np_t * pool,
+			   void (*routine)(void *), void *arg)
+{
+	pthread_mutex_lock(&pool->_lock);
+	if (pool->_stop) {
+		pthread_mutex_unlock(&pool->_lock);
+		return EINVAL;
+	}
+	while (pool->_tail - pool->_head == PTHREAD_POOL_QUEUE_NP) {
+		pthread_cond_wait(&pool->_done, &pool->_lock);
+	}
+	struct __pthread_pool_job *job =
+	    &pool->_jobs[pool->_tail++ & __STD_POOL_MASK];
+	job->_routine = routine;
+	job->_arg = arg;
+	pthread_cond_signal(&pool->_queued);
+	pthread_mutex_unlock(&pool->_lock);
+	return 0;
+}
+
+int pthread_pool_wait_np(pthread_pool_np_t * pool)
+{
+	pthread_mutex_lock(&pool->_lock);
+	while (pool->_active > 0 || pool->_head != pool->_tail) {
+		pthread_cond_wait(&pool->_done, &pool->_lock);
+	}
+	pthread_mutex_unlock(&pool->_lock);
+	return 0;
+}
+
+int pthread_pool_destroy_np(pthread_pool_np_t * pool)
+{
+	pthread_mutex_lock(&pool->_lock);
+	pool->_stop = 1;
+	pthread_cond_broadcast(&pool->_queued);
+	pthread_mutex_unlock(&pool->_lock);
+	for (unsigned int i = 0; i < pool->_thread_count; i++) {
+		pthread_join(pool->_threads[i], NULL);
+	}
+	pool->_thread_count = 0;
+	return 0;
+}
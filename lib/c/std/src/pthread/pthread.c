@@ -1,67 +1,265 @@
 #include "pthread.h"
 
 #include "errno.h"
+#include "futex.h"
+#include "thread.h"
+#include <kernel.h>
+#include <sys/mman.h>
+
+// The main thread has no thread pointer and hence needs a static control block.
+static struct __std_thread __std_main_thread;
+
+// Detached threads which are freed once they have exited.
+static struct __std_thread *volatile __std_zombies;
+
+void __std_thread_start(struct __std_thread *thread);
+
+// The kernel doesn't set the global pointer, so do it before entering C.
+__asm__(".globl __std_thread_start\n"
+	"__std_thread_start:\n"
+	"	.option push\n"
+	"	.option norelax\n"
+	"	la	gp, __global_pointer$\n"
+	"	.option pop\n"
+	"	mv	ra, zero\n"
+	"	j	__std_thread_entry\n");
+
+struct __std_thread *__std_thread_self(void)
+{
+	struct __std_thread *t;
+	__asm__("mv %0, tp":"=r"(t));
+	return t != NULL ? t : &__std_main_thread;
+}
+
+/**
+ * Mark the thread as exited, wake any joiners and stop the task.
+ *
+ * This may not touch the stack once the thread is marked as exited as the
+ * memory may be freed by another thread right away.
+ */
+static void __attribute__((noreturn)) __std_thread_finish(struct
+							    __std_thread *t)
+{
+	register size_t a0 __asm__("a0") = KERNEL_FUTEX_WAKE;
+	register volatile uint32_t *a1 __asm__("a1") = &t->state;
+	register size_t a2 __asm__("a2") = SIZE_MAX;
+	register size_t a7 __asm__("a7") = 18;	// task_futex
+	__asm__ __volatile__("	li	t0, %4\n"
+			     "	fence	rw, w\n"
+			     "	sw	t0, 0(a1)\n"
+			     "	ecall\n"
+			     "	li	a7, 20\n"	// task_exit
+			     "	ecall\n":"+r"(a0), "+r"(a1), "+r"(a7)
+			     :"r"(a2), "i"(__STD_THREAD_EXITED):"t0", "memory");
+	__builtin_unreachable();
+}
+
+/**
+ * Called by __std_thread_start.
+ */
+void __attribute__((noreturn)) __std_thread_entry(struct __std_thread *t)
+{
+	if (dux_init_thread() < 0) {
+		// Without queues the thread can't do any I/O, so give up.
+		t->ret = NULL;
+		__std_thread_finish(t);
+	}
+	pthread_exit(t->routine(t->arg));
+}
+
+/**
+ * Unmap the stack, control block and IPC queues of an exited thread.
+ */
+static void __std_thread_free(struct __std_thread *t)
+{
+	void *packets = t->queues._packets;
+	char *base = t->base;
+	size_t pages = t->pages;
+	size_t guard = t->guard_pages;
+	if (packets != NULL) {
+		kernel_mem_dealloc(packets, 1);
+		dux_unreserve_pages(packets, 1);
+	}
+	// The guard pages were never mapped.
+	kernel_mem_dealloc(base + guard * PAGE_SIZE, pages - guard);
+	dux_unreserve_pages(base, pages);
+}
+
+/**
+ * Add a detached thread to the list of threads to be freed.
+ */
+static void __std_push_zombie(struct __std_thread *t)
+{
+	struct __std_thread *head = __std_zombies;
+	do {
+		t->next_zombie = head;
+	} while (!__atomic_compare_exchange_n
+		 (&__std_zombies, &head, t, 1, __ATOMIC_RELEASE,
+		  __ATOMIC_RELAXED));
+}
+
+/**
+ * Free all detached threads that have exited.
+ */
+static void __std_reap_zombies(void)
+{
+	struct __std_thread *t =
+	    __atomic_exchange_n(&__std_zombies, NULL, __ATOMIC_ACQUIRE);
+	while (t != NULL) {
+		struct __std_thread *next = t->next_zombie;
+		if (__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) ==
+		    __STD_THREAD_EXITED) {
+			__std_thread_free(t);
+		} else {
+			__std_push_zombie(t);
+		}
+		t = next;
+	}
+}
 
 int pthread_create(pthread_t * restrict thread,
 		   const pthread_attr_t * restrict attr,
 		   void *(*routine)(void *), void *restrict arg)
 {
-	return ENOSYS;
+	__std_reap_zombies();
+
+	pthread_attr_t def;
+	if (attr == NULL) {
+		pthread_attr_init(&def);
+		attr = &def;
+	}
+	size_t stack = (attr->_stacksize + PAGE_SIZE - 1) / PAGE_SIZE;
+	size_t guard = (attr->_guardsize + PAGE_SIZE - 1) / PAGE_SIZE;
+	size_t pages = guard + stack + 1;
+
+	struct dux_reserve_pages dret = dux_reserve_pages(NULL, pages);
+	if (dret.status != 0) {
+		return EAGAIN;
+	}
+	char *base = dret.address;
+	kernel_return_t kret = kernel_mem_alloc(base + guard * PAGE_SIZE,
+						stack + 1,
+						PROT_READ | PROT_WRITE);
+	if (kret.status != 0) {
+		dux_unreserve_pages(base, pages);
+		return EAGAIN;
+	}
+
+	// The control block is right above the stack. Fresh pages are zeroed, so
+	// only the non-zero fields need to be set.
+	struct __std_thread *t =
+	    (struct __std_thread *)(base + (pages - 1) * PAGE_SIZE);
+	t->routine = routine;
+	t->arg = arg;
+	t->base = base;
+	t->pages = pages;
+	t->guard_pages = guard;
+	t->detached = attr->_detachstate == PTHREAD_CREATE_DETACHED;
+
+	kret = kernel_task_spawn_thread(__std_thread_start, t, t, t);
+	if (kret.status != 0) {
+		__std_thread_free(t);
+		return EAGAIN;
+	}
+	if (t->detached) {
+		__std_push_zombie(t);
+	}
+	*thread = (pthread_t) t;
+	return 0;
 }
 
 void pthread_exit(void *ret)
 {
-
+	struct __std_thread *t = __std_thread_self();
+	t->ret = ret;
+	__std_thread_destroy_specific(t);
+	__std_thread_finish(t);
 }
 
 int pthread_join(pthread_t thread, void **thread_return)
 {
-	return ENOSYS;
+	struct __std_thread *t = (struct __std_thread *)thread;
+	if (t == __std_thread_self()) {
+		return EDEADLK;
+	}
+	if (t->detached || t == &__std_main_thread) {
+		return EINVAL;
+	}
+
+	uint32_t s;
+	while ((s = __atomic_load_n(&t->state, __ATOMIC_ACQUIRE)) !=
+	       __STD_THREAD_EXITED) {
+		__std_futex_wait(&t->state, s, UINT64_MAX);
+	}
+	if (thread_return != NULL) {
+		*thread_return = t->ret;
+	}
+	__std_thread_free(t);
+	return 0;
 }
 
 int pthread_detach(pthread_t th)
 {
-	return ENOSYS;
+	struct __std_thread *t = (struct __std_thread *)th;
+	if (t == &__std_main_thread
+	    || __atomic_exchange_n(&t->detached, 1, __ATOMIC_RELAXED)) {
+		return EINVAL;
+	}
+	// Whoever reaps the zombies next frees it once it has exited.
+	__std_push_zombie(t);
+	__std_reap_zombies();
+	return 0;
 }
 
 pthread_t pthread_self(void)
 {
-	return 0;
+	return (pthread_t) __std_thread_self();
 }
 
 int pthread_equal(pthread_t thread1, pthread_t thread2)
 {
-	return ENOSYS;
+	return thread1 == thread2;
 }
 
 int pthread_attr_init(pthread_attr_t * attr)
 {
-	return ENOSYS;
+	attr->_stacksize = __STD_THREAD_STACK_SIZE;
+	attr->_guardsize = PAGE_SIZE;
+	attr->_detachstate = PTHREAD_CREATE_JOINABLE;
+	return 0;
 }
 
 int pthread_attr_destroy(pthread_attr_t * attr)
 {
-	return ENOSYS;
+	return 0;
 }
 
 int pthread_attr_getdetachstate(const pthread_attr_t * attr, int *detachstate)
 {
-	return ENOSYS;
+	*detachstate = attr->_detachstate;
+	return 0;
 }
 
 int pthread_attr_setdetachstate(pthread_attr_t * attr, int detachstate)
 {
-	return ENOSYS;
+	if (detachstate != PTHREAD_CREATE_DETACHED
+	    && detachstate != PTHREAD_CREATE_JOINABLE) {
+		return EINVAL;
+	}
+	attr->_detachstate = detachstate;
+	return 0;
 }
 
 int pthread_attr_getguardsize(const pthread_attr_t * attr, size_t *guardsize)
 {
-	return ENOSYS;
+	*guardsize = attr->_guardsize;
+	return 0;
 }
 
 int pthread_attr_setguardsize(pthread_attr_t * attr, size_t guardsize)
 {
-	return ENOSYS;
+	attr->_guardsize = guardsize;
+	return 0;
 }
 
 int pthread_attr_getschedparam(const pthread_attr_t * restrict attr,
@@ -123,12 +321,17 @@ int pthread_attr_setstackaddr(pthread_attr_t * attr, void *stackaddr)
 int pthread_attr_getstacksize(const pthread_attr_t * restrict
 			      attr, size_t *restrict stacksize)
 {
-	return ENOSYS;
+	*stacksize = attr->_stacksize;
+	return 0;
 }
 
 int pthread_attr_setstacksize(pthread_attr_t * attr, size_t stacksize)
 {
-	return ENOSYS;
+	if (stacksize < PAGE_SIZE) {
+		return EINVAL;
+	}
+	attr->_stacksize = stacksize;
+	return 0;
 }
 
 int pthread_attr_getstack(const pthread_attr_t * restrict attr,
@@ -173,12 +376,27 @@ int pthread_setconcurrency(int level)
 
 int pthread_yield(void)
 {
-	return ENOSYS;
+	kernel_io_wait(0);
+	return 0;
 }
 
 int pthread_once(pthread_once_t * once_control, void (*init_routine)(void))
 {
-	return ENOSYS;
+	// 0 if not called yet, 1 if running and 2 if done.
+	volatile uint32_t *state = (volatile uint32_t *)once_control;
+	uint32_t s = 0;
+	if (__atomic_compare_exchange_n(state, &s, 1, 0, __ATOMIC_ACQUIRE,
+					__ATOMIC_ACQUIRE)) {
+		init_routine();
+		__atomic_store_n(state, 2, __ATOMIC_RELEASE);
+		__std_futex_wake(state, SIZE_MAX);
+		return 0;
+	}
+	while (s != 2) {
+		__std_futex_wait(state, s, UINT64_MAX);
+		s = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+	}
+	return 0;
 }
 
 int pthread_setcancelstate(int state, int *oldstate)
@@ -0,0 +1,172 @@
+#include "pthread.h"
+
+#include "errno.h"
+#include "futex.h"
+
+// Layout of pthread_rwlock_t::_state. The remaining bits count the readers.
+#define __STD_RWLOCK_WRITER  (0x80000000)
+#define __STD_RWLOCK_WAITING (0x40000000)	// There may be sleeping tasks
+#define __STD_RWLOCK_READERS (0x3fffffff)
+
+/**
+ * Try to take a read lock. Readers are preferred, i.e. waiting writers do
+ * not block new readers.
+ */
+static int __std_rwlock_try_read(pthread_rwlock_t * rwlock, uint32_t s)
+{
+	if ((s & __STD_RWLOCK_WRITER)
+	    || (s & __STD_RWLOCK_READERS) == __STD_RWLOCK_READERS) {
+		return 0;
+	}
+	return __atomic_compare_exchange_n(&rwlock->_state, &s, s + 1, 0,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * Try to take the write lock.
+ */
+static int __std_rwlock_try_write(pthread_rwlock_t * rwlock, uint32_t s)
+{
+	if ((s & ~__STD_RWLOCK_WAITING) != 0) {
+		return 0;
+	}
+	// Keep the waiting bit so the other sleepers get woken on unlock.
+	return __atomic_compare_exchange_n(&rwlock->_state, &s,
+					   s | __STD_RWLOCK_WRITER, 0,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take either lock, spinning for a while before going to sleep.
+ */
+static int __std_rwlock_lock(pthread_rwlock_t * rwlock,
+			     int (*try)(pthread_rwlock_t *, uint32_t),
+			     const struct timespec *abstime)
+{
+	for (int i = 0;; i++) {
+		uint32_t s = __atomic_load_n(&rwlock->_state, __ATOMIC_RELAXED);
+		if (try(rwlock, s)) {
+			return 0;
+		}
+		if (i < __STD_SPIN_COUNT) {
+			__std_cpu_relax();
+			continue;
+		}
+		// Announce that we're going to sleep. If the state changed in the
+		// meantime just try again.
+		uint32_t w = s | __STD_RWLOCK_WAITING;
+		if (s != w && !__atomic_compare_exchange_n(&rwlock->_state, &s, w,
+							   0, __ATOMIC_RELAXED,
+							   __ATOMIC_RELAXED)) {
+			continue;
+		}
+		if (__std_futex_wait_until(&rwlock->_state, w, abstime) != 0) {
+			return ETIMEDOUT;
+		}
+	}
+}
+
+int pthread_rwlock_init(pthread_rwlock_t * restrict rwlock,
+			const pthread_rwlockattr_t * restrict attr)
+{
+	rwlock->_state = 0;
+	return 0;
+}
+
+int pthread_rwlock_destroy(pthread_rwlock_t * rwlock)
+{
+	return (rwlock->_state & ~__STD_RWLOCK_WAITING) != 0 ? EBUSY : 0;
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t * rwlock)
+{
+	return __std_rwlock_lock(rwlock, __std_rwlock_try_read, NULL);
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t * rwlock)
+{
+	uint32_t s = __atomic_load_n(&rwlock->_state, __ATOMIC_RELAXED);
+	return __std_rwlock_try_read(rwlock, s) ? 0 : EBUSY;
+}
+
+int pthread_rwlock_timedrdlock(pthread_rwlock_t * restrict rwlock,
+			       const struct timespec *restrict abstime)
+{
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+	return __std_rwlock_lock(rwlock, __std_rwlock_try_read, abstime);
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t * rwlock)
+{
+	return __std_rwlock_lock(rwlock, __std_rwlock_try_write, NULL);
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t * rwlock)
+{
+	uint32_t s = __atomic_load_n(&rwlock->_state, __ATOMIC_RELAXED);
+	return __std_rwlock_try_write(rwlock, s) ? 0 : EBUSY;
+}
+
+int pthread_rwlock_timedwrlock(pthread_rwlock_t * restrict rwlock,
+			       const struct timespec *restrict abstime)
+{
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+	return __std_rwlock_lock(rwlock, __std_rwlock_try_write, abstime);
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t * rwlock)
+{
+	uint32_t s = __atomic_load_n(&rwlock->_state, __ATOMIC_RELAXED);
+	if (s & __STD_RWLOCK_WRITER) {
+		s = __atomic_exchange_n(&rwlock->_state, 0, __ATOMIC_RELEASE);
+	} else if ((s & __STD_RWLOCK_READERS) == 0) {
+		return EPERM;
+	} else {
+		s = __atomic_sub_fetch(&rwlock->_state, 1, __ATOMIC_RELEASE);
+		// Only the last reader wakes the sleepers. If the state changes
+		// the new owner is responsible for it instead.
+		if (s != __STD_RWLOCK_WAITING
+		    || !__atomic_compare_exchange_n(&rwlock->_state, &s, 0, 0,
+						    __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED)) {
+			return 0;
+		}
+	}
+	if (s & __STD_RWLOCK_WAITING) {
+		// Wake everyone, as any amount of readers may be able to proceed.
+		__std_futex_wake(&rwlock->_state, SIZE_MAX);
+	}
+	return 0;
+}
+
+int pthread_rwlockattr_init(pthread_rwlockattr_t * attr)
+{
+	attr->_pshared = PTHREAD_PROCESS_PRIVATE;
+	return 0;
+}
+
+int pthread_rwlockattr_destroy(pthread_rwlockattr_t * attr)
+{
+	return 0;
+}
+
+int pthread_rwlockattr_getpshared(const pthread_rwlockattr_t *
+				  restrict attr, int *restrict pshared)
+{
+	*pshared = attr->_pshared;
+	return 0;
+}
+
+int pthread_rwlockattr_setpshared(pthread_rwlockattr_t * attr, int pshared)
+{
+	if (pshared != PTHREAD_PROCESS_PRIVATE
+	    && pshared != PTHREAD_PROCESS_SHARED) {
+		return EINVAL;
+	}
+	attr->_pshared = pshared;
+	return 0;
+}
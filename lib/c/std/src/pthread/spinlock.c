@@ -0,0 +1,40 @@
+#include "pthread.h"
+
+#include "errno.h"
+#include "futex.h"
+
+int pthread_spin_init(pthread_spinlock_t * lock, int pshared)
+{
+	lock->_lock = 0;
+	return 0;
+}
+
+int pthread_spin_destroy(pthread_spinlock_t * lock)
+{
+	return 0;
+}
+
+int pthread_spin_lock(pthread_spinlock_t * lock)
+{
+	while (__atomic_exchange_n(&lock->_lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		// Only read while waiting so the cache line isn't bounced around.
+		while (__atomic_load_n(&lock->_lock, __ATOMIC_RELAXED) != 0) {
+			__std_cpu_relax();
+		}
+	}
+	return 0;
+}
+
+int pthread_spin_trylock(pthread_spinlock_t * lock)
+{
+	if (__atomic_exchange_n(&lock->_lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		return EBUSY;
+	}
+	return 0;
+}
+
+int pthread_spin_unlock(pthread_spinlock_t * lock)
+{
+	__atomic_store_n(&lock->_lock, 0, __ATOMIC_RELEASE);
+	return 0;
+}
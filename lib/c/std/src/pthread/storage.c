@@ -0,0 +1,85 @@
+#include "pthread.h"
+
+#include "errno.h"
+#include "thread.h"
+
+// Bitmap of the keys that are in use.
+static volatile uint32_t __std_keys_used;
+
+// Incremented each time a key is created so values set with a previous key
+// that had the same index are ignored.
+static volatile uint32_t __std_key_generations[PTHREAD_KEYS_MAX];
+
+static void (*__std_key_destructors[PTHREAD_KEYS_MAX])(void *);
+
+int pthread_key_create(pthread_key_t * key, void (*destr_function)(void *))
+{
+	uint32_t used = __std_keys_used;
+	int i;
+	do {
+		if (used == UINT32_MAX) {
+			return EAGAIN;
+		}
+		i = __builtin_ctz(~used);
+	} while (!__atomic_compare_exchange_n(&__std_keys_used, &used,
+					      used | (1U << i), 1,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_RELAXED));
+	__std_key_destructors[i] = destr_function;
+	__atomic_fetch_add(&__std_key_generations[i], 1, __ATOMIC_RELEASE);
+	*key = i;
+	return 0;
+}
+
+int pthread_key_delete(pthread_key_t key)
+{
+	if (key >= PTHREAD_KEYS_MAX || !(__std_keys_used & (1U << key))) {
+		return EINVAL;
+	}
+	__std_key_destructors[key] = NULL;
+	__atomic_fetch_and(&__std_keys_used, ~(1U << key), __ATOMIC_RELEASE);
+	return 0;
+}
+
+void *pthread_getspecific(pthread_key_t key)
+{
+	if (key >= PTHREAD_KEYS_MAX) {
+		return NULL;
+	}
+	struct __std_thread *t = __std_thread_self();
+	if (t->specific[key].generation != __std_key_generations[key]) {
+		return NULL;
+	}
+	return (void *)t->specific[key].value;
+}
+
+int pthread_setspecific(pthread_key_t key, const void *pointer)
+{
+	if (key >= PTHREAD_KEYS_MAX || !(__std_keys_used & (1U << key))) {
+		return EINVAL;
+	}
+	struct __std_thread *t = __std_thread_self();
+	t->specific[key].value = pointer;
+	t->specific[key].generation = __std_key_generations[key];
+	return 0;
+}
+
+void __std_thread_destroy_specific(struct __std_thread *t)
+{
+	for (int n = 0; n < PTHREAD_DESTRUCTOR_ITERATIONS; n++) {
+		int called = 0;
+		for (pthread_key_t k = 0; k < PTHREAD_KEYS_MAX; k++) {
+			void (*destructor)(void *) = __std_key_destructors[k];
+			void *value = pthread_getspecific(k);
+			if (destructor == NULL || value == NULL) {
+				continue;
+			}
+			t->specific[k].value = NULL;
+			destructor(value);
+			called = 1;
+		}
+		if (!called) {
+			return;
+		}
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef __STD_PTHREAD_THREAD_H
+#define __STD_PTHREAD_THREAD_H
+
+#include <dux.h>
+#include <pthread.h>
+#include <stdint.h>
+
+// The default size of the stack of new threads.
+#define __STD_THREAD_STACK_SIZE (16 * PAGE_SIZE)
+
+// Values of __std_thread::state
+#define __STD_THREAD_RUNNING (0)
+#define __STD_THREAD_EXITED  (1)
+
+/**
+ * Control block of a thread. It is located in the page right above the stack
+ * of the thread, except for the main thread.
+ */
+struct __std_thread {
+	// The thread pointer points to this structure, so this must come first.
+	struct dux_thread_queues queues;
+	void *(*routine)(void *);
+	void *arg;
+	void *ret;
+	// Joiners wait on this until it becomes __STD_THREAD_EXITED.
+	volatile uint32_t state;
+	volatile uint32_t detached;
+	// The pages reserved for the guard, the stack and this structure.
+	void *base;
+	size_t pages;
+	size_t guard_pages;
+	// The next detached thread that has yet to be freed.
+	struct __std_thread *next_zombie;
+	struct {
+		const void *value;
+		// The generation of the key when the value was set.
+		uint32_t generation;
+	} specific[PTHREAD_KEYS_MAX];
+};
+
+/**
+ * Return the control block of the current thread.
+ */
+struct __std_thread *__std_thread_self(void);
+
+/**
+ * Call the destructors of all thread-specific values of the current thread.
+ */
+void __std_thread_destroy_specific(struct __std_thread *thread);
+
+#endif
@@ -19,23 +19,252 @@ typedef signed long ssize_t;
 #define MODE_UPDATE  (0x8)  // "+"
 #define MODE_EXIST   (0x10) // "x"
 
-int fileno(FILE * stream) {
-	return (stream - __files_list) / sizeof(*stream);
+int fileno(FILE * stream)
+{
+	return stream - __files_list;
+}
+
+/**
+ * Send a single read or write request for the given stream. Returns the
+ * amount of bytes actually transferred.
+ */
+static size_t __std_stream_transfer(FILE * stream, uint8_t opcode, void *data,
+				    size_t length)
+{
+	size_t len = __std_transfer(stream->_address, stream->_uuid,
+				    stream->_path, stream->_position, opcode,
+				    data, length);
+	stream->_position += len;
+	return len;
+}
+
+/**
+ * Check whether the pointer refers to the start of a page-aligned buffer we
+ * allocated ourselves for this stream.
+ */
+static int __std_is_own_buffer(FILE * stream, const void *ptr)
+{
+	return (stream->_flags & __STD_FILE_OWN_BUFFER) && ptr == stream->_buffer;
+}
+
+/**
+ * Write data directly, bypassing the stream buffer. Large writes are split in
+ * several requests which are kept in flight at once, see
+ * __std_transfer_buffer.
+ */
+static size_t __std_write_direct(FILE * stream, const void *ptr, size_t len)
+{
+	size_t written;
+	if (ptr == universal_buffer || __std_is_own_buffer(stream, ptr)) {
+		// Our own buffers can be shared as is.
+		written = __std_stream_transfer(stream, KERNEL_IPC_OP_WRITE,
+						(void *)ptr, len);
+	} else {
+		written = __std_transfer_buffer(stream->_address, stream->_uuid,
+						stream->_path,
+						stream->_position,
+						KERNEL_IPC_OP_WRITE, (void *)ptr,
+						len);
+		stream->_position += written;
+	}
+
+	// Check if the "stream" ended early
+	if (written < len) {
+		stream->_flags |= __STD_FILE_ERROR;
+	}
+	return written;
+}
+
+/**
+ * Read data directly into the given buffer, bypassing the stream buffer.
+ * Like with __std_write_direct, large reads are pipelined. Stops at the first
+ * short read.
+ */
+static size_t __std_read_direct(FILE * stream, void *ptr, size_t len)
+{
+	if (__std_is_own_buffer(stream, ptr)) {
+		return __std_stream_transfer(stream, KERNEL_IPC_OP_READ, ptr,
+					     len);
+	}
+
+	size_t rd = __std_transfer_buffer(stream->_address, stream->_uuid,
+					  stream->_path, stream->_position,
+					  KERNEL_IPC_OP_READ, ptr, len);
+	stream->_position += rd;
+	return rd;
+}
+
+/**
+ * Release the buffer of a stream if it was allocated by us.
+ */
+static void __std_release_buffer(FILE * stream)
+{
+	if (stream->_flags & __STD_FILE_OWN_BUFFER) {
+		size_t count = (stream->_buffer_size + PAGE_SIZE - 1) / PAGE_SIZE;
+		kernel_mem_dealloc(stream->_buffer, count);
+		dux_unreserve_pages(stream->_buffer, count);
+		stream->_flags &= ~__STD_FILE_OWN_BUFFER;
+	}
+	stream->_buffer = NULL;
+	stream->_buffer_size = 0;
+	stream->_buffer_index = 0;
+	stream->_buffer_length = 0;
+}
+
+/**
+ * Allocate a page-aligned buffer of at least the given size. Returns NULL if
+ * no memory is available.
+ */
+static char *__std_alloc_buffer(size_t size)
+{
+	size_t count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	struct dux_reserve_pages dret = dux_reserve_pages(NULL, count);
+	if (dret.status != 0) {
+		return NULL;
+	}
+	kernel_return_t kret =
+	    kernel_mem_alloc(dret.address, count, PROT_READ | PROT_WRITE);
+	if (kret.status != 0) {
+		dux_unreserve_pages(dret.address, count);
+		return NULL;
+	}
+	return dret.address;
+}
+
+/**
+ * Make sure the stream has a buffer if it is buffered. Streams that haven't
+ * been configured with setvbuf get a default mode: stderr is unbuffered,
+ * stdout is line buffered and everything else is fully buffered.
+ *
+ * Returns 0 if the stream has a buffer and -1 if it is unbuffered.
+ */
+static int __std_init_buffer(FILE * stream)
+{
+	if (!(stream->_flags & __STD_FILE_INITIALIZED)) {
+		stream->_flags |= __STD_FILE_INITIALIZED;
+		if (stream == stderr) {
+			stream->_buffer_mode = _IONBF;
+		} else if (stream == stdout) {
+			stream->_buffer_mode = _IOLBF;
+		} else {
+			stream->_buffer_mode = _IOFBF;
+		}
+	}
+
+	if (stream->_buffer_mode == _IONBF) {
+		return -1;
+	}
+
+	if (stream->_buffer == NULL) {
+		stream->_buffer = __std_alloc_buffer(BUFSIZ);
+		if (stream->_buffer == NULL) {
+			// Stay functional, albeit slow.
+			stream->_buffer_mode = _IONBF;
+			return -1;
+		}
+		stream->_buffer_size = BUFSIZ;
+		stream->_buffer_index = 0;
+		stream->_buffer_length = 0;
+		stream->_flags |= __STD_FILE_OWN_BUFFER;
+	}
+
+	return 0;
+}
+
+/**
+ * Write out any pending data in the stream buffer.
+ */
+static int __std_flush(FILE * stream)
+{
+	if (!(stream->_flags & __STD_FILE_WRITING)) {
+		return 0;
+	}
+	stream->_flags &= ~__STD_FILE_WRITING;
+
+	size_t pending = stream->_buffer_index;
+	stream->_buffer_index = 0;
+	if (pending == 0) {
+		return 0;
+	}
+
+	size_t written = __std_write_direct(stream, stream->_buffer, pending);
+	return written == pending ? 0 : EOF;
+}
+
+/**
+ * Switch the stream to writing, discarding any read-ahead data.
+ */
+static void __std_begin_write(FILE * stream)
+{
+	if (stream->_flags & __STD_FILE_READING) {
+		// Rewind to the position the user expects.
+		stream->_position -=
+		    stream->_buffer_length - stream->_buffer_index;
+		stream->_buffer_index = 0;
+		stream->_buffer_length = 0;
+		stream->_flags &= ~(__STD_FILE_READING | __STD_FILE_SHORT);
+	}
+	stream->_flags |= __STD_FILE_WRITING;
+}
+
+/**
+ * Switch the stream to reading, writing out any pending data.
+ */
+static void __std_begin_read(FILE * stream)
+{
+	if (stream->_flags & __STD_FILE_WRITING) {
+		__std_flush(stream);
+	}
+	if (!(stream->_flags & __STD_FILE_READING)) {
+		stream->_buffer_index = 0;
+		stream->_buffer_length = 0;
+		stream->_flags |= __STD_FILE_READING;
+	}
+}
+
+/**
+ * Refill the read-ahead buffer of a stream. Returns the amount of bytes
+ * available.
+ */
+static size_t __std_fill(FILE * stream)
+{
+	// Make sure prompts are visible before we (potentially) block.
+	if (stream != stdout && (stdout->_flags & __STD_FILE_WRITING)
+	    && stdout->_buffer_mode == _IOLBF) {
+		__std_flush(stdout);
+	}
+
+	size_t rd =
+	    __std_read_direct(stream, stream->_buffer, stream->_buffer_size);
+	stream->_buffer_index = 0;
+	stream->_buffer_length = rd;
+	stream->_flags &= ~__STD_FILE_SHORT;
+	if (rd == 0) {
+		stream->_flags |= __STD_FILE_EOF;
+	} else if (rd < stream->_buffer_size) {
+		stream->_flags |= __STD_FILE_SHORT;
+	}
+	return rd;
 }
 
 int fputc(int c, FILE * stream)
 {
 	unsigned char chr = (unsigned char)c;
-	struct iovec iov = {
-		.iov_base = &chr,
-		.iov_len = 1,
-	};
 
-	ssize_t ret = writev(fileno(stream), &iov, 1);
-	if (ret >= 0) {
-		ret = chr;
+	__std_begin_write(stream);
+	if (__std_init_buffer(stream) < 0) {
+		stream->_flags &= ~__STD_FILE_WRITING;
+		return __std_write_direct(stream, &chr, 1) == 1 ? chr : EOF;
 	}
-	return ret;
+
+	stream->_buffer[stream->_buffer_index++] = chr;
+	if (stream->_buffer_index == stream->_buffer_size
+	    || (stream->_buffer_mode == _IOLBF && chr == '\n')) {
+		if (__std_flush(stream) < 0) {
+			return EOF;
+		}
+	}
+	return chr;
 }
 
 int fputs(const char *s, FILE * stream)
@@ -60,35 +289,180 @@ int puts(const char *s)
 
 int fgetc(FILE * stream)
 {
-	return ENOSYS;
+	__std_begin_read(stream);
+	if (__std_init_buffer(stream) < 0) {
+		unsigned char chr;
+		if (__std_read_direct(stream, &chr, 1) != 1) {
+			stream->_flags |= __STD_FILE_EOF;
+			return EOF;
+		}
+		return chr;
+	}
+
+	if (stream->_buffer_index == stream->_buffer_length
+	    && __std_fill(stream) == 0) {
+		return EOF;
+	}
+	return (unsigned char)stream->_buffer[stream->_buffer_index++];
 }
 
 char *fgets(char *s, int size, FILE * stream)
 {
-	char* ret;
-	// FIXME this is not the proper way to do it
-	do {
-		// size - 1 so we can store a null terminator.
-		size_t rd = fread(s, size - 1, 1, stdin);
-		ret = rd == 0 ? NULL : s;
-		s[rd] = '\0';
-	} while (ret == NULL);
-	return ret;
+	if (size <= 0) {
+		return NULL;
+	}
+
+	// size - 1 so we can store a null terminator.
+	char *p = s;
+	char *end = s + size - 1;
+
+	__std_begin_read(stream);
+	if (__std_init_buffer(stream) < 0) {
+		while (p != end) {
+			int c = fgetc(stream);
+			if (c == EOF) {
+				break;
+			}
+			*p++ = c;
+			if (c == '\n') {
+				break;
+			}
+		}
+	} else {
+		while (p != end) {
+			if (stream->_buffer_index == stream->_buffer_length) {
+				// Interactive streams such as the console only return what is
+				// currently available. Return what we have instead of blocking
+				// until a full line has been entered.
+				if (p != s && (stream->_flags & __STD_FILE_SHORT)) {
+					break;
+				}
+				if (__std_fill(stream) == 0) {
+					break;
+				}
+			}
+			char c = stream->_buffer[stream->_buffer_index++];
+			*p++ = c;
+			if (c == '\n') {
+				break;
+			}
+		}
+	}
+
+	*p = '\0';
+	return p == s ? NULL : s;
 }
 
 int getc(FILE * stream)
 {
-	return ENOSYS;
+	return fgetc(stream);
 }
 
 int getchar(void)
 {
-	return ENOSYS;
+	return fgetc(stdin);
 }
 
 int ungetc(int c, FILE * stream)
 {
-	return ENOSYS;
+	if (c == EOF) {
+		return EOF;
+	}
+	__std_begin_read(stream);
+	if (__std_init_buffer(stream) < 0) {
+		return EOF;
+	}
+
+	if (stream->_buffer_index == stream->_buffer_length) {
+		// Put the character at the end so the buffer is "full" again.
+		stream->_buffer_index = stream->_buffer_size;
+		stream->_buffer_length = stream->_buffer_size;
+	} else if (stream->_buffer_index == 0) {
+		// No room left
+		return EOF;
+	}
+
+	stream->_buffer[--stream->_buffer_index] = c;
+	stream->_flags &= ~__STD_FILE_EOF;
+	return (unsigned char)c;
+}
+
+int fflush(FILE * stream)
+{
+	if (stream == NULL) {
+		int ret = 0;
+		if (__files_list == NULL) {
+			return ret;
+		}
+		// stdout and stderr may be aliased without being counted.
+		size_t count = __files_count < 3 ? 3 : __files_count;
+		for (size_t i = 0; i < count; i++) {
+			if (__std_flush(&__files_list[i]) < 0) {
+				ret = EOF;
+			}
+		}
+		return ret;
+	}
+	return __std_flush(stream);
+}
+
+int setvbuf(FILE * stream, char *buf, int mode, size_t size)
+{
+	if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF) {
+		return -1;
+	}
+
+	// Get rid of the current buffer.
+	__std_flush(stream);
+	if (stream->_flags & __STD_FILE_READING) {
+		stream->_position -=
+		    stream->_buffer_length - stream->_buffer_index;
+		stream->_flags &= ~(__STD_FILE_READING | __STD_FILE_SHORT);
+	}
+	__std_release_buffer(stream);
+
+	stream->_flags |= __STD_FILE_INITIALIZED;
+	stream->_buffer_mode = mode;
+
+	if (mode == _IONBF) {
+		return 0;
+	}
+
+	if (buf == NULL || size == 0) {
+		size = size == 0 ? BUFSIZ : size;
+		buf = __std_alloc_buffer(size);
+		if (buf == NULL) {
+			stream->_buffer_mode = _IONBF;
+			return -1;
+		}
+		// Round up as we got whole pages anyways.
+		size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+		stream->_flags |= __STD_FILE_OWN_BUFFER;
+	}
+
+	stream->_buffer = buf;
+	stream->_buffer_size = size;
+	return 0;
+}
+
+void setbuf(FILE * stream, char *buf)
+{
+	setvbuf(stream, buf, buf != NULL ? _IOFBF : _IONBF, BUFSIZ);
+}
+
+int feof(FILE * stream)
+{
+	return (stream->_flags & __STD_FILE_EOF) != 0;
+}
+
+int ferror(FILE * stream)
+{
+	return (stream->_flags & __STD_FILE_ERROR) != 0;
+}
+
+void clearerr(FILE * stream)
+{
+	stream->_flags &= ~(__STD_FILE_EOF | __STD_FILE_ERROR);
 }
 
 int printf(const char *format, ...)
@@ -111,7 +485,15 @@ int fprintf(FILE * stream, const char *format, ...)
 
 int fclose(FILE *stream)
 {
-	return ENOSYS;
+	int fd = fileno(stream);
+	if (!__std_is_open_file(fd)) {
+		errno = EBADF;
+		return EOF;
+	}
+	int ret = __std_flush(stream);
+	__std_release_buffer(stream);
+	__std_push_free_file(fd);
+	return ret;
 }
 
 FILE *fopen(const char *path, const char *mode)
@@ -147,22 +529,19 @@ FILE *fopen(const char *path, const char *mode)
 		return NULL;
 	}
 
-	static char path_buf[4096] __attribute__ ((__aligned__(4096)));
-
 	// Take a free file
 	FILE *f = __std_pop_free_file();
+	if (f == NULL) {
+		return NULL;
+	}
+	if (__std_set_file_path(f, path) < 0) {
+		__std_push_free_file(fileno(f));
+		return NULL;
+	}
 
 	// Get cwd address
-	size_t address = __files_list[3]._address;
-
-	size_t len = strlen(path);
-	len = len < sizeof(path_buf) - 1 ? len : sizeof(path_buf) - 1;
-	memcpy(path_buf, path, len);
-	path_buf[len] = '\0';
-	f->_address = address;
+	f->_address = __files_list[3]._address;
 	f->_uuid = kernel_uuid(0, 0);
-	f->_path = path_buf;
-	f->_position = 0;
 
 	return f;
 }
@@ -174,57 +553,45 @@ size_t fread(void *ptr, size_t size, size_t count, FILE *stream)
 	size_t read_total = size * count;
 	size_t total_read = 0;
 
+	__std_begin_read(stream);
+	int buffered = __std_init_buffer(stream) == 0;
+
 	while (read_total > total_read) {
-		// Determine the maximum amount of data to be read.
 		size_t delta_read = read_total - total_read;
-		size_t max_size = universal_buffer_size < delta_read ? universal_buffer_size : delta_read;
-
-		// Get a request entry
-		struct kernel_ipc_packet *pkt;
-		uint16_t slot = dux_reserve_transmit_entry(&pkt);
-		while (pkt == NULL) {
-			kernel_io_wait(-1);
-			slot = dux_reserve_transmit_entry(&pkt);
+
+		// Take whatever is still in the buffer first.
+		if (buffered && stream->_buffer_index < stream->_buffer_length) {
+			size_t avail =
+			    stream->_buffer_length - stream->_buffer_index;
+			size_t n = avail < delta_read ? avail : delta_read;
+			memcpy(p, stream->_buffer + stream->_buffer_index, n);
+			stream->_buffer_index += n;
+			p += n;
+			total_read += n;
+			continue;
 		}
 
-		// Fill out the request entry
-		pkt->uuid = kernel_uuid(-1, 0);
-		pkt->flags = 0;
-		pkt->address = stream->_address;
-		pkt->offset = stream->_position;
-		pkt->name = (void *)stream->_path;
-		pkt->name_len = stream->_path != NULL ? strlen(stream->_path) : 0;
-		pkt->data.raw = universal_buffer;
-		pkt->length = 0x1000; // TODO
-		pkt->opcode = KERNEL_IPC_OP_READ;
-		
-		// Send the packet
-		dux_submit_transmit_entry(slot);
-
-		// Wait for a response
-		const struct kernel_ipc_packet *cce;
-		for (;;) {
-			slot = dux_get_received_entry(&cce);
-			if (slot == -1) {
-				// Do nothing
-			} else if (cce->opcode == KERNEL_IPC_OP_READ) {
-
-				// Copy the received data.
-				memcpy(p, universal_buffer, cce->length);
-				p += cce->length;
-				total_read += cce->length;
-				stream->_position += cce->length;
-
-				dux_pop_received_entry(slot);
+		// Check if the "stream" ended early
+		if (buffered && (stream->_flags & __STD_FILE_SHORT)
+		    && total_read > 0) {
+			break;
+		}
+
+		// Large reads go straight to the destination.
+		if (!buffered || delta_read >= stream->_buffer_size) {
+			size_t rd = __std_read_direct(stream, p, delta_read);
+			p += rd;
+			total_read += rd;
+			if (rd == 0) {
+				stream->_flags |= __STD_FILE_EOF;
+			}
+			if (rd < delta_read) {
 				break;
-			} else {
-				dux_defer_received_entry(slot);
 			}
-			kernel_io_wait(-1);
+			continue;
 		}
 
-		// Check if the "stream" ended early
-		if (cce->length < max_size) {
+		if (__std_fill(stream) == 0) {
 			break;
 		}
 	}
@@ -237,159 +604,215 @@ size_t fwrite(const void *ptr, size_t size, size_t count, FILE * stream)
 	// TODO account properly for size
 	const char *p = ptr;
 	size_t write_total = size * count;
-	size_t total_written = 0;
 
+	__std_begin_write(stream);
+	if (__std_init_buffer(stream) < 0) {
+		stream->_flags &= ~__STD_FILE_WRITING;
+		return __std_write_direct(stream, p, write_total);
+	}
+
+	size_t total_written = 0;
+	int newline = 0;
 	while (write_total > total_written) {
-		// Determine the maximum amount of data to be written.
 		size_t delta_write = write_total - total_written;
-		size_t max_size = universal_buffer_size < delta_write ? universal_buffer_size : delta_write;
 
-		// Copy the data
-		for (size_t i = 0; i < max_size; i++) {
-			((char *)universal_buffer)[i] = *p++;
+		// Large writes go straight to the receiver.
+		if (delta_write >= stream->_buffer_size) {
+			if (__std_flush(stream) < 0) {
+				return total_written;
+			}
+			__std_begin_write(stream);
+			return total_written +
+			    __std_write_direct(stream, p, delta_write);
 		}
 
-		// Get a request entry
-		struct kernel_ipc_packet *pkt;
-		uint16_t slot = dux_reserve_transmit_entry(&pkt);
-		while (pkt == NULL) {
-			kernel_io_wait(-1);
-			slot = dux_reserve_transmit_entry(&pkt);
+		size_t space = stream->_buffer_size - stream->_buffer_index;
+		size_t n = space < delta_write ? space : delta_write;
+
+		char *out = stream->_buffer + stream->_buffer_index;
+		for (size_t i = 0; i < n; i++) {
+			newline |= p[i] == '\n';
+			out[i] = p[i];
 		}
+		stream->_buffer_index += n;
+		p += n;
+		total_written += n;
 
-		// Fill out the request entry
-		pkt->uuid = kernel_uuid(0, -1);
-		pkt->flags = 0;
-		pkt->address = stream->_address;
-		pkt->offset = stream->_position;
-		pkt->name = (void *)stream->_path;
-		pkt->name_len = stream->_path != NULL ? strlen(stream->_path) : 0;
-		pkt->data.raw = universal_buffer;
-		pkt->length = max_size;
-		pkt->opcode = KERNEL_IPC_OP_WRITE;
-
-		// Send the packet
-		dux_submit_transmit_entry(slot);
-
-		// Wait for a response
-		const struct kernel_ipc_packet *cce;
-		for (;;) {
-			slot = dux_get_received_entry(&cce);
-			if (slot == -1) {
-				// Do nothing
-			} else if (cce->opcode == KERNEL_IPC_OP_WRITE) {
-
-				// Note the amount of written data.
-				p += cce->length;
-				total_written += cce->length;
-				stream->_position += cce->length;
-
-				dux_pop_received_entry(slot);
-				break;
-			} else {
-				dux_defer_received_entry(slot);
+		if (stream->_buffer_index == stream->_buffer_size) {
+			if (__std_flush(stream) < 0) {
+				return total_written;
 			}
+			newline = 0;
+			__std_begin_write(stream);
 		}
+	}
 
-		// Check if the "stream" ended early
-		if (cce->length < max_size) {
-			break;
-		}
+	if (newline && stream->_buffer_mode == _IOLBF) {
+		__std_flush(stream);
 	}
 
 	return total_written;
 }
 
-int vfprintf(FILE * stream, const char *format, va_list args)
+/**
+ * A format sink that writes to a stream.
+ */
+struct __std_stream_sink {
+	struct std_format_sink sink;
+	FILE *stream;
+	// The start of the data written since the last flush.
+	char *start;
+	// Whether a newline has been written and the stream is line buffered.
+	int newline;
+	// Used if the stream is unbuffered.
+	char chunk[128];
+};
+
+/**
+ * Check if any of the characters written since the last flush is a newline.
+ */
+static void __std_stream_sink_scan(struct __std_stream_sink *s)
 {
-	char *out = universal_buffer;
-	int total_written = 0;
-
-	const char *c = format;
-
-	while (*c != '\0') {
-		// Fill out data
-		char *ptr = out;
-		while (*c != '\0') {
-			if (*c == '%') {
-				// It's an argument
-				struct std_format_type fty;
-				const char *end =
-				    __std_determine_format(c, &fty);
-				if (end != NULL) {
-					// Make a backup of args in case we need to revert
-					va_list bka;
-					va_copy(bka, args);
-					char *e = __std_format(ptr,
-							       universal_buffer_size
-							       - (ptr - out),
-							       &fty,
-							       &args);
-					if (e != NULL) {
-						ptr = e;
-						c = end;
-					} else {
-						// Don't write anything. Instead restore everything and try again next
-						// cycle.
-						// FIXME this will deadlock if any of the arguments is larger than the
-						// buffer capacity.
-						va_copy(args, bka);
-						break;
-					}
-				} else {
-					// Print invalid arguments normally
-					if (ptr - out < universal_buffer_size) {
-						*ptr++ = *c++;
-					}
-				}
-			} else {
-				// It's a regular ol' char
-				if (ptr - out < universal_buffer_size) {
-					*ptr++ = *c++;
-				}
-			}
+	if (s->stream->_buffer_mode != _IOLBF || s->newline) {
+		return;
+	}
+	for (const char *c = s->start; c != s->sink.buffer; c++) {
+		if (*c == '\n') {
+			s->newline = 1;
+			return;
 		}
+	}
+}
 
-		// Get a request entry
-		struct kernel_ipc_packet *pkt;
-		uint16_t slot = dux_reserve_transmit_entry(&pkt);
-
-		// Fill out the request entry
-		pkt->uuid = stream->_uuid;
-		pkt->flags = 0;
-		pkt->address = stream->_address;
-		pkt->offset = total_written;
-		pkt->name = NULL;
-		pkt->name_len = 0;
-		pkt->data.raw = universal_buffer;
-		pkt->length = ptr - out;
-		pkt->opcode = KERNEL_IPC_OP_WRITE;
-
-		// Send the packet
-		dux_submit_transmit_entry(slot);
-
-		// Wait for a response
-		const struct kernel_ipc_packet *cce;
-		for (;;) {
-			slot = dux_get_received_entry(&cce);
-			if (slot == -1) {
-				// Do nothing
-			} else if (cce->opcode == KERNEL_IPC_OP_WRITE) {
-
-				// Note the amount of written data.
-				total_written += cce->length;
-				stream->_position += cce->length;
-
-				dux_pop_received_entry(slot);
-				break;
-			} else {
-				for (;;) {}
-				dux_defer_received_entry(slot);
-			}
-			kernel_io_wait(-1);
-		}
+/**
+ * Hand any formatted data to the stream.
+ */
+static int __std_stream_sink_commit(struct __std_stream_sink *s)
+{
+	FILE *stream = s->stream;
+	if (s->sink.buffer == s->start) {
+		return 0;
+	}
+	if (s->start == s->chunk) {
+		size_t len = s->sink.buffer - s->chunk;
+		s->sink.buffer = s->chunk;
+		return __std_write_direct(stream, s->chunk, len) == len ? 0 : EOF;
 	}
+	__std_stream_sink_scan(s);
+	stream->_buffer_index = s->sink.buffer - stream->_buffer;
+	s->start = s->sink.buffer;
+	return 0;
+}
 
-	// TODO return the correct amount of bytes written
-	return total_written;
+/**
+ * Write the formatted data to the stream and make room for more.
+ */
+static int __std_stream_sink_flush(struct std_format_sink *sink)
+{
+	struct __std_stream_sink *s = (struct __std_stream_sink *)sink;
+	FILE *stream = s->stream;
+	if (__std_stream_sink_commit(s) < 0) {
+		return EOF;
+	}
+	if (s->start == s->chunk) {
+		return 0;
+	}
+	if (__std_flush(stream) < 0) {
+		return EOF;
+	}
+	__std_begin_write(stream);
+	s->newline = 0;
+	s->start = s->sink.buffer = stream->_buffer;
+	s->sink.end = stream->_buffer + stream->_buffer_size;
+	return 0;
+}
+
+int vfprintf(FILE * stream, const char *format, va_list args)
+{
+	struct __std_stream_sink s;
+	s.stream = stream;
+	s.newline = 0;
+	s.sink.count = 0;
+	s.sink.flush = __std_stream_sink_flush;
+
+	// Format straight into the stream buffer if there is one.
+	__std_begin_write(stream);
+	if (__std_init_buffer(stream) < 0) {
+		stream->_flags &= ~__STD_FILE_WRITING;
+		s.sink.buffer = s.chunk;
+		s.sink.end = s.chunk + sizeof(s.chunk);
+	} else {
+		s.sink.buffer = stream->_buffer + stream->_buffer_index;
+		s.sink.end = stream->_buffer + stream->_buffer_size;
+	}
+	s.start = s.sink.buffer;
+
+	va_list ap;
+	va_copy(ap, args);
+	size_t total = __std_format(&s.sink, format, &ap);
+	va_end(ap);
+
+	// A sink that failed to flush has been disabled.
+	int failed = s.sink.flush == NULL;
+	if (!failed) {
+		failed = __std_stream_sink_commit(&s) < 0;
+	}
+	if (!failed && s.newline) {
+		failed = __std_flush(stream) < 0;
+	}
+	if (failed) {
+		stream->_flags |= __STD_FILE_ERROR;
+		return EOF;
+	}
+	return total;
+}
+
+int vprintf(const char *format, va_list args)
+{
+	return vfprintf(stdout, format, args);
+}
+
+int vsnprintf(char *str, size_t size, const char *format, va_list args)
+{
+	// No flush callback, so anything past the end is only counted.
+	struct std_format_sink sink = {
+		.buffer = str,
+		.end = size > 0 ? str + size - 1 : str,
+		.flush = NULL,
+		.count = 0,
+	};
+
+	va_list ap;
+	va_copy(ap, args);
+	size_t total = __std_format(&sink, format, &ap);
+	va_end(ap);
+
+	if (size > 0) {
+		*sink.buffer = '\0';
+	}
+	return total;
+}
+
+int snprintf(char *str, size_t size, const char *format, ...)
+{
+	va_list vl;
+	va_start(vl, format);
+	int rc = vsnprintf(str, size, format, vl);
+	va_end(vl);
+	return rc;
+}
+
+int vsprintf(char *str, const char *format, va_list args)
+{
+	// The caller guarantees the buffer is large enough.
+	return vsnprintf(str, UINTPTR_MAX - (uintptr_t) str, format, args);
+}
+
+int sprintf(char *str, const char *format, ...)
+{
+	va_list vl;
+	va_start(vl, format);
+	int rc = vsprintf(str, format, vl);
+	va_end(vl);
+	return rc;
 }
@@ -1,14 +1,240 @@
 #include <stddef.h>
 #include <string.h>
 
-void *memcpy(void *dest, const void *src, size_t n)
+#include <stdint.h>
+
+// Word type used for the bulk copy & fill loops. may_alias is needed as the
+// words overlap with objects of any type.
+typedef uint64_t __attribute__((__may_alias__)) __std_word_t;
+
+#define WORD_SIZE   (sizeof(__std_word_t))
+#define WORD_MASK   (WORD_SIZE - 1)
+#define WORD_BITS   (WORD_SIZE * 8)
+#define WORD_ONES   ((__std_word_t)0x0101010101010101ULL)
+#define WORD_HIGHS  ((__std_word_t)0x8080808080808080ULL)
+
+// Below this size the setup cost of the word loops isn't worth it.
+#define WORD_THRESHOLD (WORD_SIZE * 2)
+
+// Check if any byte in a word is zero.
+#define WORD_HAS_ZERO(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
+#define IS_ALIGNED(p) (((uintptr_t)(p) & WORD_MASK) == 0)
+
+#ifdef __riscv_vector
+
+// The vector kernels are only used when the library is built for a target
+// with the V extension. User tasks can't read misa, so there is no way to
+// detect support at runtime.
+
+static void __std_memcpy_rvv(char *d, const char *s, size_t n)
 {
-	char *d = dest;
-	const char *s = src;
-	const char *e = s + n;
-	while (s != e) {
+	__asm__ __volatile__("1:\n\t"
+			     "vsetvli	t0, %2, e8, m8, ta, ma\n\t"
+			     "vle8.v	v8, (%1)\n\t"
+			     "add	%1, %1, t0\n\t"
+			     "sub	%2, %2, t0\n\t"
+			     "vse8.v	v8, (%0)\n\t"
+			     "add	%0, %0, t0\n\t"
+			     "bnez	%2, 1b\n\t":"+r"(d), "+r"(s), "+r"(n)
+			     ::"t0", "v8", "v9", "v10", "v11", "v12", "v13",
+			     "v14", "v15", "memory");
+}
+
+static void __std_memmove_back_rvv(char *d, const char *s, size_t n)
+{
+	// Copy chunks from the end so the source is read before it is overwritten.
+	d += n, s += n;
+	__asm__ __volatile__("1:\n\t"
+			     "vsetvli	t0, %2, e8, m8, ta, ma\n\t"
+			     "sub	%1, %1, t0\n\t"
+			     "sub	%0, %0, t0\n\t"
+			     "vle8.v	v8, (%1)\n\t"
+			     "sub	%2, %2, t0\n\t"
+			     "vse8.v	v8, (%0)\n\t"
+			     "bnez	%2, 1b\n\t":"+r"(d), "+r"(s), "+r"(n)
+			     ::"t0", "v8", "v9", "v10", "v11", "v12", "v13",
+			     "v14", "v15", "memory");
+}
+
+static void __std_memset_rvv(char *d, int c, size_t n)
+{
+	__asm__ __volatile__("vsetvli	t0, zero, e8, m8, ta, ma\n\t"
+			     "vmv.v.x	v8, %2\n\t"
+			     "1:\n\t"
+			     "vsetvli	t0, %1, e8, m8, ta, ma\n\t"
+			     "vse8.v	v8, (%0)\n\t"
+			     "add	%0, %0, t0\n\t"
+			     "sub	%1, %1, t0\n\t"
+			     "bnez	%1, 1b\n\t":"+r"(d), "+r"(n)
+			     :"r"(c)
+			     :"t0", "v8", "v9", "v10", "v11", "v12", "v13",
+			     "v14", "v15", "memory");
+}
+
+static size_t __std_strlen_rvv(const char *s)
+{
+	const char *p = s;
+	size_t vl;
+	long i;
+	// Fault-only-first loads stop at the first inaccessible byte instead of
+	// trapping, so reading past the terminator is safe.
+	__asm__ __volatile__("1:\n\t"
+			     "vsetvli	%1, zero, e8, m8, ta, ma\n\t"
+			     "vle8ff.v	v8, (%0)\n\t"
+			     "csrr	%1, vl\n\t"
+			     "vmseq.vi	v0, v8, 0\n\t"
+			     "vfirst.m	%2, v0\n\t"
+			     "add	%0, %0, %1\n\t"
+			     "bltz	%2, 1b\n\t":"+r"(p), "=&r"(vl), "=&r"(i)
+			     ::"v0", "v8", "v9", "v10", "v11", "v12", "v13",
+			     "v14", "v15", "memory");
+	return p - vl + i - s;
+}
+
+#endif
+
+/**
+ * Copy words forwards from a source with a different alignment than the
+ * (aligned) destination by shifting adjacent aligned source words together.
+ * This avoids misaligned loads, which may trap and be emulated.
+ */
+static void __std_copy_shifted(__std_word_t * d, const char *s, size_t words)
+{
+	size_t shift = ((uintptr_t) s & WORD_MASK) * 8;
+	const __std_word_t *ws = (const __std_word_t *)(s - shift / 8);
+	__std_word_t prev = *ws++;
+	for (; words >= 2; words -= 2) {
+		__std_word_t w0 = ws[0];
+		__std_word_t w1 = ws[1];
+		d[0] = (prev >> shift) | (w0 << (WORD_BITS - shift));
+		d[1] = (w0 >> shift) | (w1 << (WORD_BITS - shift));
+		prev = w1;
+		d += 2, ws += 2;
+	}
+	if (words > 0) {
+		__std_word_t w0 = *ws;
+		*d = (prev >> shift) | (w0 << (WORD_BITS - shift));
+	}
+}
+
+/**
+ * The backwards variant of __std_copy_shifted. The pointers point to the end
+ * of the regions.
+ */
+static void __std_copy_shifted_back(__std_word_t * d, const char *s,
+				    size_t words)
+{
+	size_t shift = ((uintptr_t) s & WORD_MASK) * 8;
+	const __std_word_t *ws = (const __std_word_t *)(s - shift / 8);
+	__std_word_t prev = *ws;
+	for (; words > 0; words--) {
+		__std_word_t w = *--ws;
+		*--d = (w >> shift) | (prev << (WORD_BITS - shift));
+		prev = w;
+	}
+}
+
+/**
+ * Copy forwards. The source is always read before the corresponding
+ * destination words are written, so this is also safe for overlapping
+ * regions if dest is below src.
+ */
+static void __std_copy_forward(char *d, const char *s, size_t n)
+{
+	if (n >= WORD_THRESHOLD) {
+		// Align the destination
+		while (!IS_ALIGNED(d)) {
+			*d++ = *s++;
+			n--;
+		}
+
+		size_t words = n / WORD_SIZE;
+		__std_word_t *wd = (__std_word_t *) d;
+		if (IS_ALIGNED(s)) {
+			const __std_word_t *ws = (const __std_word_t *)s;
+			for (; words >= 4; words -= 4) {
+				__std_word_t w0 = ws[0];
+				__std_word_t w1 = ws[1];
+				__std_word_t w2 = ws[2];
+				__std_word_t w3 = ws[3];
+				wd[0] = w0;
+				wd[1] = w1;
+				wd[2] = w2;
+				wd[3] = w3;
+				wd += 4, ws += 4;
+			}
+			for (; words > 0; words--) {
+				*wd++ = *ws++;
+			}
+		} else {
+			__std_copy_shifted(wd, s, words);
+		}
+		d += n & ~WORD_MASK;
+		s += n & ~WORD_MASK;
+		n &= WORD_MASK;
+	}
+
+	while (n-- > 0) {
 		*d++ = *s++;
 	}
+}
+
+/**
+ * Copy backwards, i.e. starting at the end. Used when dest is above src and
+ * the regions overlap.
+ */
+static void __std_copy_backward(char *d, const char *s, size_t n)
+{
+	d += n, s += n;
+
+	if (n >= WORD_THRESHOLD) {
+		// Align the (end of the) destination
+		while (!IS_ALIGNED(d)) {
+			*--d = *--s;
+			n--;
+		}
+
+		size_t words = n / WORD_SIZE;
+		__std_word_t *wd = (__std_word_t *) d;
+		if (IS_ALIGNED(s)) {
+			const __std_word_t *ws = (const __std_word_t *)s;
+			for (; words >= 4; words -= 4) {
+				__std_word_t w0 = ws[-1];
+				__std_word_t w1 = ws[-2];
+				__std_word_t w2 = ws[-3];
+				__std_word_t w3 = ws[-4];
+				wd[-1] = w0;
+				wd[-2] = w1;
+				wd[-3] = w2;
+				wd[-4] = w3;
+				wd -= 4, ws -= 4;
+			}
+			for (; words > 0; words--) {
+				*--wd = *--ws;
+			}
+		} else {
+			__std_copy_shifted_back(wd, s, words);
+		}
+		d -= n & ~WORD_MASK;
+		s -= n & ~WORD_MASK;
+		n &= WORD_MASK;
+	}
+
+	while (n-- > 0) {
+		*--d = *--s;
+	}
+}
+
+void *memcpy(void *dest, const void *src, size_t n)
+{
+#ifdef __riscv_vector
+	if (n > 0) {
+		__std_memcpy_rvv(dest, src, n);
+	}
+#else
+	__std_copy_forward(dest, src, n);
+#endif
 	return dest;
 }
 
@@ -16,19 +242,24 @@ void *memmove(void *dest, const void *src, size_t n)
 {
 	char *d = dest;
 	const char *s = src;
-	const char *e = s + n;
 	// Check the relative position of the pointers to make sure we don't accidently
 	// overwrite the data we're reading.
-	if (dest < src) {
-		while (s != e) {
-			*d++ = *s++;
-		}
+	if (d == s || n == 0) {
+		// Nothing to do
+	} else if (d < s || d >= s + n) {
+#ifdef __riscv_vector
+		// Each chunk is loaded completely before it is stored, so the
+		// forward kernel is also safe for overlapping regions.
+		__std_memcpy_rvv(d, s, n);
+#else
+		__std_copy_forward(d, s, n);
+#endif
 	} else {
-		d += n - 1;
-		e--, s--;
-		while (s != e) {
-			*d-- = *e--;
-		}
+#ifdef __riscv_vector
+		__std_memmove_back_rvv(d, s, n);
+#else
+		__std_copy_backward(d, s, n);
+#endif
 	}
 	return dest;
 }
@@ -36,20 +267,66 @@ void *memmove(void *dest, const void *src, size_t n)
 void *memset(void *dest, int c, size_t n)
 {
 	char *d = dest;
-	char *e = dest + n;
-	while (d != e) {
+#ifdef __riscv_vector
+	if (n > 0) {
+		__std_memset_rvv(d, c, n);
+	}
+#else
+	if (n >= WORD_THRESHOLD) {
+		// Align the destination
+		while (!IS_ALIGNED(d)) {
+			*d++ = c;
+			n--;
+		}
+
+		__std_word_t w = WORD_ONES * (unsigned char)c;
+		__std_word_t *wd = (__std_word_t *) d;
+		size_t words = n / WORD_SIZE;
+		for (; words >= 4; words -= 4) {
+			wd[0] = w;
+			wd[1] = w;
+			wd[2] = w;
+			wd[3] = w;
+			wd += 4;
+		}
+		for (; words > 0; words--) {
+			*wd++ = w;
+		}
+		d += n & ~WORD_MASK;
+		n &= WORD_MASK;
+	}
+
+	while (n-- > 0) {
 		*d++ = c;
 	}
+#endif
 	return dest;
 }
 
 size_t strlen(const char *s)
 {
+#ifdef __riscv_vector
+	return __std_strlen_rvv(s);
+#else
 	const char *e = s;
+	// Check byte-wise until we're aligned.
+	for (; !IS_ALIGNED(e); e++) {
+		if (*e == 0) {
+			return e - s;
+		}
+	}
+	// Aligned loads never cross a page boundary, so reading past the
+	// terminator is safe.
+	const __std_word_t *w = (const __std_word_t *)e;
+	while (!WORD_HAS_ZERO(*w)) {
+		w++;
+	}
+	e = (const char *)w;
 	while (*e != 0) {
 		e++;
 	}
 	return e - s;
+#endif
 }
 
 #include <kernel.h>
@@ -122,6 +399,137 @@ char *strncpy(char *dest, const char *src, size_t n)
 
 #include <stdio.h>
 
+#define TEST_MAX_ALIGN  (16)
+#define TEST_MAX_LENGTH (96)
+#define TEST_BENCH_SIZE (1 << 14)
+#define TEST_BENCH_RUNS (16)
+#define TEST_GUARD      ((char)0xa5)
+
+static char __std_test_a[TEST_BENCH_SIZE + TEST_MAX_ALIGN * 2]
+    __attribute__ ((__aligned__(64)));
+static char __std_test_b[TEST_BENCH_SIZE + TEST_MAX_ALIGN * 2]
+    __attribute__ ((__aligned__(64)));
+
+static uint64_t __std_test_cycles(void)
+{
+	uint64_t c;
+	__asm__ __volatile__("rdcycle %0":"=r"(c));
+	return c;
+}
+
+static void __std_test_fill(char *p, size_t n, unsigned seed)
+{
+	for (size_t i = 0; i < n; i++) {
+		p[i] = (char)(i * 7 + seed);
+	}
+}
+
+/**
+ * Copy every length up to TEST_MAX_LENGTH between every pair of alignments
+ * and check both the copied data and the bytes around it.
+ */
+static int __std_test_memcpy_check(void)
+{
+	int failures = 0;
+	for (size_t sa = 0; sa < WORD_SIZE; sa++) {
+		for (size_t da = 0; da < WORD_SIZE; da++) {
+			for (size_t n = 0; n <= TEST_MAX_LENGTH; n++) {
+				char *src = __std_test_a + sa;
+				char *dst = __std_test_b + da;
+				__std_test_fill(__std_test_a,
+						TEST_MAX_LENGTH + TEST_MAX_ALIGN,
+						n);
+				for (size_t i = 0;
+				     i < TEST_MAX_LENGTH + TEST_MAX_ALIGN;
+				     i++) {
+					__std_test_b[i] = TEST_GUARD;
+				}
+
+				memcpy(dst, src, n);
+
+				int ok = 1;
+				for (size_t i = 0; i < da; i++) {
+					ok &= __std_test_b[i] == TEST_GUARD;
+				}
+				for (size_t i = 0; i < n; i++) {
+					ok &= dst[i] == src[i];
+				}
+				ok &= dst[n] == TEST_GUARD;
+				if (!ok && failures++ < 8) {
+					printf("memcpy failed: src %zu, dst %zu, len %zu\n",
+					     sa, da, n);
+				}
+			}
+		}
+	}
+	return failures;
+}
+
+/**
+ * Move every length up to TEST_MAX_LENGTH between every pair of offsets
+ * within the same buffer, so both overlapping directions are exercised.
+ */
+static int __std_test_memmove_check(void)
+{
+	int failures = 0;
+	char *buf = __std_test_a;
+	char *ref = __std_test_b;
+	for (size_t so = 0; so < TEST_MAX_ALIGN; so++) {
+		for (size_t doff = 0; doff < TEST_MAX_ALIGN; doff++) {
+			for (size_t n = 0; n <= TEST_MAX_LENGTH; n++) {
+				size_t total = TEST_MAX_LENGTH + TEST_MAX_ALIGN;
+				__std_test_fill(buf, total, n);
+				__std_test_fill(ref, total, n);
+
+				// Reference result using a temporary copy
+				char tmp[TEST_MAX_LENGTH];
+				for (size_t i = 0; i < n; i++) {
+					tmp[i] = ref[so + i];
+				}
+				for (size_t i = 0; i < n; i++) {
+					ref[doff + i] = tmp[i];
+				}
+
+				memmove(buf + doff, buf + so, n);
+
+				int ok = 1;
+				for (size_t i = 0; i < total; i++) {
+					ok &= buf[i] == ref[i];
+				}
+				if (!ok && failures++ < 8) {
+					printf("memmove failed: src %zu, dst %zu, len %zu\n",
+					     so, doff, n);
+				}
+			}
+		}
+	}
+	return failures;
+}
+
+/**
+ * Measure the amount of cycles needed to copy TEST_BENCH_SIZE bytes for
+ * every pair of alignments.
+ */
+static void __std_test_bench(const char *name,
+			     void *(*fn)(void *, const void *, size_t))
+{
+	printf("%s throughput (%d bytes, cycles per run):\n", name,
+	       TEST_BENCH_SIZE);
+	for (size_t sa = 0; sa < WORD_SIZE; sa++) {
+		for (size_t da = 0; da < WORD_SIZE; da++) {
+			uint64_t best = -1;
+			for (int r = 0; r < TEST_BENCH_RUNS; r++) {
+				uint64_t start = __std_test_cycles();
+				fn(__std_test_b + da, __std_test_a + sa,
+				   TEST_BENCH_SIZE);
+				uint64_t delta = __std_test_cycles() - start;
+				best = delta < best ? delta : best;
+			}
+			printf("  src %zu, dst %zu: %lu\n", sa, da, best);
+		}
+	}
+}
+
 void __std_test_memmove(void)
 {
 	char buf[64] = { "kitty" };
@@ -140,6 +548,11 @@ void __std_test_memmove(void)
 	puts("Shifted 2 to the right:");
 	memmove(buf + 2, buf, 10);
 	puts(buf);
+
+	int failures = __std_test_memmove_check();
+	printf("Alignment checks: %d failures\n", failures);
+
+	__std_test_bench("memmove", memmove);
 }
 
 void __std_test_memcpy(void)
@@ -153,6 +566,11 @@ void __std_test_memcpy(void)
 	puts("Copy:");
 	memcpy(buf2, buf, sizeof(buf));
 	puts(buf2);
+
+	int failures = __std_test_memcpy_check();
+	printf("Alignment checks: %d failures\n", failures);
+
+	__std_test_bench("memcpy", memcpy);
 }
 
 #endif
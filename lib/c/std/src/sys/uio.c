@@ -2,85 +2,79 @@
 #include <errno.h>
 #include <dux.h>
 #include <kernel.h>
+#include <string.h>
 #include <sys/uio.h>
 
 // FIXME this is temporary as we currently rely on GCC's stddef, which doesn't have ssize_t
 typedef signed long ssize_t;
 
+/**
+ * Send out the data gathered in the universal buffer.
+ */
+static size_t __std_writev_send(size_t length, size_t offset)
+{
+	return __std_transfer(0, kernel_uuid(0, 0x12345678), NULL, offset,
+			      KERNEL_IPC_OP_WRITE, universal_buffer, length);
+}
+
 ssize_t writev(int fd, const struct iovec *iov, int iov_count)
 {
 	char *out = universal_buffer;
 	size_t total_written = 0;
-	int iov_offset = 0;
-	size_t iov_base_offset = 0;
+	size_t copied = 0;
 
-	// Loop until all data has been written out
-	for (;;) {
+	for (int i = 0; i < iov_count; i++) {
+		const char *in = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
 
-		// Copy data until the buffer is full or no data is left
-		size_t copied = 0;
-		{
-			for (; iov_offset < iov_count; iov_offset++) {
-				const char *in = iov[iov_offset].iov_base;
-				for (;
-				     iov_base_offset < iov[iov_offset].iov_len;
-				     iov_base_offset++) {
-					if (copied < universal_buffer_size) {
-						out[copied++] =
-						    in[iov_base_offset];
-					} else {
-						goto buffer_full;
-					}
+		if (left >= PAGE_SIZE) {
+			// Write out whatever precedes this vector first.
+			if (copied > 0) {
+				size_t w = __std_writev_send(copied, total_written);
+				total_written += w;
+				if (w < copied) {
+					return total_written;
 				}
-				iov_base_offset = 0;
+				copied = 0;
 			}
- buffer_full:		;
-		}
 
-		// If we didn't write any data, return
-		if (copied == 0) {
-			return total_written;
+			// Large vectors are sent (mostly) without copying.
+			size_t w = __std_transfer_buffer(0,
+							 kernel_uuid(0,
+								     0x12345678),
+							 NULL, total_written,
+							 KERNEL_IPC_OP_WRITE,
+							 (void *)in, left);
+			total_written += w;
+			if (w < left) {
+				return total_written;
+			}
+			continue;
 		}
 
-		// Get a request entry
-		struct kernel_ipc_packet *cre;
-		uint16_t slot = dux_reserve_transmit_entry(&cre);
-
-		// Fill out the request entry
-		cre->address = 0;
-		cre->uuid = kernel_uuid(0, 0x12345678);
-
-		cre->id = 0;
-
-		cre->name = NULL;
-		cre->name_len = 0;
+		// Gather small vectors in the buffer.
+		while (left > 0) {
+			size_t space = universal_buffer_size - copied;
+			size_t n = left < space ? left : space;
+			memcpy(out + copied, in, n);
+			copied += n;
+			in += n;
+			left -= n;
 
-		cre->flags = 0;
-		cre->offset = total_written;
-		cre->data.raw = universal_buffer;
-		cre->length = copied;
-
-		cre->opcode = KERNEL_IPC_OP_WRITE;
-
-		// Send the packet
-		dux_submit_transmit_entry(slot);
-
-		// Wait for a response
-		const struct kernel_ipc_packet *cce;
-		for (;;) {
-			slot = dux_get_received_entry(&cce);
-			if (slot == -1) {
-				// Do nothing
-			} else if (cce->opcode == KERNEL_IPC_OP_WRITE) {
-				// Note the amount written.
-				total_written += cce->length;
-
-				dux_pop_received_entry(slot);
-				break;
-			} else {
-				dux_defer_received_entry(slot);
+			if (copied == universal_buffer_size) {
+				size_t w = __std_writev_send(copied, total_written);
+				total_written += w;
+				if (w < copied) {
+					return total_written;
+				}
+				copied = 0;
 			}
-			kernel_io_wait(-1);
 		}
 	}
+
+	if (copied > 0) {
+		total_written += __std_writev_send(copied, total_written);
+	}
+
+	return total_written;
 }
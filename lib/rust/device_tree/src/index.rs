@@ -0,0 +1,558 @@
+//! # Flat index of a device tree
+//!
+//! Iterating the properties or children of a [`Node`] rescans the structure block every time.
+//! An [`Index`] is instead built in a single pass and records for each node its parent, first
+//! child and next sibling along with the location of its `compatible`, `reg` and `interrupts`
+//! properties. Nodes can be looked up by phandle and by compatible string in expected constant
+//! time.
+//!
+//! The index is stored in a single buffer provided by the caller, the size of which is returned
+//! by [`Index::required_size`].
+
+use crate::{DeviceTree, Node, ParseNodeError, Properties, Property};
+use core::convert::TryInto;
+use core::mem;
+use core::slice;
+
+/// Marks the absence of a node or entry.
+const NONE: u32 = u32::MAX;
+
+/// The maximum depth of nested nodes, including the root.
+const MAX_DEPTH: usize = 16;
+
+/// A range of bytes in the DTB.
+#[derive(Clone, Copy)]
+#[repr(C)]
+struct Span {
+	offset: u32,
+	len: u32,
+}
+
+impl Span {
+	const EMPTY: Self = Self { offset: 0, len: 0 };
+}
+
+/// A single node.
+#[derive(Clone, Copy)]
+#[repr(C)]
+struct Entry {
+	/// The offset of the first property in words.
+	properties: u32,
+	name: Span,
+	parent: u32,
+	first_child: u32,
+	next_sibling: u32,
+	phandle: u32,
+	/// The next node in the same phandle bucket.
+	next_phandle: u32,
+	compatible: Span,
+	reg: Span,
+	interrupts: Span,
+	/// `#address-cells`, `#size-cells` and `#interrupt-cells` of the parent, then of this node.
+	cells: [u8; 6],
+	_padding: [u8; 2],
+}
+
+/// A single string of the `compatible` property of a node.
+#[derive(Clone, Copy)]
+#[repr(C)]
+struct Compatible {
+	node: u32,
+	string: Span,
+	/// The next string in the same bucket.
+	next: u32,
+}
+
+/// A flat index of all nodes in a device tree.
+pub struct Index<'a, 's> {
+	dtb: DeviceTree<'a>,
+	/// All nodes in depth-first order, i.e. the root is first.
+	nodes: &'s [Entry],
+	compatibles: &'s [Compatible],
+	/// The first node of each phandle bucket.
+	phandles: &'s [u32],
+	/// The first compatible string of each bucket.
+	compatible_heads: &'s [u32],
+}
+
+/// A node in an [`Index`].
+#[derive(Clone, Copy)]
+pub struct IndexedNode<'i, 'a, 's> {
+	index: &'i Index<'a, 's>,
+	id: u32,
+}
+
+#[derive(Debug)]
+pub enum BuildError {
+	/// The structure block is malformed.
+	Parse(ParseNodeError),
+	/// The buffer is smaller than [`Index::required_size`].
+	BufferTooSmall,
+	/// The buffer isn't aligned to 4 bytes.
+	BadAlignment,
+	/// Nodes are nested deeper than is supported.
+	TooDeep,
+}
+
+impl From<ParseNodeError> for BuildError {
+	fn from(e: ParseNodeError) -> Self {
+		Self::Parse(e)
+	}
+}
+
+/// The amount of nodes and compatible strings in a tree.
+struct Counts {
+	nodes: usize,
+	compatibles: usize,
+}
+
+impl Counts {
+	fn buckets(n: usize) -> usize {
+		n.max(1).next_power_of_two()
+	}
+
+	fn size(&self) -> usize {
+		self.nodes * mem::size_of::<Entry>()
+			+ self.compatibles * mem::size_of::<Compatible>()
+			+ (Self::buckets(self.nodes) + Self::buckets(self.compatibles)) * mem::size_of::<u32>()
+	}
+}
+
+/// A token in the structure block.
+enum Token<'a> {
+	BeginNode { name: Span },
+	EndNode,
+	Prop { name: &'a [u8], value: Span },
+	End,
+}
+
+/// A cursor over the tokens of the structure block that skips `NOP`s.
+struct Tokens<'d, 'a> {
+	dtb: &'d DeviceTree<'a>,
+	/// The offset of the next token in words.
+	offset: u32,
+}
+
+impl<'a> Tokens<'_, 'a> {
+	fn next(&mut self) -> Result<Token<'a>, ParseNodeError> {
+		let dtb = self.dtb;
+		loop {
+			let token = dtb.get(self.offset).ok_or(ParseNodeError::TooShort)?;
+			self.offset += 1;
+			return Ok(match token {
+				Node::TOKEN_BEGIN_NODE => {
+					let name = dtb
+						.data
+						.get(self.offset as usize..)
+						.and_then(crate::cstr_to_str)
+						.ok_or(ParseNodeError::UnterminatedName)?;
+					let name = Span {
+						offset: self.offset * 4,
+						len: name.len() as u32,
+					};
+					// Include the null terminator.
+					self.offset += (name.len + 1 + 3) / 4;
+					Token::BeginNode { name }
+				}
+				Node::TOKEN_END_NODE => Token::EndNode,
+				Node::TOKEN_PROP => {
+					let len = dtb.get(self.offset).ok_or(ParseNodeError::TooShort)?;
+					let name = dtb.get(self.offset + 1).ok_or(ParseNodeError::TooShort)?;
+					let name = dtb.strings().get(name).ok_or(ParseNodeError::OutOfBounds)?;
+					let value = Span {
+						offset: (self.offset + 2) * 4,
+						len,
+					};
+					if (value.offset + value.len) as usize > dtb.data.len() * 4 {
+						return Err(ParseNodeError::TooShort);
+					}
+					self.offset += 2 + (len + 3) / 4;
+					Token::Prop { name, value }
+				}
+				Node::TOKEN_NOP => continue,
+				Node::TOKEN_END => Token::End,
+				_ => return Err(ParseNodeError::UnexpectedToken),
+			});
+		}
+	}
+}
+
+impl<'a, 's> Index<'a, 's> {
+	/// Return the size in bytes of the buffer needed to index the given tree.
+	pub fn required_size(dtb: &DeviceTree<'a>) -> Result<usize, ParseNodeError> {
+		Self::count(dtb).map(|c| c.size())
+	}
+
+	fn count(dtb: &DeviceTree<'a>) -> Result<Counts, ParseNodeError> {
+		let mut counts = Counts {
+			nodes: 0,
+			compatibles: 0,
+		};
+		let mut tokens = dtb.tokens();
+		loop {
+			match tokens.next()? {
+				Token::BeginNode { .. } => counts.nodes += 1,
+				Token::Prop { name, value } if name == b"compatible" => {
+					counts.compatibles += strings(dtb.bytes(value)).count();
+				}
+				Token::End => break Ok(counts),
+				_ => (),
+			}
+		}
+	}
+
+	/// Build an index of the given tree in `buffer`, which must be aligned to 4 bytes and be at
+	/// least [`required_size`](Self::required_size) bytes large.
+	pub fn build(dtb: DeviceTree<'a>, buffer: &'s mut [u8]) -> Result<Self, BuildError> {
+		let counts = Self::count(&dtb)?;
+		if buffer.as_ptr() as usize % mem::align_of::<Entry>() != 0 {
+			return Err(BuildError::BadAlignment);
+		}
+		if buffer.len() < counts.size() {
+			return Err(BuildError::BufferTooSmall);
+		}
+
+		// SAFETY: the buffer is large enough and properly aligned for all parts and all types
+		// consist only of integers, for which any bit pattern is valid.
+		let (nodes, compatibles, phandles, compatible_heads) = unsafe {
+			let p = buffer.as_mut_ptr();
+			let nodes = slice::from_raw_parts_mut(p.cast::<Entry>(), counts.nodes);
+			let p = p.add(mem::size_of_val(nodes));
+			let compatibles = slice::from_raw_parts_mut(p.cast::<Compatible>(), counts.compatibles);
+			let p = p.add(mem::size_of_val(compatibles));
+			let phandles =
+				slice::from_raw_parts_mut(p.cast::<u32>(), Counts::buckets(counts.nodes));
+			let p = p.add(mem::size_of_val(phandles));
+			let heads = slice::from_raw_parts_mut(p.cast(), Counts::buckets(counts.compatibles));
+			(nodes, compatibles, phandles, heads)
+		};
+
+		// Link all nodes in a single walk. The stack holds the ancestors of the current token and
+		// the last child that has been added to each of them.
+		let mut stack = [(NONE, NONE); MAX_DEPTH];
+		let mut depth = 0usize;
+		let mut count = 0;
+		let mut tokens = dtb.tokens();
+		loop {
+			match tokens.next()? {
+				Token::BeginNode { name } => {
+					let id = count as u32;
+					let (parent, cells) = match depth.checked_sub(1).map(|d| &mut stack[d]) {
+						Some((parent, last)) => {
+							match *last {
+								NONE => nodes[*parent as usize].first_child = id,
+								l => nodes[l as usize].next_sibling = id,
+							}
+							*last = id;
+							let c = nodes[*parent as usize].cells;
+							(*parent, [c[3], c[4], c[5]])
+						}
+						// If missing, assume 2 for address-cells and 1 for size-cells.
+						None => (NONE, [2, 1, 0]),
+					};
+					nodes[count] = Entry {
+						properties: tokens.offset,
+						name,
+						parent,
+						first_child: NONE,
+						next_sibling: NONE,
+						phandle: NONE,
+						next_phandle: NONE,
+						compatible: Span::EMPTY,
+						reg: Span::EMPTY,
+						interrupts: Span::EMPTY,
+						cells: [cells[0], cells[1], cells[2], 2, 1, 0],
+						_padding: [0; 2],
+					};
+					*stack.get_mut(depth).ok_or(BuildError::TooDeep)? = (id, NONE);
+					depth += 1;
+					count += 1;
+				}
+				Token::EndNode => {
+					depth = depth
+						.checked_sub(1)
+						.ok_or(ParseNodeError::UnexpectedToken)?;
+				}
+				Token::Prop { name, value } => {
+					let node = match depth.checked_sub(1) {
+						Some(d) => &mut nodes[stack[d].0 as usize],
+						None => return Err(ParseNodeError::UnexpectedToken.into()),
+					};
+					let bytes = dtb.bytes(value);
+					match name {
+						b"compatible" => node.compatible = value,
+						b"reg" => node.reg = value,
+						b"interrupts" => node.interrupts = value,
+						b"phandle" | b"linux,phandle" => node.phandle = cell(bytes)?,
+						b"#address-cells" => node.cells[3] = small_cell(bytes)?,
+						b"#size-cells" => node.cells[4] = small_cell(bytes)?,
+						b"#interrupt-cells" => node.cells[5] = small_cell(bytes)?,
+						_ => (),
+					}
+				}
+				Token::End => break,
+			}
+		}
+
+		// Fill the hash chains. Nodes are prepended in reverse so that lookups return them in
+		// depth-first order.
+		phandles.iter_mut().for_each(|h| *h = NONE);
+		compatible_heads.iter_mut().for_each(|h| *h = NONE);
+		let mut c = compatibles.len();
+		for (id, node) in nodes.iter_mut().enumerate().rev() {
+			if node.phandle != NONE {
+				let bucket = &mut phandles[node.phandle as usize & (phandles.len() - 1)];
+				node.next_phandle = *bucket;
+				*bucket = id as u32;
+			}
+			c -= strings(dtb.bytes(node.compatible)).count();
+			let mut offset = node.compatible.offset;
+			for (i, s) in strings(dtb.bytes(node.compatible)).enumerate() {
+				let string = Span {
+					offset,
+					len: s.len() as u32,
+				};
+				offset += string.len + 1;
+				let bucket = &mut compatible_heads[hash(s) & (compatible_heads.len() - 1)];
+				compatibles[c + i] = Compatible {
+					node: id as u32,
+					string,
+					next: *bucket,
+				};
+				*bucket = (c + i) as u32;
+			}
+		}
+
+		Ok(Self {
+			dtb,
+			nodes,
+			compatibles,
+			phandles,
+			compatible_heads,
+		})
+	}
+
+	/// Return the root node.
+	pub fn root(&self) -> IndexedNode<'_, 'a, 's> {
+		IndexedNode { index: self, id: 0 }
+	}
+
+	/// Iterate over all nodes in depth-first order.
+	pub fn iter(&self) -> impl Iterator<Item = IndexedNode<'_, 'a, 's>> + '_ {
+		(0..self.nodes.len() as u32).map(move |id| IndexedNode { index: self, id })
+	}
+
+	/// Return the node with the given phandle.
+	pub fn by_phandle(&self, phandle: u32) -> Option<IndexedNode<'_, 'a, 's>> {
+		let mut id = self.phandles[phandle as usize & (self.phandles.len() - 1)];
+		while id != NONE {
+			let node = &self.nodes[id as usize];
+			if node.phandle == phandle {
+				return Some(IndexedNode { index: self, id });
+			}
+			id = node.next_phandle;
+		}
+		None
+	}
+
+	/// Iterate over all nodes with the given string in their `compatible` property, in
+	/// depth-first order.
+	pub fn by_compatible<'i>(
+		&'i self,
+		compatible: &'i [u8],
+	) -> impl Iterator<Item = IndexedNode<'i, 'a, 's>> + 'i {
+		let heads = self.compatible_heads;
+		let mut c = heads[hash(compatible) & (heads.len() - 1)];
+		core::iter::from_fn(move || {
+			while c != NONE {
+				let entry = &self.compatibles[c as usize];
+				c = entry.next;
+				if self.dtb.bytes(entry.string) == compatible {
+					return Some(IndexedNode {
+						index: self,
+						id: entry.node,
+					});
+				}
+			}
+			None
+		})
+	}
+
+	/// Return the amount of nodes.
+	pub fn len(&self) -> usize {
+		self.nodes.len()
+	}
+
+	/// Return the tree this index was built from.
+	pub fn device_tree(&self) -> &DeviceTree<'a> {
+		&self.dtb
+	}
+}
+
+impl<'i, 'a, 's> IndexedNode<'i, 'a, 's> {
+	fn entry(&self) -> &'s Entry {
+		&self.index.nodes[self.id as usize]
+	}
+
+	fn get(&self, id: u32) -> Option<Self> {
+		(id != NONE).then(|| Self {
+			index: self.index,
+			id,
+		})
+	}
+
+	/// The name of the node, including the unit address.
+	pub fn name(&self) -> &'a [u8] {
+		self.index.dtb.bytes(self.entry().name)
+	}
+
+	pub fn parent(&self) -> Option<Self> {
+		self.get(self.entry().parent)
+	}
+
+	/// Iterate over the direct children of this node.
+	pub fn children(&self) -> impl Iterator<Item = Self> {
+		let mut next = self.get(self.entry().first_child);
+		core::iter::from_fn(move || {
+			let node = next?;
+			next = node.get(node.entry().next_sibling);
+			Some(node)
+		})
+	}
+
+	/// Iterate over all properties of this node.
+	pub fn properties(&self) -> impl Iterator<Item = Property<'a>> + 'i {
+		Properties {
+			dtb: &self.index.dtb,
+			offset: self.entry().properties,
+		}
+	}
+
+	pub fn phandle(&self) -> Option<u32> {
+		Some(self.entry().phandle).filter(|&p| p != NONE)
+	}
+
+	/// The raw value of the `compatible` property.
+	pub fn raw_compatible(&self) -> &'a [u8] {
+		self.index.dtb.bytes(self.entry().compatible)
+	}
+
+	/// Iterate over the strings in the `compatible` property.
+	pub fn compatible(&self) -> impl Iterator<Item = &'a [u8]> {
+		strings(self.raw_compatible())
+	}
+
+	/// The raw value of the `reg` property.
+	pub fn raw_reg(&self) -> &'a [u8] {
+		self.index.dtb.bytes(self.entry().reg)
+	}
+
+	/// Iterate over the address and size pairs in the `reg` property.
+	pub fn reg(&self) -> impl Iterator<Item = (u128, u128)> + 'a {
+		let (a, s) = (
+			self.address_cells() as usize * 4,
+			self.size_cells() as usize * 4,
+		);
+		let mut reg = self.raw_reg();
+		core::iter::from_fn(move || {
+			(a + s > 0 && reg.len() >= a + s).then(|| {
+				let (address, r) = reg.split_at(a);
+				let (size, r) = r.split_at(s);
+				reg = r;
+				(cells(address), cells(size))
+			})
+		})
+	}
+
+	/// The raw value of the `interrupts` property.
+	pub fn raw_interrupts(&self) -> &'a [u8] {
+		self.index.dtb.bytes(self.entry().interrupts)
+	}
+
+	/// Iterate over the cells of the `interrupts` property.
+	pub fn interrupts(&self) -> impl Iterator<Item = u32> + 'a {
+		self.raw_interrupts()
+			.chunks_exact(4)
+			.map(|c| u32::from_be_bytes(c.try_into().unwrap()))
+	}
+
+	/// The value of `#address-cells` of the parent, which applies to this node.
+	pub fn address_cells(&self) -> u32 {
+		self.entry().cells[0].into()
+	}
+
+	/// The value of `#size-cells` of the parent, which applies to this node.
+	pub fn size_cells(&self) -> u32 {
+		self.entry().cells[1].into()
+	}
+
+	/// The value of `#interrupt-cells` of the parent.
+	pub fn interrupt_cells(&self) -> u32 {
+		self.entry().cells[2].into()
+	}
+
+	/// The value of `#address-cells` of this node, which applies to its children.
+	pub fn child_address_cells(&self) -> u32 {
+		self.entry().cells[3].into()
+	}
+
+	/// The value of `#size-cells` of this node, which applies to its children.
+	pub fn child_size_cells(&self) -> u32 {
+		self.entry().cells[4].into()
+	}
+
+	/// The value of `#interrupt-cells` of this node.
+	pub fn child_interrupt_cells(&self) -> u32 {
+		self.entry().cells[5].into()
+	}
+}
+
+impl<'a> DeviceTree<'a> {
+	fn tokens(&self) -> Tokens<'_, 'a> {
+		Tokens {
+			dtb: self,
+			offset: u32::from(self.header().offset_structure_block) / 4,
+		}
+	}
+
+	/// Return the bytes of the given span.
+	fn bytes(&self, span: Span) -> &'a [u8] {
+		let data = self.data;
+		// SAFETY: the data is valid for its length in bytes.
+		let data = unsafe { slice::from_raw_parts(data.as_ptr().cast::<u8>(), data.len() * 4) };
+		&data[span.offset as usize..][..span.len as usize]
+	}
+}
+
+/// Iterate over the null-terminated strings in a property value.
+fn strings(value: &[u8]) -> impl Iterator<Item = &[u8]> {
+	let value = value.strip_suffix(b"\0").unwrap_or(value);
+	value.split(|&c| c == 0).filter(move |_| !value.is_empty())
+}
+
+/// Decode a single cell.
+fn cell(value: &[u8]) -> Result<u32, ParseNodeError> {
+	value
+		.try_into()
+		.map(u32::from_be_bytes)
+		.map_err(|_| ParseNodeError::BadCellsValue)
+}
+
+/// Decode the value of a `#...-cells` property.
+fn small_cell(value: &[u8]) -> Result<u8, ParseNodeError> {
+	cell(value)?
+		.try_into()
+		.map_err(|_| ParseNodeError::BadCellsValue)
+}
+
+/// Decode a big-endian value of up to four cells.
+fn cells(value: &[u8]) -> u128 {
+	value.iter().fold(0, |v, &b| (v << 8) | u128::from(b))
+}
+
+/// Hash a string with 64-bit FNV-1a.
+fn hash(s: &[u8]) -> usize {
+	s.iter().fold(0xcbf29ce484222325u64, |h, &b| {
+		(h ^ u64::from(b)).wrapping_mul(0x100000001b3)
+	}) as usize
+}
@@ -20,7 +20,12 @@ use core::mem;
 use core::slice;
 use simple_endian::{u32be, u64be};
 
+mod index;
+
+pub use index::{BuildError, Index, IndexedNode};
+
 /// A structure representing a device tree.
+#[derive(Clone, Copy)]
 pub struct DeviceTree<'a> {
 	data: &'a [u32],
 }
@@ -317,52 +322,7 @@ impl<'a, 'b> Node<'a, 'b> {
 
 	/// Return an iterator over all the properties of this node
 	pub fn properties(&self) -> impl Iterator<Item = Property<'b>> + fmt::Debug + '_ {
-		struct Iter<'a, 'b: 'a> {
-			dtb: &'a DeviceTree<'b>,
-			offset: u32,
-		}
-
-		impl<'a, 'b> Iterator for Iter<'a, 'b> {
-			type Item = Property<'b>;
-
-			fn next(&mut self) -> Option<Self::Item> {
-				#[cfg(debug_assertions)]
-				Node::is_token_valid(self.dtb, self.offset).expect("invalid token");
-				(self.dtb.get(self.offset) == Some(Node::TOKEN_PROP)).then(|| {
-					self.offset += 1;
-
-					let len = self.dtb.get(self.offset).unwrap();
-					self.offset += 1;
-
-					let name = self.dtb.get(self.offset).unwrap();
-					let name = self.dtb.strings().get(name).unwrap();
-					self.offset += 1;
-
-					let value = &self.dtb.data[self.offset.try_into().unwrap()..];
-					let value = unsafe {
-						slice::from_raw_parts(
-							value as *const _ as *const _,
-							value.len() * mem::size_of::<u32>(),
-						)
-					};
-					let value = &value[..len.try_into().unwrap()];
-					let size = u32::try_from(mem::align_of::<u32>()).unwrap();
-					self.offset += (u32::try_from(len).unwrap() + size - 1) / size;
-
-					Property { name, value }
-				})
-			}
-		}
-
-		impl fmt::Debug for Iter<'_, '_> {
-			fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
-				let &Iter { dtb, offset } = self;
-				let iter = Self { dtb, offset };
-				f.debug_list().entries(iter).finish()
-			}
-		}
-
-		Iter {
+		Properties {
 			dtb: self.dtb,
 			offset: self.properties,
 		}
@@ -492,6 +452,52 @@ impl fmt::Debug for Property<'_> {
 	}
 }
 
+/// An iterator over the properties of a node, starting at the given offset.
+struct Properties<'a, 'b: 'a> {
+	dtb: &'a DeviceTree<'b>,
+	offset: u32,
+}
+
+impl<'a, 'b> Iterator for Properties<'a, 'b> {
+	type Item = Property<'b>;
+
+	fn next(&mut self) -> Option<Self::Item> {
+		#[cfg(debug_assertions)]
+		Node::is_token_valid(self.dtb, self.offset).expect("invalid token");
+		(self.dtb.get(self.offset) == Some(Node::TOKEN_PROP)).then(|| {
+			self.offset += 1;
+
+			let len = self.dtb.get(self.offset).unwrap();
+			self.offset += 1;
+
+			let name = self.dtb.get(self.offset).unwrap();
+			let name = self.dtb.strings().get(name).unwrap();
+			self.offset += 1;
+
+			let value = &self.dtb.data[self.offset.try_into().unwrap()..];
+			let value = unsafe {
+				slice::from_raw_parts(
+					value as *const _ as *const _,
+					value.len() * mem::size_of::<u32>(),
+				)
+			};
+			let value = &value[..len.try_into().unwrap()];
+			let size = u32::try_from(mem::align_of::<u32>()).unwrap();
+			self.offset += (u32::try_from(len).unwrap() + size - 1) / size;
+
+			Property { name, value }
+		})
+	}
+}
+
+impl fmt::Debug for Properties<'_, '_> {
+	fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+		let &Properties { dtb, offset } = self;
+		let iter = Self { dtb, offset };
+		f.debug_list().entries(iter).finish()
+	}
+}
+
 /// Converts a null-terminated C string to a Rust `[u8]`.
 fn cstr_to_str<T>(s: &[T]) -> Option<&[u8]> {
 	let len = s.len() * mem::size_of::<T>();
@@ -527,4 +533,36 @@ mod test {
 		let data = Align(*include_bytes!("../test/qemu_system_riscv64.dtb"));
 		DeviceTree::parse(data.as_u32()).unwrap().root().unwrap();
 	}
+
+	#[test]
+	fn qemu_system_riscv64_index() {
+		let data = Align(*include_bytes!("../test/qemu_system_riscv64.dtb"));
+		let dtb = DeviceTree::parse(data.as_u32()).unwrap();
+		let mut buffer = vec![0u32; Index::required_size(&dtb).unwrap() / 4];
+		let buffer =
+			unsafe { slice::from_raw_parts_mut(buffer.as_mut_ptr().cast(), buffer.len() * 4) };
+		let index = Index::build(dtb, buffer).unwrap();
+
+		let root = index.root();
+		assert_eq!(root.name(), b"");
+		assert_eq!(
+			root.children().count(),
+			dtb.root().unwrap().children().count()
+		);
+
+		let plic = index.by_compatible(b"riscv,plic0").next().unwrap();
+		assert!(plic.name().starts_with(b"plic@"));
+		assert_eq!(plic.parent().unwrap().name(), b"soc");
+		assert_eq!(plic.reg().next(), Some((0xc00_0000, 0x21_0000)));
+		let phandle = plic.phandle().unwrap();
+		assert_eq!(index.by_phandle(phandle).unwrap().name(), plic.name());
+
+		for node in index.iter() {
+			if let Some(p) = node.phandle() {
+				assert_eq!(index.by_phandle(p).unwrap().name(), node.name());
+			}
+		}
+		assert!(index.by_compatible(b"virtio,mmio").count() > 0);
+		assert!(index.by_compatible(b"nonexistent").next().is_none());
+	}
 }
@@ -0,0 +1,256 @@
+//! # Shared-memory channels
+//!
+//! A channel is a byte ring buffer in pages shared between two tasks. One end only writes and
+//! the other only reads. The kernel is only involved when either end has to sleep, in which
+//! case the other end wakes it with a futex.
+//!
+//! The creator of a channel must pass the ID and the amount of pages to the peer somehow, e.g.
+//! with an IPC packet.
+
+use crate::mem;
+use crate::task::Address;
+use crate::Page;
+use core::ptr::NonNull;
+use core::sync::atomic::{self, AtomicU32, AtomicUsize, Ordering};
+
+/// The state of one end of the channel.
+#[repr(C, align(64))]
+struct End {
+	/// The total amount of bytes written or read.
+	index: AtomicUsize,
+	/// Whether the *other* end is sleeping until this end makes progress.
+	waiting: AtomicU32,
+}
+
+/// The header at the start of a channel. The data follows it.
+#[repr(C)]
+struct Header {
+	/// The end that is written by the producer.
+	head: End,
+	/// The end that is written by the consumer.
+	tail: End,
+}
+
+/// The end of a shared-memory channel.
+#[repr(C)]
+pub struct Channel {
+	header: NonNull<Header>,
+	/// The amount of bytes available for data.
+	capacity: usize,
+	/// The amount of pages of the channel.
+	pages: usize,
+}
+
+#[derive(Debug)]
+pub enum CreateError {
+	/// There is no free range large enough.
+	NoSpace,
+	/// There is no more memory available.
+	NoMemory,
+	/// The amount of pages is invalid.
+	BadSize,
+	/// The kernel can't create any more channels right now.
+	Unavailable,
+}
+
+#[derive(Debug)]
+pub enum OpenError {
+	/// There is no free range large enough.
+	NoSpace,
+	/// There is no channel with the given ID for this task.
+	NotFound,
+	/// The channel has a different amount of pages.
+	BadSize,
+}
+
+impl Channel {
+	/// Create a channel of `pages` pages that can be opened by the task at `peer`.
+	///
+	/// Returns the channel along with the ID the peer needs to open it.
+	pub fn create(pages: usize, peer: Address) -> Result<(Self, usize), CreateError> {
+		let address = mem::reserve_range(None, pages).map_err(|e| match e {
+			mem::ReserveError::NoSpace => CreateError::NoSpace,
+			mem::ReserveError::NoMemory => CreateError::NoMemory,
+		})?;
+		let ret = unsafe { kernel::chan_create(address.as_ptr(), pages, peer.into()) };
+		let err = match ret.status {
+			kernel::Return::OK => return Ok((unsafe { Self::new(address, pages) }, ret.value)),
+			kernel::Return::TOO_LONG => CreateError::BadSize,
+			kernel::Return::MEMORY_UNAVAILABLE => CreateError::NoMemory,
+			kernel::Return::UNAVAILABLE => CreateError::Unavailable,
+			r => unreachable!("{}", r),
+		};
+		let _ = mem::unreserve_range(address, pages);
+		Err(err)
+	}
+
+	/// Open the channel with the given ID and amount of pages.
+	pub fn open(id: usize, pages: usize) -> Result<Self, OpenError> {
+		let address = mem::reserve_range(None, pages).map_err(|_| OpenError::NoSpace)?;
+		let ret = unsafe { kernel::chan_open(id, address.as_ptr(), pages) };
+		let err = match ret.status {
+			kernel::Return::OK => return Ok(unsafe { Self::new(address, pages) }),
+			kernel::Return::NOT_FOUND => OpenError::NotFound,
+			kernel::Return::TOO_LONG => OpenError::BadSize,
+			r => unreachable!("{}", r),
+		};
+		let _ = mem::unreserve_range(address, pages);
+		Err(err)
+	}
+
+	/// # Safety
+	///
+	/// The pages are a mapped channel.
+	unsafe fn new(address: Page, pages: usize) -> Self {
+		Self {
+			header: address.as_non_null_ptr().cast(),
+			capacity: pages * Page::SIZE - core::mem::size_of::<Header>(),
+			pages,
+		}
+	}
+
+	/// Write as many bytes as fit without waiting. Returns the amount of bytes written.
+	///
+	/// Only one end of a channel may write.
+	pub fn try_write(&self, data: &[u8]) -> usize {
+		let header = self.header();
+		let head = header.head.index.load(Ordering::Relaxed);
+		let tail = header.tail.index.load(Ordering::Acquire);
+		let n = data.len().min(self.capacity - head.wrapping_sub(tail));
+		if n > 0 {
+			let (a, b) = self.split(head, n);
+			unsafe {
+				self.data(head).copy_from_nonoverlapping(data.as_ptr(), a);
+				self.data(0)
+					.copy_from_nonoverlapping(data.as_ptr().add(a), b);
+			}
+			header
+				.head
+				.index
+				.store(head.wrapping_add(n), Ordering::Release);
+			Self::wake(&header.head.waiting);
+		}
+		n
+	}
+
+	/// Write all bytes, waiting for the reader whenever the channel is full.
+	pub fn write(&self, mut data: &[u8]) {
+		let header = self.header();
+		while !data.is_empty() {
+			let n = self.try_write(data);
+			if n == 0 {
+				Self::wait(&header.tail.waiting, || self.free() > 0);
+			}
+			data = &data[n..];
+		}
+	}
+
+	/// Read as many bytes as are available without waiting. Returns the amount of bytes read.
+	///
+	/// Only one end of a channel may read.
+	pub fn try_read(&self, buffer: &mut [u8]) -> usize {
+		let header = self.header();
+		let tail = header.tail.index.load(Ordering::Relaxed);
+		let head = header.head.index.load(Ordering::Acquire);
+		let n = buffer.len().min(head.wrapping_sub(tail));
+		if n > 0 {
+			let (a, b) = self.split(tail, n);
+			unsafe {
+				buffer
+					.as_mut_ptr()
+					.copy_from_nonoverlapping(self.data(tail), a);
+				buffer
+					.as_mut_ptr()
+					.add(a)
+					.copy_from_nonoverlapping(self.data(0), b);
+			}
+			header
+				.tail
+				.index
+				.store(tail.wrapping_add(n), Ordering::Release);
+			Self::wake(&header.tail.waiting);
+		}
+		n
+	}
+
+	/// Read at least one byte, waiting for the writer if the channel is empty. Returns the
+	/// amount of bytes read.
+	pub fn read(&self, buffer: &mut [u8]) -> usize {
+		let header = self.header();
+		loop {
+			let n = self.try_read(buffer);
+			if n > 0 || buffer.is_empty() {
+				return n;
+			}
+			Self::wait(&header.head.waiting, || self.available() > 0);
+		}
+	}
+
+	/// The amount of bytes that can be read.
+	pub fn available(&self) -> usize {
+		let header = self.header();
+		let head = header.head.index.load(Ordering::Acquire);
+		head.wrapping_sub(header.tail.index.load(Ordering::Acquire))
+	}
+
+	/// The amount of bytes that can be written.
+	pub fn free(&self) -> usize {
+		self.capacity - self.available()
+	}
+
+	/// The amount of pages of this channel.
+	pub fn pages(&self) -> usize {
+		self.pages
+	}
+
+	/// Wake the other end if it is waiting on the given word.
+	fn wake(waiting: &AtomicU32) {
+		// Ensure the index is visible before checking whether the other end is waiting.
+		atomic::fence(Ordering::SeqCst);
+		if waiting.load(Ordering::Relaxed) != 0 && waiting.swap(0, Ordering::Relaxed) != 0 {
+			let _ = unsafe { kernel::task_futex(kernel::futex::WAKE, Self::word(waiting), 1, 0) };
+		}
+	}
+
+	/// Sleep on the given word unless `ready` returns `true` after announcing it.
+	fn wait(waiting: &AtomicU32, ready: impl Fn() -> bool) {
+		waiting.store(1, Ordering::SeqCst);
+		if ready() {
+			waiting.store(0, Ordering::Relaxed);
+			return;
+		}
+		// The other end clears the word before waking us, so this returns immediately if
+		// it made progress in the meantime.
+		let _ =
+			unsafe { kernel::task_futex(kernel::futex::WAIT, Self::word(waiting), 1, u64::MAX) };
+	}
+
+	fn word(waiting: &AtomicU32) -> *const u32 {
+		waiting as *const AtomicU32 as *const u32
+	}
+
+	/// Split a range starting at the given index in the part up to the end of the buffer
+	/// and the part that wraps around.
+	fn split(&self, index: usize, count: usize) -> (usize, usize) {
+		let a = count.min(self.capacity - index % self.capacity);
+		(a, count - a)
+	}
+
+	/// Return a pointer to the byte at the given index.
+	fn data(&self, index: usize) -> *mut u8 {
+		unsafe {
+			self.header
+				.as_ptr()
+				.add(1)
+				.cast::<u8>()
+				.add(index % self.capacity)
+		}
+	}
+
+	fn header(&self) -> &Header {
+		unsafe { self.header.as_ref() }
+	}
+}
+
+// SAFETY: all shared state is accessed atomically.
+unsafe impl Send for Channel {}
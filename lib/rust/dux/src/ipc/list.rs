@@ -4,6 +4,16 @@ use core::mem;
 use core::slice;
 use core::str;
 
+/// The maximum amount of entries a server returns for a single `List` request.
+///
+/// The `offset` of a request is the index of the first entry to return. The `offset` of the
+/// response is the index to pass in the next request, or [`END`] if there are no more entries.
+/// This way huge listings are streamed in fixed-size batches.
+pub const BATCH_ENTRIES: usize = 64;
+
+/// The offset returned when there are no more entries.
+pub const END: u64 = u64::MAX;
+
 /// A listing of an object's children.
 #[repr(C)]
 pub struct List<'a> {
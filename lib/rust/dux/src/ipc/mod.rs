@@ -1,4 +1,6 @@
 pub mod list;
+pub mod server;
+pub mod tag;
 
 // Re-export the transmit & receive functions in the "right" module.
 pub use crate::mem::ipc::*;
@@ -0,0 +1,63 @@
+//! # Event-driven servers
+//!
+//! A server that has to wait on other tasks while handling a request would stall all of its
+//! other clients if it handled requests one by one. Instead, handling is split up in steps
+//! that never wait. [`serve`] takes in new requests while there is room for them and advances
+//! every request in turn, only sleeping when none of them can make progress.
+//!
+//! Steps that are blocked are retried after the next wake-up, which is caused either by a new
+//! request or by a completion of a request the server made itself, e.g. with [`tag`].
+//!
+//! [`tag`]: super::tag
+
+use crate::ipc;
+
+/// The result of advancing a request.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Step {
+	/// The request has been handled and its slot can be reused.
+	Done,
+	/// The request made progress but isn't finished yet.
+	Progress,
+	/// The request can't make progress until a packet is received.
+	Blocked,
+}
+
+/// Handle requests with up to `slots.len()` of them in progress at once.
+///
+/// Only received packets for which `filter` returns `true` are taken in as requests. Others,
+/// such as completions, are left in the ring buffer. `accept` turns each packet into the state
+/// of a request, after which the packet is released, and `step` advances a request.
+pub fn serve<T>(
+	slots: &mut [Option<T>],
+	mut filter: impl FnMut(&kernel::ipc::Packet) -> bool,
+	mut accept: impl FnMut(&kernel::ipc::Packet) -> T,
+	mut step: impl FnMut(&mut T) -> Step,
+) -> ! {
+	loop {
+		let mut idle = true;
+
+		for slot in slots.iter_mut().filter(|s| s.is_none()) {
+			match ipc::try_receive_matching(&mut filter) {
+				Some(rxq) => *slot = Some(accept(&rxq)),
+				None => break,
+			}
+			idle = false;
+		}
+
+		for slot in slots.iter_mut() {
+			if let Some(request) = slot {
+				match step(request) {
+					Step::Done => *slot = None,
+					Step::Progress => (),
+					Step::Blocked => continue,
+				}
+				idle = false;
+			}
+		}
+
+		if idle {
+			unsafe { kernel::io_wait(u64::MAX) };
+		}
+	}
+}
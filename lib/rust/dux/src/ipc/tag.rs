@@ -0,0 +1,138 @@
+//! # Request tags
+//!
+//! Tags are stored in the `id` field of a packet and are used to match completions to the
+//! requests that caused them, which allows keeping multiple requests in flight at once.
+//!
+//! This relies on servers copying the `id` of a request to its completion. A completion is
+//! matched on both the address of the peer it came from and its tag, so packets from other
+//! tasks that happen to carry the same `id` are never mistaken for it.
+//!
+//! Requests submitted with [`submit`] are tracked per tag. When a thread polls for a tag, all
+//! completions in its received ring buffer are moved out of the ring and assigned to their
+//! tag. Waiters can then pick up their completion directly instead of scanning the ring
+//! buffer again, and the completions don't get in the way of regular receivers.
+
+use crate::ipc;
+use core::sync::atomic::{AtomicU16, AtomicU64, AtomicUsize, Ordering};
+
+/// A bitmap of all tags that are currently in use.
+static TAGS: [AtomicU64; 4] = [
+	AtomicU64::new(0),
+	AtomicU64::new(0),
+	AtomicU64::new(0),
+	AtomicU64::new(0),
+];
+
+/// The thread that submitted the request of each tag, or `0` if there is no outstanding request.
+///
+/// Only the submitting thread ever sets or clears its own entries.
+static OWNER: [AtomicUsize; 256] = [ZERO_USIZE; 256];
+
+/// The address the request of each tag was sent to.
+static DESTINATION: [AtomicUsize; 256] = [ZERO_USIZE; 256];
+
+/// The slot of the completion of each tag plus one, or `0` if it hasn't been received yet.
+static PENDING: [AtomicU16; 256] = [ZERO_U16; 256];
+
+const ZERO_USIZE: AtomicUsize = AtomicUsize::new(0);
+const ZERO_U16: AtomicU16 = AtomicU16::new(0);
+
+/// Error returned when all tags are in use.
+#[derive(Debug)]
+pub struct NoFreeTags;
+
+/// Allocate an unused tag.
+pub fn allocate() -> Result<u8, NoFreeTags> {
+	for (i, word) in TAGS.iter().enumerate() {
+		let mut v = word.load(Ordering::Relaxed);
+		while v != u64::MAX {
+			let bit = (!v).trailing_zeros();
+			match word.compare_exchange_weak(
+				v,
+				v | (1 << bit),
+				Ordering::Acquire,
+				Ordering::Relaxed,
+			) {
+				Ok(_) => return Ok((i * 64) as u8 + bit as u8),
+				Err(nv) => v = nv,
+			}
+		}
+	}
+	Err(NoFreeTags)
+}
+
+/// Release a tag so it can be reused.
+///
+/// # Panics
+///
+/// The tag isn't in use.
+pub fn free(tag: u8) {
+	let (i, bit) = (usize::from(tag / 64), tag % 64);
+	let prev = TAGS[i].fetch_and(!(1 << bit), Ordering::Release);
+	assert_ne!(prev & (1 << bit), 0, "tag wasn't in use");
+}
+
+/// Allocate a tag and transmit a request with it.
+///
+/// The completion must be retrieved with [`poll`] or [`wait`] by the same thread.
+pub fn submit(packet: &kernel::ipc::Packet) -> Result<u8, NoFreeTags> {
+	let tag = allocate()?;
+	let i = usize::from(tag);
+	DESTINATION[i].store(packet.address, Ordering::Relaxed);
+	OWNER[i].store(owner(), Ordering::Relaxed);
+	*ipc::transmit() = kernel::ipc::Packet {
+		id: tag,
+		..packet.clone()
+	};
+	Ok(tag)
+}
+
+/// Return the completion of the request with the given tag, if it has been received.
+///
+/// The tag is freed if a completion is returned.
+pub fn poll(tag: u8) -> Option<ipc::Completion> {
+	let i = usize::from(tag);
+	debug_assert_eq!(
+		OWNER[i].load(Ordering::Relaxed),
+		owner(),
+		"tag not owned by thread"
+	);
+	if PENDING[i].load(Ordering::Relaxed) == 0 {
+		ipc::route_received(route);
+	}
+	let slot = PENDING[i].swap(0, Ordering::Relaxed).checked_sub(1)?;
+	OWNER[i].store(0, Ordering::Relaxed);
+	free(tag);
+	// SAFETY: the slot was claimed by route and is only returned once.
+	Some(unsafe { ipc::Completion::from_raw(slot) })
+}
+
+/// Wait for the completion of the request with the given tag.
+///
+/// The tag is freed.
+pub fn wait(tag: u8) -> ipc::Completion {
+	loop {
+		if let Some(c) = poll(tag) {
+			return c;
+		}
+		unsafe { kernel::io_wait(u64::MAX) };
+	}
+}
+
+/// Claim a received packet if it is the completion of an outstanding request of this thread,
+/// i.e. it has the tag of the request and comes from the task the request was sent to.
+fn route(slot: u16, packet: &kernel::ipc::Packet) -> bool {
+	let i = usize::from(packet.id);
+	let claim = OWNER[i].load(Ordering::Relaxed) == owner()
+		&& DESTINATION[i].load(Ordering::Relaxed) == packet.address
+		&& PENDING[i].load(Ordering::Relaxed) == 0;
+	if claim {
+		PENDING[i].store(slot + 1, Ordering::Relaxed);
+	}
+	claim
+}
+
+/// Return an identifier of the current thread that is never `0`.
+fn owner() -> usize {
+	kernel::thread_pointer() as usize | 1
+}
@@ -27,13 +27,42 @@ struct MemoryMap {
 	end: Cell<*mut kernel::Page>,
 }
 
-/// Part of the global structure but separate to account for be able to account for memory size.
+/// The IPC queues of a single thread.
+///
+/// The main thread uses the queues in `GLOBAL`. Other threads store them at the start of the
+/// block their thread pointer points to.
 #[repr(C)]
-struct GlobalPart {
+pub struct Queues {
 	/// The table of IPC packets as well as the transmit & receive buffers & free stack.
 	ipc_packets: Cell<*mut kernel::ipc::Packet>,
 
+	/// The mask of the ring buffers, which is the length of the buffer `- 1`.
+	ring_mask: Cell<u16>,
+
+	/// The slot index of the last processed received packet.
+	last_received_index: Cell<u16>,
+
+	/// The position in the transmit ring buffer of the next packet to be submitted.
+	///
+	/// Each submitter reserves a position by incrementing this, which allows multiple threads
+	/// to submit packets without locking.
+	transmit_reserved: AtomicU16,
+
+	/// A lock for the received ring buffer.
+	///
+	/// `false` means the lock is open, `true` means it is locked.
+	received_lock: AtomicBool,
+}
+
+/// Part of the global structure but separate to account for be able to account for memory size.
+#[repr(C)]
+struct GlobalPart {
+	/// The IPC queues of the main thread.
+	queues: Queues,
+
 	/// A list of free ranges for use with IPC.
+	///
+	/// This list is shared by all threads.
 	free_ranges: Cell<*mut kernel::ipc::FreePage>,
 
 	/// A pointer to extra reserved entries.
@@ -51,22 +80,6 @@ struct GlobalPart {
 	///
 	/// If it is 0, the list is locked.
 	free_ranges_capacity: AtomicUsize,
-
-	/// The mask of the ring buffers, which is the length of the buffer `- 1`.
-	ring_mask: Cell<u16>,
-
-	/// The slot index of the last processed received packet.
-	last_received_index: Cell<u16>,
-
-	/// A lock for the transmit ring buffer.
-	///
-	/// `false` means the lock is open, `true` means it is locked.
-	transmit_lock: AtomicBool,
-
-	/// A lock for the received ring buffer.
-	///
-	/// `false` means the lock is open, `true` means it is locked.
-	received_lock: AtomicBool,
 }
 
 /// The whole memory management structure.
@@ -95,6 +108,14 @@ const GLOBAL_PTR: *mut Global = (0x0fff_ffff & !(kernel::Page::SIZE - 1)) as *mu
 
 const GLOBAL_PAGE: Page = unsafe { Page::new_unchecked(GLOBAL_PTR.cast()) };
 
+/// The amount of packet slots of each thread.
+///
+/// Use enough slots to keep several requests in flight at once.
+const PACKETS_COUNT: u16 = 16;
+
+/// The amount of entries in the free range list.
+const FREE_RANGES_LEN: usize = 12;
+
 // Lol, lmao, this won't backfire, pinky promise.
 const GLOBAL: Magic = Magic;
 
@@ -117,7 +138,8 @@ pub unsafe fn init() {
 	// FIXME need a mem_get_mappings syscall of sorts.
 
 	// Allocate a page for the global struct.
-	let ret = kernel::mem_alloc(GLOBAL_PTR.cast(), 1, kernel::PROT_READ_WRITE);
+	let flags = kernel::PROT_READ_WRITE | kernel::MEM_PREFAULT;
+	let ret = kernel::mem_alloc(GLOBAL_PTR.cast(), 1, flags);
 	if ret.status != 0 {
 		// FIXME handle errors properly
 		todo!()
@@ -147,28 +169,8 @@ pub unsafe fn init() {
 	GLOBAL.part.reserved_count.set(3);
 
 	// Set up IPC queues
-	let packets_count = 4;
-
-	// Reserve pages for IPC
 	// FIXME handle errors properly
-	let addr = reserve_range(None, 8).unwrap();
-	let ret = kernel::mem_alloc(addr.as_ptr(), 1, kernel::PROT_READ_WRITE);
-	if ret.status != 0 {
-		// FIXME handle errors properly
-		todo!()
-	}
-
-	GLOBAL
-		.part
-		.ipc_packets
-		.set(addr.as_ptr().cast::<kernel::ipc::Packet>());
-	GLOBAL.part.last_received_index.set(0);
-	GLOBAL.part.ring_mask.set(packets_count - 1);
-
-	// Push the slots on the free stack
-	for slot in 0..packets_count {
-		ipc::push_free_slot(slot);
-	}
+	let packets = allocate_queues(&GLOBAL.part.queues).unwrap();
 
 	// Reserve pages for free ranges
 	// FIXME handle errors properly
@@ -179,30 +181,94 @@ pub unsafe fn init() {
 		todo!()
 	}
 	let free_ranges = addr.as_ptr().cast();
-	let free_ranges_len = 12;
 	GLOBAL.part.free_ranges.set(free_ranges);
 	GLOBAL
 		.part
 		.free_ranges_capacity
-		.store(free_ranges_len, Ordering::Release);
+		.store(FREE_RANGES_LEN, Ordering::Release);
 
 	// Set a range to which pages can be mapped to.
-	let free_ranges = slice::from_raw_parts_mut(free_ranges, free_ranges_len);
-	let count = free_ranges_len; // The effective maximum right now.
+	//
+	// Every in-flight packet with data needs its own range, so make it large enough to hold
+	// multiple multi-page packets.
+	let count = 64;
 	let addr = reserve_range(None, count).unwrap();
 	ipc::add_free_range(addr, count).unwrap();
 
 	// Register the queues to the kernel
-	let ret = kernel::io_set_queues(
-		GLOBAL.part.ipc_packets.get(),
-		(packets_count - 1).count_ones() as u8,
-		free_ranges.as_ptr() as *mut _,
-		free_ranges.len(),
-	);
+	// FIXME handle errors properly
+	register_queues(packets).unwrap();
+}
+
+/// Allocate a packet table with rings & a free stack and push all slots on the stack.
+///
+/// # Safety
+///
+/// The queues may not be in use.
+unsafe fn allocate_queues(queues: &Queues) -> Result<Page, ReserveError> {
+	// The queues are used for every packet, so don't wait for the first one to allocate them.
+	let addr = reserve_range(None, 1)?;
+	let flags = kernel::PROT_READ_WRITE | kernel::MEM_PREFAULT;
+	let ret = kernel::mem_alloc(addr.as_ptr(), 1, flags);
 	if ret.status != 0 {
-		// FIXME handle errors properly
-		todo!()
+		let _ = unreserve_range(addr, 1);
+		return Err(ReserveError::NoMemory);
 	}
+
+	queues
+		.ipc_packets
+		.set(addr.as_ptr().cast::<kernel::ipc::Packet>());
+	queues.last_received_index.set(0);
+	queues.transmit_reserved.store(0, Ordering::Relaxed);
+	queues.ring_mask.set(PACKETS_COUNT - 1);
+
+	// Mark all transmit entries as unwritten
+	let (_, entries) = ipc::transmit_ring(queues);
+	for e in entries {
+		e.store(ipc::TRANSMIT_EMPTY, Ordering::Relaxed);
+	}
+
+	// Push the slots on the free stack
+	for slot in 0..PACKETS_COUNT {
+		ipc::push_free_slot_of(queues, slot);
+	}
+	Ok(addr)
+}
+
+/// Register the queues at the given address to the kernel for the current task.
+unsafe fn register_queues(packets: Page) -> Result<(), ()> {
+	let ret = kernel::io_set_queues(
+		packets.as_ptr().cast(),
+		(PACKETS_COUNT - 1).count_ones() as u8,
+		GLOBAL.part.free_ranges.get(),
+		FREE_RANGES_LEN,
+	);
+	(ret.status == 0).then(|| ()).ok_or(())
+}
+
+/// Set up the IPC queues of the current thread.
+///
+/// # Safety
+///
+/// The thread pointer must point to a zeroed `Queues` structure which outlives the thread.
+///
+/// It may only be called once per thread and must not be called by the main thread.
+pub unsafe fn init_thread() -> Result<(), ReserveError> {
+	let queues = kernel::thread_pointer()
+		.cast::<Queues>()
+		.as_ref()
+		.expect("no thread pointer");
+	let packets = allocate_queues(queues)?;
+	register_queues(packets).map_err(|()| {
+		deallocate_range(packets, 1);
+		ReserveError::NoMemory
+	})
+}
+
+/// Return the IPC queues of the current thread.
+fn queues() -> &'static Queues {
+	// SAFETY: the thread pointer is either null or points to the queues of the thread.
+	unsafe { kernel::thread_pointer().cast::<Queues>().as_ref() }.unwrap_or(&GLOBAL.part.queues)
 }
 
 /// Insert a memory reservation entry. The index must be lower than reserved_count.
@@ -364,26 +430,43 @@ pub(crate) mod ipc {
 	///
 	/// This will yield the task if no slots are available.
 	pub fn transmit() -> TransmitLock {
-		let _ = util::SpinLockGuard::new(&GLOBAL.part.transmit_lock, true).into_raw();
 		loop {
 			match pop_free_slot() {
 				Ok(slot) => return TransmitLock { slot },
-				Err(NoFreeSlots) => unsafe {
-					let _ = kernel::io_wait(u64::MAX);
-				},
+				Err(NoFreeSlots) => {
+					// Delivering packets frees their slots, so only wait if none could be
+					// delivered.
+					if submit() == 0 {
+						unsafe { kernel::io_wait(u64::MAX) };
+					}
+				}
 			}
 		}
 	}
 
+	/// Deliver all packets queued for transmission without waiting.
+	///
+	/// Returns the amount of packets delivered.
+	pub fn submit() -> usize {
+		unsafe { kernel::io_submit(usize::MAX, 0, 0) }.value
+	}
+
+	/// Deliver all packets queued for transmission, then wait until `count` more packets
+	/// have been received or `time` has passed.
+	///
+	/// Returns the amount of packets delivered.
+	pub fn submit_and_wait(count: u16, time: u64) -> usize {
+		unsafe { kernel::io_submit(usize::MAX, count.into(), time) }.value
+	}
+
 	/// Attempt to reserve a slot for sendng an IPC packet to a task.
 	pub fn try_transmit() -> Result<TransmitLock, NoFreeSlots> {
-		let guard = util::SpinLockGuard::new(&GLOBAL.part.transmit_lock, true);
-		let slot = pop_free_slot()?;
-		let _ = guard.into_raw();
-		Ok(TransmitLock { slot })
+		pop_free_slot().map(|slot| TransmitLock { slot })
 	}
 
-	/// A lock on the transmit queue along with the slot of the packet to write to.
+	/// A reserved slot for a packet to be transmitted. The packet is submitted on drop.
+	///
+	/// Multiple slots can be reserved at once, including by different threads.
 	pub struct TransmitLock {
 		slot: u16,
 	}
@@ -398,6 +481,61 @@ pub(crate) mod ipc {
 		pub unsafe fn from_raw(slot: u16) -> Self {
 			Self { slot }
 		}
+
+		/// Submit the packet and return a handle to check whether the kernel has taken it out
+		/// of the ring buffer, after which any ranges it refers to may be freed.
+		pub fn transmitted(self) -> Transmitted {
+			let (slot, position) = (self.slot, self.publish());
+			mem::forget(self);
+			Transmitted { slot, position }
+		}
+
+		/// Put the slot in the ring buffer and return its position.
+		fn publish(&self) -> u16 {
+			let queues = queues();
+			let (index, entries) = unsafe { transmit_ring(queues) };
+			let mask = queues.ring_mask.get();
+
+			let position = queues.transmit_reserved.fetch_add(1, Ordering::Relaxed);
+			entries[usize::from(position & mask)].store(self.slot, Ordering::SeqCst);
+
+			// Advance the index past all written entries. Threads that reserved an earlier
+			// position but haven't written it yet will advance past this entry once they do,
+			// so there is no need to wait for them.
+			//
+			// The index must not pass the reserved positions: if the ring is full the entries
+			// after them are from the previous lap and may not have been consumed yet.
+			let mut i = index.load(Ordering::SeqCst);
+			while i != queues.transmit_reserved.load(Ordering::SeqCst)
+				&& entries[usize::from(i & mask)].load(Ordering::SeqCst) != TRANSMIT_EMPTY
+			{
+				let next = i.wrapping_add(1);
+				match index.compare_exchange_weak(i, next, Ordering::SeqCst, Ordering::SeqCst) {
+					Ok(_) => i = next,
+					Err(v) => i = v,
+				}
+			}
+			position
+		}
+	}
+
+	/// A packet that has been submitted with [`TransmitLock::transmitted`].
+	pub struct Transmitted {
+		slot: u16,
+		position: u16,
+	}
+
+	impl Transmitted {
+		/// Whether the kernel has taken the packet out of the ring buffer.
+		///
+		/// If the slot is reused for a packet that lands on the same entry a lap later, this
+		/// returns `false` until that packet is taken as well, so it is never early.
+		pub fn is_consumed(&self) -> bool {
+			let queues = queues();
+			let (_, entries) = unsafe { transmit_ring(queues) };
+			let mask = queues.ring_mask.get();
+			entries[usize::from(self.position & mask)].load(Ordering::SeqCst) != self.slot
+		}
 	}
 
 	impl ops::Deref for TransmitLock {
@@ -416,13 +554,7 @@ pub(crate) mod ipc {
 
 	impl Drop for TransmitLock {
 		fn drop(&mut self) {
-			let (index, entries) = unsafe { transmit_ring() };
-			let mask = GLOBAL.part.ring_mask.get();
-
-			entries[usize::from(*index & mask)] = self.slot;
-			*index = index.wrapping_add(1);
-
-			unsafe { util::SpinLockGuard::from_raw(&GLOBAL.part.transmit_lock, false) };
+			self.publish();
 		}
 	}
 
@@ -430,11 +562,11 @@ pub(crate) mod ipc {
 	///
 	/// This will yield the task if no packets have been received yet.
 	pub fn receive() -> ReceivedLock {
-		let _ = util::SpinLockGuard::new(&GLOBAL.part.received_lock, true).into_raw();
-		let mask = GLOBAL.part.ring_mask.get();
+		let _ = util::SpinLockGuard::new(&queues().received_lock, true).into_raw();
+		let mask = queues().ring_mask.get();
 		loop {
 			let (index, entries) = unsafe { received_ring() };
-			let i = GLOBAL.part.last_received_index.get();
+			let i = queues().last_received_index.get();
 			if i != index {
 				return ReceivedLock {
 					slot: entries[usize::from(i & mask)].get(),
@@ -446,11 +578,11 @@ pub(crate) mod ipc {
 
 	/// Attempt to reserve a slot for sendng an IPC packet to a task.
 	pub fn try_receive() -> Option<ReceivedLock> {
-		let guard = util::SpinLockGuard::new(&GLOBAL.part.received_lock, true);
+		let guard = util::SpinLockGuard::new(&queues().received_lock, true);
 
 		let (index, entries) = unsafe { received_ring() };
-		let mask = GLOBAL.part.ring_mask.get();
-		let i = GLOBAL.part.last_received_index.get();
+		let mask = queues().ring_mask.get();
+		let i = queues().last_received_index.get();
 		(i != index).then(|| {
 			let _ = guard.into_raw();
 			ReceivedLock {
@@ -459,6 +591,45 @@ pub(crate) mod ipc {
 		})
 	}
 
+	/// Attempt to receive a packet for which the predicate returns `true`.
+	///
+	/// The matching packet is swapped with the packet at the front of the ring buffer so that
+	/// any packets before it remain available.
+	pub fn try_receive_matching(
+		mut f: impl FnMut(&kernel::ipc::Packet) -> bool,
+	) -> Option<ReceivedLock> {
+		let guard = util::SpinLockGuard::new(&queues().received_lock, true);
+
+		let (index, entries) = unsafe { received_ring() };
+		let mask = queues().ring_mask.get();
+		let first = queues().last_received_index.get();
+		let mut i = first;
+		while i != index {
+			let slot = entries[usize::from(i & mask)].get();
+			if f(unsafe { packet(slot) }.unwrap()) {
+				let front = entries[usize::from(first & mask)].get();
+				entries[usize::from(i & mask)].set(front);
+				entries[usize::from(first & mask)].set(slot);
+				let _ = guard.into_raw();
+				return Some(ReceivedLock { slot });
+			}
+			i = i.wrapping_add(1);
+		}
+		None
+	}
+
+	/// Receive a packet for which the predicate returns `true`.
+	///
+	/// This will yield the task until a matching packet has been received.
+	pub fn receive_matching(mut f: impl FnMut(&kernel::ipc::Packet) -> bool) -> ReceivedLock {
+		loop {
+			if let Some(rx) = try_receive_matching(&mut f) {
+				return rx;
+			}
+			unsafe { kernel::io_wait(u64::MAX) };
+		}
+	}
+
 	/// A lock on the received queue along with the slot of the packet to write to.
 	pub struct ReceivedLock {
 		slot: u16,
@@ -479,8 +650,8 @@ pub(crate) mod ipc {
 		/// available entry in the ring buffer.
 		pub fn defer(self) {
 			let (index, entries) = unsafe { received_ring() };
-			let last_index = GLOBAL.part.last_received_index.get();
-			let mask = GLOBAL.part.ring_mask.get();
+			let last_index = queues().last_received_index.get();
+			let mask = queues().ring_mask.get();
 
 			let prev_index = index.wrapping_sub(1);
 			let a = entries[usize::from(last_index & mask)].get();
@@ -491,7 +662,7 @@ pub(crate) mod ipc {
 			entries[usize::from(last_index & mask)].set(b);
 
 			mem::forget(self);
-			unsafe { util::SpinLockGuard::from_raw(&GLOBAL.part.received_lock, false) };
+			unsafe { util::SpinLockGuard::from_raw(&queues().received_lock, false) };
 		}
 	}
 
@@ -505,14 +676,80 @@ pub(crate) mod ipc {
 
 	impl Drop for ReceivedLock {
 		fn drop(&mut self) {
-			let i = GLOBAL.part.last_received_index.get();
-			GLOBAL.part.last_received_index.set(i.wrapping_add(1));
-			drop(unsafe { util::SpinLockGuard::from_raw(&GLOBAL.part.received_lock, false) });
+			let i = queues().last_received_index.get();
+			queues().last_received_index.set(i.wrapping_add(1));
+			drop(unsafe { util::SpinLockGuard::from_raw(&queues().received_lock, false) });
 			// push it after dropping the lock to reduce contention
 			unsafe { push_free_slot(self.slot) };
 		}
 	}
 
+	/// Claim received packets for which `f` returns `true`.
+	///
+	/// `f` is called with the slot of each packet in the ring buffer, newest first. Claimed
+	/// packets are removed from the ring buffer and must be released with a [`Completion`].
+	/// The order of the remaining packets is preserved.
+	///
+	/// Returns `false` without calling `f` if the ring buffer is locked.
+	pub fn route_received(mut f: impl FnMut(u16, &kernel::ipc::Packet) -> bool) -> bool {
+		let guard = match util::SpinLockGuard::try_new(&queues().received_lock, true) {
+			Ok(guard) => guard,
+			Err(util::Locked) => return false,
+		};
+
+		// The kernel only appends entries past the index, so the remaining entries can be
+		// moved towards it.
+		let (index, entries) = unsafe { received_ring() };
+		let mask = queues().ring_mask.get();
+		let first = queues().last_received_index.get();
+		let (mut i, mut keep) = (index, index);
+		while i != first {
+			i = i.wrapping_sub(1);
+			let slot = entries[usize::from(i & mask)].get();
+			if !f(slot, unsafe { packet(slot) }.unwrap()) {
+				keep = keep.wrapping_sub(1);
+				entries[usize::from(keep & mask)].set(slot);
+			}
+		}
+		queues().last_received_index.set(keep);
+		drop(guard);
+		true
+	}
+
+	/// A received packet claimed with [`route_received`]. The slot is freed on drop.
+	pub struct Completion {
+		slot: u16,
+	}
+
+	impl Completion {
+		pub fn into_raw<'a>(self) -> (u16, &'a kernel::ipc::Packet) {
+			let slot = self.slot;
+			mem::forget(self);
+			(slot, unsafe { packet(slot) }.unwrap())
+		}
+
+		/// # Safety
+		///
+		/// The slot must have been claimed with [`route_received`] and not be freed yet.
+		pub unsafe fn from_raw(slot: u16) -> Self {
+			Self { slot }
+		}
+	}
+
+	impl ops::Deref for Completion {
+		type Target = kernel::ipc::Packet;
+
+		fn deref(&self) -> &Self::Target {
+			unsafe { packet(self.slot) }.unwrap()
+		}
+	}
+
+	impl Drop for Completion {
+		fn drop(&mut self) {
+			unsafe { push_free_slot(self.slot) };
+		}
+	}
+
 	/// Add an address range the kernel is free to map pages into.
 	pub fn add_free_range(page: Page, count: usize) -> Result<(), ()> {
 		util::spin_lock(&GLOBAL.part.free_ranges_capacity, 0, |capacity| {
@@ -544,25 +781,28 @@ pub(crate) mod ipc {
 	///
 	/// There may be no other references to this packet.
 	unsafe fn packet<'a>(index: u16) -> Option<&'a mut kernel::ipc::Packet> {
-		(index <= GLOBAL.part.ring_mask.get())
-			.then(|| &mut *GLOBAL.part.ipc_packets.get().add(usize::from(index)))
+		(index <= queues().ring_mask.get())
+			.then(|| &mut *queues().ipc_packets.get().add(usize::from(index)))
 	}
 
-	/// Return the transmit index & buffer.
+	/// The value of a transmit entry that hasn't been written yet.
 	///
-	/// # Safety
+	/// The kernel resets entries to this value after reading them.
+	pub(super) const TRANSMIT_EMPTY: u16 = u16::MAX;
+
+	/// Return the transmit index & buffer of the given queues.
 	///
-	/// There may be no other references to this buffer.
+	/// The index is only advanced past entries that have been written.
 	///
-	/// The ring may not be resized while there is a reference to the slice.
+	/// # Safety
 	///
-	/// The ring must be locked during this call.
-	unsafe fn transmit_ring<'a>() -> (&'a mut u16, &'a mut [u16]) {
-		let len = usize::from(ring_len());
+	/// The ring may not be resized while there is a reference to the slice.
+	pub(super) unsafe fn transmit_ring<'a>(queues: &Queues) -> (&'a AtomicU16, &'a [AtomicU16]) {
+		let len = usize::from(queues.ring_mask.get()) + 1;
 		// Skip table
-		let addr = GLOBAL.part.ipc_packets.get().add(len).cast::<u16>();
-		let index = &mut *addr;
-		let slice = slice::from_raw_parts_mut(addr.cast::<u16>().add(1), len);
+		let addr = queues.ipc_packets.get().add(len).cast::<AtomicU16>();
+		let index = &*addr;
+		let slice = slice::from_raw_parts(addr.add(1), len);
 		(index, slice)
 	}
 
@@ -577,8 +817,7 @@ pub(crate) mod ipc {
 		let len = usize::from(ring_len());
 		// Skip table + transmit ring
 		// Use an AtomicU16 as the kernel may write to it from another thread.
-		let addr = GLOBAL
-			.part
+		let addr = queues()
 			.ipc_packets
 			.get()
 			.add(len)
@@ -591,7 +830,7 @@ pub(crate) mod ipc {
 
 	/// Try to get an unused slot from the free stack.
 	fn pop_free_slot() -> Result<u16, NoFreeSlots> {
-		let (top, entries) = unsafe { free_stack() };
+		let (top, entries) = unsafe { free_stack(queues()) };
 		util::spin_lock(top, u16::MAX, |top| {
 			top.checked_sub(1)
 				.map(|t| {
@@ -607,28 +846,36 @@ pub(crate) mod ipc {
 	/// # Safety
 	///
 	/// The index must be in range and not already present on the stack.
-	pub(super) unsafe fn push_free_slot(slot: u16) {
-		let (top, entries) = free_stack();
+	unsafe fn push_free_slot(slot: u16) {
+		push_free_slot_of(queues(), slot)
+	}
+
+	/// Add an unused slot to the free stack of the given queues.
+	///
+	/// # Safety
+	///
+	/// The index must be in range and not already present on the stack.
+	pub(super) unsafe fn push_free_slot_of(queues: &Queues, slot: u16) {
+		let (top, entries) = free_stack(queues);
 		util::spin_lock(top, u16::MAX, |top| {
-			assert!(*top < ring_len(), "free stack overflow");
+			assert!(*top < queues.ring_mask.get() + 1, "free stack overflow");
 			entries[usize::from(*top)].set(slot);
 			*top += 1;
 		});
 	}
 
-	/// Return the free stack.
+	/// Return the free stack of the given queues.
 	///
 	/// # Safety
 	///
 	/// The stack may not be resized while there is a reference to the slice.
 	///
 	/// The stack must be locked during this call.
-	unsafe fn free_stack<'a>() -> (&'a AtomicU16, &'a [Cell<u16>]) {
-		let len = usize::from(ring_len());
+	unsafe fn free_stack<'a>(queues: &Queues) -> (&'a AtomicU16, &'a [Cell<u16>]) {
+		let len = usize::from(queues.ring_mask.get()) + 1;
 		// Skip table + transmit ring
 		// Use an AtomicU16 as the kernel may write to it from another thread.
-		let addr = GLOBAL
-			.part
+		let addr = queues
 			.ipc_packets
 			.get()
 			.add(len)
@@ -643,7 +890,7 @@ pub(crate) mod ipc {
 	///
 	/// The queue may not be resized during this call.
 	unsafe fn ring_len() -> u16 {
-		debug_assert_ne!(GLOBAL.part.ring_mask.get(), u16::MAX);
-		GLOBAL.part.ring_mask.get() + 1
+		debug_assert_ne!(queues().ring_mask.get(), u16::MAX);
+		queues().ring_mask.get() + 1
 	}
 }
@@ -129,60 +129,63 @@ pub fn spawn_elf(
 			_ => Err(SpawnElfError::BadRWXFlags)?,
 		};
 
-		if ph.flags().is_write() {
-			// We must copy the pages as they may be written to.
-			let addr =
-				mem::allocate_range(None, mem_pages, flags).map_err(SpawnElfError::ReserveError)?;
-
-			// FIXME ensure there is no garbage in the pages.
-			//
-			// This should be done by the kernel...
-			unsafe {
-				let to_zero = core::slice::from_raw_parts_mut(
-					addr.as_ptr().cast::<kernel::Page>(),
-					mem_pages,
-				);
-				to_zero.iter_mut().for_each(kernel::Page::zeroize);
-			}
+		// Pages that only hold data from the file are shared as copy-on-write, so each task
+		// only pays for the pages it actually writes to. The kernel write-protects our side as
+		// well, so later writes to `data` don't change the program of the task either.
+		//
+		// If the segment is larger than the data in the file, the rest must be zeroed. The page
+		// with the end of the data is copied and the pages after it are reserved, so they are
+		// only allocated once they are used.
+		let shared_pages = if ph.mem_size() == ph.file_size() {
+			file_pages
+		} else {
+			(ph.file_size() as usize + page_offset) / Page::SIZE
+		};
+		for _ in 0..shared_pages {
+			let self_address = data.as_ptr().wrapping_add(offset as usize) as *mut _;
+			mappings[i] = kernel::TaskSpawnMapping {
+				typ: kernel::TaskSpawnMapping::SHARE_COPY_ON_WRITE,
+				flags: flags.into(),
+				task_address: virt_a as *mut _,
+				self_address,
+			};
+			i += 1;
+			offset += Page::SIZE;
+			virt_a += Page::SIZE;
+		}
 
-			reserved_ranges.push(addr, mem_pages);
+		if file_pages > shared_pages {
+			// Pages are zeroed when they are first accessed.
+			let addr = mem::allocate_range(None, 1, flags).map_err(SpawnElfError::ReserveError)?;
+			reserved_ranges.push(addr, 1);
 
+			let start = if shared_pages == 0 { page_offset } else { 0 };
+			let end = (page_offset + ph.file_size() as usize) - shared_pages * Page::SIZE;
 			let copy = unsafe {
-				let addr = addr.as_ptr().cast::<u8>().add(page_offset);
-				slice::from_raw_parts_mut(addr, ph.file_size().try_into().unwrap())
+				let addr = addr.as_ptr().cast::<u8>().add(start);
+				slice::from_raw_parts_mut(addr, end - start)
 			};
+			copy.copy_from_slice(&data[offset + start..offset + end]);
 
-			let data = match ph {
-				xmas_elf::program::ProgramHeader::Ph64(ph) => ph.raw_data(&elf),
-				_ => unreachable!(),
+			mappings[i] = kernel::TaskSpawnMapping {
+				typ: kernel::TaskSpawnMapping::SHARE,
+				flags: flags.into(),
+				task_address: virt_a as *mut _,
+				self_address: addr.as_ptr(),
 			};
-			copy.copy_from_slice(&data);
-			for k in 0..mem_pages {
-				let self_address = addr.as_ptr().wrapping_add(k);
-				mappings[i] = kernel::TaskSpawnMapping {
-					typ: 0,
-					flags: flags.into(),
-					task_address: virt_a as *mut _,
-					self_address,
-				};
-				i += 1;
-				offset += Page::SIZE;
-				virt_a += Page::SIZE;
-			}
-		} else {
-			// It is safe to share the pages
-			for _ in 0..file_pages {
-				let self_address = data.as_ptr().wrapping_add(offset as usize) as *mut _;
-				mappings[i] = kernel::TaskSpawnMapping {
-					typ: 0,
-					flags: flags.into(),
-					task_address: virt_a as *mut _,
-					self_address,
-				};
-				i += 1;
-				offset += Page::SIZE;
-				virt_a += Page::SIZE;
-			}
+			i += 1;
+			virt_a += Page::SIZE;
+		}
+
+		for _ in file_pages..mem_pages {
+			mappings[i] = kernel::TaskSpawnMapping {
+				typ: kernel::TaskSpawnMapping::RESERVE,
+				flags: flags.into(),
+				task_address: virt_a as *mut _,
+				self_address: core::ptr::null_mut(),
+			};
+			i += 1;
+			virt_a += Page::SIZE;
 		}
 	}
 
@@ -197,6 +200,9 @@ pub fn spawn_elf(
 
 		reserved_ranges.push(addr, stack_pages);
 
+		// The amount of pages at the top of the stack that have been written to.
+		let used_pages;
+
 		unsafe {
 			let mut sp = addr.as_ptr().add(stack_pages);
 
@@ -243,16 +249,24 @@ pub fn spawn_elf(
 				sp = sp.cast::<kernel::ipc::UUID>().sub(1).cast();
 				sp.cast::<kernel::ipc::UUID>().write(uuid);
 			}
+
+			used_pages = stack_pages - (sp as usize - addr.as_ptr() as usize) / Page::SIZE;
 		}
 
-		// Map
+		// Map. The part of the stack that hasn't been used yet is only allocated once the task
+		// needs it.
 		let mut virt_a = 0x7fff_0000;
 		let mut offset = 0x0;
 
-		for i in i..i + 16 {
+		for i in i..i + stack_pages {
+			let typ = if offset < stack_pages - used_pages {
+				kernel::TaskSpawnMapping::RESERVE
+			} else {
+				kernel::TaskSpawnMapping::SHARE
+			};
 			let self_address = addr.as_ptr().wrapping_add(offset as usize) as *mut _;
 			mappings[i] = kernel::TaskSpawnMapping {
-				typ: 0,
+				typ,
 				flags: RWX::RW.into(),
 				task_address: virt_a as *mut _,
 				self_address,
@@ -260,7 +274,7 @@ pub fn spawn_elf(
 			offset += 1;
 			virt_a += Page::SIZE;
 		}
-		i += 16;
+		i += stack_pages;
 	}
 
 	let pc = elf.header.pt2.entry_point() as usize;
@@ -292,7 +306,8 @@ pub mod registry {
 
 	#[derive(Debug)]
 	pub enum GetError {
-		NotFound,
+		/// The entry doesn't exist. The generation of the registry can be passed to [`wait`].
+		NotFound { generation: usize },
 	}
 
 	/// Try to add a task to the kernel's registry.
@@ -313,8 +328,30 @@ pub mod registry {
 		let ret = unsafe { kernel::sys_registry_get(name.as_ptr(), name.len()) };
 		match ret.status {
 			kernel::Return::OK => Ok(Address(ret.value)),
-			kernel::Return::NOT_FOUND => Err(GetError::NotFound),
+			kernel::Return::NOT_FOUND => Err(GetError::NotFound {
+				generation: ret.value,
+			}),
+			r => unreachable!("{}", r),
+		}
+	}
+
+	/// Sleep until an entry is added to the registry, unless one has been added since
+	/// [`get`] returned the given generation.
+	pub fn wait(generation: usize) {
+		let ret = unsafe { kernel::sys_registry_wait(generation, u64::MAX) };
+		match ret.status {
+			kernel::Return::OK | kernel::Return::RETRY => (),
 			r => unreachable!("{}", r),
 		}
 	}
+
+	/// Find a task in the kernel's registry, waiting until it is added if necessary.
+	pub fn get_or_wait(name: &[u8]) -> Address {
+		loop {
+			match get(name) {
+				Ok(address) => break address,
+				Err(GetError::NotFound { generation }) => wait(generation),
+			}
+		}
+	}
 }
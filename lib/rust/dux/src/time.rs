@@ -0,0 +1,22 @@
+//! # Time
+
+/// Return the current time in microseconds, the same unit the kernel uses for timeouts.
+#[inline]
+pub fn now() -> u64 {
+	let now: u64;
+	// SAFETY: the kernel lets user tasks read the time counter.
+	unsafe { asm!("csrr {0}, time", out(reg) now) };
+	now
+}
+
+/// Return the amount of cycles executed by the current hart.
+///
+/// The counter is not synchronized between harts, so it is only useful for measuring short
+/// intervals.
+#[inline]
+pub fn cycles() -> u64 {
+	let cycles: u64;
+	// SAFETY: the kernel lets user tasks read the cycle counter.
+	unsafe { asm!("csrr {0}, cycle", out(reg) cycles) };
+	cycles
+}
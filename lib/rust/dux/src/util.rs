@@ -113,25 +113,21 @@ where
 		}
 	}
 
-	/*
-	/// Attempt to store a certain value in an atomic variable and call the closure with the original.
+	/// Attempt to store a certain value in an atomic variable without waiting.
 	///
-	/// If the original value is equal to the given value, it will try again until it no longer matches.
+	/// Fails if the original value is equal to the given value or if another thread
+	/// modified the variable concurrently.
 	///
 	/// This function uses `Ordering::Acquire` on lock and `Ordering::Release` on release.
 	pub fn try_new(lock: &'a T, value: T::Inner) -> Result<Self, Locked> {
-		// Try to get the lock
-		let mut val = lock.load(Ordering::Acquire);
-		if val != value {
-			match lock.compare_exchange_weak(val, value, Ordering::Acquire, Ordering::Acquire) {
-				Ok(v) => Ok(Self { lock, value: val })
-				Err(_) => Err(Locked),
-			}
-		} else {
-			Err(Locked)
+		let val = lock.load(Ordering::Acquire);
+		if val == value {
+			return Err(Locked);
 		}
+		lock.compare_exchange_weak(val, value, Ordering::Acquire, Ordering::Acquire)
+			.map(|v| Self { lock, value: v })
+			.map_err(|_| Locked)
 	}
-	*/
 
 	/// Consume the lock without releasing it & return the raw components.
 	#[must_use]
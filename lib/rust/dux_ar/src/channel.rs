@@ -0,0 +1,67 @@
+use crate::ffi;
+use core::mem::MaybeUninit;
+use dux::channel::*;
+
+#[no_mangle]
+extern "C" fn dux_channel_create(
+	channel: &mut MaybeUninit<Channel>,
+	pages: usize,
+	peer: usize,
+	id: &mut usize,
+) -> ffi::c_int {
+	match Channel::create(pages, peer.into()) {
+		Ok((c, i)) => {
+			channel.write(c);
+			*id = i;
+			0
+		}
+		Err(CreateError::NoSpace) | Err(CreateError::NoMemory) => -1,
+		Err(CreateError::BadSize) => -2,
+		Err(CreateError::Unavailable) => -3,
+	}
+}
+
+#[no_mangle]
+extern "C" fn dux_channel_open(
+	channel: &mut MaybeUninit<Channel>,
+	id: usize,
+	pages: usize,
+) -> ffi::c_int {
+	match Channel::open(id, pages) {
+		Ok(c) => {
+			channel.write(c);
+			0
+		}
+		Err(OpenError::NoSpace) => -1,
+		Err(OpenError::BadSize) => -2,
+		Err(OpenError::NotFound) => -3,
+	}
+}
+
+#[no_mangle]
+unsafe extern "C" fn dux_channel_write(channel: &Channel, data: *const u8, length: usize) {
+	channel.write(core::slice::from_raw_parts(data, length))
+}
+
+#[no_mangle]
+unsafe extern "C" fn dux_channel_try_write(
+	channel: &Channel,
+	data: *const u8,
+	length: usize,
+) -> usize {
+	channel.try_write(core::slice::from_raw_parts(data, length))
+}
+
+#[no_mangle]
+unsafe extern "C" fn dux_channel_read(channel: &Channel, buffer: *mut u8, length: usize) -> usize {
+	channel.read(core::slice::from_raw_parts_mut(buffer, length))
+}
+
+#[no_mangle]
+unsafe extern "C" fn dux_channel_try_read(
+	channel: &Channel,
+	buffer: *mut u8,
+	length: usize,
+) -> usize {
+	channel.try_read(core::slice::from_raw_parts_mut(buffer, length))
+}
@@ -46,3 +46,27 @@ unsafe extern "C" fn dux_pop_received_entry(slot: u16) {
 unsafe extern "C" fn dux_defer_received_entry(slot: u16) {
 	ReceivedLock::from_raw(slot).defer();
 }
+
+#[no_mangle]
+extern "C" fn dux_ipc_submit(packet: &kernel::ipc::Packet) -> ffi::c_int {
+	match tag::submit(packet) {
+		Ok(tag) => tag.into(),
+		Err(tag::NoFreeTags) => -1,
+	}
+}
+
+#[no_mangle]
+extern "C" fn dux_ipc_poll(tag: u8, completion: &mut kernel::ipc::Packet) -> ffi::c_int {
+	match tag::poll(tag) {
+		Some(c) => {
+			*completion = (*c).clone();
+			0
+		}
+		None => -1,
+	}
+}
+
+#[no_mangle]
+extern "C" fn dux_ipc_wait(tag: u8, completion: &mut kernel::ipc::Packet) {
+	*completion = (*tag::wait(tag)).clone();
+}
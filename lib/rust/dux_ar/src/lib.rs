@@ -2,6 +2,7 @@
 #![crate_type = "staticlib"]
 #![feature(panic_info_message)]
 
+mod channel;
 mod ffi;
 mod ipc;
 mod mem;
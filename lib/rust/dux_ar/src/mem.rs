@@ -52,3 +52,11 @@ extern "C" fn dux_unreserve_pages(address: *mut kernel::Page, count: usize) -> f
 		None => -1,
 	}
 }
+
+#[no_mangle]
+unsafe extern "C" fn dux_init_thread() -> ffi::c_int {
+	match init_thread() {
+		Ok(()) => 0,
+		Err(_) => -1,
+	}
+}
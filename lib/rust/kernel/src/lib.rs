@@ -19,6 +19,15 @@ pub const PROT_READ_WRITE: u8 = PROT_READ | PROT_WRITE;
 pub const PROT_READ_EXEC: u8 = PROT_READ | PROT_EXEC;
 pub const PROT_READ_WRITE_EXEC: u8 = PROT_READ | PROT_WRITE | PROT_EXEC;
 
+/// Allow mapping aligned parts of the range with megapages, which must be freed as a whole.
+pub const MEM_MEGAPAGE: u8 = 0x10;
+/// Allow mapping aligned parts of the range with mega- and gigapages, which must be freed as a
+/// whole.
+pub const MEM_GIGAPAGE: u8 = 0x20;
+/// Allocate all pages immediately instead of when they are first accessed. This avoids page
+/// faults later, which is useful for memory that is used in latency-critical paths.
+pub const MEM_PREFAULT: u8 = 0x40;
+
 /// Structure returned by system calls.
 #[repr(C)]
 pub struct Return {
@@ -39,6 +48,8 @@ impl Return {
 	pub const NOT_FOUND: usize = 9;
 	pub const TOO_LONG: usize = 10;
 	pub const OCCUPIED: usize = 11;
+	pub const UNAVAILABLE: usize = 12;
+	pub const RETRY: usize = 13;
 }
 
 pub mod ipc {
@@ -196,6 +207,17 @@ pub struct TaskSpawnMapping {
 	pub self_address: *mut Page,
 }
 
+impl TaskSpawnMapping {
+	/// Share the page with the new task.
+	pub const SHARE: u8 = 0;
+	/// Share the page with the new task until it writes to it, at which point it gets a private
+	/// copy.
+	pub const SHARE_COPY_ON_WRITE: u8 = 1;
+	/// Reserve a zeroed page that is allocated when the new task first accesses it.
+	/// `self_address` is ignored.
+	pub const RESERVE: u8 = 2;
+}
+
 #[macro_use]
 #[cfg(any(target_arch = "riscv32", target_arch = "riscv64"))]
 mod riscv;
@@ -272,6 +294,129 @@ syscall!(
 );
 syscall!(sys_registry_get, 17, name: *const u8, name_length: usize);
 
+syscall!(
+	task_futex,
+	18,
+	op: usize,
+	address: *const u32,
+	value: usize,
+	time: u64
+);
+
+syscall!(
+	task_spawn_thread,
+	19,
+	program_counter: *const ffi::c_void,
+	stack_pointer: *const ffi::c_void,
+	argument: usize,
+	thread_pointer: *const ffi::c_void
+);
+syscall!(task_exit, 20);
+syscall!(task_set_priority, 21, priority: usize);
+syscall!(io_submit, 22, count: usize, wait: usize, time: u64);
+syscall!(chan_create, 23, address: *mut Page, count: usize, peer: usize);
+syscall!(chan_open, 24, id: usize, address: *mut Page, count: usize);
+syscall!(sys_registry_wait, 25, generation: usize, time: u64);
+syscall!(sys_trace_read, 26, address: *mut TraceEvent, count: usize);
+syscall!(task_counters, 27, task: usize, address: *mut TaskCounters);
+syscall!(sys_log_read, 28, address: *mut u8, length: usize);
+syscall!(sys_log_level, 29, level: usize);
+
+/// Operations for [`task_futex`](task_futex).
+pub mod futex {
+	/// Sleep while the value at the address equals the given value.
+	pub const WAIT: usize = 0;
+	/// Wake at most the given amount of tasks waiting on the address.
+	pub const WAKE: usize = 1;
+}
+
+/// An event recorded in the trace buffer of a hart, as returned by
+/// [`sys_trace_read`](sys_trace_read).
+#[derive(Clone, Copy, Debug, Default)]
+#[repr(C)]
+pub struct TraceEvent {
+	/// When the event occured in microseconds.
+	pub time: u64,
+	/// The task running at the time of the event or `usize::MAX` if there is none.
+	pub task: usize,
+	/// Data specific to the kind of event, see [`trace`].
+	pub a: usize,
+	pub b: u32,
+	/// One of the kinds in [`trace`].
+	pub kind: u16,
+	/// The hart the event occured on.
+	pub hart: u16,
+}
+
+/// Kinds of [`TraceEvent`]s.
+pub mod trace {
+	/// `a` is the syscall ID.
+	pub const SYSCALL: u16 = 0;
+	/// `a` is the address of the receiver, `b` the amount of packets.
+	pub const IPC: u16 = 1;
+	/// `task` is the task that will run, `a` the task that ran before.
+	pub const SWITCH: u16 = 2;
+	/// `a` is the address of the fault, `b` is `1` if it was a write.
+	pub const PAGE_FAULT: u16 = 3;
+	/// `a` is the interrupt source.
+	pub const INTERRUPT: u16 = 4;
+	/// `b` is the amount of events that were overwritten before they were read.
+	pub const LOST: u16 = 5;
+	/// The amount of kinds.
+	pub const COUNT: usize = 6;
+}
+
+/// Statistics about a task, as returned by [`task_counters`](task_counters).
+#[derive(Clone, Copy, Debug, Default)]
+#[repr(C)]
+pub struct TaskCounters {
+	/// The time the task has been running in microseconds.
+	pub run_time: u64,
+	/// The amount of IPC packets delivered from this task.
+	pub ipc_sent: u64,
+	/// The amount of IPC packets delivered to this task.
+	pub ipc_received: u64,
+	/// The amount of pages mapped into this task's address space.
+	pub pages_mapped: u64,
+}
+
+/// Priority classes for [`task_set_priority`](task_set_priority).
+///
+/// Ready tasks with a higher priority always run first.
+pub mod priority {
+	/// Tasks that should only run if nothing else can.
+	pub const LOW: usize = 0;
+	/// The default priority.
+	pub const NORMAL: usize = 1;
+	/// Tasks that should run as soon as possible, such as drivers.
+	pub const HIGH: usize = 2;
+}
+
+/// Levels of messages in the kernel log. Lower levels are more important.
+pub mod log {
+	use core::sync::atomic::{AtomicUsize, Ordering};
+
+	pub const ERROR: usize = 1;
+	pub const WARN: usize = 2;
+	pub const INFO: usize = 3;
+	pub const DEBUG: usize = 4;
+	pub const TRACE: usize = 5;
+
+	/// The maximum level of the kernel log as of the last message sent to it.
+	static MAX_LEVEL: AtomicUsize = AtomicUsize::new(INFO);
+
+	/// Whether messages of the given level are logged. Used to skip formatting messages that
+	/// would be dropped anyways.
+	#[inline]
+	pub fn enabled(level: usize) -> bool {
+		level <= MAX_LEVEL.load(Ordering::Relaxed)
+	}
+
+	pub(crate) fn set_max_level(level: usize) {
+		MAX_LEVEL.store(level, Ordering::Relaxed);
+	}
+}
+
 /// Interface for sending messages to the kernel log.
 pub struct SysLog;
 
@@ -279,17 +424,76 @@ impl fmt::Write for SysLog {
 	fn write_str(&mut self, s: &str) -> fmt::Result {
 		unsafe {
 			let ret = sys_log(s as *const _ as *const _, s.len());
-			(ret.status == 0).then(|| ()).ok_or(fmt::Error)
+			(ret.status == 0)
+				.then(|| log::set_max_level(ret.value))
+				.ok_or(fmt::Error)
+		}
+	}
+}
+
+/// A buffer to format a message in so that it is sent to the kernel log with as few calls as
+/// possible. The remaining contents are sent on drop.
+pub struct SysLogBuffer {
+	data: [u8; 256],
+	len: usize,
+}
+
+impl SysLogBuffer {
+	pub const fn new() -> Self {
+		Self {
+			data: [0; 256],
+			len: 0,
+		}
+	}
+
+	/// Send the contents of the buffer to the kernel log.
+	pub fn flush(&mut self) {
+		if self.len > 0 {
+			// SAFETY: only whole strings are copied to the buffer.
+			let s = unsafe { core::str::from_utf8_unchecked(&self.data[..self.len]) };
+			let _ = fmt::Write::write_str(&mut SysLog, s);
+			self.len = 0;
 		}
 	}
 }
 
+impl fmt::Write for SysLogBuffer {
+	fn write_str(&mut self, s: &str) -> fmt::Result {
+		if self.data.len() - self.len < s.len() {
+			self.flush();
+		}
+		if self.data.len() < s.len() {
+			return SysLog.write_str(s);
+		}
+		self.data[self.len..self.len + s.len()].copy_from_slice(s.as_bytes());
+		self.len += s.len();
+		Ok(())
+	}
+}
+
+impl Drop for SysLogBuffer {
+	fn drop(&mut self) {
+		self.flush();
+	}
+}
+
 /// A macro that acts similar to println but sends output to the kernel log.
 #[macro_export]
 macro_rules! sys_log {
-	($($arg:tt)*) => {{
-		use core::fmt::Write;
-		let _ = writeln!($crate::SysLog, $($arg)*);
+	($($arg:tt)*) => {
+		$crate::sys_log_at!($crate::log::INFO, $($arg)*)
+	};
+}
+
+/// Like [`sys_log`] but with the given level from [`log`]. The message is only formatted if
+/// the level is [enabled](log::enabled).
+#[macro_export]
+macro_rules! sys_log_at {
+	($level:expr, $($arg:tt)*) => {{
+		if $crate::log::enabled($level) {
+			use core::fmt::Write;
+			let _ = writeln!($crate::SysLogBuffer::new(), $($arg)*);
+		}
 	}};
 }
 
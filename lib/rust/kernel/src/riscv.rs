@@ -72,6 +72,16 @@ macro_rules! syscall {
 	};
 }
 
+/// Return the thread pointer of the current task.
+///
+/// It is null unless the task was spawned with `task_spawn_thread`.
+#[inline(always)]
+pub fn thread_pointer() -> *mut () {
+	let tp;
+	unsafe { asm!("mv {0}, tp", out(reg) tp) };
+	tp
+}
+
 /// Representation of a single memory page.
 #[repr(align(4096))]
 #[repr(C)]
@@ -174,6 +174,11 @@ impl Header0 {
 		}
 	}
 
+	/// Return the MSI-X capability of this header, if any.
+	pub fn msix(&self) -> Option<&MsiX> {
+		self.capabilities().find_map(MsiX::from_capability)
+	}
+
 	pub fn base_address(&self, index: usize) -> u32 {
 		self.base_address[usize::from(index)].get().into()
 	}
@@ -327,6 +332,128 @@ impl<'a> Iterator for CapabilityIter<'a> {
 	}
 }
 
+/// The MSI-X capability, which describes where the table of interrupt vectors is located.
+#[repr(C)]
+pub struct MsiX {
+	_header: Capability,
+	message_control: VolatileCell<u16le>,
+	table: VolatileCell<u32le>,
+	pending: VolatileCell<u32le>,
+}
+
+impl MsiX {
+	/// The ID of the MSI-X capability.
+	pub const ID: u8 = 0x11;
+
+	const ENABLE: u16 = 1 << 15;
+	const FUNCTION_MASK: u16 = 1 << 14;
+	const TABLE_SIZE_MASK: u16 = 0x7ff;
+	const BIR_MASK: u32 = 0x7;
+
+	/// Return the MSI-X capability if the given capability is one.
+	pub fn from_capability(capability: &Capability) -> Option<&Self> {
+		// SAFETY: the capability ID guarantees the structure is present.
+		(capability.id() == Self::ID).then(|| unsafe { capability.data::<Self>() })
+	}
+
+	/// Return the amount of entries in the table.
+	pub fn table_size(&self) -> u16 {
+		(u16::from(self.message_control.get()) & Self::TABLE_SIZE_MASK) + 1
+	}
+
+	/// Return the index of the BAR and the offset within it of the table.
+	pub fn table_location(&self) -> (u8, u32) {
+		let t = u32::from(self.table.get());
+		((t & Self::BIR_MASK) as u8, t & !Self::BIR_MASK)
+	}
+
+	/// Return the index of the BAR and the offset within it of the pending bit array.
+	pub fn pending_location(&self) -> (u8, u32) {
+		let t = u32::from(self.pending.get());
+		((t & Self::BIR_MASK) as u8, t & !Self::BIR_MASK)
+	}
+
+	/// Enable or disable MSI-X. If enabled, the device no longer uses the interrupt pin.
+	pub fn set_enabled(&self, enable: bool) {
+		self.set_control(Self::ENABLE, enable);
+	}
+
+	/// Mask or unmask all vectors at once, regardless of the mask of each entry.
+	pub fn set_function_mask(&self, mask: bool) {
+		self.set_control(Self::FUNCTION_MASK, mask);
+	}
+
+	fn set_control(&self, bit: u16, set: bool) {
+		let c = u16::from(self.message_control.get());
+		let c = if set { c | bit } else { c & !bit };
+		self.message_control.set(c.into());
+	}
+}
+
+/// A single entry in the MSI-X table.
+#[repr(C)]
+pub struct MsiXEntry {
+	address_low: VolatileCell<u32le>,
+	address_high: VolatileCell<u32le>,
+	data: VolatileCell<u32le>,
+	control: VolatileCell<u32le>,
+}
+
+impl MsiXEntry {
+	const MASKED: u32 = 1;
+
+	/// Set the address the device writes `data` to to signal this vector.
+	pub fn set_message(&self, address: u64, data: u32) {
+		self.address_low.set((address as u32).into());
+		self.address_high.set(((address >> 32) as u32).into());
+		self.data.set(data.into());
+	}
+
+	/// Mask or unmask this vector.
+	pub fn set_masked(&self, mask: bool) {
+		self.control.set(if mask { Self::MASKED } else { 0 }.into());
+	}
+}
+
+/// The MSI-X table of a device.
+pub struct MsiXTable<'a> {
+	entries: &'a [MsiXEntry],
+}
+
+impl<'a> MsiXTable<'a> {
+	/// Locate the table of the given capability in the mapped BARs of a device.
+	///
+	/// Returns `None` if the BAR holding the table is not mapped.
+	///
+	/// ## Safety
+	///
+	/// Each region must be the mapping of the BAR with the corresponding index.
+	pub unsafe fn new(
+		capability: &MsiX,
+		base_address_regions: &[Option<NonNull<()>>],
+	) -> Option<Self> {
+		let (bar, offset) = capability.table_location();
+		let bar = (*base_address_regions.get(usize::from(bar))?)?;
+		let entries = bar
+			.cast::<u8>()
+			.as_ptr()
+			.add(offset as usize)
+			.cast::<MsiXEntry>();
+		let entries = core::slice::from_raw_parts(entries, capability.table_size().into());
+		Some(Self { entries })
+	}
+
+	/// Return the entry for the given vector, if it exists.
+	pub fn get(&self, vector: u16) -> Option<&'a MsiXEntry> {
+		self.entries.get(usize::from(vector))
+	}
+
+	/// Return the amount of entries.
+	pub fn len(&self) -> u16 {
+		self.entries.len() as u16
+	}
+}
+
 /// Representation of a PCI MMIO area
 pub struct PCI {
 	/// The start of the area
@@ -4,3 +4,23 @@
 
 pub mod pci;
 pub mod queue;
+
+use core::ptr::NonNull;
+
+static mut DMA_ADDR: usize = 0x300_0000; // FIXME get rid of this crap.
+
+/// Allocate physically contiguous memory for use by a device. Returns the address of the memory
+/// and its physical address.
+pub fn dma_alloc(size: usize) -> Result<(NonNull<u8>, usize), queue::OutOfMemory> {
+	let size = (size + kernel::Page::SIZE - 1) & !(kernel::Page::SIZE - 1);
+	// SAFETY: drivers are single threaded.
+	// FIXME something very, VERY bad is happening here...
+	if unsafe { DMA_ADDR } == 0 {
+		unsafe { DMA_ADDR = 0x300_0000 };
+	}
+	let address = unsafe { DMA_ADDR };
+	let ret = unsafe { kernel::dev_dma_alloc(address as *mut kernel::Page, size, 0x2) };
+	(ret.status == 0).then(|| ()).ok_or(queue::OutOfMemory)?;
+	unsafe { DMA_ADDR += size };
+	Ok((NonNull::new(address as *mut u8).unwrap(), ret.value))
+}
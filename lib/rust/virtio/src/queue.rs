@@ -64,11 +64,14 @@ struct UsedTail {
 	avail_event: u16le,
 }
 
+/// The maximum amount of descriptors in a queue.
+pub const MAX_SIZE: u16 = 128;
+
 pub struct Queue<'a> {
 	_config: &'a super::pci::CommonConfig,
 	mask: u16,
 	last_used: u16,
-	free_descriptors: [u16; 8],
+	free_descriptors: [u16; MAX_SIZE as usize],
 	free_count: u16,
 	descriptors: NonNull<Descriptor>,
 	available: NonNull<Avail>,
@@ -118,25 +121,23 @@ unsafe fn return_table<'s, T>(ptr: &'s mut NonNull<T>, mask: u16) -> &'s mut [T]
 	slice::from_raw_parts_mut(ptr.as_ptr(), size)
 }
 
-static mut DMA_ADDR: usize = 0x300_0000; // FIXME get rid of this crap.
-
 impl<'a> Queue<'a> {
 	/// Create a new split virtqueue and attach it to the device.
 	///
-	/// The size must be a power of 2.
+	/// The size must be a power of 2 and is limited to [`MAX_SIZE`].
 	pub fn new(
 		config: &'a super::pci::CommonConfig,
 		index: u16,
 		max_size: u16,
 		msix: Option<u16>,
 	) -> Result<Self, OutOfMemory> {
-		// FIXME something very, VERY bad is happening here...
-		if unsafe { DMA_ADDR } == 0 {
-			unsafe { DMA_ADDR = 0x300_0000 };
-		}
+		// The queue registers, including the size, refer to the selected queue.
+		config.queue_select.set(index.into());
 
 		// TODO ensure max_size is a power of 2
-		let size = u16::from(config.queue_size.get()).min(max_size) as usize;
+		let size = u16::from(config.queue_size.get())
+			.min(max_size)
+			.min(MAX_SIZE) as usize;
 		let desc_size = mem::size_of::<Descriptor>() * size;
 		let avail_size = mem::size_of::<AvailHead>()
 			+ mem::size_of::<AvailElement>() * size
@@ -147,16 +148,8 @@ impl<'a> Queue<'a> {
 
 		let align = |s| (s + 0xfff) & !0xfff;
 
-		let ret = unsafe {
-			kernel::dev_dma_alloc(
-				DMA_ADDR as *mut kernel::Page,
-				align(desc_size + avail_size) + align(used_size),
-				0x2,
-			)
-		};
-		let kernel::Return { status, value } = ret;
-		assert_eq!(status, 0, "Failed DMA alloc");
-		let mem = value as *mut u8;
+		let (mem, phys) = super::dma_alloc(align(desc_size + avail_size) + align(used_size))?;
+		let mem = mem.as_ptr();
 
 		let descriptors = unsafe { NonNull::new_unchecked(mem.cast()) };
 		let available = unsafe { NonNull::new_unchecked(mem.add(desc_size).cast()) };
@@ -170,22 +163,16 @@ impl<'a> Queue<'a> {
 			}
 		}
 
-		let mut free_descriptors = [0; 8];
-		for (i, u) in free_descriptors.iter_mut().enumerate() {
+		let mut free_descriptors = [0; MAX_SIZE as usize];
+		for (i, u) in free_descriptors[..size].iter_mut().enumerate() {
 			*u = i as u16;
 		}
-		let free_descriptors = [5, 7, 6, 0, 1, 3, 2, 4];
-		let free_count = 8;
-
-		let mut phys = 0;
-		let ret = unsafe { kernel::mem_physical_address(mem.cast(), &mut phys as *mut _, 1) };
-		assert_eq!(ret.status, 0, "Failed DMA get phys address");
+		let free_count = size as u16;
 
 		let d_phys = phys;
 		let a_phys = phys + desc_size;
 		let u_phys = phys + align(desc_size + avail_size);
 
-		config.queue_select.set(index.into());
 		config.queue_descriptors.set((d_phys as u64).into());
 		config.queue_driver.set((a_phys as u64).into());
 		config.queue_device.set((u_phys as u64).into());
@@ -194,8 +181,6 @@ impl<'a> Queue<'a> {
 
 		let notify_offset = config.queue_notify_off.get().into();
 
-		unsafe { DMA_ADDR += 4096 * 0x2 };
-
 		msix.map(|msix| config.queue_msix_vector.set(msix.into()));
 
 		Ok(Queue {
@@ -267,6 +252,38 @@ impl<'a> Queue<'a> {
 		Ok(())
 	}
 
+	/// Put each entry of the iterator in the available ring as a chain of a single descriptor.
+	///
+	/// Unlike calling [`Self::send`] for each entry, the device only sees the new buffers once
+	/// all of them have been added.
+	pub fn send_each<I>(&mut self, iterator: I) -> Result<(), NoBuffers>
+	where
+		I: ExactSizeIterator<Item = (u64, u32, bool)>,
+	{
+		if usize::from(self.free_count) < iterator.len() {
+			return Err(NoBuffers);
+		}
+
+		let desc = descriptors_table!(self);
+		let (avail_head, avail_ring) = available_ring!(self);
+
+		let mut index = u16::from(avail_head.index);
+		for (address, length, write) in iterator {
+			self.free_count -= 1;
+			let i = usize::from(self.free_descriptors[usize::from(self.free_count)]);
+			desc[i].address = u64le::from(address);
+			desc[i].length = u32le::from(length);
+			desc[i].flags = u16le::from(u16::from(write) * Descriptor::WRITE);
+			avail_ring[usize::from(index & self.mask)].index = u16le::from(i as u16);
+			index = index.wrapping_add(1);
+		}
+
+		atomic::fence(Ordering::AcqRel);
+		avail_head.index = index.into();
+
+		Ok(())
+	}
+
 	/// Collect used buffers from the device and add them to the free_descriptors list.
 	///
 	/// A callback function can be specified which will return the descriptor, physical address
@@ -281,6 +298,8 @@ impl<'a> Queue<'a> {
 
 		let mut index @ last = self.last_used;
 		let head_index = u16::from(head.index);
+		// Don't read any buffers before the device is done with them.
+		atomic::fence(Ordering::Acquire);
 		while index != head_index {
 			// TODO maybe we should use unwrap?
 			let mut descr_index = u32::from(ring[usize::from(index & self.mask)].index) as u16;
@@ -322,6 +341,11 @@ impl<'a> Queue<'a> {
 		}
 	}
 
+	/// Return the amount of descriptors that can be used for new chains.
+	pub fn free_descriptors(&self) -> u16 {
+		self.free_count
+	}
+
 	/// Return the offset relative to the notify address to flush this queue.
 	pub fn notify_offset(&self) -> u16 {
 		self.notify_offset
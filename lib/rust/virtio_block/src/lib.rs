@@ -7,6 +7,7 @@ pub use sector::Sector;
 use core::convert::TryInto;
 use core::fmt;
 use core::mem;
+use core::ptr::{self, NonNull};
 use simple_endian::{u16le, u32le, u64le};
 use virtio::pci::{CommonConfig, DeviceConfig, Notify};
 use virtio::queue;
@@ -20,6 +21,7 @@ const BLK_SIZE: u32 = 1 << 6;
 #[allow(dead_code)]
 const FLUSH: u32 = 1 << 9;
 const TOPOLOGY: u32 = 1 << 10;
+const MQ: u32 = 1 << 12;
 #[allow(dead_code)]
 const CONFIG_WCE: u32 = 1 << 11;
 #[allow(dead_code)]
@@ -34,13 +36,24 @@ const EVENT_IDX: u32 = 1 << 28;
 #[allow(dead_code)]
 const INDIRECT_DESC: u32 = 1 << 29;
 
+/// The maximum amount of requests that can be in flight at once.
+pub const MAX_REQUESTS: usize = 32;
+
+/// The maximum amount of pages a single request can cover.
+pub const MAX_PAGES: usize = 16;
+
+/// The maximum amount of request queues that are used.
+pub const MAX_QUEUES: usize = 8;
+
 /// A driver for a virtio block device.
 pub struct BlockDevice<'a> {
-	queue: queue::Queue<'a>,
+	queues: [Option<RequestQueue<'a>>; MAX_QUEUES],
+	/// The amount of queues that have been set up.
+	queue_count: usize,
 	notify: virtio::pci::Notify<'a>,
 	isr: &'a virtio::pci::ISR,
 	/// The amount of sectors available
-	_capacity: u64,
+	capacity: u64,
 }
 
 #[repr(C)]
@@ -75,6 +88,8 @@ struct Config {
 	max_write_zeroes_seg: u32le,
 	write_zeroes_may_unmap: u8,
 	_unused_1: [u8; 3],
+	// Only valid with VIRTIO_BLK_F_MQ
+	num_queues: u16le,
 }
 
 #[repr(C)]
@@ -94,10 +109,41 @@ struct RequestStatus {
 	status: u8,
 }
 
+impl RequestStatus {
+	const OK: u8 = 0;
+	#[allow(dead_code)]
+	const IOERR: u8 = 1;
+	const UNSUPPORTED: u8 = 2;
+	/// Not a status the device returns, only used to make stale statuses stand out.
+	const PENDING: u8 = 111;
+}
+
+/// A request as seen by the device, excluding the data.
+#[repr(C, align(32))]
+struct Request {
+	header: RequestHeader,
+	status: RequestStatus,
+}
+
+/// A virtqueue along with the requests in flight on it.
+struct RequestQueue<'a> {
+	queue: queue::Queue<'a>,
+	/// The headers & statuses of all requests, which are read & written by the device.
+	requests: NonNull<Request>,
+	/// The physical address of `requests`.
+	requests_phys: u64,
+	/// The token of each request that has not been collected yet.
+	tokens: [Option<u64>; MAX_REQUESTS],
+	/// The request slot plus one of each descriptor that is the head of a chain or `0`.
+	heads: [u8; queue::MAX_SIZE as usize],
+	/// Whether requests have been added since the device was last notified.
+	dirty: bool,
+}
+
 use virtio::pci::*;
 
 impl<'a> BlockDevice<'a> {
-	/// Setup a block device
+	/// Setup a block device with a single request queue.
 	///
 	/// This is meant to be used as a handler by the `virtio` crate.
 	pub fn new(
@@ -106,11 +152,27 @@ impl<'a> BlockDevice<'a> {
 		notify: Notify<'a>,
 		isr: &'a virtio::pci::ISR,
 	) -> Result<Self, SetupError> {
-		let features = SIZE_MAX | SEG_MAX | GEOMETRY | BLK_SIZE | TOPOLOGY;
+		Self::new_multiqueue(common, device, notify, isr, 1, &[])
+	}
+
+	/// Setup a block device with up to `queues` request queues, if the device supports it.
+	///
+	/// Queue `i` signals the MSI-X vector `vectors[i]`. Queues without a vector only raise the
+	/// legacy interrupt, which requires MSI-X to be disabled.
+	pub fn new_multiqueue(
+		common: &'a CommonConfig,
+		device: &'a DeviceConfig,
+		notify: Notify<'a>,
+		isr: &'a virtio::pci::ISR,
+		queues: usize,
+		vectors: &[u16],
+	) -> Result<Self, SetupError> {
+		let features = SIZE_MAX | SEG_MAX | GEOMETRY | BLK_SIZE | TOPOLOGY | MQ;
 		common.device_feature_select.set(0.into());
 
 		let features = u32le::from(features) & common.device_feature.get();
-		common.device_feature.set(features);
+		common.driver_feature_select.set(0.into());
+		common.driver_feature.set(features);
 		#[allow(dead_code)]
 		const STATUS_DRIVER_OK: u8 = 0x4;
 
@@ -123,8 +185,28 @@ impl<'a> BlockDevice<'a> {
 
 		let blk_cfg = unsafe { device.cast::<Config>() };
 
-		// Set up queue.
-		let queue = queue::Queue::<'a>::new(common, 0, 8, None).expect("OOM");
+		// Set up queues.
+		let queue_count = if u32::from(features) & MQ != 0 {
+			let n = usize::from(u16::from(blk_cfg.num_queues));
+			n.min(queues).min(MAX_QUEUES).max(1)
+		} else {
+			1
+		};
+		let mut rqs = <[Option<RequestQueue>; MAX_QUEUES]>::default();
+		for (i, rq) in rqs[..queue_count].iter_mut().enumerate() {
+			let vector = vectors.get(i).copied();
+			let queue =
+				queue::Queue::<'a>::new(common, i as u16, queue::MAX_SIZE, vector).expect("OOM");
+			let (requests, phys) = virtio::dma_alloc(kernel::Page::SIZE).expect("OOM");
+			*rq = Some(RequestQueue {
+				queue,
+				requests: requests.cast(),
+				requests_phys: phys as u64,
+				tokens: [None; MAX_REQUESTS],
+				heads: [0; queue::MAX_SIZE as usize],
+				dirty: false,
+			});
+		}
 
 		common.device_status.set(
 			CommonConfig::STATUS_ACKNOWLEDGE
@@ -134,142 +216,208 @@ impl<'a> BlockDevice<'a> {
 		);
 
 		Ok(Self {
-			queue,
+			queues: rqs,
+			queue_count,
 			notify,
 			isr,
-			_capacity: blk_cfg.capacity.into(),
+			capacity: blk_cfg.capacity.into(),
 		})
 	}
 
-	/// Write out sectors
-	pub fn write<'s>(
-		&'s mut self,
-		data: impl AsRef<[Sector]> + 's,
+	/// Return the amount of sectors of the device.
+	pub fn capacity(&self) -> u64 {
+		self.capacity
+	}
+
+	/// Return the amount of request queues.
+	pub fn queue_count(&self) -> usize {
+		self.queue_count
+	}
+
+	/// Queue a request to write out sectors, starting at `sector_start`, on the given queue.
+	///
+	/// The device isn't notified until [`flush`](Self::flush) is called. `token` is passed to
+	/// the callback of [`collect`](Self::collect) once the request finishes.
+	///
+	/// # Safety
+	///
+	/// `data` may not be modified or freed until the request has been collected.
+	pub unsafe fn submit_write(
+		&mut self,
+		queue: usize,
+		data: &[Sector],
 		sector_start: u64,
-		wait: impl FnMut(),
-	) -> Result<(), WriteError> {
-		let header = RequestHeader {
-			typ: RequestHeader::WRITE.into(),
-			reserved: 0.into(),
-			sector: sector_start.into(),
-		};
-		let status = RequestStatus { status: 111 };
-		let (mut phys_header, mut phys_data, mut phys_status) = (0, 0, 0);
-		let h = &header as *const _ as usize;
-		let d = data.as_ref() as *const _ as *const u8 as usize;
-		let s = &status as *const _ as usize;
-		let (hp, ho) = (h & !0xfff, h & 0xfff);
-		let (dp, d_) = (d & !0xfff, d & 0xfff);
-		let (sp, so) = (s & !0xfff, s & 0xfff);
-		let ret =
-			unsafe { kernel::mem_physical_address(hp as *const _, &mut phys_header as *mut _, 1) };
-		assert_eq!(ret.status, 0, "Failed DMA get phys address");
-		let ret =
-			unsafe { kernel::mem_physical_address(dp as *const _, &mut phys_data as *mut _, 1) };
-		assert_eq!(ret.status, 0, "Failed DMA get phys address");
-		let ret =
-			unsafe { kernel::mem_physical_address(sp as *const _, &mut phys_status as *mut _, 1) };
-		assert_eq!(ret.status, 0, "Failed DMA get phys address");
+		token: u64,
+	) -> Result<(), SubmitError> {
+		let d = data.as_ptr() as *mut u8;
+		let rq = self.queue(queue);
+		rq.submit(
+			RequestHeader::WRITE,
+			d,
+			data.len(),
+			sector_start,
+			token,
+			false,
+		)
+	}
+
+	/// Queue a request to read in sectors, starting at `sector_start`, on the given queue.
+	///
+	/// The device isn't notified until [`flush`](Self::flush) is called. `token` is passed to
+	/// the callback of [`collect`](Self::collect) once the request finishes.
+	///
+	/// # Safety
+	///
+	/// `data` may not be accessed or freed until the request has been collected.
+	pub unsafe fn submit_read(
+		&mut self,
+		queue: usize,
+		data: &mut [Sector],
+		sector_start: u64,
+		token: u64,
+	) -> Result<(), SubmitError> {
+		let d = data.as_mut_ptr().cast();
+		let rq = self.queue(queue);
+		rq.submit(
+			RequestHeader::READ,
+			d,
+			data.len(),
+			sector_start,
+			token,
+			true,
+		)
+	}
 
-		let data = [
-			(
-				(phys_header + ho).try_into().unwrap(),
-				mem::size_of::<RequestHeader>().try_into().unwrap(),
-				false,
-			),
-			(
-				(phys_data + d_).try_into().unwrap(),
-				(data.as_ref().len() * mem::size_of::<Sector>())
-					.try_into()
-					.unwrap(),
-				false,
-			),
-			(
-				(phys_status + so).try_into().unwrap(),
-				mem::size_of::<RequestStatus>().try_into().unwrap(),
-				true,
-			),
-		];
+	/// Collect finished requests on the given queue and call `f` with the token and the result
+	/// of each. Requests may finish in any order.
+	///
+	/// Returns the amount of requests collected.
+	pub fn collect(&mut self, queue: usize, f: impl FnMut(u64, Result<(), IoError>)) -> usize {
+		self.queue(queue).collect(f)
+	}
 
-		self.queue
-			.send(data.iter().copied(), None, None)
-			.expect("Failed to send data");
+	/// Return the amount of requests on the given queue that have not been collected yet.
+	pub fn in_flight(&self, queue: usize) -> usize {
+		let rq = self.queues[..self.queue_count][queue].as_ref().unwrap();
+		rq.tokens.iter().filter(|t| t.is_some()).count()
+	}
 
-		self.flush();
+	/// Notify the device of all queues with new requests.
+	pub fn flush(&mut self) {
+		let notify = &self.notify;
+		for rq in self.queues.iter_mut().flatten().filter(|rq| rq.dirty) {
+			notify.send(rq.queue.notify_offset());
+			rq.dirty = false;
+		}
+	}
 
-		self.queue.wait_for_used(None, wait);
+	/// ## Panics
+	///
+	/// The queue doesn't exist.
+	fn queue(&mut self, queue: usize) -> &mut RequestQueue<'a> {
+		self.queues[..self.queue_count][queue].as_mut().unwrap()
+	}
 
-		Ok(())
+	#[inline]
+	pub fn was_interrupted(&self) -> bool {
+		self.isr.read().queue_update()
 	}
+}
 
-	/// Read in sectors
-	pub fn read<'s>(
-		&'s mut self,
-		mut data: impl AsMut<[Sector]> + 's,
+impl RequestQueue<'_> {
+	unsafe fn submit(
+		&mut self,
+		typ: u32,
+		data: *mut u8,
+		sectors: usize,
 		sector_start: u64,
-		wait: impl FnMut(),
-	) -> Result<(), WriteError> {
-		let header = RequestHeader {
-			typ: RequestHeader::READ.into(),
+		token: u64,
+		device_writes: bool,
+	) -> Result<(), SubmitError> {
+		let page_mask = kernel::Page::SIZE - 1;
+		let (base, offset) = (data as usize & !page_mask, data as usize & page_mask);
+		let bytes = sectors * mem::size_of::<Sector>();
+		let pages = (offset + bytes + page_mask) / kernel::Page::SIZE;
+		if pages > MAX_PAGES {
+			return Err(SubmitError::TooLarge);
+		}
+		let slot = self
+			.tokens
+			.iter()
+			.position(Option::is_none)
+			.ok_or(SubmitError::Full)?;
+		if usize::from(self.queue.free_descriptors()) < pages + 2 {
+			return Err(SubmitError::Full);
+		}
+
+		let mut phys = [0; MAX_PAGES];
+		let ret = kernel::mem_physical_address(base as *const _, phys.as_mut_ptr(), pages);
+		assert_eq!(ret.status, 0, "Failed DMA get phys address");
+
+		let request = &mut *self.requests.as_ptr().add(slot);
+		request.header = RequestHeader {
+			typ: typ.into(),
 			reserved: 0.into(),
 			sector: sector_start.into(),
 		};
-		let status = RequestStatus { status: 111 };
-		let (mut phys_header, mut phys_data, mut phys_status) = (0, 0, 0);
-		let h = &header as *const _ as usize;
-		let d = data.as_mut() as *mut _ as *mut u8 as usize;
-		let s = &status as *const _ as usize;
-		let (hp, ho) = (h & !0xfff, h & 0xfff);
-		let (dp, d_) = (d & !0xfff, d & 0xfff);
-		let (sp, so) = (s & !0xfff, s & 0xfff);
-		let ret =
-			unsafe { kernel::mem_physical_address(hp as *const _, &mut phys_header as *mut _, 1) };
-		assert_eq!(ret.status, 0, "Failed DMA get phys address");
-		let ret =
-			unsafe { kernel::mem_physical_address(dp as *const _, &mut phys_data as *mut _, 1) };
-		assert_eq!(ret.status, 0, "Failed DMA get phys address");
-		let ret =
-			unsafe { kernel::mem_physical_address(sp as *const _, &mut phys_status as *mut _, 1) };
-		assert_eq!(ret.status, 0, "Failed DMA get phys address");
-
-		let data = [
-			(
-				(phys_header + ho).try_into().unwrap(),
-				mem::size_of::<RequestHeader>().try_into().unwrap(),
-				false,
-			),
-			(
-				(phys_data + d_).try_into().unwrap(),
-				(data.as_mut().len() * mem::size_of::<Sector>())
-					.try_into()
-					.unwrap(),
-				true,
-			),
-			(
-				(phys_status + so).try_into().unwrap(),
-				mem::size_of::<RequestStatus>().try_into().unwrap(),
-				true,
-			),
-		];
+		request.status.status = RequestStatus::PENDING;
+		let request = self.requests_phys + (slot * mem::size_of::<Request>()) as u64;
+
+		// Each page gets its own descriptor as the pages may not be physically contiguous.
+		let mut descriptors = [(0, 0, false); MAX_PAGES + 2];
+		descriptors[0] = (request, mem::size_of::<RequestHeader>() as u32, false);
+		for (i, (d, &p)) in descriptors[1..].iter_mut().zip(&phys[..pages]).enumerate() {
+			let page = i * kernel::Page::SIZE;
+			let start = offset.max(page);
+			let end = (offset + bytes).min(page + kernel::Page::SIZE);
+			let address = (p + start - page).try_into().unwrap();
+			*d = (address, (end - start).try_into().unwrap(), device_writes);
+		}
+		descriptors[pages + 1] = (
+			request + mem::size_of::<RequestHeader>() as u64,
+			mem::size_of::<RequestStatus>() as u32,
+			true,
+		);
 
+		let mut head = None;
 		self.queue
-			.send(data.iter().copied(), None, None)
+			.send(
+				descriptors[..pages + 2].iter().copied(),
+				Some(&mut |d| {
+					head.get_or_insert(d);
+				}),
+				None,
+			)
 			.expect("Failed to send data");
-
-		self.flush();
-
-		self.queue.wait_for_used(None, wait);
+		self.heads[usize::from(head.unwrap())] = slot as u8 + 1;
+		self.tokens[slot] = Some(token);
+		self.dirty = true;
 
 		Ok(())
 	}
 
-	pub fn flush(&self) {
-		self.notify.send(0);
-	}
-
-	#[inline]
-	pub fn was_interrupted(&self) -> bool {
-		self.isr.read().queue_update()
+	fn collect(&mut self, mut f: impl FnMut(u64, Result<(), IoError>)) -> usize {
+		let (heads, tokens, requests) = (&mut self.heads, &mut self.tokens, self.requests);
+		let mut count = 0;
+		self.queue.collect_used(Some(&mut |d, _, _| {
+			// Only the head of each chain refers to a request.
+			let slot = match mem::replace(&mut heads[usize::from(d)], 0) {
+				0 => return,
+				s => usize::from(s - 1),
+			};
+			let token = tokens[slot].take().expect("no request in slot");
+			let status = unsafe { ptr::addr_of!((*requests.as_ptr().add(slot)).status.status) };
+			f(
+				token,
+				match unsafe { status.read_volatile() } {
+					RequestStatus::OK => Ok(()),
+					RequestStatus::UNSUPPORTED => Err(IoError::Unsupported),
+					_ => Err(IoError::Failed),
+				},
+			);
+			count += 1;
+		}));
+		count
 	}
 }
 
@@ -291,14 +439,18 @@ impl fmt::Debug for SetupError {
 	}
 }
 
-pub enum WriteError {}
+#[derive(Debug)]
+pub enum SubmitError {
+	/// There are too many requests in flight.
+	Full,
+	/// The request covers too many pages.
+	TooLarge,
+}
 
-impl fmt::Debug for WriteError {
-	fn fmt(&self, _f: &mut fmt::Formatter) -> fmt::Result {
-		/*
-		f.write_str(match self {
-		})
-		*/
-		Ok(())
-	}
+#[derive(Debug)]
+pub enum IoError {
+	/// The device failed to perform the request.
+	Failed,
+	/// The device doesn't support the request.
+	Unsupported,
 }
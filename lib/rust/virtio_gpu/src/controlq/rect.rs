@@ -20,6 +20,25 @@ impl Rect {
 		}
 	}
 
+	/// Whether the rectangle covers no pixels.
+	pub fn is_empty(&self) -> bool {
+		self.width() == 0 || self.height() == 0
+	}
+
+	/// Return the smallest rectangle that covers both rectangles. Empty rectangles are ignored.
+	pub fn union(&self, other: &Self) -> Self {
+		match (self.is_empty(), other.is_empty()) {
+			(_, true) => *self,
+			(true, false) => *other,
+			(false, false) => {
+				let (x0, y0) = (self.x().min(other.x()), self.y().min(other.y()));
+				let x1 = (self.x() + self.width()).max(other.x() + other.width());
+				let y1 = (self.y() + self.height()).max(other.y() + other.height());
+				Self::new(x0, y0, x1 - x0, y1 - y0)
+			}
+		}
+	}
+
 	#[inline(always)]
 	pub fn x(&self) -> u32 {
 		self.x.into()
@@ -6,12 +6,12 @@ mod cursorq;
 pub use controlq::resource::create_2d::Format;
 pub use controlq::Rect;
 
-use core::convert::TryInto;
+use core::convert::{TryFrom, TryInto};
 use core::fmt;
 use core::mem;
 use core::num::NonZeroU32;
 use core::pin::Pin;
-use core::ptr::NonNull;
+use core::ptr::{self, NonNull};
 use simple_endian::{u32le, u64le};
 use vcell::VolatileCell;
 
@@ -147,13 +147,48 @@ impl fmt::Debug for ControlHeader {
 #[derive(Clone, Copy)]
 pub struct Resource(NonZeroU32);
 
+/// The maximum amount of commands that can be in flight at once.
+const MAX_COMMANDS: usize = 32;
+
+/// A command and its response, as read and written by the device.
+#[repr(C, align(128))]
+struct Command {
+	request: [u64; 8],
+	response: ControlHeader,
+}
+
+#[derive(Clone, Copy)]
+enum Slot {
+	Free,
+	/// The command is in flight. Only the last command of a draw has a token.
+	Busy(Option<u64>),
+}
+
 pub struct Device<'a> {
 	notify: virtio::pci::Notify<'a>,
 	controlq: virtio::queue::Queue<'a>,
 	cursorq: virtio::queue::Queue<'a>,
+	/// The width in pixels of each resource, indexed by ID - 1.
+	widths: [u32; Self::MAX_RESOURCES],
+	/// The commands submitted with [`Self::submit_draw`].
+	commands: NonNull<Command>,
+	/// The physical address of `commands`.
+	commands_phys: u64,
+	slots: [Slot; MAX_COMMANDS],
+	/// The slot plus one of each descriptor that is the head of a chain or `0`.
+	heads: [u8; virtio::queue::MAX_SIZE as usize],
+	/// Whether a command without a token failed since the last draw completed.
+	failed: bool,
 }
 
 impl<'a> Device<'a> {
+	/// The amount of resources that can be created: the scanout, the cursor and extra buffers
+	/// for the scanout.
+	const MAX_RESOURCES: usize = 4;
+
+	/// The size of a pixel in bytes, which is the same for all formats.
+	const PIXEL_SIZE: u64 = 4;
+
 	/// Setup a GPU device
 	///
 	/// This is meant to be used as a handler by the `virtio` crate.
@@ -176,7 +211,9 @@ impl<'a> Device<'a> {
 		);
 		// TODO check device status to ensure features were enabled correctly.
 
-		let controlq = virtio::queue::Queue::<'a>::new(common, 0, 8, None).expect("OOM");
+		// Each command needs a descriptor for the request and one for the response.
+		let size = (2 * MAX_COMMANDS) as u16;
+		let controlq = virtio::queue::Queue::<'a>::new(common, 0, size, None).expect("OOM");
 		let cursorq = virtio::queue::Queue::<'a>::new(common, 1, 8, None).expect("OOM");
 
 		common.device_status.set(
@@ -186,10 +223,18 @@ impl<'a> Device<'a> {
 				| virtio::pci::CommonConfig::STATUS_DRIVER_OK,
 		);
 
+		let (commands, phys) = virtio::dma_alloc(kernel::Page::SIZE).expect("OOM");
+
 		Ok(Self {
 			controlq,
 			cursorq,
 			notify,
+			widths: [0; Self::MAX_RESOURCES],
+			commands: commands.cast(),
+			commands_phys: phys as u64,
+			slots: [Slot::Free; MAX_COMMANDS],
+			heads: [0; virtio::queue::MAX_SIZE as usize],
+			failed: false,
 		})
 	}
 
@@ -231,6 +276,25 @@ impl<'a> Device<'a> {
 		Ok(Resource(NonZeroU32::new(res_id).unwrap()))
 	}
 
+	/// Create a resource that can be attached to the scanout with [`Self::submit_draw`] in
+	/// place of the one created by [`Self::init_scanout`].
+	pub unsafe fn create_buffer(
+		&mut self,
+		format: Format,
+		rect: Rect,
+		backend: NonNull<kernel::Page>,
+		count: usize,
+	) -> Result<Resource, CreateBufferError> {
+		// The first two IDs are reserved for the scanout and the cursor.
+		let i = self.widths[2..]
+			.iter()
+			.position(|&w| w == 0)
+			.ok_or(CreateBufferError::TooMany)?;
+		let res_id = NonZeroU32::new(u32::try_from(i + 3).unwrap()).unwrap();
+		self.create_resource(res_id, rect, format, backend, count);
+		Ok(Resource(res_id))
+	}
+
 	pub unsafe fn init_cursor(
 		&mut self,
 		x: u32,
@@ -315,35 +379,146 @@ impl<'a> Device<'a> {
 		Ok(())
 	}
 
+	/// Transfer the given area of a resource to the host and flush it.
+	///
+	/// Only the area covered by `rect` is transferred, so small updates are cheap. This waits
+	/// for the device and may not be used while draws submitted with [`Self::submit_draw`]
+	/// are in flight.
 	pub fn draw(&mut self, resource: Resource, rect: Rect) -> Result<(), DrawError> {
+		assert_eq!(self.in_flight(), 0, "draws are in flight");
+		self.submit_draw(resource, rect, None, 0)
+			.expect("no free command slots");
+		self.flush();
+		let mut ret = None;
+		while ret.is_none() {
+			self.collect(|_, r| ret = Some(r));
+		}
+		ret.unwrap()
+	}
+
+	/// Transfer the given area of a resource to the host and flush it without waiting.
+	///
+	/// If `scanout` is set, the resource is attached to the scanout with the given area before
+	/// it is flushed, which allows flipping between buffers. The device handles commands in
+	/// order, so multiple draws can be in flight at once.
+	///
+	/// `token` is passed to [`Self::collect`] once the device is done with the resource. The
+	/// device must be notified with [`Self::flush`] afterwards.
+	pub fn submit_draw(
+		&mut self,
+		resource: Resource,
+		rect: Rect,
+		scanout: Option<Rect>,
+		token: u64,
+	) -> Result<(), SubmitError> {
+		let count = 2 + usize::from(scanout.is_some());
+		let free = self.slots.iter().filter(|s| matches!(s, Slot::Free));
+		if free.count() < count {
+			return Err(SubmitError::Full);
+		}
+
 		let res_id = resource.0.get();
+		let width = self.widths[usize::try_from(res_id - 1).unwrap()];
 
-		// Response buffer
-		let mut resp_buffer = ControlHeader::new(0, None);
-		let resp_buffer = Pin::new(&mut resp_buffer);
-		let resp_data = Self::create_queue_entry_mut(resp_buffer, None);
+		// The offset points to the first pixel of the area in the backing storage.
+		let stride = u64::from(width) * Self::PIXEL_SIZE;
+		let offset = u64::from(rect.y()) * stride + u64::from(rect.x()) * Self::PIXEL_SIZE;
 
-		// Transfer to host
-		let res = controlq::TransferToHost2D::new(res_id, 0, rect, Some(0));
-		let res = Pin::new(&res);
-		let data = [Self::create_queue_entry(res, None), resp_data];
-		self.controlq
-			.send(data.iter().copied(), None, None)
-			.expect("failed to send data");
-		self.flush();
-		self.controlq.wait_for_used(None, || ());
+		self.push(
+			controlq::TransferToHost2D::new(res_id, offset, rect, Some(0)),
+			None,
+		);
+		if let Some(scanout) = scanout {
+			self.push(controlq::SetScanout::new(0, res_id, scanout, Some(0)), None);
+		}
+		self.push(
+			controlq::resource::Flush::new(res_id, rect, Some(0)),
+			Some(token),
+		);
+		Ok(())
+	}
+
+	/// Collect completed draws and call `f` with the token of each.
+	///
+	/// Returns the amount of draws collected.
+	pub fn collect(&mut self, mut f: impl FnMut(u64, Result<(), DrawError>)) -> usize {
+		let (heads, slots, failed) = (&mut self.heads, &mut self.slots, &mut self.failed);
+		let commands = self.commands;
+		let mut count = 0;
+		self.controlq.collect_used(Some(&mut |d, _, _| {
+			// Only the head of each chain refers to a command.
+			let slot = match mem::replace(&mut heads[usize::from(d)], 0) {
+				0 => return,
+				s => usize::from(s - 1),
+			};
+			let ty = unsafe { ptr::addr_of!((*commands.as_ptr().add(slot)).response.ty) };
+			*failed |= u32::from(unsafe { ty.read_volatile() }) != ControlHeader::RESP_OK_NODATA;
+			// Commands are handled in order, so any failure belongs to the draw that completes
+			// next.
+			if let Slot::Busy(Some(token)) = mem::replace(&mut slots[slot], Slot::Free) {
+				let ret = if mem::replace(failed, false) {
+					Err(DrawError::Failed)
+				} else {
+					Ok(())
+				};
+				f(token, ret);
+				count += 1;
+			}
+		}));
+		count
+	}
+
+	/// Return the amount of draws that have not been collected yet.
+	pub fn in_flight(&self) -> usize {
+		self.slots
+			.iter()
+			.filter(|s| matches!(s, Slot::Busy(Some(_))))
+			.count()
+	}
 
-		// Flush resource
-		let flush = controlq::resource::Flush::new(res_id.try_into().unwrap(), rect, Some(0));
-		let flush = Pin::new(&flush);
-		let data = [Self::create_queue_entry(flush, None), resp_data];
+	/// Put a command in a free slot and add it to the control queue.
+	///
+	/// ## Panics
+	///
+	/// There is no free slot.
+	fn push<T>(&mut self, command: T, token: Option<u64>) {
+		assert!(
+			mem::size_of::<T>() <= mem::size_of::<[u64; 8]>(),
+			"command too large"
+		);
+		let slot = self
+			.slots
+			.iter()
+			.position(|s| matches!(s, Slot::Free))
+			.expect("no free command slots");
+
+		unsafe {
+			let c = &mut *self.commands.as_ptr().add(slot);
+			c.request.as_mut_ptr().cast::<T>().write(command);
+			c.response = ControlHeader::new(0, None);
+		}
+		let phys = self.commands_phys + (slot * mem::size_of::<Command>()) as u64;
+		let data = [
+			(phys, mem::size_of::<T>() as u32, false),
+			(
+				phys + mem::size_of::<[u64; 8]>() as u64,
+				mem::size_of::<ControlHeader>() as u32,
+				true,
+			),
+		];
+
+		let mut head = None;
 		self.controlq
-			.send(data.iter().copied(), None, None)
+			.send(
+				data.iter().copied(),
+				Some(&mut |d| {
+					head.get_or_insert(d);
+				}),
+				None,
+			)
 			.expect("failed to send data");
-		self.flush();
-		self.controlq.wait_for_used(None, || ());
-
-		Ok(())
+		self.heads[usize::from(head.unwrap())] = slot as u8 + 1;
+		self.slots[slot] = Slot::Busy(token);
 	}
 
 	fn create_resource(
@@ -356,6 +531,8 @@ impl<'a> Device<'a> {
 	) {
 		const MAX_PAGES: usize = 1024;
 
+		self.widths[usize::try_from(id.get() - 1).unwrap()] = rect.width();
+
 		// Response buffer
 		let mut resp_buffer = ControlHeader::new(0, None);
 		let mut resp_buffer = Pin::new(&mut resp_buffer);
@@ -477,7 +654,8 @@ impl<'a> Device<'a> {
 		)
 	}
 
-	fn flush(&self) {
+	/// Notify the device of new commands.
+	pub fn flush(&self) {
 		self.notify.send(0);
 		self.notify.send(1);
 	}
@@ -501,4 +679,19 @@ pub enum UpdateCursorError {}
 pub enum MoveCursorError {}
 
 #[derive(Debug)]
-pub enum DrawError {}
+pub enum CreateBufferError {
+	/// All resource IDs are in use.
+	TooMany,
+}
+
+#[derive(Debug)]
+pub enum DrawError {
+	/// The device failed to handle a command.
+	Failed,
+}
+
+#[derive(Debug)]
+pub enum SubmitError {
+	/// There are too many commands in flight.
+	Full,
+}
@@ -88,6 +88,15 @@ impl InputEvent {
 	pub fn value(&self) -> i32 {
 		self.value.into()
 	}
+
+	/// Return the event as laid out by the device, which is also how it is sent to clients.
+	pub fn to_bytes(&self) -> [u8; 8] {
+		let mut b = [0; 8];
+		b[..2].copy_from_slice(&self.ty().to_le_bytes());
+		b[2..4].copy_from_slice(&self.code().to_le_bytes());
+		b[4..].copy_from_slice(&self.value().to_le_bytes());
+		b
+	}
 }
 
 impl fmt::Debug for InputEvent {
@@ -110,7 +119,9 @@ pub struct Device<'a> {
 }
 
 impl<'a> Device<'a> {
-	const MAX_EVENTS: u16 = 8;
+	/// High-rate devices like tablets report many events at once, so keep plenty of buffers
+	/// available.
+	const MAX_EVENTS: u16 = 64;
 	const MAX_STATUS: u16 = 8;
 
 	/// Setup an input device
@@ -184,9 +195,12 @@ impl<'a> Device<'a> {
 
 	/// Collect received entries.
 	///
+	/// All used buffers are collected in one pass and given back to the device together, with a
+	/// single notification. Returns the amount of events received.
+	///
 	/// This should be called periodically or on interrupt to prevent the queue from getting backed
 	/// up.
-	pub fn receive(&mut self, callback: &mut dyn FnMut(InputEvent)) -> Result<(), ReceiveError> {
+	pub fn receive(&mut self, callback: &mut dyn FnMut(InputEvent)) -> Result<usize, ReceiveError> {
 		let evt = self.events;
 		let evt_phys = self.events_phys_addr;
 		let mut used = [(0, 0, false); Self::MAX_EVENTS as usize];
@@ -205,14 +219,14 @@ impl<'a> Device<'a> {
 			used_count += 1;
 		}));
 
-		for u in used[..used_count].iter().copied() {
+		if used_count > 0 {
 			self.eventq
-				.send([u].iter().copied(), None, None)
+				.send_each(used[..used_count].iter().copied())
 				.expect("failed to send to eventq");
+			self.flush();
 		}
-		self.flush();
 
-		Ok(())
+		Ok(used_count)
 	}
 
 	pub fn name(&self, buf: &mut [u8; 128]) -> u8 {
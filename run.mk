@@ -1,6 +1,7 @@
 FIRMWARE    ?= ../riscv/opensbi/build/platform/generic/firmware/fw_jump.bin
 KERNEL      ?= target/kernel.bin
 VIRTIO_DISK ?= target/disk
+BENCH_DISK  ?= target/bench_disk
 
 QEMU=qemu-system-riscv64 \
 		-s \
@@ -24,6 +25,12 @@ run: build $(VIRTIO_DISK)
 	@echo Enter Ctrl-A + X to quit
 	$(QEMU) $(QEMU_OPT)
 
+# The file benchmarks need a larger disk than the default one.
+run-bench: VIRTIO_DISK = $(BENCH_DISK)
+run-bench: build $(BENCH_DISK)
+	@echo Enter Ctrl-A + X to quit
+	$(QEMU) $(QEMU_OPT)
+
 RUST_TARGET ?= riscv64gc-unknown-none-elf
 
 gdb: build $(VIRTIO_DISK)
@@ -39,6 +46,9 @@ gdb-run: build
 $(VIRTIO_DISK):
 	fallocate -l $$((32 * 512)) $@
 
+$(BENCH_DISK):
+	fallocate -l $$((16 * 1024 * 1024)) $@
+
 help-log-trace:
 	$(QEMU) $(QEMU_OPT) -d trace:help
 
@@ -0,0 +1,62 @@
+//! # Benchmark echo server
+//!
+//! Answers every packet it receives with a packet with the same ID, opcode, offset and length
+//! but without any data. Pages that were sent along are unmapped right away, so clients can
+//! measure the round trip of both bare packets and page transfers.
+
+#![no_std]
+#![no_main]
+#![feature(asm)]
+#![feature(global_asm)]
+#![feature(panic_info_message)]
+
+#[panic_handler]
+fn panic_handler(info: &core::panic::PanicInfo) -> ! {
+	kernel::sys_log!("Panic!");
+	if let Some(m) = info.message() {
+		kernel::sys_log!("  Message: {}", m);
+	}
+	if let Some(l) = info.location() {
+		kernel::sys_log!("  Location: {}", l);
+	}
+	loop {}
+}
+
+mod rtbegin;
+
+#[export_name = "main"]
+fn main() {
+	unsafe { dux::init() };
+
+	let name = b"bench_echo";
+	let ret = unsafe { kernel::sys_registry_add(name.as_ptr(), name.len(), usize::MAX) };
+	assert_eq!(ret.status, 0, "failed to add self to registry");
+
+	loop {
+		// Replies are delivered when waiting for the next packet.
+		let rxq = dux::ipc::receive();
+		free_range(rxq.name, rxq.name_len.into());
+		free_range(rxq.data, rxq.length);
+		*dux::ipc::transmit() = kernel::ipc::Packet {
+			uuid: kernel::ipc::UUID::INVALID,
+			opcode: rxq.opcode,
+			name: None,
+			name_len: 0,
+			flags: 0,
+			id: rxq.id,
+			address: rxq.address,
+			data: None,
+			length: rxq.length,
+			offset: rxq.offset,
+		};
+	}
+}
+
+fn free_range(range: Option<core::ptr::NonNull<kernel::Page>>, length: usize) {
+	if let Some(range) = range {
+		let len = dux::Page::min_pages_for_range(length);
+		let ret = unsafe { kernel::mem_dealloc(range.as_ptr(), len) };
+		assert_eq!(ret.status, 0);
+		dux::ipc::add_free_range(dux::Page::new(range).unwrap(), len).unwrap();
+	}
+}
@@ -0,0 +1,97 @@
+// Measures the throughput of fwrite and fread through the C library, the FAT
+// driver and the block device driver.
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PATH "bench"
+
+// The total amount of bytes written and read in each run.
+#define FILE_SIZE (1024 * 1024)
+
+// The largest amount of bytes passed to a single fwrite or fread.
+#define MAX_CHUNK (64 * 1024)
+
+struct sample {
+	uint64_t time;
+	uint64_t cycles;
+};
+
+static char buf[MAX_CHUNK];
+
+static struct sample now() {
+	struct sample s;
+	__asm__ volatile ("rdtime %0" : "=r"(s.time));
+	__asm__ volatile ("rdcycle %0" : "=r"(s.cycles));
+	return s;
+}
+
+static struct sample elapsed(struct sample start) {
+	struct sample s = now();
+	s.time -= start.time;
+	s.cycles -= start.cycles;
+	return s;
+}
+
+static void report(const char *name, size_t chunk, size_t ops, struct sample d) {
+	uint64_t time = d.time > 0 ? d.time : 1;
+	printf("bench: %-8s %6zu B: %10llu cycles/op %8llu ns/op %8llu KiB/s\n",
+		name,
+		chunk,
+		(unsigned long long)(d.cycles / ops),
+		(unsigned long long)(time * 1000 / ops),
+		(unsigned long long)((uint64_t)FILE_SIZE * 1000000 / 1024 / time));
+}
+
+static int run(size_t chunk) {
+	size_t ops = FILE_SIZE / chunk;
+
+	FILE *f = fopen(PATH, "w");
+	if (f == NULL) {
+		puts("bench: failed to open file for writing");
+		return 1;
+	}
+	struct sample start = now();
+	for (size_t i = 0; i < ops; i++) {
+		if (fwrite(buf, chunk, 1, f) != 1) {
+			puts("bench: failed to write");
+			fclose(f);
+			return 1;
+		}
+	}
+	// Include flushing the last buffered data in the measurement.
+	fclose(f);
+	report("fwrite", chunk, ops, elapsed(start));
+
+	f = fopen(PATH, "r");
+	if (f == NULL) {
+		puts("bench: failed to open file for reading");
+		return 1;
+	}
+	start = now();
+	for (size_t i = 0; i < ops; i++) {
+		if (fread(buf, chunk, 1, f) != 1) {
+			puts("bench: failed to read");
+			fclose(f);
+			return 1;
+		}
+	}
+	fclose(f);
+	report("fread", chunk, ops, elapsed(start));
+
+	return 0;
+}
+
+int main() {
+	memset(buf, 0xaa, sizeof(buf));
+
+	puts("bench: starting file benchmarks");
+	for (size_t chunk = 512; chunk <= MAX_CHUNK; chunk *= 8) {
+		if (run(chunk) != 0) {
+			return 1;
+		}
+	}
+	puts("bench: done");
+
+	return 0;
+}
@@ -0,0 +1,222 @@
+//! # IPC and memory benchmarks
+//!
+//! Measures the round trip of packets to `bench_echo` with one or more packets in flight, the
+//! bandwidth of sending pages along with packets and the rate at which pages can be allocated
+//! and deallocated. Results are logged as cycles and nanoseconds per operation.
+//!
+//! Once done it adds itself to the registry so that tasks that depend on it can start.
+
+#![no_std]
+#![no_main]
+#![feature(asm)]
+#![feature(global_asm)]
+#![feature(panic_info_message)]
+
+#[panic_handler]
+fn panic_handler(info: &core::panic::PanicInfo) -> ! {
+	kernel::sys_log!("Panic!");
+	if let Some(m) = info.message() {
+		kernel::sys_log!("  Message: {}", m);
+	}
+	if let Some(l) = info.location() {
+		kernel::sys_log!("  Location: {}", l);
+	}
+	loop {}
+}
+
+mod rtbegin;
+
+use kernel::sys_log;
+
+/// The amount of packets sent in each IPC benchmark.
+const ROUNDS: usize = 10_000;
+
+/// The amounts of packets in flight that are measured. The largest must leave room in the
+/// queues of both tasks for the completions.
+const DEPTHS: [usize; 4] = [1, 2, 4, 8];
+
+/// The amount of pages sent along with each packet in the transfer benchmark. The server maps
+/// them in one of its free ranges, which must be large enough.
+const TRANSFER_PAGES: usize = 16;
+
+/// The amount of pages allocated at once in the allocation benchmark.
+const ALLOC_PAGES: usize = 16;
+
+/// The amount of times pages are allocated and deallocated.
+const ALLOC_ROUNDS: usize = 1_000;
+
+/// A point in time as both time in microseconds and cycles.
+#[derive(Clone, Copy)]
+struct Sample {
+	time: u64,
+	cycles: u64,
+}
+
+impl Sample {
+	fn now() -> Self {
+		Self {
+			time: dux::time::now(),
+			cycles: dux::time::cycles(),
+		}
+	}
+
+	fn elapsed(self) -> Self {
+		let now = Self::now();
+		Self {
+			time: now.time - self.time,
+			cycles: now.cycles - self.cycles,
+		}
+	}
+}
+
+/// Log the result of a benchmark that did `ops` operations, moving `bytes` bytes in total.
+/// `param` is the depth or the amount of pages, depending on the benchmark.
+fn report(name: &str, param: usize, ops: usize, bytes: usize, d: Sample) {
+	let ops = ops as u64;
+	let time = d.time.max(1);
+	if bytes > 0 {
+		sys_log!(
+			"bench: {:<16} {:>3} {:>8} cycles/op {:>8} ns/op {:>8} KiB/s",
+			name,
+			param,
+			d.cycles / ops,
+			time * 1000 / ops,
+			bytes as u64 * 1_000_000 / 1024 / time,
+		);
+	} else {
+		sys_log!(
+			"bench: {:<16} {:>3} {:>8} cycles/op {:>8} ns/op",
+			name,
+			param,
+			d.cycles / ops,
+			time * 1000 / ops,
+		);
+	}
+}
+
+fn packet(address: usize) -> kernel::ipc::Packet {
+	kernel::ipc::Packet {
+		uuid: kernel::ipc::UUID::INVALID,
+		opcode: None,
+		name: None,
+		name_len: 0,
+		flags: 0,
+		id: 0,
+		address,
+		data: None,
+		length: 0,
+		offset: 0,
+	}
+}
+
+/// Send packets one by one and wait for each reply.
+fn ping_pong(address: usize) {
+	let start = Sample::now();
+	for _ in 0..ROUNDS {
+		*dux::ipc::transmit() = packet(address);
+		drop(dux::ipc::receive());
+	}
+	report("ping-pong", 1, ROUNDS, 0, start.elapsed());
+}
+
+/// Send packets while keeping `depth` of them in flight.
+fn ring(address: usize, depth: usize) {
+	let mut tags = [0; DEPTHS[DEPTHS.len() - 1]];
+	let packet = packet(address);
+	let start = Sample::now();
+	for t in tags[..depth].iter_mut() {
+		*t = dux::ipc::tag::submit(&packet).expect("no free tags");
+	}
+	let mut submitted = depth;
+	for i in (0..depth).cycle().take(ROUNDS) {
+		drop(dux::ipc::tag::wait(tags[i]));
+		if submitted < ROUNDS {
+			tags[i] = dux::ipc::tag::submit(&packet).expect("no free tags");
+			submitted += 1;
+		}
+	}
+	report("ring", depth, ROUNDS, 0, start.elapsed());
+}
+
+/// Send packets with pages and wait for each reply, which unmaps them.
+fn transfer(address: usize) {
+	let length = TRANSFER_PAGES * dux::Page::SIZE;
+	let data = dux::mem::allocate_range(None, TRANSFER_PAGES, dux::RWX::RW)
+		.expect("failed to allocate transfer pages");
+	// Touch the pages so that faulting them in isn't measured.
+	unsafe { core::ptr::write_bytes(data.as_ptr().cast::<u8>(), 0xaa, length) };
+
+	let start = Sample::now();
+	for _ in 0..ROUNDS {
+		*dux::ipc::transmit() = kernel::ipc::Packet {
+			data: Some(data.as_non_null_ptr()),
+			length,
+			..packet(address)
+		};
+		drop(dux::ipc::receive());
+	}
+	report(
+		"transfer",
+		TRANSFER_PAGES,
+		ROUNDS,
+		ROUNDS * length,
+		start.elapsed(),
+	);
+
+	unsafe { dux::mem::deallocate_range(data, TRANSFER_PAGES) };
+}
+
+/// Allocate and deallocate pages in a loop, with and without faulting them in immediately.
+fn alloc() {
+	let range =
+		dux::mem::reserve_range(None, ALLOC_PAGES).expect("failed to reserve allocation range");
+	for &(name, flags) in [
+		("alloc", kernel::PROT_READ_WRITE),
+		(
+			"alloc prefault",
+			kernel::PROT_READ_WRITE | kernel::MEM_PREFAULT,
+		),
+	]
+	.iter()
+	{
+		let start = Sample::now();
+		for _ in 0..ALLOC_ROUNDS {
+			let ret = unsafe { kernel::mem_alloc(range.as_ptr(), ALLOC_PAGES, flags) };
+			assert_eq!(ret.status, kernel::Return::OK, "failed to allocate pages");
+			let ret = unsafe { kernel::mem_dealloc(range.as_ptr(), ALLOC_PAGES) };
+			assert_eq!(ret.status, kernel::Return::OK, "failed to deallocate pages");
+		}
+		report(
+			name,
+			ALLOC_PAGES,
+			ALLOC_ROUNDS,
+			ALLOC_ROUNDS * ALLOC_PAGES * dux::Page::SIZE,
+			start.elapsed(),
+		);
+	}
+	dux::mem::unreserve_range(range, ALLOC_PAGES).expect("failed to unreserve range");
+}
+
+#[export_name = "main"]
+fn main() {
+	unsafe { dux::init() };
+
+	let address: usize = dux::task::registry::get_or_wait(b"bench_echo").into();
+
+	sys_log!("bench: starting IPC and memory benchmarks");
+	ping_pong(address);
+	for &depth in DEPTHS.iter() {
+		ring(address, depth);
+	}
+	transfer(address);
+	alloc();
+	sys_log!("bench: done");
+
+	let name = b"bench_ipc";
+	let ret = unsafe { kernel::sys_registry_add(name.as_ptr(), name.len(), usize::MAX) };
+	assert_eq!(ret.status, 0, "failed to add self to registry");
+
+	loop {
+		unsafe { kernel::io_wait(u64::MAX) };
+	}
+}
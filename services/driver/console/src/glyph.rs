@@ -0,0 +1,92 @@
+//! Cache of letters expanded to pixels.
+//!
+//! Expanding a letter bit by bit is slow compared to copying it. Each entry of the cache holds
+//! all letters for one pair of colors, which are expanded the first time they are drawn. Text
+//! rarely uses many colors at once, so a handful of entries is enough.
+
+use crate::letter::{self, Letter};
+use crate::{PALETTE, RGBA8};
+use core::ptr::NonNull;
+
+/// The amount of color pairs that are cached at once.
+const ENTRIES: usize = 4;
+
+/// The pixels of a letter, row by row.
+pub type Glyph = [RGBA8; Letter::WIDTH * Letter::HEIGHT];
+
+/// The amount of pages needed to hold all glyphs.
+const PAGES: usize =
+	(ENTRIES * 256 * core::mem::size_of::<Glyph>() + dux::Page::SIZE - 1) / dux::Page::SIZE;
+
+struct Entry {
+	/// The foreground and background color as palette indices.
+	colors: Option<(u8, u8)>,
+	/// A bitmap of the letters that have been expanded already.
+	expanded: [u64; 4],
+	/// When this entry was last used.
+	used: u64,
+}
+
+pub struct Cache {
+	glyphs: NonNull<Glyph>,
+	entries: [Entry; ENTRIES],
+	clock: u64,
+}
+
+impl Cache {
+	pub fn new() -> Self {
+		const EMPTY: Entry = Entry {
+			colors: None,
+			expanded: [0; 4],
+			used: 0,
+		};
+		let glyphs = dux::mem::allocate_range(None, PAGES, dux::RWX::RW)
+			.expect("failed to allocate glyph cache");
+		Self {
+			glyphs: glyphs.as_non_null_ptr().cast(),
+			entries: [EMPTY; ENTRIES],
+			clock: 0,
+		}
+	}
+
+	/// Return a letter in the given colors, expanding it first if necessary.
+	pub fn get(&mut self, letter: u8, fg: u8, bg: u8) -> &Glyph {
+		self.clock += 1;
+		let colors = Some((fg, bg));
+		let i = match self.entries.iter().position(|e| e.colors == colors) {
+			Some(i) => i,
+			None => {
+				let (i, e) = self
+					.entries
+					.iter_mut()
+					.enumerate()
+					.min_by_key(|(_, e)| e.used)
+					.unwrap();
+				*e = Entry {
+					colors,
+					expanded: [0; 4],
+					used: 0,
+				};
+				i
+			}
+		};
+		let e = &mut self.entries[i];
+		e.used = self.clock;
+
+		// SAFETY: the index is in range and the glyph is only borrowed through self.
+		let glyph = unsafe { &mut *self.glyphs.as_ptr().add(i * 256 + usize::from(letter)) };
+		let (word, bit) = (usize::from(letter) / 64, 1 << (letter % 64));
+		if e.expanded[word] & bit == 0 {
+			e.expanded[word] |= bit;
+			let (fg, bg) = (PALETTE[usize::from(fg)], PALETTE[usize::from(bg)]);
+			let l = letter::get(letter);
+			for (y, row) in glyph.chunks_exact_mut(Letter::WIDTH).enumerate() {
+				let bits = l.row(y);
+				for (x, p) in row.iter_mut().enumerate() {
+					*p = if bits & (1 << x) != 0 { fg } else { bg };
+				}
+			}
+		}
+		glyph
+	}
+}
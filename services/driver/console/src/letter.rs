@@ -1,7 +1,5 @@
 //! Table of letter bitmaps.
 
-use crate::RGBA8;
-
 /// Bitmap of letters stolen from https://forum.osdev.org/viewtopic.php?f=2&t=20833
 ///
 /// The bitmap has been manually compressed to be an actual bitmap instead of bytemap. It also
@@ -33,24 +31,10 @@ impl Letter {
 		LETTERS[i / 8] & (1 << (i % 8)) > 0
 	}
 
-	/// Copy a letter to the given buffer with the given foreground and background color.
-	pub(crate) fn copy(
-		&self,
-		x: usize,
-		y: usize,
-		buffer: &mut [RGBA8],
-		w: usize,
-		h: usize,
-		fg: RGBA8,
-		bg: RGBA8,
-	) {
-		let _ = h;
-		assert!(x + w * y < buffer.len());
-		for (ly, wy) in (0..Self::HEIGHT).zip(y..y + Self::HEIGHT) {
-			for (lx, wx) in (0..Self::WIDTH).zip(x..x + Self::WIDTH) {
-				buffer[wx + wy * w] = self.get(lx, ly).then(|| fg).unwrap_or(bg);
-			}
-		}
+	/// Return a row of the letter with the leftmost pixel in the lowest bit.
+	#[inline]
+	pub fn row(&self, y: usize) -> u16 {
+		(0..Self::WIDTH).fold(0, |r, x| r | u16::from(self.get(x, y)) << x)
 	}
 }
 
@@ -18,10 +18,13 @@ fn panic_handler(info: &core::panic::PanicInfo) -> ! {
 	loop {}
 }
 
+mod glyph;
 mod letter;
 mod rtbegin;
+mod screen;
+mod terminal;
 
-use letter::Letter;
+use core::cell::Cell;
 
 #[derive(Clone, Copy)]
 #[repr(C)]
@@ -42,20 +45,94 @@ impl RGBA8 {
 	}
 }
 
+/// The colors that can be selected with escape sequences. The last 8 are the bright variants.
+const PALETTE: [RGBA8; 16] = [
+	RGBA8::rgb(0, 0, 0),
+	RGBA8::rgb(170, 0, 0),
+	RGBA8::rgb(0, 170, 0),
+	RGBA8::rgb(170, 85, 0),
+	RGBA8::rgb(0, 0, 170),
+	RGBA8::rgb(170, 0, 170),
+	RGBA8::rgb(0, 170, 170),
+	RGBA8::rgb(170, 170, 170),
+	RGBA8::rgb(85, 85, 85),
+	RGBA8::rgb(255, 85, 85),
+	RGBA8::rgb(85, 255, 85),
+	RGBA8::rgb(255, 255, 85),
+	RGBA8::rgb(85, 85, 255),
+	RGBA8::rgb(255, 85, 255),
+	RGBA8::rgb(85, 255, 255),
+	RGBA8::rgb(255, 255, 255),
+];
+
+/// The minimum time between flushes in microseconds.
+const FRAME_INTERVAL: u64 = 16_000;
+
+/// The area of the framebuffer that changed since the last flush.
+///
+/// Only a single bounding box is tracked. Most writes touch a couple of adjacent lines, so
+/// tracking separate rectangles would save little.
+struct Damage {
+	x0: usize,
+	y0: usize,
+	x1: usize,
+	y1: usize,
+}
+
+impl Damage {
+	const NONE: Self = Self {
+		x0: usize::MAX,
+		y0: usize::MAX,
+		x1: 0,
+		y1: 0,
+	};
+
+	fn add(&mut self, x: usize, y: usize, w: usize, h: usize) {
+		self.x0 = self.x0.min(x);
+		self.y0 = self.y0.min(y);
+		self.x1 = self.x1.max(x + w);
+		self.y1 = self.y1.max(y + h);
+	}
+
+	fn is_empty(&self) -> bool {
+		self.x0 >= self.x1 || self.y0 >= self.y1
+	}
+
+	/// Clear the damage and return it clamped to a screen of the given size.
+	fn take(&mut self, w: usize, h: usize) -> Self {
+		let (x0, y0) = (self.x0.min(w), self.y0.min(h));
+		let (x1, y1) = (self.x1.min(w).max(x0), self.y1.min(h).max(y0));
+		*self = Self::NONE;
+		Self { x0, y0, x1, y1 }
+	}
+
+	/// Encode the damage as the offset of a flush packet.
+	///
+	/// The offset holds the x, y, width and height as 16 bit fields, starting from the lowest
+	/// bits.
+	fn encode(&self) -> u64 {
+		let f = |n: usize, shift: u32| u64::from(n as u16) << shift;
+		f(self.x0, 0) | f(self.y0, 16) | f(self.x1 - self.x0, 32) | f(self.y1 - self.y0, 48)
+	}
+
+	/// Copy the damaged area from one framebuffer with the given width to another.
+	fn copy(&self, from: &[RGBA8], to: &mut [RGBA8], w: usize) {
+		if !self.is_empty() {
+			for y in self.y0..self.y1 {
+				let (start, end) = (y * w + self.x0, y * w + self.x1);
+				to[start..end].copy_from_slice(&from[start..end]);
+			}
+		}
+	}
+}
+
 #[export_name = "main"]
 fn main() {
 	// FIXME move this to rtbegin
 	unsafe { dux::init() };
 
 	// Wait for virtio_gpu driver to come online
-	let address = loop {
-		let name = b"virtio_gpu";
-		let ret = unsafe { kernel::sys_registry_get(name.as_ptr(), name.len()) };
-		if ret.status == 0 {
-			break ret.value;
-		}
-		unsafe { kernel::io_wait(0) };
-	};
+	let address: usize = dux::task::registry::get_or_wait(b"virtio_gpu").into();
 
 	// Request draw buffer
 	unsafe {
@@ -80,72 +157,46 @@ fn main() {
 		};
 	}
 
-	let buffer = {
+	// There are two buffers back to back, which are separated by the offset in bytes. One
+	// can be drawn to while the GPU transfers the other.
+	let mut buffers = {
 		let rx = dux::ipc::receive();
 		assert_eq!(rx.address, address);
 		let ptr = rx.data.unwrap().as_ptr().cast::<RGBA8>();
 		let len = rx.length / core::mem::size_of::<RGBA8>();
+		let stride = rx.offset as usize / core::mem::size_of::<RGBA8>();
+		assert!(2 * stride <= len, "expected two buffers");
 		// SAFETY: while the device will read from it, only we will write to it.
-		unsafe { core::slice::from_raw_parts_mut(ptr, len) }
+		let buffer = unsafe { core::slice::from_raw_parts_mut(ptr, len) };
+		let (a, b) = buffer.split_at_mut(stride);
+		let size = screen::WIDTH * screen::HEIGHT;
+		[&mut a[..size], &mut b[..size]]
 	};
 
-	let (w, h) = (800, 600);
-
 	// Add self to registry
 	let name = "console";
 	let ret = unsafe { kernel::sys_registry_add(name.as_ptr(), name.len(), usize::MAX) };
 	assert_eq!(ret.status, 0, "failed to add self to registry");
 
-	let (mut cursor_x, mut cursor_y) = (0, 0);
-	let (cursor_w, _cursor_h) = (50, 24);
+	let mut screen = screen::Screen::new();
+	let mut terminal = terminal::Terminal::new();
+	let mut cache = glyph::Cache::new();
+	let mut damage = Damage::NONE;
 
-	loop {
-		use core::slice;
+	// The buffer to draw to next and the damage of the frame drawn to the other buffer.
+	let (mut current, mut previous) = (0, Damage::NONE);
+	// Whether the GPU may still be reading from each buffer.
+	let busy = [Cell::new(false), Cell::new(false)];
 
-		let rx = dux::ipc::receive();
-		match rx.opcode.map(|n| n.get()).unwrap_or(0) {
+	let mut handle = |rx: &kernel::ipc::Packet, scr: &mut screen::Screen| {
+		let op = rx.opcode.map(|n| n.get()).unwrap_or(0);
+		match op {
+			OP_FLUSH if rx.address == address => busy[usize::from(rx.id)].set(false),
 			op if op == kernel::ipc::Op::Write as u8 => {
 				let data = unsafe {
-					slice::from_raw_parts(rx.data.unwrap().as_ptr().cast::<u8>(), rx.length)
+					core::slice::from_raw_parts(rx.data.unwrap().as_ptr().cast::<u8>(), rx.length)
 				};
-				let mut iter = data.iter();
-				let fg = RGBA8::rgb(255, 255, 255);
-				let bg = RGBA8::rgb(0, 0, 0);
-				while let Some(c) = iter.next() {
-					match c {
-						b'\n' => {
-							cursor_x = 0;
-							cursor_y += 1;
-						}
-						b'\r' => cursor_x = 0,
-						b'\x1b' => {
-							assert_eq!(iter.next(), Some(&b'['));
-							match iter.next().unwrap() {
-								b'2' => match iter.next().unwrap() {
-									b'K' => {
-										for x in 0..cursor_w {
-											let (x, y) =
-												(x * Letter::WIDTH, cursor_y * Letter::HEIGHT);
-											letter::get(0).copy(x, y, buffer, w, h, fg, bg);
-										}
-										cursor_x = 0;
-									}
-									_ => panic!(),
-								},
-								_ => panic!(),
-							}
-						}
-						c => {
-							let (x, y) = (cursor_x * Letter::WIDTH, cursor_y * Letter::HEIGHT);
-							letter::get(*c).copy(x, y, buffer, w, h, fg, bg);
-							cursor_x += 1;
-							if cursor_x >= cursor_w {
-								cursor_x = 0;
-								cursor_y += 1;
-							}
-						}
-					}
-				}
+				terminal.write(scr, data);
 				*dux::ipc::transmit() = kernel::ipc::Packet {
 					flags: 0,
 					id: rx.id,
@@ -161,19 +212,51 @@ fn main() {
 			}
 			_ => todo!(),
 		}
-		drop(rx);
+	};
+
+	loop {
+		while let Some(rx) = dux::ipc::try_receive() {
+			handle(&rx, &mut screen);
+		}
+
+		if !screen.is_dirty() {
+			unsafe { kernel::io_wait(u64::MAX) };
+			continue;
+		}
+
+		// Give writers a frame to add more text so it can be drawn in one go.
+		unsafe { kernel::io_wait(FRAME_INTERVAL) };
+		while let Some(rx) = dux::ipc::try_receive() {
+			handle(&rx, &mut screen);
+		}
+
+		// The buffer only misses the changes of the previous frame, which are copied over
+		// before drawing the changes of this frame.
+		while busy[current].get() {
+			handle(&dux::ipc::receive(), &mut screen);
+		}
+		let (a, b) = buffers.split_at_mut(1);
+		let (back, front) = match current {
+			0 => (&mut *a[0], &*b[0]),
+			_ => (&mut *b[0], &*a[0]),
+		};
+		previous.copy(front, back, screen::WIDTH);
+		screen.render(back, &mut cache, &mut damage);
+		previous = damage.take(screen::WIDTH, screen::HEIGHT);
 
 		*dux::ipc::transmit() = kernel::ipc::Packet {
 			flags: 0,
-			id: 0,
-			offset: 0,
+			id: current as u8,
+			offset: previous.encode(),
 			opcode: core::num::NonZeroU8::new(OP_FLUSH),
-			uuid: kernel::ipc::UUID::INVALID,
+			uuid: kernel::ipc::UUID::new(current as u128),
 			data: None,
 			length: 0,
 			name: None,
 			name_len: 0,
 			address,
 		};
+		busy[current].set(true);
+		current = 1 - current;
 	}
 }
@@ -0,0 +1,169 @@
+//! Grid of letters that is rendered to the framebuffer.
+//!
+//! Writes only update the grid. The framebuffer is updated once per flush and only where the
+//! grid changed, so the cost of drawing doesn't grow with the amount of text written in a
+//! frame. Rows are kept in a ring, which makes scrolling the grid itself free.
+
+use crate::glyph;
+use crate::letter::Letter;
+use crate::{Damage, RGBA8};
+use core::ptr::NonNull;
+
+/// The size of the framebuffer in pixels.
+pub const WIDTH: usize = 800;
+pub const HEIGHT: usize = 600;
+
+/// The size of the grid in letters.
+pub const COLUMNS: usize = WIDTH / Letter::WIDTH;
+pub const ROWS: usize = HEIGHT / Letter::HEIGHT;
+
+type Row = [Cell; COLUMNS];
+
+/// The amount of pages needed to hold the grid.
+const PAGES: usize = (ROWS * core::mem::size_of::<Row>() + dux::Page::SIZE - 1) / dux::Page::SIZE;
+
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub struct Cell {
+	pub letter: u8,
+	/// The foreground color as index in the palette.
+	pub fg: u8,
+	/// The background color as index in the palette.
+	pub bg: u8,
+}
+
+impl Cell {
+	/// An empty cell with the given background color.
+	pub const fn blank(bg: u8) -> Self {
+		Self {
+			letter: b' ',
+			fg: bg,
+			bg,
+		}
+	}
+}
+
+pub struct Screen {
+	rows: NonNull<Row>,
+	/// The index of the row that is at the top of the screen.
+	top: usize,
+	/// The range of columns that changed in each row of the screen since the last render.
+	dirty: [(u8, u8); ROWS],
+	/// The amount of rows scrolled since the last render.
+	scrolled: usize,
+}
+
+impl Screen {
+	pub fn new() -> Self {
+		let rows =
+			dux::mem::allocate_range(None, PAGES, dux::RWX::RW).expect("failed to allocate screen");
+		let mut s = Self {
+			rows: rows.as_non_null_ptr().cast(),
+			top: 0,
+			dirty: [(0, 0); ROWS],
+			scrolled: 0,
+		};
+		for y in 0..ROWS {
+			s.clear(y, 0, COLUMNS, 0);
+		}
+		// The framebuffer may hold anything, so draw everything.
+		s.scrolled = ROWS;
+		s
+	}
+
+	pub fn set(&mut self, x: usize, y: usize, cell: Cell) {
+		self.row(y)[x] = cell;
+		self.mark(y, x, x + 1);
+	}
+
+	/// Clear the columns `x0..x1` of a row with the given background color.
+	pub fn clear(&mut self, y: usize, x0: usize, x1: usize, bg: u8) {
+		let x1 = x1.min(COLUMNS);
+		if x0 < x1 {
+			self.row(y)[x0..x1].fill(Cell::blank(bg));
+			self.mark(y, x0, x1);
+		}
+	}
+
+	/// Move all rows up by one and clear the bottom row.
+	pub fn scroll(&mut self, bg: u8) {
+		self.top = (self.top + 1) % ROWS;
+		self.dirty.rotate_left(1);
+		self.dirty[ROWS - 1] = (0, 0);
+		self.clear(ROWS - 1, 0, COLUMNS, bg);
+		self.scrolled = (self.scrolled + 1).min(ROWS);
+	}
+
+	/// Whether anything changed since the last render.
+	pub fn is_dirty(&self) -> bool {
+		self.scrolled > 0 || self.dirty.iter().any(|&(s, e)| s < e)
+	}
+
+	/// Update the framebuffer with all changes since the last render and add the area that
+	/// changed to `damage`.
+	pub fn render(&mut self, buffer: &mut [RGBA8], cache: &mut glyph::Cache, damage: &mut Damage) {
+		const ROW_PIXELS: usize = WIDTH * Letter::HEIGHT;
+
+		if self.scrolled > 0 {
+			// Rows that only moved can be copied instead of drawn again. Rows that changed
+			// after scrolling are marked dirty and drawn below.
+			if self.scrolled < ROWS {
+				for y in 0..ROWS - self.scrolled {
+					if self.dirty[y] != (0, COLUMNS as u8) {
+						let (dst, src) = (y * ROW_PIXELS, (y + self.scrolled) * ROW_PIXELS);
+						buffer.copy_within(src..src + ROW_PIXELS, dst);
+					}
+				}
+				for d in &mut self.dirty[ROWS - self.scrolled..] {
+					*d = (0, COLUMNS as u8);
+				}
+			} else {
+				self.dirty = [(0, COLUMNS as u8); ROWS];
+			}
+			damage.add(0, 0, COLUMNS * Letter::WIDTH, ROWS * Letter::HEIGHT);
+			self.scrolled = 0;
+		}
+
+		for y in 0..ROWS {
+			let (x0, x1) = self.dirty[y];
+			let (x0, x1) = (usize::from(x0), usize::from(x1));
+			if x0 >= x1 {
+				continue;
+			}
+			self.dirty[y] = (0, 0);
+			let row = self.row(y);
+			for x in x0..x1 {
+				let c = row[x];
+				let glyph = cache.get(c.letter, c.fg, c.bg);
+				let mut offset = y * ROW_PIXELS + x * Letter::WIDTH;
+				for line in glyph.chunks_exact(Letter::WIDTH) {
+					buffer[offset..offset + Letter::WIDTH].copy_from_slice(line);
+					offset += WIDTH;
+				}
+			}
+			damage.add(
+				x0 * Letter::WIDTH,
+				y * Letter::HEIGHT,
+				(x1 - x0) * Letter::WIDTH,
+				Letter::HEIGHT,
+			);
+		}
+	}
+
+	/// Mark the columns `x0..x1` of a row as changed.
+	fn mark(&mut self, y: usize, x0: usize, x1: usize) {
+		let (s, e) = &mut self.dirty[y];
+		if *s >= *e {
+			*s = x0 as u8;
+			*e = x1 as u8;
+		} else {
+			*s = (*s).min(x0 as u8);
+			*e = (*e).max(x1 as u8);
+		}
+	}
+
+	fn row(&mut self, y: usize) -> &mut Row {
+		assert!(y < ROWS, "row out of range");
+		// SAFETY: the index is in range and rows can only be accessed through self.
+		unsafe { &mut *self.rows.as_ptr().add((self.top + y) % ROWS) }
+	}
+}
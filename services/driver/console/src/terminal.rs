@@ -0,0 +1,197 @@
+//! Interpreter for text with ANSI escape sequences.
+//!
+//! Only the sequences commonly used by programs that log to a terminal are implemented:
+//! moving the cursor, erasing parts of the screen and colors. Other sequences are ignored.
+//! Sequences may be split across writes.
+//!
+//! ## References
+//!
+//! https://vt100.net/emu/dec_ansi_parser
+
+use crate::screen::{Cell, Screen, COLUMNS, ROWS};
+
+/// The maximum amount of parameters of a control sequence. Any extra parameters are ignored.
+const MAX_PARAMS: usize = 8;
+
+/// The palette index of the default foreground and background color.
+const DEFAULT_FG: u8 = 7;
+const DEFAULT_BG: u8 = 0;
+
+enum State {
+	Ground,
+	Escape,
+	Csi,
+}
+
+pub struct Terminal {
+	x: usize,
+	y: usize,
+	fg: u8,
+	bg: u8,
+	bold: bool,
+	state: State,
+	params: [u16; MAX_PARAMS],
+	/// The index of the parameter being parsed.
+	param: usize,
+}
+
+impl Terminal {
+	pub const fn new() -> Self {
+		Self {
+			x: 0,
+			y: 0,
+			fg: DEFAULT_FG,
+			bg: DEFAULT_BG,
+			bold: false,
+			state: State::Ground,
+			params: [0; MAX_PARAMS],
+			param: 0,
+		}
+	}
+
+	pub fn write(&mut self, screen: &mut Screen, data: &[u8]) {
+		for &c in data {
+			match self.state {
+				State::Ground => self.ground(screen, c),
+				State::Escape => self.escape(screen, c),
+				State::Csi => self.csi(screen, c),
+			}
+		}
+	}
+
+	fn ground(&mut self, screen: &mut Screen, c: u8) {
+		match c {
+			b'\n' => self.newline(screen),
+			b'\r' => self.x = 0,
+			b'\x08' => self.x = self.x.saturating_sub(1),
+			b'\t' => self.x = ((self.x & !7) + 8).min(COLUMNS - 1),
+			b'\x1b' => self.state = State::Escape,
+			c if c < b' ' || c == 0x7f => (),
+			c => {
+				// Wrapping is delayed until the next letter so a full line doesn't cause an
+				// empty line if it is followed by a newline.
+				if self.x >= COLUMNS {
+					self.newline(screen);
+				}
+				let fg = self.fg | if self.bold { 8 } else { 0 };
+				let cell = Cell {
+					letter: c,
+					fg,
+					bg: self.bg,
+				};
+				screen.set(self.x, self.y, cell);
+				self.x += 1;
+			}
+		}
+	}
+
+	fn escape(&mut self, screen: &mut Screen, c: u8) {
+		self.state = State::Ground;
+		match c {
+			b'[' => {
+				self.params = [0; MAX_PARAMS];
+				self.param = 0;
+				self.state = State::Csi;
+			}
+			b'c' => {
+				*self = Self::new();
+				for y in 0..ROWS {
+					screen.clear(y, 0, COLUMNS, self.bg);
+				}
+			}
+			_ => (),
+		}
+	}
+
+	fn csi(&mut self, screen: &mut Screen, c: u8) {
+		match c {
+			b'0'..=b'9' => {
+				if let Some(p) = self.params.get_mut(self.param) {
+					*p = p.saturating_mul(10).saturating_add(u16::from(c - b'0'));
+				}
+			}
+			b';' => self.param += 1,
+			// Private markers and intermediate bytes don't change the meaning of any of the
+			// supported sequences.
+			b'<'..=b'?' | b' '..=b'/' => (),
+			0x40..=0x7e => {
+				self.state = State::Ground;
+				self.execute(screen, c);
+			}
+			_ => self.state = State::Ground,
+		}
+	}
+
+	fn execute(&mut self, screen: &mut Screen, c: u8) {
+		let n = usize::from(self.params[0].max(1));
+		match c {
+			b'A' => self.y = self.y.saturating_sub(n),
+			b'B' => self.y = (self.y + n).min(ROWS - 1),
+			b'C' => self.x = (self.x + n).min(COLUMNS - 1),
+			b'D' => self.x = self.x.min(COLUMNS - 1).saturating_sub(n),
+			b'G' => self.x = (n - 1).min(COLUMNS - 1),
+			b'H' | b'f' => {
+				self.y = (n - 1).min(ROWS - 1);
+				self.x = usize::from(self.params[1].max(1) - 1).min(COLUMNS - 1);
+			}
+			b'J' => {
+				let (start, end) = match self.params[0] {
+					0 => (self.y + 1, ROWS),
+					1 => (0, self.y),
+					_ => (0, ROWS),
+				};
+				for y in start..end {
+					screen.clear(y, 0, COLUMNS, self.bg);
+				}
+				if self.params[0] < 2 {
+					self.erase_line(screen, self.params[0]);
+				}
+			}
+			b'K' => self.erase_line(screen, self.params[0]),
+			b'm' => self.select_graphic_rendition(),
+			_ => (),
+		}
+	}
+
+	/// Erase from the cursor to the end of the line (0), from the start of the line to the cursor
+	/// (1) or the entire line (2).
+	fn erase_line(&mut self, screen: &mut Screen, mode: u16) {
+		let (start, end) = match mode {
+			0 => (self.x, COLUMNS),
+			1 => (0, self.x + 1),
+			_ => (0, COLUMNS),
+		};
+		screen.clear(self.y, start, end, self.bg);
+	}
+
+	fn select_graphic_rendition(&mut self) {
+		let count = (self.param + 1).min(MAX_PARAMS);
+		for &p in &self.params[..count] {
+			match p {
+				0 => {
+					self.fg = DEFAULT_FG;
+					self.bg = DEFAULT_BG;
+					self.bold = false;
+				}
+				1 => self.bold = true,
+				22 => self.bold = false,
+				30..=37 => self.fg = (p - 30) as u8,
+				39 => self.fg = DEFAULT_FG,
+				40..=47 => self.bg = (p - 40) as u8,
+				49 => self.bg = DEFAULT_BG,
+				90..=97 => self.fg = (p - 90) as u8 | 8,
+				100..=107 => self.bg = (p - 100) as u8 | 8,
+				_ => (),
+			}
+		}
+	}
+
+	fn newline(&mut self, screen: &mut Screen) {
+		self.x = 0;
+		if self.y + 1 < ROWS {
+			self.y += 1;
+		} else {
+			screen.scroll(self.bg);
+		}
+	}
+}
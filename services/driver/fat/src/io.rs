@@ -1,159 +1,502 @@
 //! # Support for `rust-fatfs` I/O traits.
+//!
+//! Pages of the block device are kept in a small LRU cache. Modified pages are only written
+//! back when they're evicted or when the cache is flushed. When the device is read
+//! sequentially the next few pages are requested ahead of time so the block driver can work
+//! on them while the filesystem is still busy with the current page.
+//!
+//! The FAT itself can be kept entirely in memory with [`GlobalIO::load_fat`] so that walking
+//! cluster chains and looking for free clusters never has to wait for the device.
+//!
+//! In non-blocking mode, set with [`set_blocking`], accesses to pages that aren't in memory
+//! yet fail with [`Error::WouldBlock`] after requesting them instead of waiting. This lets
+//! the service work on other requests in the meantime and retry once a completion arrives.
 
-use fatfs::*;
+use core::convert::TryFrom;
+use core::ptr::NonNull;
+use core::sync::atomic::{AtomicBool, Ordering};
+use fatfs::{IoBase, IoError, Read, Seek, SeekFrom, Write};
 
 pub static mut ADDRESS: usize = 0;
 pub static mut UUID: kernel::ipc::UUID = kernel::ipc::UUID::new(0);
 
-pub struct GlobalIO<'a> {
-	buffer: &'a mut kernel::Page,
-	position: u64,
-	buffer_sector: u64,
-	max_position: u64,
+/// The amount of pages kept in the cache.
+const CACHE_PAGES: usize = 16;
+
+/// The amount of pages to read ahead when the device is read sequentially.
+const READ_AHEAD: u64 = 4;
+
+/// The maximum size of a FAT that is kept in memory, in pages.
+const MAX_FAT_PAGES: usize = 128;
+
+/// Whether accesses wait for pages that aren't in memory.
+static BLOCKING: AtomicBool = AtomicBool::new(true);
+
+#[derive(Debug)]
+pub enum Error {
+	/// The data isn't available yet. Try again once a completion has been received.
+	WouldBlock,
+	/// The data can't be read or written.
+	Failed,
+}
+
+impl IoError for Error {
+	fn is_interrupted(&self) -> bool {
+		// Retrying right away won't help, the caller has to wait for a completion first.
+		false
+	}
+
+	fn new_unexpected_eof_error() -> Self {
+		Self::Failed
+	}
+
+	fn new_write_zero_error() -> Self {
+		Self::Failed
+	}
+}
+
+/// Set whether accesses wait for pages that aren't in memory.
+pub fn set_blocking(blocking: bool) {
+	BLOCKING.store(blocking, Ordering::Relaxed);
+}
+
+fn blocking() -> bool {
+	BLOCKING.load(Ordering::Relaxed)
+}
+
+#[derive(Clone, Copy, PartialEq)]
+enum State {
+	/// The entry doesn't hold any page.
+	Empty,
+	/// The page is being read with the request of the given tag.
+	Loading(u8),
+	/// The page holds valid data.
+	Valid,
+}
+
+#[derive(Clone, Copy)]
+struct Entry {
+	/// The index of the page on the device.
+	page: u64,
+	state: State,
+	/// Whether the page has been modified since it was read or written back.
 	dirty: bool,
+	/// The value of the clock when the page was last accessed.
+	used: u64,
 }
 
-impl<'a> GlobalIO<'a> {
-	pub fn new(buffer: &'a mut kernel::Page) -> Self {
-		let mut slf = Self {
-			buffer,
+impl Entry {
+	const EMPTY: Self = Self {
+		page: 0,
+		state: State::Empty,
+		dirty: false,
+		used: 0,
+	};
+}
+
+/// A range of pages that always stays in memory.
+struct Resident {
+	pages: NonNull<kernel::Page>,
+	/// The index of the first page on the device.
+	start: u64,
+	count: usize,
+	dirty: [bool; MAX_FAT_PAGES],
+}
+
+pub struct GlobalIO {
+	/// The pages of the cache. Each entry owns the page at the same index.
+	pages: NonNull<kernel::Page>,
+	entries: [Entry; CACHE_PAGES],
+	position: u64,
+	/// The size of the device in bytes.
+	size: u64,
+	/// Incremented on each access to find the least recently used entry.
+	clock: u64,
+	/// The page of the previous access, used to detect sequential reads.
+	last_page: u64,
+	/// The pages holding the FAT, if it is kept in memory.
+	fat: Option<Resident>,
+}
+
+impl GlobalIO {
+	pub fn new() -> Self {
+		let pages = dux::mem::allocate_range(None, CACHE_PAGES, dux::RWX::RW)
+			.expect("failed to allocate cache");
+		Self {
+			pages: pages.as_non_null_ptr(),
+			entries: [Entry::EMPTY; CACHE_PAGES],
 			position: 0,
-			dirty: false,
-			max_position: 512 * 32, // TODO
-			buffer_sector: u64::MAX,
+			size: Self::query_size(),
+			clock: 0,
+			last_page: u64::MAX,
+			fat: None,
+		}
+	}
+
+	/// Read all copies of the FAT into memory if the device holds a filesystem with a small
+	/// enough FAT.
+	///
+	/// This must be called again if the device is formatted afterwards.
+	pub fn load_fat(&mut self) -> Result<(), Error> {
+		let mut boot = [0; 512];
+		self.seek(SeekFrom::Start(0))?;
+		self.read_exact(&mut boot)?;
+		self.seek(SeekFrom::Start(0))?;
+		if boot[510..] != [0x55, 0xaa] {
+			return Err(Error::Failed);
+		}
+		let u16_at = |i: usize| u64::from(u16::from_le_bytes([boot[i], boot[i + 1]]));
+		let sector_size = u16_at(11);
+		let sectors_per_fat = match u16_at(22) {
+			0 => u64::from(u32::from_le_bytes([boot[36], boot[37], boot[38], boot[39]])),
+			n => n,
 		};
-		slf.fetch();
-		slf
+		let begin = u16_at(14) * sector_size;
+		let end = begin + u64::from(boot[16]) * sectors_per_fat * sector_size;
+		let page_size = kernel::Page::SIZE as u64;
+		let (start, count) = (begin / page_size, (end + page_size - 1) / page_size);
+		let count = (count - start) as usize;
+		if count == 0 || count > MAX_FAT_PAGES {
+			return Err(Error::Failed);
+		}
+
+		// The cache may hold a stale or dirty copy of some of the pages.
+		self.flush()?;
+		for i in 0..CACHE_PAGES {
+			self.complete(i);
+			if (start..start + count as u64).contains(&self.entries[i].page) {
+				self.entries[i] = Entry::EMPTY;
+			}
+		}
+		self.unload_fat();
+
+		let pages =
+			dux::mem::allocate_range(None, count, dux::RWX::RW).map_err(|_| Error::Failed)?;
+		let fat = Resident {
+			pages: pages.as_non_null_ptr(),
+			start,
+			count,
+			dirty: [false; MAX_FAT_PAGES],
+		};
+		let mut tags = [None; MAX_FAT_PAGES];
+		let mut ret = Ok(());
+		for (i, tag) in tags[..count].iter_mut().enumerate() {
+			let data = NonNull::new(fat.pages.as_ptr().wrapping_add(i)).unwrap();
+			match Self::submit(kernel::ipc::Op::Read, data, start + i as u64) {
+				Ok(t) => *tag = Some(t),
+				Err(e) => ret = Err(e),
+			}
+		}
+		tags.iter()
+			.filter_map(|t| *t)
+			.for_each(|t| drop(dux::ipc::tag::wait(t)));
+		self.fat = Some(fat);
+		if ret.is_err() {
+			self.unload_fat();
+		}
+		ret
 	}
 
-	fn seek_sector(&self) -> u64 {
-		self.position / kernel::Page::SIZE as u64
+	/// Free the resident copy of the FAT, if any. It must have been flushed.
+	fn unload_fat(&mut self) {
+		if let Some(fat) = self.fat.take() {
+			let pages = dux::Page::new(fat.pages).unwrap();
+			unsafe { dux::mem::deallocate_range(pages, fat.count) };
+		}
+	}
+
+	/// Ask the block device for its size in bytes.
+	fn query_size() -> u64 {
+		let packet = kernel::ipc::Packet {
+			opcode: Some(kernel::ipc::Op::Info.into()),
+			address: unsafe { ADDRESS },
+			uuid: unsafe { UUID },
+			data: None,
+			length: 0,
+			offset: 0,
+			flags: 0,
+			id: 0,
+			name: None,
+			name_len: 0,
+		};
+		let tag = dux::ipc::tag::submit(&packet).expect("no free tags");
+		dux::ipc::tag::wait(tag).offset
 	}
 
-	fn buffer_sector(&self) -> u64 {
-		self.buffer_sector
+	fn seek_page(&self) -> u64 {
+		self.position / kernel::Page::SIZE as u64
 	}
 
 	fn seek_offset(&self) -> usize {
 		self.position as usize & kernel::Page::MASK
 	}
 
-	fn fetch(&mut self) {
-		self.buffer_sector = self.seek_sector();
+	fn max_seek(&self) -> u64 {
+		self.size
+	}
 
+	/// Return the data of the page of the given entry.
+	fn data(&mut self, entry: usize) -> &mut [u8] {
+		assert!(entry < CACHE_PAGES);
 		unsafe {
-			*dux::ipc::transmit() = kernel::ipc::Packet {
-				opcode: Some(kernel::ipc::Op::Read.into()),
-				address: ADDRESS,
-				uuid: UUID,
-				data: Some(core::ptr::NonNull::from(&*self.buffer)),
-				length: kernel::Page::SIZE,
-				offset: self.buffer_sector,
-				flags: 0,
-				id: 0,
-				name: None,
-				name_len: 0,
-			};
+			let page = self.pages.as_ptr().add(entry).cast::<u8>();
+			core::slice::from_raw_parts_mut(page, kernel::Page::SIZE)
 		}
-		loop {
-			let pkt = dux::ipc::receive();
-			if pkt.address != unsafe { ADDRESS } {
-				pkt.defer();
-				unsafe { kernel::io_wait(10_000) };
-				continue;
+	}
+
+	/// Return the data of the given page and whether it has to be written back, if the page
+	/// is resident.
+	fn resident(&mut self, page: u64) -> Option<(&mut [u8], &mut bool)> {
+		let fat = self.fat.as_mut()?;
+		let i = usize::try_from(page.checked_sub(fat.start)?).ok()?;
+		(i < fat.count).then(move || unsafe {
+			let data = fat.pages.as_ptr().add(i).cast::<u8>();
+			let data = core::slice::from_raw_parts_mut(data, kernel::Page::SIZE);
+			(data, &mut fat.dirty[i])
+		})
+	}
+
+	/// Send a request to read or write the page of the given entry and return its tag.
+	fn request(&self, op: kernel::ipc::Op, entry: usize) -> Result<u8, Error> {
+		let data = NonNull::new(self.pages.as_ptr().wrapping_add(entry)).unwrap();
+		Self::submit(op, data, self.entries[entry].page)
+	}
+
+	/// Send a request to read or write a page on the device and return its tag.
+	///
+	/// Fails with [`Error::WouldBlock`] if too many requests are in flight.
+	fn submit(op: kernel::ipc::Op, data: NonNull<kernel::Page>, page: u64) -> Result<u8, Error> {
+		let packet = kernel::ipc::Packet {
+			opcode: Some(op.into()),
+			address: unsafe { ADDRESS },
+			uuid: unsafe { UUID },
+			data: Some(data),
+			length: kernel::Page::SIZE,
+			offset: page,
+			flags: 0,
+			id: 0,
+			name: None,
+			name_len: 0,
+		};
+		dux::ipc::tag::submit(&packet).map_err(|_| Error::WouldBlock)
+	}
+
+	/// Wait until the page of the given entry has been read, if it is being read.
+	fn complete(&mut self, entry: usize) {
+		if let State::Loading(tag) = self.entries[entry].state {
+			drop(dux::ipc::tag::wait(tag));
+			self.entries[entry].state = State::Valid;
+		}
+	}
+
+	/// Check whether the page of the given entry has been read, if it is being read.
+	fn poll(&mut self, entry: usize) -> Result<(), Error> {
+		if let State::Loading(tag) = self.entries[entry].state {
+			drop(dux::ipc::tag::poll(tag).ok_or(Error::WouldBlock)?);
+			self.entries[entry].state = State::Valid;
+		}
+		Ok(())
+	}
+
+	/// Write back the page of the given entry if it is dirty.
+	fn write_back(&mut self, entry: usize) -> Result<(), Error> {
+		if self.entries[entry].dirty {
+			let tag = self.request(kernel::ipc::Op::Write, entry)?;
+			drop(dux::ipc::tag::wait(tag));
+			self.entries[entry].dirty = false;
+		}
+		Ok(())
+	}
+
+	fn lookup(&self, page: u64) -> Option<usize> {
+		self.entries
+			.iter()
+			.position(|e| e.state != State::Empty && e.page == page)
+	}
+
+	/// Free the least recently used entry.
+	///
+	/// In non-blocking mode pages that are still being read are skipped.
+	fn evict(&mut self) -> Result<usize, Error> {
+		let entry = match self.entries.iter().position(|e| e.state == State::Empty) {
+			Some(i) => i,
+			None => (0..CACHE_PAGES)
+				.filter(|&i| blocking() || self.entries[i].state == State::Valid)
+				.min_by_key(|&i| self.entries[i].used)
+				.ok_or(Error::WouldBlock)?,
+		};
+		self.complete(entry);
+		self.write_back(entry)?;
+		self.entries[entry] = Entry::EMPTY;
+		Ok(entry)
+	}
+
+	/// Return the entry holding the given page, reading it in if `fetch` is `true`.
+	///
+	/// If `fetch` is `false` and the page isn't cached its contents are undefined, so
+	/// the caller must overwrite all of it.
+	fn load(&mut self, page: u64, fetch: bool) -> Result<usize, Error> {
+		self.clock += 1;
+		let sequential = page == self.last_page.wrapping_add(1);
+		self.last_page = page;
+
+		let entry = match self.lookup(page) {
+			Some(i) => i,
+			None => {
+				let i = self.evict()?;
+				self.entries[i].page = page;
+				self.entries[i].state = match fetch {
+					true => State::Loading(self.request(kernel::ipc::Op::Read, i)?),
+					false => State::Valid,
+				};
+				i
 			}
-			break;
+		};
+		self.entries[entry].used = self.clock;
+
+		// Issue the read-ahead before waiting so all requests are in flight at once.
+		if sequential {
+			self.read_ahead(page);
+		}
+		if blocking() {
+			self.complete(entry);
+		} else {
+			self.poll(entry)?;
 		}
+		Ok(entry)
 	}
 
-	fn max_seek(&self) -> u64 {
-		self.max_position
+	/// Start reading the pages following the given page.
+	///
+	/// Only clean entries are reused so read-ahead never has to wait for write-backs.
+	fn read_ahead(&mut self, page: u64) {
+		let end = self.size / kernel::Page::SIZE as u64;
+		for page in (page + 1..=page + READ_AHEAD).take_while(|&p| p < end) {
+			if self.lookup(page).is_some() {
+				continue;
+			}
+			let clock = self.clock;
+			let victim = (0..CACHE_PAGES)
+				.filter(|&i| {
+					let e = &self.entries[i];
+					match e.state {
+						State::Empty => true,
+						State::Valid => !e.dirty && e.used != clock,
+						State::Loading(_) => false,
+					}
+				})
+				.min_by_key(|&i| self.entries[i].used);
+			let entry = match victim {
+				Some(i) => i,
+				None => break,
+			};
+			self.entries[entry] = Entry {
+				page,
+				used: clock,
+				..Entry::EMPTY
+			};
+			match self.request(kernel::ipc::Op::Read, entry) {
+				Ok(tag) => self.entries[entry].state = State::Loading(tag),
+				Err(_) => {
+					self.entries[entry] = Entry::EMPTY;
+					break;
+				}
+			}
+		}
 	}
 }
 
-impl IoBase for GlobalIO<'_> {
-	type Error = ();
+impl IoBase for GlobalIO {
+	type Error = Error;
 }
 
-impl Read for GlobalIO<'_> {
+impl Read for GlobalIO {
 	fn read(&mut self, data: &mut [u8]) -> Result<usize, Self::Error> {
 		let mut i = 0;
-		while i < data.len() {
-			if self.position >= self.max_seek() {
-				break;
+		while i < data.len() && self.position < self.max_seek() {
+			let offset = self.seek_offset();
+			let n = (data.len() - i)
+				.min(kernel::Page::SIZE - offset)
+				.min((self.max_seek() - self.position) as usize);
+			let page = self.seek_page();
+			if let Some((buf, _)) = self.resident(page) {
+				data[i..i + n].copy_from_slice(&buf[offset..offset + n]);
+			} else {
+				let entry = self.load(page, true)?;
+				data[i..i + n].copy_from_slice(&self.data(entry)[offset..offset + n]);
 			}
-			if self.seek_sector() != self.buffer_sector() {
-				self.flush()?;
-				self.fetch();
-				assert_eq!(self.seek_sector(), self.buffer_sector());
-			}
-			data[i] = self.buffer.as_ref()[self.seek_offset()];
-			self.position += 1;
-			i += 1;
+			self.position += n as u64;
+			i += n;
 		}
 		Ok(i)
 	}
 }
 
-impl Write for GlobalIO<'_> {
+impl Write for GlobalIO {
 	fn write(&mut self, data: &[u8]) -> Result<usize, Self::Error> {
 		let mut i = 0;
-		while i < data.len() {
-			if self.position >= self.max_seek() {
-				break;
-			}
-			if self.seek_sector() != self.buffer_sector() {
-				self.flush()?;
-				if data.len() <= self.buffer.as_ref().len() {
-					self.fetch();
-					assert_eq!(self.seek_sector(), self.buffer_sector());
-				}
+		while i < data.len() && self.position < self.max_seek() {
+			let offset = self.seek_offset();
+			let n = (data.len() - i)
+				.min(kernel::Page::SIZE - offset)
+				.min((self.max_seek() - self.position) as usize);
+			let page = self.seek_page();
+			if let Some((buf, dirty)) = self.resident(page) {
+				buf[offset..offset + n].copy_from_slice(&data[i..i + n]);
+				*dirty = true;
+			} else {
+				// Don't bother reading pages that will be overwritten entirely.
+				let entry = self.load(page, n < kernel::Page::SIZE)?;
+				self.data(entry)[offset..offset + n].copy_from_slice(&data[i..i + n]);
+				self.entries[entry].dirty = true;
 			}
-			let so = self.seek_offset();
-			self.buffer.as_mut()[so] = data[i];
-			self.position += 1;
-			i += 1;
-			self.dirty = true;
+			self.position += n as u64;
+			i += n;
 		}
 		Ok(i)
 	}
 
+	/// Write back all dirty pages.
 	fn flush(&mut self) -> Result<(), Self::Error> {
-		if !self.dirty {
-			return Ok(());
+		let mut tags = [None; CACHE_PAGES];
+		let mut fat_tags = [None; MAX_FAT_PAGES];
+		let mut ret = Ok(());
+		for (i, tag) in tags.iter_mut().enumerate() {
+			if self.entries[i].dirty {
+				match self.request(kernel::ipc::Op::Write, i) {
+					Ok(t) => *tag = Some(t),
+					Err(e) => ret = Err(e),
+				}
+			}
 		}
-
-		self.buffer_sector = self.seek_sector();
-
-		unsafe {
-			*dux::ipc::transmit() = kernel::ipc::Packet {
-				opcode: Some(kernel::ipc::Op::Write.into()),
-				address: ADDRESS,
-				uuid: UUID,
-				data: Some(core::ptr::NonNull::from(&*self.buffer)),
-				length: kernel::Page::SIZE,
-				offset: self.buffer_sector,
-				flags: 0,
-				id: 0,
-				name: None,
-				name_len: 0,
-			};
+		if let Some(fat) = self.fat.as_ref() {
+			for (i, tag) in fat_tags[..fat.count].iter_mut().enumerate() {
+				if fat.dirty[i] {
+					let data = NonNull::new(fat.pages.as_ptr().wrapping_add(i)).unwrap();
+					match Self::submit(kernel::ipc::Op::Write, data, fat.start + i as u64) {
+						Ok(t) => *tag = Some(t),
+						Err(e) => ret = Err(e),
+					}
+				}
+			}
 		}
-		loop {
-			let pkt = dux::ipc::receive();
-			if pkt.address != unsafe { ADDRESS } {
-				pkt.defer();
-				unsafe { kernel::io_wait(10_000) };
-				continue;
+		for (i, tag) in tags.iter().enumerate() {
+			if let Some(tag) = *tag {
+				drop(dux::ipc::tag::wait(tag));
+				self.entries[i].dirty = false;
 			}
-			break;
 		}
-		self.dirty = false;
-		Ok(())
+		for (i, tag) in fat_tags.iter().enumerate() {
+			if let Some(tag) = *tag {
+				drop(dux::ipc::tag::wait(tag));
+				self.fat.as_mut().unwrap().dirty[i] = false;
+			}
+		}
+		ret
 	}
 }
 
-impl Seek for GlobalIO<'_> {
+impl Seek for GlobalIO {
 	fn seek(&mut self, pos: SeekFrom) -> Result<u64, Self::Error> {
 		self.position = match pos {
 			SeekFrom::Start(p) => p,
@@ -161,21 +504,31 @@ impl Seek for GlobalIO<'_> {
 				if p > 0 {
 					self.position.checked_add(p as u64).unwrap_or(u64::MAX)
 				} else {
-					self.position.checked_sub((-p) as u64).ok_or(())?
+					self.position
+						.checked_sub((-p) as u64)
+						.ok_or(Error::Failed)?
 				}
 			}
-			SeekFrom::End(p) => self.max_seek().checked_sub((-p) as u64).ok_or(())?,
+			SeekFrom::End(p) => self
+				.max_seek()
+				.checked_sub((-p) as u64)
+				.ok_or(Error::Failed)?,
 		};
 		Ok(self.position)
 	}
 }
 
-impl Drop for GlobalIO<'_> {
+impl Drop for GlobalIO {
 	fn drop(&mut self) {
 		// Panicking is tempting, but also a bad idea in a Drop handler
 		match self.flush() {
 			Ok(()) => (),
-			Err(()) => kernel::sys_log!("failed to flush device on drop"),
+			Err(_) => kernel::sys_log!("failed to flush device on drop"),
 		}
+		// The block driver may still be writing to pages that are being read ahead.
+		(0..CACHE_PAGES).for_each(|i| self.complete(i));
+		self.unload_fat();
+		let pages = dux::Page::new(self.pages).unwrap();
+		unsafe { dux::mem::deallocate_range(pages, CACHE_PAGES) };
 	}
 }
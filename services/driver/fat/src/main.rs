@@ -20,42 +20,44 @@ fn panic_handler(info: &core::panic::PanicInfo) -> ! {
 }
 
 use core::convert::TryFrom;
+use dux::ipc::server::Step;
+use fatfs::{Read, Seek, SeekFrom, Write};
 
 mod io;
 mod rtbegin;
 
+type FileSystem =
+	fatfs::FileSystem<io::GlobalIO, fatfs::DefaultTimeProvider, fatfs::LossyOemCpConverter>;
+type File<'a> =
+	fatfs::File<'a, io::GlobalIO, fatfs::DefaultTimeProvider, fatfs::LossyOemCpConverter>;
+
+/// The maximum amount of client requests in progress at once.
+const MAX_REQUESTS: usize = 8;
+
 #[export_name = "main"]
 fn main() {
 	unsafe { dux::init() };
 
 	// Wait for virtio_block driver to come online
-	let addr = loop {
-		let name = b"virtio_block";
-		let ret = unsafe { kernel::sys_registry_get(name.as_ptr(), name.len()) };
-		if ret.status == 0 {
-			break ret.value;
-		}
-		unsafe { kernel::io_wait(0) };
-	};
+	let addr: usize = dux::task::registry::get_or_wait(b"virtio_block").into();
 
 	unsafe { io::ADDRESS = addr };
 
-	let mut buffer = kernel::Page::zeroed();
-	let mut buffer2 = kernel::Page::zeroed();
-
 	let fvo = fatfs::FormatVolumeOptions::new()
 		.volume_label(*b"DUX ROOT\0\0\0")
 		.volume_id(100117120)
 		.max_root_dir_entries(16);
-	let mut io = io::GlobalIO::new(&mut buffer);
+	let mut io = io::GlobalIO::new();
+	// Keep the FAT in memory if it is small enough. It is fine if this fails.
+	let _ = io.load_fat();
 	let fs = match fatfs::FileSystem::new(io, fatfs::FsOptions::new()) {
 		Ok(fs) => fs,
 		fs => {
 			drop(fs);
-			io = io::GlobalIO::new(&mut buffer2);
+			io = io::GlobalIO::new();
 			fatfs::format_volume(&mut io, fvo).unwrap();
+			let _ = io.load_fat();
 			let fs = fatfs::FileSystem::new(io, fatfs::FsOptions::new()).unwrap();
-			use fatfs::Write;
 			fs.root_dir()
 				.create_file("ducks")
 				.unwrap()
@@ -70,112 +72,221 @@ fn main() {
 	let ret = unsafe { kernel::sys_registry_add(name.as_ptr(), name.len(), usize::MAX) };
 	assert_eq!(ret.status, 0);
 
-	loop {
-		let rxq_lock = dux::ipc::receive();
-		let rxq = (*rxq_lock).clone();
-		drop(rxq_lock);
-		let opcode = rxq.opcode.unwrap();
-
-		use fatfs::{Read, Seek, SeekFrom, Write};
-
-		match kernel::ipc::Op::try_from(opcode) {
-			Ok(kernel::ipc::Op::Read) => {
-				// Figure out object to read.
-				let data = unsafe {
-					core::slice::from_raw_parts_mut(rxq.data.unwrap().as_ptr().cast(), rxq.length)
-				};
-				let path = rxq.name.map(|name| unsafe {
-					core::slice::from_raw_parts(name.cast::<u8>().as_ptr(), rxq.name_len.into())
-				});
-
-				let path = path.unwrap();
-				let path = core::str::from_utf8(path).unwrap();
-				let mut file = fs.root_dir().open_file(path).unwrap();
-				file.seek(SeekFrom::Start(rxq.offset)).unwrap();
-				let length = file.read(&mut data[..rxq.length]).unwrap();
-
-				// Send completion event
-				*dux::ipc::transmit() = kernel::ipc::Packet {
-					uuid: kernel::ipc::UUID::INVALID,
-					opcode: Some(opcode),
-					name: None,
-					name_len: 0,
-					flags: 0,
-					id: rxq.id,
-					address: rxq.address,
-					data: None,
-					length,
-					offset: rxq.offset,
-				};
-			}
-			Ok(kernel::ipc::Op::Write) => {
-				// Figure out object to write to.
-				let data = unsafe {
-					core::slice::from_raw_parts_mut(rxq.data.unwrap().as_ptr().cast(), rxq.length)
-				};
-				let path = rxq.name.map(|name| unsafe {
-					core::slice::from_raw_parts(name.cast::<u8>().as_ptr(), rxq.name_len.into())
-				});
-
-				let path = path.unwrap();
-				let path = core::str::from_utf8(path).unwrap();
-				let mut file = fs.root_dir().create_file(path).unwrap();
-				file.seek(SeekFrom::Start(rxq.offset)).unwrap();
-				let length = file.write(&mut data[..rxq.length]).unwrap();
-
-				// Confirm reception.
-				let mut tx = dux::ipc::transmit();
-				*tx = kernel::ipc::Packet {
-					uuid: kernel::ipc::UUID::INVALID,
-					opcode: Some(opcode),
-					name: None,
-					name_len: 0,
-					flags: 0,
-					id: rxq.id,
-					address: rxq.address,
-					data: None,
-					length,
-					offset: rxq.offset,
-				};
-				// Drop now to prevent a deadlock
-				drop(tx);
+	// Reads only wait for the block device in between steps. Everything else is handled in
+	// one go.
+	io::set_blocking(false);
+	let mut requests: [Option<Request>; MAX_REQUESTS] = Default::default();
+	dux::ipc::server::serve(
+		&mut requests,
+		// Completions of the block device are picked up by the cache.
+		|p| p.address != unsafe { io::ADDRESS },
+		|p| Request {
+			packet: p.clone(),
+			file: None,
+			done: 0,
+			listing: None,
+		},
+		|r| r.step(&fs),
+	)
+}
+
+/// A client request that is in progress.
+struct Request<'a> {
+	packet: kernel::ipc::Packet,
+	/// The file being read, once it has been opened.
+	file: Option<File<'a>>,
+	/// The amount of bytes that have been read so far.
+	done: usize,
+	/// The listing that has been sent, which must be kept until the kernel has taken it.
+	listing: Option<(dux::ipc::list::Builder, dux::ipc::Transmitted)>,
+}
+
+impl<'a> Request<'a> {
+	fn step(&mut self, fs: &'a FileSystem) -> Step {
+		let op = kernel::ipc::Op::try_from(self.packet.opcode.unwrap());
+		match op {
+			Ok(kernel::ipc::Op::Read) => return self.read(fs),
+			Ok(kernel::ipc::Op::List) => return self.list(fs),
+			_ => (),
+		}
+		io::set_blocking(true);
+		match op {
+			Ok(kernel::ipc::Op::Write) => self.write(fs),
+			// Just ignore other requests for now
+			_ => (),
+		}
+		io::set_blocking(false);
+		self.free_ranges();
+		Step::Done
+	}
+
+	/// Read the next chunk of the file.
+	fn read(&mut self, fs: &'a FileSystem) -> Step {
+		if self.file.is_none() {
+			match fs.root_dir().open_file(self.path()) {
+				Ok(file) => self.file = Some(file),
+				Err(fatfs::Error::Io(io::Error::WouldBlock)) => return Step::Blocked,
+				Err(e) => {
+					kernel::sys_log!("failed to open {:?}: {:?}", self.path(), e);
+					return self.finish_read();
+				}
 			}
-			Ok(kernel::ipc::Op::List) => {
-				let mut list_builder =
-					dux::ipc::list::Builder::new(fs.root_dir().iter().count(), 50).unwrap();
-				for f in fs.root_dir().iter() {
-					let f = f.unwrap();
-					let uuid = kernel::ipc::UUID::from(0);
-					let name = f.short_file_name_as_bytes();
-					let size = f.len();
-					list_builder.add(uuid, name, size).unwrap();
+		}
+
+		let (done, offset) = (self.done, self.packet.offset + self.done as u64);
+		let data = unsafe {
+			let data = self.packet.data.unwrap().as_ptr().cast::<u8>();
+			core::slice::from_raw_parts_mut(data, self.packet.length)
+		};
+		let file = self.file.as_mut().unwrap();
+		let ret = file
+			.seek(SeekFrom::Start(offset))
+			.and_then(|_| file.read(&mut data[done..]));
+		match ret {
+			Ok(0) => self.finish_read(),
+			Ok(n) => {
+				self.done += n;
+				match self.done == data.len() {
+					true => self.finish_read(),
+					false => Step::Progress,
 				}
+			}
+			Err(fatfs::Error::Io(io::Error::WouldBlock)) => Step::Blocked,
+			Err(e) => {
+				kernel::sys_log!("failed to read {:?}: {:?}", self.path(), e);
+				self.finish_read()
+			}
+		}
+	}
+
+	/// Send the completion event of a read request.
+	fn finish_read(&mut self) -> Step {
+		// Close the file while the cache may still block.
+		io::set_blocking(true);
+		self.file = None;
+		io::set_blocking(false);
+		*dux::ipc::transmit() = kernel::ipc::Packet {
+			uuid: kernel::ipc::UUID::INVALID,
+			opcode: self.packet.opcode,
+			name: None,
+			name_len: 0,
+			flags: 0,
+			id: self.packet.id,
+			address: self.packet.address,
+			data: None,
+			length: self.done,
+			offset: self.packet.offset,
+		};
+		self.free_ranges();
+		Step::Done
+	}
+
+	fn write(&self, fs: &'a FileSystem) {
+		// Figure out object to write to.
+		let rxq = &self.packet;
+		let data = unsafe {
+			core::slice::from_raw_parts_mut(rxq.data.unwrap().as_ptr().cast(), rxq.length)
+		};
+		let mut file = fs.root_dir().create_file(self.path()).unwrap();
+		file.seek(SeekFrom::Start(rxq.offset)).unwrap();
+		let length = file.write(&mut data[..rxq.length]).unwrap();
 
-				let data = Some(core::ptr::NonNull::from(list_builder.data()).cast());
-
-				*dux::ipc::transmit() = kernel::ipc::Packet {
-					uuid: kernel::ipc::UUID::INVALID,
-					opcode: Some(kernel::ipc::Op::List.into()),
-					name: None,
-					name_len: 0,
-					flags: 0,
-					id: rxq.id,
-					address: rxq.address,
-					data,
-					length: list_builder.bytes_len(),
-					offset: 0,
-				};
-				// FIXME Ultra shitty workaround to make sure we don't deallocate the pages
-				// before they're transmitted.
-				let _ = unsafe { kernel::io_wait(u64::MAX) };
+		// Confirm reception.
+		let mut tx = dux::ipc::transmit();
+		*tx = kernel::ipc::Packet {
+			uuid: kernel::ipc::UUID::INVALID,
+			opcode: rxq.opcode,
+			name: None,
+			name_len: 0,
+			flags: 0,
+			id: rxq.id,
+			address: rxq.address,
+			data: None,
+			length,
+			offset: rxq.offset,
+		};
+		// Drop now to prevent a deadlock
+		drop(tx);
+	}
+
+	/// Send a listing, then wait in between steps until the kernel has taken it before
+	/// freeing it.
+	fn list(&mut self, fs: &'a FileSystem) -> Step {
+		if self.listing.is_none() {
+			io::set_blocking(true);
+			self.listing = Some(self.send_list(fs));
+			io::set_blocking(false);
+		}
+		let (_, sent) = self.listing.as_ref().unwrap();
+		// Deliver it right away so it can usually be freed in the same step.
+		if !sent.is_consumed() {
+			dux::ipc::submit();
+			if !sent.is_consumed() {
+				return Step::Blocked;
+			}
+		}
+		self.listing = None;
+		self.free_ranges();
+		Step::Done
+	}
+
+	fn send_list(&self, fs: &'a FileSystem) -> (dux::ipc::list::Builder, dux::ipc::Transmitted) {
+		use dux::ipc::list::{Builder, BATCH_ENTRIES, END};
+
+		let rxq = &self.packet;
+		let dir = match self.path().trim_matches('/') {
+			"" | "." => Ok(fs.root_dir()),
+			path => fs.root_dir().open_dir(path),
+		};
+
+		// Short names are at most 12 bytes ("8.3").
+		let mut list_builder = Builder::new(BATCH_ENTRIES, BATCH_ENTRIES * 12).unwrap();
+		let mut next = END;
+		if let Ok(dir) = dir {
+			let start = usize::try_from(rxq.offset).unwrap_or(usize::MAX);
+			for (i, f) in dir.iter().skip(start).enumerate() {
+				if i == BATCH_ENTRIES {
+					next = rxq.offset + u64::try_from(i).unwrap();
+					break;
+				}
+				let f = f.unwrap();
+				let uuid = kernel::ipc::UUID::from(0);
+				let name = f.short_file_name_as_bytes();
+				let size = f.len();
+				list_builder.add(uuid, name, size).unwrap();
 			}
-			// Just ignore other requests for now
-			_ => (),
 		}
 
-		// Free ranges
-		if let Some(data) = rxq.data {
-			let len = dux::Page::min_pages_for_range(rxq.length);
+		let data = (list_builder.bytes_len() > 0)
+			.then(|| core::ptr::NonNull::from(list_builder.data()).cast());
+
+		let mut tx = dux::ipc::transmit();
+		*tx = kernel::ipc::Packet {
+			uuid: kernel::ipc::UUID::INVALID,
+			opcode: Some(kernel::ipc::Op::List.into()),
+			name: None,
+			name_len: 0,
+			flags: 0,
+			id: rxq.id,
+			address: rxq.address,
+			data,
+			length: list_builder.bytes_len(),
+			offset: next,
+		};
+		(list_builder, tx.transmitted())
+	}
+
+	fn path(&self) -> &str {
+		let path = self.packet.name.map(|name| unsafe {
+			core::slice::from_raw_parts(name.cast::<u8>().as_ptr(), self.packet.name_len.into())
+		});
+		path.map(|p| core::str::from_utf8(p).unwrap()).unwrap_or("")
+	}
+
+	/// Unmap the ranges of the request.
+	fn free_ranges(&self) {
+		if let Some(data) = self.packet.data {
+			let len = dux::Page::min_pages_for_range(self.packet.length);
 			let ret = unsafe { kernel::mem_dealloc(data.as_ptr() as *mut _, len) };
 			assert_eq!(ret.status, 0);
 			dux::ipc::add_free_range(
@@ -184,8 +295,8 @@ fn main() {
 			)
 			.unwrap();
 		}
-		if let Some(name) = rxq.name {
-			let len = dux::Page::min_pages_for_range(rxq.name_len.into());
+		if let Some(name) = self.packet.name {
+			let len = dux::Page::min_pages_for_range(self.packet.name_len.into());
 			let ret = unsafe { kernel::mem_dealloc(name.as_ptr() as *mut _, len) };
 			assert_eq!(ret.status, 0);
 			dux::ipc::add_free_range(
@@ -3,6 +3,9 @@
 //! All this driver does is buffer UART input and send received data over it. It is meant to be
 //! used by one task only.
 //!
+//! Both directions are buffered in rings that are emptied and filled by the interrupt handler,
+//! so writes are confirmed as soon as the data is in the ring rather than when it is sent.
+//!
 //! The driver does not add itself to the registry! This must be done by the "parent" task.
 
 #![no_std]
@@ -28,6 +31,8 @@ mod rtbegin;
 
 use core::convert::{TryFrom, TryInto};
 use core::ptr;
+use core::sync::atomic::{AtomicU16, Ordering};
+use dux::ipc::server::Step;
 
 /// The base address of the UART.
 const ADDRESS: *mut u8 = 0x1000_0000 as *mut _;
@@ -44,6 +49,21 @@ static mut NEW_INDEX: u16 = 0;
 /// The last index of data read from the buffer
 static mut USED_INDEX: u16 = 0;
 
+/// Buffer for data to write.
+static mut TX_BUFFER: [u8; 1 << 14] = [0; 1 << 14];
+
+/// The index of the next byte to add to the write buffer.
+static TX_HEAD: AtomicU16 = AtomicU16::new(0);
+
+/// The index of the next byte to send.
+static TX_TAIL: AtomicU16 = AtomicU16::new(0);
+
+/// The amount of bytes that fit in the transmit FIFO.
+const FIFO_DEPTH: u16 = 16;
+
+/// The maximum amount of requests that are handled at once.
+const MAX_REQUESTS: usize = 8;
+
 /// Map & initialize a new UART interface at the given physical address.
 ///
 /// The address is a PPN! The offset bits are not included. Similarly, the size refers to the
@@ -60,6 +80,10 @@ pub unsafe fn init(address: usize, size: usize) {
 	let ret = kernel::sys_direct_alloc(ADDRESS.cast(), address, size, 0b011);
 	assert_eq!(ret.status, 0, "mapping UART failed");
 
+	// Enable and clear the FIFOs. Interrupts are raised as soon as a single byte is
+	// received, which keeps typing responsive.
+	ADDRESS.add(2).write_volatile(0x07);
+
 	// Initialize the device
 	// Copied from https://wiki.osdev.org/Serial_Ports
 	/*
@@ -85,7 +109,6 @@ pub fn interrupt_data_available(enable: bool) {
 }
 
 /// Enable / disable transmitter empty interrupts
-#[allow(dead_code)]
 pub fn interrupt_transmitter_empty(enable: bool) {
 	unsafe {
 		let m = ptr::read_volatile(ADDRESS.add(1));
@@ -100,7 +123,7 @@ pub fn data_available() -> bool {
 	unsafe { ptr::read_volatile(ADDRESS.add(5)) & 0x1 > 0 }
 }
 
-/// Check if it is possible to transmit data, i.e. the queue isn't full.
+/// Check if it is possible to transmit data, i.e. the transmit FIFO is empty.
 #[must_use]
 pub fn can_transmit() -> bool {
 	unsafe { ptr::read_volatile(ADDRESS.add(5)) & 0x20 > 0 }
@@ -112,12 +135,44 @@ pub fn read() -> Option<u8> {
 	data_available().then(|| unsafe { ptr::read_volatile(ADDRESS) })
 }
 
-/// Write a single byte.
-#[must_use]
-pub fn write(byte: u8) -> bool {
-	let tr = can_transmit();
-	tr.then(|| unsafe { ptr::write_volatile(ADDRESS, byte) });
-	tr
+/// Fill the transmit FIFO from the write buffer if it is empty.
+///
+/// Transmitter empty interrupts are enabled as long as there is data left to send.
+///
+/// # Safety
+///
+/// This may only be called by the notification handler.
+unsafe fn transmit() {
+	let head = TX_HEAD.load(Ordering::Acquire);
+	let mut tail = TX_TAIL.load(Ordering::Relaxed);
+	if can_transmit() {
+		let n = head.wrapping_sub(tail).min(FIFO_DEPTH);
+		for _ in 0..n {
+			let c = TX_BUFFER[usize::from(tail) & (TX_BUFFER.len() - 1)];
+			ptr::write_volatile(ADDRESS, c);
+			tail = tail.wrapping_add(1);
+		}
+		TX_TAIL.store(tail, Ordering::Release);
+	}
+	interrupt_transmitter_empty(head != tail);
+}
+
+/// Copy as much data as fits to the write buffer and return the amount of bytes copied.
+fn queue(data: &[u8]) -> usize {
+	let head = TX_HEAD.load(Ordering::Relaxed);
+	let tail = TX_TAIL.load(Ordering::Acquire);
+	let len = unsafe { TX_BUFFER.len() };
+	let n = data.len().min(len - usize::from(head.wrapping_sub(tail)));
+	for (i, &c) in data[..n].iter().enumerate() {
+		let i = usize::from(head).wrapping_add(i) & (len - 1);
+		unsafe { TX_BUFFER[i] = c };
+	}
+	TX_HEAD.store(head.wrapping_add(n as u16), Ordering::Release);
+	if n > 0 {
+		// If the FIFO is empty this raises an interrupt right away, which starts sending.
+		interrupt_transmitter_empty(true);
+	}
+	n
 }
 
 #[naked]
@@ -185,6 +240,7 @@ extern "C" fn notification_handler(typ: usize, value: usize, address: usize) {
 				BUFFER[usize::from(NEW_INDEX)] = c;
 				NEW_INDEX = NEW_INDEX.wrapping_add(1);
 			}
+			transmit();
 		},
 		_ => (),
 	}
@@ -224,111 +280,152 @@ fn main() {
 	// Enable UART data available interrupts.
 	interrupt_data_available(true);
 
+	// Writes are sent in the order they were received. Each write gets a ticket and may only
+	// add to the write buffer when its ticket is up.
+	let (mut issued, mut sent) = (0u64, 0u64);
+
 	// Wait for & respond to requests
-	loop {
-		let rx = dux::ipc::receive();
-		let rxq = rx.clone();
-		drop(rx);
-		let op = rxq.opcode.unwrap();
-		match kernel::ipc::Op::try_from(op) {
-			Ok(kernel::ipc::Op::Read) => {
-				// Figure out object to read.
-				let data = unsafe {
-					core::slice::from_raw_parts_mut(rxq.data.unwrap().as_ptr().cast(), rxq.length)
-				};
-
-				let mut length = 0;
-
-				unsafe {
-					// Wait until data is available
-					// TODO this blocks writes from other tasks.
-					while USED_INDEX == NEW_INDEX {
-						kernel::io_wait(u64::MAX);
+	let mut slots: [Option<Request>; MAX_REQUESTS] = Default::default();
+	dux::ipc::server::serve(
+		&mut slots,
+		|_| true,
+		|rx| {
+			let ticket = issued;
+			if rx.opcode == Some(kernel::ipc::Op::Write.into()) {
+				issued += 1;
+			}
+			Request {
+				packet: rx.clone(),
+				ticket,
+				done: 0,
+			}
+		},
+		|request| {
+			let step = match kernel::ipc::Op::try_from(request.packet.opcode.unwrap()) {
+				Ok(kernel::ipc::Op::Read) => read_step(request),
+				Ok(kernel::ipc::Op::Write) if request.ticket != sent => Step::Blocked,
+				Ok(kernel::ipc::Op::Write) => {
+					let step = write_step(request);
+					if step == Step::Done {
+						sent += 1;
 					}
+					step
+				}
+				// Just ignore other requests for now
+				_ => Step::Done,
+			};
+			if step == Step::Done {
+				free(&request.packet);
+			}
+			step
+		},
+	)
+}
 
-					while USED_INDEX != NEW_INDEX && length < data.len() {
-						data[length] = BUFFER[usize::from(USED_INDEX) & (BUFFER.len() - 1)];
-						// Workaround QEMU sillyness
-						if data[length] == b'\r' {
-							data[length] = b'\n';
-						}
-						USED_INDEX = USED_INDEX.wrapping_add(1);
-						length += 1;
-					}
+/// A request that is being handled.
+struct Request {
+	packet: kernel::ipc::Packet,
+	/// The position of this request among writes.
+	ticket: u64,
+	/// The amount of bytes handled so far.
+	done: usize,
+}
 
-					// Re-enable UART data available interrupts if it was disabled.
-					interrupt_data_available(true);
-				}
+/// Read from the read buffer if it has any data.
+fn read_step(request: &mut Request) -> Step {
+	let rxq = &request.packet;
+	// Figure out object to read.
+	let data =
+		unsafe { core::slice::from_raw_parts_mut(rxq.data.unwrap().as_ptr().cast(), rxq.length) };
 
-				// Send completion event
-				*dux::ipc::transmit() = kernel::ipc::Packet {
-					uuid: kernel::ipc::UUID::from(0x09090909090555577777),
-					opcode: Some(kernel::ipc::Op::Read.into()),
-					name: None,
-					name_len: 0,
-					flags: 0,
-					id: 0,
-					address: rxq.address,
-					data: None,
-					length,
-					offset: 0,
-				};
-			}
-			Ok(kernel::ipc::Op::Write) => {
-				// Figure out object to write to.
-				let data = unsafe {
-					core::slice::from_raw_parts(rxq.data.unwrap().as_ptr().cast(), rxq.length)
-				};
-
-				// Write data
-				let mut len = 0;
-				while len < data.len() {
-					while !write(data[len]) {
-						interrupt_transmitter_empty(true);
-						unsafe { kernel::io_wait(u64::MAX) };
-					}
-					interrupt_transmitter_empty(false);
-					len += 1;
-				}
+	let mut length = 0;
 
-				// Confirm reception.
-				*dux::ipc::transmit() = kernel::ipc::Packet {
-					uuid: kernel::ipc::UUID::from(0x10101010101010),
-					opcode: Some(kernel::ipc::Op::Write.into()),
-					name: None,
-					name_len: 0,
-					flags: 0,
-					id: 0,
-					address: rxq.address,
-					data: None,
-					length: len,
-					offset: 0,
-				};
-			}
-			// Just ignore other requests for now
-			_ => (),
+	unsafe {
+		// Wait until data is available
+		if USED_INDEX == NEW_INDEX {
+			return Step::Blocked;
 		}
 
-		// Free ranges
-		if let Some(data) = rxq.data {
-			let len = dux::Page::min_pages_for_range(rxq.length);
-			let ret = unsafe { kernel::mem_dealloc(data.as_ptr() as *mut _, len) };
-			assert_eq!(ret.status, 0);
-			dux::ipc::add_free_range(
-				dux::Page::new(core::ptr::NonNull::new(data.as_ptr() as *mut _).unwrap()).unwrap(),
-				len,
-			)
-			.unwrap();
-		}
-		if let Some(name) = rxq.name {
-			let len = dux::Page::min_pages_for_range(rxq.name_len.into());
-			let ret = unsafe { kernel::mem_dealloc(name.as_ptr() as *mut _, len) };
-			assert_eq!(ret.status, 0);
-			dux::ipc::add_free_range(
-				dux::Page::new(core::ptr::NonNull::new(name.as_ptr() as *mut _).unwrap()).unwrap(),
-				len,
-			)
-			.unwrap();
+		while USED_INDEX != NEW_INDEX && length < data.len() {
+			data[length] = BUFFER[usize::from(USED_INDEX) & (BUFFER.len() - 1)];
+			// Workaround QEMU sillyness
+			if data[length] == b'\r' {
+				data[length] = b'\n';
+			}
+			USED_INDEX = USED_INDEX.wrapping_add(1);
+			length += 1;
 		}
+
+		// Re-enable UART data available interrupts if it was disabled.
+		interrupt_data_available(true);
+	}
+
+	// Send completion event
+	*dux::ipc::transmit() = kernel::ipc::Packet {
+		uuid: kernel::ipc::UUID::from(0x09090909090555577777),
+		opcode: Some(kernel::ipc::Op::Read.into()),
+		name: None,
+		name_len: 0,
+		flags: 0,
+		id: rxq.id,
+		address: rxq.address,
+		data: None,
+		length,
+		offset: 0,
+	};
+	Step::Done
+}
+
+/// Add as much data as fits to the write buffer. The write is confirmed once all data is in
+/// the buffer.
+fn write_step(request: &mut Request) -> Step {
+	let rxq = &request.packet;
+	// Figure out object to write to.
+	let data =
+		unsafe { core::slice::from_raw_parts(rxq.data.unwrap().as_ptr().cast(), rxq.length) };
+
+	let n = queue(&data[request.done..]);
+	request.done += n;
+	if request.done < data.len() {
+		return if n > 0 { Step::Progress } else { Step::Blocked };
+	}
+
+	// Confirm reception.
+	*dux::ipc::transmit() = kernel::ipc::Packet {
+		uuid: kernel::ipc::UUID::from(0x10101010101010),
+		opcode: Some(kernel::ipc::Op::Write.into()),
+		name: None,
+		name_len: 0,
+		flags: 0,
+		id: rxq.id,
+		address: rxq.address,
+		data: None,
+		length: request.done,
+		offset: 0,
+	};
+	Step::Done
+}
+
+/// Free the ranges of a packet.
+fn free(rxq: &kernel::ipc::Packet) {
+	if let Some(data) = rxq.data {
+		let len = dux::Page::min_pages_for_range(rxq.length);
+		let ret = unsafe { kernel::mem_dealloc(data.as_ptr() as *mut _, len) };
+		assert_eq!(ret.status, 0);
+		dux::ipc::add_free_range(
+			dux::Page::new(core::ptr::NonNull::new(data.as_ptr() as *mut _).unwrap()).unwrap(),
+			len,
+		)
+		.unwrap();
+	}
+	if let Some(name) = rxq.name {
+		let len = dux::Page::min_pages_for_range(rxq.name_len.into());
+		let ret = unsafe { kernel::mem_dealloc(name.as_ptr() as *mut _, len) };
+		assert_eq!(ret.status, 0);
+		dux::ipc::add_free_range(
+			dux::Page::new(core::ptr::NonNull::new(name.as_ptr() as *mut _).unwrap()).unwrap(),
+			len,
+		)
+		.unwrap();
 	}
 }
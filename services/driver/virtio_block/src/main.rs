@@ -71,8 +71,8 @@ fn main() {
 	let pci = unsafe { pci::Header::from_raw(virt) };
 	virt = virt.wrapping_add(size / Page::SIZE);
 
-	let irq = match pci {
-		pci::Header::H0(h) => h.interrupt_pin.get(),
+	let (irq, msix) = match pci {
+		pci::Header::H0(h) => (h.interrupt_pin.get(), h.msix()),
 		_ => todo!(),
 	};
 
@@ -115,101 +115,155 @@ fn main() {
 	// TODO move this to behind block device setup but right before we allocate an interrupt.
 	notification::init();
 
+	// Completions should be handled as soon as they arrive.
+	let ret = unsafe { kernel::task_set_priority(kernel::priority::HIGH) };
+	assert_eq!(ret.status, 0, "failed to set priority");
+
+	// The kernel can only route interrupts through the PLIC and there is no MSI controller
+	// to point vectors at yet, so stick to the interrupt pin. Requests are still spread over
+	// multiple queues if the device has them.
+	if let Some(msix) = msix {
+		msix.set_enabled(false);
+	}
+
 	// Set up block device
-	let mut device = virtio::pci::new_device(pci, &virt_bars[..], virtio_block::BlockDevice::new)
-		.expect("failed to create device");
+	let mut device = virtio::pci::new_device(pci, &virt_bars[..], |c, d, n, i| {
+		virtio_block::BlockDevice::new_multiqueue(c, d, n, i, virtio_block::MAX_QUEUES, &[])
+	})
+	.expect("failed to create device");
 
 	// Add self to registry
 	let name = "virtio_block";
 	let ret = unsafe { kernel::sys_registry_add(name.as_ptr(), name.len(), usize::MAX) };
 	assert_eq!(ret.status, 0, "failed to add self to registry");
 
-	// Wait for & respond to requests
-	loop {
-		let rxq = dux::ipc::receive();
-		let op = rxq.opcode.unwrap();
-
-		let ratio = kernel::Page::SIZE / core::mem::size_of::<virtio_block::Sector>();
-		let length = rxq.length / virtio_block::Sector::SIZE;
-		let offset = rxq.offset * ratio as u64;
-
-		//let mut wait = || unsafe { kernel::io_wait(u64::MAX) };
-		// FIXME it is _still_ not fixed (wtf?)
-		let mut wait = || unsafe { kernel::io_wait(10_000) };
-
-		match kernel::ipc::Op::try_from(op) {
-			Ok(kernel::ipc::Op::Read) => {
-				let data = unsafe {
-					let data = rxq.data.unwrap().as_ptr().cast::<virtio_block::Sector>();
-					core::slice::from_raw_parts_mut(data, length)
-				};
+	// Requests that have been submitted to the device, indexed by token.
+	let mut pending = [None; virtio_block::MAX_REQUESTS * virtio_block::MAX_QUEUES];
 
-				device
-					.read(data, offset, &mut wait)
-					.expect("failed to read sectors");
+	// Keep as many requests in flight as the device allows and respond to them in whatever
+	// order they finish.
+	loop {
+		// Take in new requests until the device or our table is full.
+		let mut submitted = false;
+		while let Some(token) = pending.iter().position(Option::is_none) {
+			let rxq = match dux::ipc::try_receive() {
+				Some(rxq) => rxq,
+				None => break,
+			};
+			let ratio = kernel::Page::SIZE / core::mem::size_of::<virtio_block::Sector>();
+			let length = rxq.length / virtio_block::Sector::SIZE;
+			let offset = rxq.offset * ratio as u64;
+			let op = rxq.opcode.map(|op| kernel::ipc::Op::try_from(op));
+			// Spread requests over the queues.
+			let queue = (0..device.queue_count())
+				.min_by_key(|&q| device.in_flight(q))
+				.unwrap();
 
-				// Send completion event
-				*dux::ipc::transmit() = kernel::ipc::Packet {
-					uuid: kernel::ipc::UUID::INVALID,
-					opcode: Some(kernel::ipc::Op::Read.into()),
-					name: None,
-					name_len: 0,
-					flags: 0,
-					id: 0,
-					address: rxq.address,
-					data: None,
-					length: length / virtio_block::Sector::SIZE,
-					offset: offset / ratio as u64,
-				};
+			let ret = match (op, rxq.data) {
+				(Some(Ok(kernel::ipc::Op::Read)), Some(data)) => unsafe {
+					let data = data.as_ptr().cast::<virtio_block::Sector>();
+					let data = core::slice::from_raw_parts_mut(data, length);
+					device.submit_read(queue, data, offset, token as u64)
+				},
+				(Some(Ok(kernel::ipc::Op::Write)), Some(data)) => unsafe {
+					let data = data.as_ptr().cast::<virtio_block::Sector>();
+					let data = core::slice::from_raw_parts(data, length);
+					device.submit_write(queue, data, offset, token as u64)
+				},
+				// Respond with the size of the device in bytes.
+				(Some(Ok(kernel::ipc::Op::Info)), _) => {
+					*dux::ipc::transmit() = kernel::ipc::Packet {
+						uuid: kernel::ipc::UUID::INVALID,
+						opcode: rxq.opcode,
+						name: None,
+						name_len: 0,
+						flags: 0,
+						id: rxq.id,
+						address: rxq.address,
+						data: None,
+						length: 0,
+						offset: device.capacity() * virtio_block::Sector::SIZE as u64,
+					};
+					free_range(rxq.name, rxq.name_len.into());
+					free_range(rxq.data, rxq.length);
+					continue;
+				}
+				// Just ignore other requests for now
+				_ => {
+					free_range(rxq.name, rxq.name_len.into());
+					free_range(rxq.data, rxq.length);
+					continue;
+				}
+			};
+			match ret {
+				Ok(()) => submitted = true,
+				// Try again once some requests have finished.
+				Err(virtio_block::SubmitError::Full) => {
+					rxq.defer();
+					break;
+				}
+				Err(e) => panic!("failed to submit request: {:?}", e),
 			}
-			Ok(kernel::ipc::Op::Write) => {
-				let data = unsafe {
-					let data = rxq.data.unwrap().as_ptr().cast::<virtio_block::Sector>();
-					core::slice::from_raw_parts(data, length)
-				};
-
-				device
-					.write(data, offset, &mut wait)
-					.expect("failed to write sectors");
+			free_range(rxq.name, rxq.name_len.into());
+			pending[token] = Some(Pending {
+				op: rxq.opcode.unwrap(),
+				id: rxq.id,
+				address: rxq.address,
+				data: rxq.data,
+				length: rxq.length,
+				offset: rxq.offset,
+			});
+		}
+		if submitted {
+			device.flush();
+		}
 
-				// Confirm reception.
+		// Send completion events
+		let mut collected = 0;
+		for queue in 0..device.queue_count() {
+			collected += device.collect(queue, |token, ret| {
+				ret.expect("failed to read or write sectors");
+				let p = pending[token as usize].take().expect("no pending request");
 				*dux::ipc::transmit() = kernel::ipc::Packet {
 					uuid: kernel::ipc::UUID::INVALID,
-					opcode: Some(kernel::ipc::Op::Write.into()),
+					opcode: Some(p.op),
 					name: None,
 					name_len: 0,
 					flags: 0,
-					id: 0,
-					address: rxq.address,
+					id: p.id,
+					address: p.address,
 					data: None,
-					length: length / virtio_block::Sector::SIZE,
-					offset: offset / ratio as u64,
+					length: p.length / virtio_block::Sector::SIZE / virtio_block::Sector::SIZE,
+					offset: p.offset,
 				};
-			}
-			// Just ignore other requests for now
-			_ => (),
+				free_range(p.data, p.length);
+			});
 		}
 
-		// Free ranges
-		if let Some(data) = rxq.data {
-			let len = dux::Page::min_pages_for_range(rxq.length);
-			let ret = unsafe { kernel::mem_dealloc(data.as_ptr() as *mut _, len) };
-			assert_eq!(ret.status, 0);
-			dux::ipc::add_free_range(
-				dux::Page::new(core::ptr::NonNull::new(data.as_ptr() as *mut _).unwrap()).unwrap(),
-				len,
-			)
-			.unwrap();
-		}
-		if let Some(name) = rxq.name {
-			let len = dux::Page::min_pages_for_range(rxq.name_len.into());
-			let ret = unsafe { kernel::mem_dealloc(name.as_ptr() as *mut _, len) };
-			assert_eq!(ret.status, 0);
-			dux::ipc::add_free_range(
-				dux::Page::new(core::ptr::NonNull::new(name.as_ptr() as *mut _).unwrap()).unwrap(),
-				len,
-			)
-			.unwrap();
+		if collected == 0 {
+			// Either the interrupt of the device or a new request wakes us up.
+			unsafe { kernel::io_wait(u64::MAX) };
 		}
 	}
 }
+
+/// A request that is being processed by the device.
+#[derive(Clone, Copy)]
+struct Pending {
+	op: core::num::NonZeroU8,
+	id: u8,
+	address: usize,
+	data: Option<core::ptr::NonNull<kernel::Page>>,
+	length: usize,
+	offset: u64,
+}
+
+/// Unmap a range received in a packet and make it available for new packets.
+fn free_range(range: Option<core::ptr::NonNull<kernel::Page>>, length: usize) {
+	if let Some(range) = range {
+		let len = dux::Page::min_pages_for_range(length);
+		let ret = unsafe { kernel::mem_dealloc(range.as_ptr(), len) };
+		assert_eq!(ret.status, 0);
+		dux::ipc::add_free_range(dux::Page::new(range).unwrap(), len).unwrap();
+	}
+}
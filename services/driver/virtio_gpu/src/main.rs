@@ -23,6 +23,7 @@ fn panic_handler(info: &core::panic::PanicInfo) -> ! {
 	loop {}
 }
 
+mod notification;
 mod rtbegin;
 
 use core::convert::{TryFrom, TryInto};
@@ -70,6 +71,11 @@ fn main() {
 	let pci = unsafe { pci::Header::from_raw(virt) };
 	virt = virt.wrapping_add(size / Page::SIZE);
 
+	let (irq, msix) = match pci {
+		pci::Header::H0(h) => (h.interrupt_pin.get(), h.msix()),
+		_ => todo!(),
+	};
+
 	// Map BARs
 	let mut virt_bars = [None; 6];
 	for (w, r) in virt_bars.iter_mut().zip(bars.iter()) {
@@ -85,17 +91,40 @@ fn main() {
 		});
 	}
 
+	// Route interrupts to us
+	{
+		let uuid = u128::from(irq);
+		*dux::ipc::transmit() = kernel::ipc::Packet {
+			address: 1,
+			data: None,
+			uuid: kernel::ipc::UUID::new(uuid),
+			id: 0,
+			flags: 0,
+			length: 0,
+			name: None,
+			name_len: 0,
+			offset: 0,
+			opcode: core::num::NonZeroU8::new(128), // OP_OPEN
+		};
+	}
+
 	pci.set_command(
-		pci::HeaderCommon::COMMAND_INTERRUPT_DISABLE
-			| pci::HeaderCommon::COMMAND_MMIO_MASK
-			| pci::HeaderCommon::COMMAND_BUS_MASTER_MASK,
+		pci::HeaderCommon::COMMAND_MMIO_MASK | pci::HeaderCommon::COMMAND_BUS_MASTER_MASK,
 	);
 
+	notification::init();
+
+	// The kernel can only route interrupts through the PLIC, so use the interrupt pin.
+	if let Some(msix) = msix {
+		msix.set_enabled(false);
+	}
+
 	// Set up block device
 	let mut device = virtio::pci::new_device(pci, &virt_bars[..], virtio_gpu::Device::new)
 		.expect("failed to create device");
 
-	// Create draw buffer
+	// Create draw buffers. There are two so clients can draw to one while the other is being
+	// transferred.
 	#[repr(C)]
 	struct RGBA8 {
 		r: u8,
@@ -106,7 +135,7 @@ fn main() {
 	let (w, h) = (800, 600);
 	let size = (w * h * core::mem::size_of::<RGBA8>() + kernel::Page::MASK) / kernel::Page::SIZE;
 	let addr = core::ptr::NonNull::new(0x3333_0000 as *mut _).unwrap();
-	let ret = unsafe { kernel::mem_alloc(addr.as_ptr(), size, 0b11) };
+	let ret = unsafe { kernel::mem_alloc(addr.as_ptr(), size * BUFFERS, 0b11) };
 	assert_eq!(ret.status, 0);
 	let buffer = unsafe {
 		let ptr = addr.as_ptr().cast::<RGBA8>();
@@ -117,7 +146,7 @@ fn main() {
 
 	// Create cursor buffer
 	let (cursor_w, cursor_h) = (64, 64);
-	let cursor_addr = core::ptr::NonNull::new(addr.as_ptr().wrapping_add(size)).unwrap();
+	let cursor_addr = core::ptr::NonNull::new(addr.as_ptr().wrapping_add(size * BUFFERS)).unwrap();
 	let cursor_size = (cursor_w * cursor_h * core::mem::size_of::<RGBA8>() + kernel::Page::MASK)
 		/ kernel::Page::SIZE;
 	let ret = unsafe { kernel::mem_alloc(cursor_addr.cast().as_ptr(), cursor_size, 0b11) };
@@ -127,6 +156,10 @@ fn main() {
 	let rect = virtio_gpu::Rect::new(0, 0, w.try_into().unwrap(), h.try_into().unwrap());
 	let ret = unsafe { device.init_scanout(virtio_gpu::Format::RGBA8Unorm, rect, addr, size) };
 	let id = ret.unwrap();
+	let back_addr = core::ptr::NonNull::new(addr.as_ptr().wrapping_add(size)).unwrap();
+	let ret =
+		unsafe { device.create_buffer(virtio_gpu::Format::RGBA8Unorm, rect, back_addr, size) };
+	let resources = [id, ret.unwrap()];
 
 	for x in 0..w {
 		for y in 0..h {
@@ -163,56 +196,144 @@ fn main() {
 	let ret = unsafe { kernel::sys_registry_add(name.as_ptr(), name.len(), usize::MAX) };
 	assert_eq!(ret.status, 0, "failed to add self to registry");
 
+	// The area of each resource that is out of date with its buffer. A client only draws the
+	// changes since its previous frame, which went to the other buffer, so the damage of
+	// every frame applies to both resources.
+	let mut stale = [virtio_gpu::Rect::new(0, 0, 0, 0); BUFFERS];
+	// The flush request waiting to be submitted and the one in flight for each buffer.
+	let mut queued = [None; BUFFERS];
+	let mut in_flight = [None; BUFFERS];
+
 	loop {
-		let rx = dux::ipc::receive();
-
-		const OP_OPEN: u8 = 128;
-		const OP_FLUSH: u8 = 129;
-
-		match rx.opcode.map(|n| n.get()).unwrap_or(0) {
-			OP_OPEN => match u128::from(rx.uuid) {
-				0 => {
-					*dux::ipc::transmit() = kernel::ipc::Packet {
-						uuid: kernel::ipc::UUID::INVALID,
-						data: Some(addr),
-						length: w * h * core::mem::size_of::<RGBA8>(),
-						address: rx.address,
-						id: rx.id,
-						name: None,
-						name_len: 0,
-						flags: 0,
-						offset: 0,
-						opcode: rx.opcode,
+		let mut progress = false;
+
+		// Send completion events
+		device.collect(|token, ret| {
+			ret.expect("failed to draw");
+			let f: Flush = in_flight[token as usize]
+				.take()
+				.expect("no flush in flight");
+			*dux::ipc::transmit() = kernel::ipc::Packet {
+				uuid: kernel::ipc::UUID::INVALID,
+				data: None,
+				length: 0,
+				address: f.address,
+				id: f.id,
+				name: None,
+				name_len: 0,
+				flags: 0,
+				offset: 0,
+				opcode: core::num::NonZeroU8::new(OP_FLUSH),
+			};
+			progress = true;
+		});
+
+		while let Some(rx) = dux::ipc::try_receive() {
+			progress = true;
+			match rx.opcode.map(|n| n.get()).unwrap_or(0) {
+				OP_OPEN => match u128::from(rx.uuid) {
+					0 => {
+						// The buffers are laid out back to back. The offset is the distance
+						// between the start of each buffer in bytes.
+						*dux::ipc::transmit() = kernel::ipc::Packet {
+							uuid: kernel::ipc::UUID::INVALID,
+							data: Some(addr),
+							length: size * kernel::Page::SIZE * BUFFERS,
+							address: rx.address,
+							id: rx.id,
+							name: None,
+							name_len: 0,
+							flags: 0,
+							offset: (size * kernel::Page::SIZE) as u64,
+							opcode: rx.opcode,
+						};
+					}
+					1 => {
+						*dux::ipc::transmit() = kernel::ipc::Packet {
+							uuid: kernel::ipc::UUID::INVALID,
+							data: Some(cursor_addr),
+							length: cursor_w * cursor_h * core::mem::size_of::<RGBA8>(),
+							address: rx.address,
+							id: rx.id,
+							name: None,
+							name_len: 0,
+							flags: 0,
+							offset: 0,
+							opcode: rx.opcode,
+						};
+					}
+					_ => todo!(),
+				},
+				OP_FLUSH => {
+					// The UUID is the buffer that was drawn to. The offset holds the area to
+					// flush as 16 bit x, y, width and height fields. Zero means the entire
+					// screen.
+					let buffer = usize::try_from(u128::from(rx.uuid))
+						.ok()
+						.filter(|&b| b < BUFFERS)
+						.expect("invalid buffer");
+					let f = |shift: u32| u32::from((rx.offset >> shift) as u16);
+					let area = match rx.offset {
+						0 => rect,
+						_ => {
+							let (x, y) = (f(0).min(rect.width()), f(16).min(rect.height()));
+							let w = f(32).min(rect.width() - x);
+							let h = f(48).min(rect.height() - y);
+							virtio_gpu::Rect::new(x, y, w, h)
+						}
 					};
-				}
-				1 => {
-					*dux::ipc::transmit() = kernel::ipc::Packet {
-						uuid: kernel::ipc::UUID::INVALID,
-						data: Some(cursor_addr),
-						length: cursor_w * cursor_h * core::mem::size_of::<RGBA8>(),
+					for s in stale.iter_mut() {
+						*s = s.union(&area);
+					}
+					let f = Flush {
 						address: rx.address,
 						id: rx.id,
-						name: None,
-						name_len: 0,
-						flags: 0,
-						offset: 0,
-						opcode: rx.opcode,
 					};
+					assert!(queued[buffer].replace(f).is_none(), "buffer flushed twice");
 				}
 				_ => todo!(),
-			},
-			OP_FLUSH => {
-				device.draw(id, rect).expect("failed to draw");
-				device.draw(cursor_id, cursor_rect).expect("failed to draw");
-				device
-					.update_cursor(cursor_id, 0, 0)
-					.expect("failed to update cursor");
 			}
-			_ => todo!(),
 		}
 
-		unsafe {
-			kernel::io_wait(u64::MAX);
+		// Submit draws for buffers that aren't being transferred already. Flushes of
+		// different buffers are kept in flight together.
+		let mut submitted = false;
+		for b in 0..BUFFERS {
+			if in_flight[b].is_some() || queued[b].is_none() {
+				continue;
+			}
+			let area = match stale[b] {
+				r if r.is_empty() => virtio_gpu::Rect::new(0, 0, 1, 1),
+				r => r,
+			};
+			match device.submit_draw(resources[b], area, Some(rect), b as u64) {
+				Ok(()) => (),
+				Err(virtio_gpu::SubmitError::Full) => break,
+			}
+			stale[b] = virtio_gpu::Rect::new(0, 0, 0, 0);
+			in_flight[b] = queued[b].take();
+			submitted = true;
+		}
+		if submitted {
+			device.flush();
+		}
+
+		if !progress {
+			// Either the interrupt of the device or a new request wakes us up.
+			unsafe { kernel::io_wait(u64::MAX) };
 		}
 	}
 }
+
+/// The amount of buffers clients can draw to.
+const BUFFERS: usize = 2;
+
+const OP_OPEN: u8 = 128;
+const OP_FLUSH: u8 = 129;
+
+/// A flush request of a client.
+#[derive(Clone, Copy)]
+struct Flush {
+	address: usize,
+	id: u8,
+}
@@ -23,6 +23,7 @@ fn panic_handler(info: &core::panic::PanicInfo) -> ! {
 	loop {}
 }
 
+mod notification;
 mod rtbegin;
 mod scancode;
 
@@ -42,6 +43,20 @@ static mut NEW_INDEX: u16 = 0;
 /// The last index of data read from the buffer
 static mut USED_INDEX: u16 = 0;
 
+/// Raw events that haven't been read yet.
+static mut EVENTS: [[u8; 8]; 1 << 9] = [[0; 8]; 1 << 9];
+
+/// The index of the next event to add and of the next event to read.
+static mut EVENTS_NEW: u16 = 0;
+static mut EVENTS_USED: u16 = 0;
+
+/// The maximum amount of requests that are handled at once.
+const MAX_REQUESTS: usize = 8;
+
+/// The default time in microseconds to wait for more events before answering a read of raw
+/// events.
+const DEFAULT_COALESCE: u64 = 4_000;
+
 static mut DEVICE: Option<virtio_input::Device> = None;
 
 static mut SET: Option<scancode::ScanCodes> = None;
@@ -93,9 +108,17 @@ fn main() {
 	// Parse arguments
 	let mut pci = None;
 	let mut bars = [None; 6];
+	let mut coalesce = DEFAULT_COALESCE;
 
-	driver::parse_args(rtbegin::args(), |arg, _| {
+	driver::parse_args(rtbegin::args(), |arg, args| {
 		match arg {
+			driver::Arg::Other(b"--coalesce") => {
+				let t = args.next().expect("expected coalesce window");
+				coalesce = core::str::from_utf8(t)
+					.ok()
+					.and_then(|t| t.parse().ok())
+					.expect("invalid coalesce window");
+			}
 			driver::Arg::Pci(p) => pci
 				.replace(p)
 				.ok_or(())
@@ -142,12 +165,44 @@ fn main() {
 		});
 	}
 
+	let (irq, msix) = match pci {
+		pci::Header::H0(h) => (h.interrupt_pin.get(), h.msix()),
+		_ => {
+			// Only type 0 headers have an interrupt pin, so there is nothing to wait on.
+			kernel::sys_log!("unsupported PCI header type, exiting");
+			let _ = unsafe { kernel::task_exit() };
+			return;
+		}
+	};
+
+	// Route interrupts to us
+	{
+		let uuid = u128::from(irq);
+		*dux::ipc::transmit() = kernel::ipc::Packet {
+			address: 1,
+			data: None,
+			uuid: kernel::ipc::UUID::new(uuid),
+			id: 0,
+			flags: 0,
+			length: 0,
+			name: None,
+			name_len: 0,
+			offset: 0,
+			opcode: core::num::NonZeroU8::new(128), // OP_OPEN
+		};
+	}
+
 	pci.set_command(
-		pci::HeaderCommon::COMMAND_INTERRUPT_DISABLE
-			| pci::HeaderCommon::COMMAND_MMIO_MASK
-			| pci::HeaderCommon::COMMAND_BUS_MASTER_MASK,
+		pci::HeaderCommon::COMMAND_MMIO_MASK | pci::HeaderCommon::COMMAND_BUS_MASTER_MASK,
 	);
 
+	notification::init();
+
+	// The kernel can only route interrupts through the PLIC, so use the interrupt pin.
+	if let Some(msix) = msix {
+		msix.set_enabled(false);
+	}
+
 	// Set up device
 	let dev = virtio::pci::new_device(pci, &virt_bars[..], virtio_input::Device::new)
 		.expect("failed to create device");
@@ -165,76 +220,165 @@ fn main() {
 		DEVICE = Some(dev);
 	}
 
+	// Reads with UUID 0 get text, reads with UUID 1 get raw events. Raw events are packed
+	// as many as fit in the buffer of the request, eight bytes each, in the layout of
+	// virtio_input::InputEvent. A read of raw events is answered once the buffer is full or
+	// the coalescing window has passed since events became available.
+	let mut pending: [Option<Pending>; MAX_REQUESTS] = Default::default();
+
 	loop {
-		let rx = dux::ipc::receive();
-
-		match kernel::ipc::Op::try_from(rx.opcode.unwrap()) {
-			Ok(kernel::ipc::Op::Read) => {
-				// Figure out object to read.
-				let data = unsafe {
-					core::slice::from_raw_parts_mut(rx.data.unwrap().as_ptr().cast(), rx.length)
-				};
-
-				let mut length = 0;
-
-				unsafe {
-					// Wait until data is available
-					// TODO this blocks writes from other tasks.
-					while USED_INDEX == NEW_INDEX {
-						process_events();
-						kernel::io_wait(50_000);
-					}
+		let mut progress = process_events() > 0;
+
+		for slot in pending.iter_mut().filter(|p| p.is_none()) {
+			match dux::ipc::try_receive() {
+				Some(rx) => {
+					*slot = Some(Pending {
+						packet: rx.clone(),
+						since: None,
+					})
+				}
+				None => break,
+			}
+			progress = true;
+		}
 
-					while USED_INDEX != NEW_INDEX && length < data.len() {
-						data[length] = BUFFER[usize::from(USED_INDEX) & (BUFFER.len() - 1)];
-						USED_INDEX = USED_INDEX.wrapping_add(1);
-						length += 1;
+		let now = dux::time::now();
+		let mut timeout = u64::MAX;
+		for slot in pending.iter_mut() {
+			let p = match slot {
+				Some(p) => p,
+				None => continue,
+			};
+			let rx = &p.packet;
+			let done = match (
+				kernel::ipc::Op::try_from(rx.opcode.unwrap()),
+				u128::from(rx.uuid),
+			) {
+				(Ok(kernel::ipc::Op::Read), 0) => read_text(rx),
+				(Ok(kernel::ipc::Op::Read), 1) => {
+					let available = usize::from(unsafe { EVENTS_NEW.wrapping_sub(EVENTS_USED) });
+					if available == 0 {
+						false
+					} else {
+						let deadline = p.since.get_or_insert(now).saturating_add(coalesce);
+						if available * 8 >= rx.length || now >= deadline {
+							read_events(rx);
+							true
+						} else {
+							timeout = timeout.min(deadline - now);
+							false
+						}
 					}
 				}
-
-				// Send completion event
-				*dux::ipc::transmit() = kernel::ipc::Packet {
-					uuid: kernel::ipc::UUID::INVALID,
-					opcode: Some(kernel::ipc::Op::Read.into()),
-					name: None,
-					name_len: 0,
-					flags: 0,
-					id: 0,
-					address: rx.address,
-					data: None,
-					length,
-					offset: 0,
-				};
+				// Just ignore other requests for now
+				_ => true,
+			};
+			if done {
+				free(rx);
+				*slot = None;
+				progress = true;
 			}
-			// Just ignore other requests for now
-			_ => (),
 		}
 
-		// Free ranges
-		if let Some(data) = rx.data {
-			let len = dux::Page::min_pages_for_range(rx.length);
-			let ret = unsafe { kernel::mem_dealloc(data.as_ptr() as *mut _, len) };
-			assert_eq!(ret.status, 0);
-			dux::ipc::add_free_range(
-				dux::Page::new(core::ptr::NonNull::new(data.as_ptr() as *mut _).unwrap()).unwrap(),
-				len,
-			)
-			.unwrap();
+		if !progress {
+			// Either the interrupt of the device, a new request or the end of a coalescing
+			// window wakes us up.
+			unsafe { kernel::io_wait(timeout) };
 		}
-		if let Some(name) = rx.name {
-			let len = dux::Page::min_pages_for_range(rx.name_len.into());
-			let ret = unsafe { kernel::mem_dealloc(name.as_ptr() as *mut _, len) };
-			assert_eq!(ret.status, 0);
-			dux::ipc::add_free_range(
-				dux::Page::new(core::ptr::NonNull::new(name.as_ptr() as *mut _).unwrap()).unwrap(),
-				len,
-			)
-			.unwrap();
+	}
+}
+
+/// A read request waiting for data.
+struct Pending {
+	packet: kernel::ipc::Packet,
+	/// When events first became available for this request.
+	since: Option<u64>,
+}
+
+/// Answer a read with text if any is available.
+fn read_text(rx: &kernel::ipc::Packet) -> bool {
+	// Figure out object to read.
+	let data =
+		unsafe { core::slice::from_raw_parts_mut(rx.data.unwrap().as_ptr().cast(), rx.length) };
+
+	let mut length = 0;
+
+	unsafe {
+		if USED_INDEX == NEW_INDEX {
+			return false;
+		}
+
+		while USED_INDEX != NEW_INDEX && length < data.len() {
+			data[length] = BUFFER[usize::from(USED_INDEX) & (BUFFER.len() - 1)];
+			USED_INDEX = USED_INDEX.wrapping_add(1);
+			length += 1;
 		}
 	}
+
+	reply(rx, length);
+	true
+}
+
+/// Answer a read with as many raw events as fit.
+fn read_events(rx: &kernel::ipc::Packet) {
+	let data: &mut [[u8; 8]] =
+		unsafe { core::slice::from_raw_parts_mut(rx.data.unwrap().as_ptr().cast(), rx.length / 8) };
+
+	let mut count = 0;
+
+	unsafe {
+		while EVENTS_USED != EVENTS_NEW && count < data.len() {
+			data[count] = EVENTS[usize::from(EVENTS_USED) & (EVENTS.len() - 1)];
+			EVENTS_USED = EVENTS_USED.wrapping_add(1);
+			count += 1;
+		}
+	}
+
+	reply(rx, count * 8);
 }
 
-fn process_events() {
+/// Send a completion event for a read.
+fn reply(rx: &kernel::ipc::Packet, length: usize) {
+	*dux::ipc::transmit() = kernel::ipc::Packet {
+		uuid: kernel::ipc::UUID::INVALID,
+		opcode: Some(kernel::ipc::Op::Read.into()),
+		name: None,
+		name_len: 0,
+		flags: 0,
+		id: rx.id,
+		address: rx.address,
+		data: None,
+		length,
+		offset: 0,
+	};
+}
+
+/// Free the ranges of a packet.
+fn free(rx: &kernel::ipc::Packet) {
+	if let Some(data) = rx.data {
+		let len = dux::Page::min_pages_for_range(rx.length);
+		let ret = unsafe { kernel::mem_dealloc(data.as_ptr() as *mut _, len) };
+		assert_eq!(ret.status, 0);
+		dux::ipc::add_free_range(
+			dux::Page::new(core::ptr::NonNull::new(data.as_ptr() as *mut _).unwrap()).unwrap(),
+			len,
+		)
+		.unwrap();
+	}
+	if let Some(name) = rx.name {
+		let len = dux::Page::min_pages_for_range(rx.name_len.into());
+		let ret = unsafe { kernel::mem_dealloc(name.as_ptr() as *mut _, len) };
+		assert_eq!(ret.status, 0);
+		dux::ipc::add_free_range(
+			dux::Page::new(core::ptr::NonNull::new(name.as_ptr() as *mut _).unwrap()).unwrap(),
+			len,
+		)
+		.unwrap();
+	}
+}
+
+/// Collect all events from the device and return the amount of events collected.
+fn process_events() -> usize {
 	let k_mods = unsafe { &mut KEY_MODIFIERS };
 	let putc = |on: bool, c: char| unsafe {
 		if on {
@@ -244,6 +388,13 @@ fn process_events() {
 	};
 	unsafe { DEVICE.as_mut().unwrap() }
 		.receive(&mut |evt| {
+			unsafe {
+				// Drop events if nobody reads them.
+				if usize::from(EVENTS_NEW.wrapping_sub(EVENTS_USED)) < EVENTS.len() {
+					EVENTS[usize::from(EVENTS_NEW) & (EVENTS.len() - 1)] = evt.to_bytes();
+					EVENTS_NEW = EVENTS_NEW.wrapping_add(1);
+				}
+			}
 			if let Some(k) = NonZeroU8::new(evt.code().try_into().unwrap()) {
 				use scancode::*;
 				let mut mods = Modifiers::new();
@@ -262,5 +413,5 @@ fn process_events() {
 				}
 			}
 		})
-		.unwrap();
+		.unwrap()
 }
@@ -4,10 +4,13 @@ use std::io::{Read, Write};
 use std::path::PathBuf;
 
 const BASE_DIR: &str = "../../..";
+/// The list used if `INITFS_LIST` isn't set, e.g. `make bench` uses `initfs.bench.list`.
 const LIST: &str = "initfs.list";
 
 fn main() {
-	let list = format!("{}/{}", BASE_DIR, LIST);
+	println!("cargo:rerun-if-env-changed=INITFS_LIST");
+	let list = env::var("INITFS_LIST").unwrap_or_else(|_| String::from(LIST));
+	let list = format!("{}/{}", BASE_DIR, list);
 
 	println!("cargo:rerun-if-changed={}", list);
 
@@ -31,6 +34,8 @@ fn main() {
 	pub struct Binary {{
 		name: &'static str,
 		compatible: &'static str,
+		/// The registry entries that must exist before the binary is started.
+		dependencies: &'static [&'static str],
 		data: &'static [u8],
 	}}
 
@@ -49,11 +54,19 @@ fn main() {
 			.and_then(|(n, r)| r.split_once(char::is_whitespace).map(|(c, p)| (n, c, p)))
 			.map(|(n, c, p)| (n, c.trim_start(), p.trim_start()))
 			.expect("expected name, compatibility and path");
-		dbg!(name, compat, path);
+		// Dependencies are optional and separated by commas as names may contain spaces.
+		let (path, deps) = path
+			.split_once(char::is_whitespace)
+			.map_or((path, ""), |(p, d)| (p, d.trim_start()));
+		let deps = deps
+			.split(',')
+			.map(str::trim)
+			.filter(|d| !d.is_empty())
+			.collect::<Vec<_>>();
 		let path = if &path[0..1] != "/" {
 			format!("{}/{}/{}", base_dir, BASE_DIR, path)
 		} else {
-			String::from(line)
+			String::from(path)
 		};
 		write!(
 			out,
@@ -63,10 +76,11 @@ fn main() {
 			Binary {{
 				name: {:?},
 				compatible: {:?},
+				dependencies: &{:?},
 				data: &ALIGNED.0,
 			}}
 		}},",
-			path, path, name, compat
+			path, path, name, compat, deps
 		)
 		.unwrap();
 	}
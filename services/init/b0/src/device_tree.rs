@@ -1,6 +1,7 @@
 //! # Device tree parsing.
 //!
-//! This module keeps track of used devices & their addresses.
+//! This module keeps track of used devices & their addresses. The tree is indexed once by
+//! [`load`] and the index is reused whenever the devices are iterated.
 
 use core::convert::{TryFrom, TryInto};
 
@@ -13,10 +14,9 @@ pub struct Device<'a> {
 	pub interrupt_map_mask: driver::InterruptMapMask,
 }
 
-pub fn iter_devices<F>(mut f: F)
-where
-	F: FnMut(Device),
-{
+/// Map the device tree and build an index of it, so the tree doesn't need to be scanned again
+/// each time the devices are iterated.
+pub fn load() -> device_tree::Index<'static, 'static> {
 	let dtb = unsafe {
 		let dtb = 0x100_0000 as *mut _;
 		let ret = kernel::sys_platform_info(dtb, 16);
@@ -26,121 +26,113 @@ where
 
 	let dtb = device_tree::DeviceTree::parse(dtb).unwrap();
 
-	if let Ok(node) = dtb.root() {
-		for node in node.children() {
-			if node.name == b"soc" {
-				for node in node.children() {
-					let mut child_address_cells = 0;
-					let mut child_interrupt_cells = 0;
-					let mut raw_compatible = &[][..];
-					let mut raw_ranges = &[][..];
-					let mut raw_reg = &[][..];
-					let mut raw_interrupt_map = &[][..];
-
-					for p in node.properties() {
-						match p.name {
-							b"compatible" => raw_compatible = p.value,
-							b"interrupt-map" => raw_interrupt_map = p.value,
-							b"ranges" => raw_ranges = p.value,
-							b"reg" => raw_reg = p.value,
-							b"#address-cells" => {
-								child_address_cells =
-									u32::from_be_bytes(p.value.try_into().unwrap())
-							}
-							b"#interrupt-cells" => {
-								child_interrupt_cells =
-									u32::from_be_bytes(p.value.try_into().unwrap())
-							}
-							_ => (),
-						}
+	let size = device_tree::Index::required_size(&dtb).unwrap();
+	let pages = dux::Page::min_pages_for_range(size);
+	let buffer = dux::mem::allocate_range(None, pages, dux::RWX::RW)
+		.expect("failed to allocate device tree index");
+	// SAFETY: the range is mapped and not used for anything else.
+	let buffer =
+		unsafe { core::slice::from_raw_parts_mut(buffer.as_ptr().cast(), pages * dux::Page::SIZE) };
+	device_tree::Index::build(dtb, buffer).unwrap()
+}
+
+pub fn iter_devices<F>(index: &device_tree::Index, mut f: F)
+where
+	F: FnMut(Device),
+{
+	for node in index.root().children() {
+		if node.name() == b"soc" {
+			for node in node.children() {
+				let child_address_cells = node.child_address_cells();
+				let child_interrupt_cells = node.child_interrupt_cells();
+				let mut raw_ranges = &[][..];
+				let mut raw_interrupt_map = &[][..];
+				let mut raw_interrupt_map_mask = None;
+
+				for p in node.properties() {
+					match p.name {
+						b"interrupt-map" => raw_interrupt_map = p.value,
+						b"interrupt-map-mask" => raw_interrupt_map_mask = Some(p.value),
+						b"ranges" => raw_ranges = p.value,
+						_ => (),
 					}
+				}
 
-					let name = node.name.split(|c| *c == b'@').next().unwrap();
+				let name = node.name().split(|c| *c == b'@').next().unwrap();
 
-					// Parse reg
-					let mut addr_size = [driver::Reg::new(0, 0); 8];
-					let mut reg = raw_reg;
-					let mut as_i = 0;
+				// Parse reg
+				let mut addr_size = [driver::Reg::new(0, 0); 8];
+				let mut as_i = 0;
+				for (a, s) in node.reg() {
+					addr_size[as_i] = driver::Reg::new(a, s);
+					as_i += 1;
+				}
 
-					while !reg.is_empty() {
-						let (a, r) = unpack_reg(reg, node.address_cells);
-						let (s, r) = unpack_reg(r, node.size_cells);
-						addr_size[as_i] = driver::Reg::new(a, s);
-						reg = r;
-						as_i += 1;
-					}
+				// Parse compatible
+				let mut compatible = [&[][..]; 8];
+				let mut c_i = 0;
+				for s in node.compatible() {
+					compatible[c_i] = s;
+					c_i += 1;
+				}
 
-					// Parse compatible
-					let mut compatible = [&[][..]; 8];
-					let mut c_i = 0;
-					for (i, s) in raw_compatible.split(|c| c == &b'\0').enumerate() {
-						compatible[i] = s;
-						c_i = i;
-					}
+				// Parse ranges
+				let mut ranges = [driver::Range::new(0, 0, 0); 8];
+				let mut r_i = 0;
+
+				while !raw_ranges.is_empty() {
+					let (c, r) = unpack_reg(raw_ranges, child_address_cells);
+					let (a, r) = unpack_reg(r, node.address_cells());
+					let (s, r) = unpack_reg(r, node.size_cells());
+					ranges[r_i] = driver::Range::new(c, a, s);
+					raw_ranges = r;
+					r_i += 1;
+				}
 
-					// Parse ranges
-					let mut ranges = [driver::Range::new(0, 0, 0); 8];
-					let mut r_i = 0;
-
-					while !raw_ranges.is_empty() {
-						let (c, r) = unpack_reg(raw_ranges, child_address_cells);
-						let (a, r) = unpack_reg(r, node.address_cells);
-						let (s, r) = unpack_reg(r, node.size_cells);
-						ranges[r_i] = driver::Range::new(c, a, s);
-						raw_ranges = r;
-						r_i += 1;
-					}
+				// Parse interrupt map
+				let mut interrupt_map = [driver::InterruptMap::new(0, 0, 0, 0, 0); 32];
+				let mut im_i = 0;
+
+				// FIXME retrieve this from the actual interrupt controller
+				let parent_address_cells = 0;
+				let parent_interrupt_cells = 1;
+
+				while !raw_interrupt_map.is_empty() {
+					let (ca, r) = unpack_reg(raw_interrupt_map, child_address_cells);
+					let (ci, r) = unpack_reg(r, child_interrupt_cells);
+					let (ph, r) = unpack_reg(r, 1);
+					let (pa, r) = unpack_reg(r, parent_address_cells);
+					let (pi, r) = unpack_reg(r, parent_interrupt_cells);
+					let ph = ph.try_into().unwrap();
+					interrupt_map[im_i] = driver::InterruptMap::new(ca, ci, ph, pa, pi);
+					im_i += 1;
+					raw_interrupt_map = r;
+				}
 
-					// Parse interrupt map
-					let mut interrupt_map = [driver::InterruptMap::new(0, 0, 0, 0, 0); 32];
-					let mut im_i = 0;
-
-					// FIXME retrieve this from the actual interrupt controller
-					let parent_address_cells = 0;
-					let parent_interrupt_cells = 1;
-
-					while !raw_interrupt_map.is_empty() {
-						let (ca, r) = unpack_reg(raw_interrupt_map, child_address_cells);
-						let (ci, r) = unpack_reg(r, child_interrupt_cells);
-						let (ph, r) = unpack_reg(r, 1);
-						let (pa, r) = unpack_reg(r, parent_address_cells);
-						let (pi, r) = unpack_reg(r, parent_interrupt_cells);
-						let ph = ph.try_into().unwrap();
-						interrupt_map[im_i] = driver::InterruptMap::new(ca, ci, ph, pa, pi);
-						im_i += 1;
-						raw_interrupt_map = r;
+				let interrupt_map_mask = if !interrupt_map[..im_i].is_empty() {
+					let (child_address, r) =
+						unpack_reg(raw_interrupt_map_mask.unwrap(), child_address_cells);
+					let (child_interrupt, r) = unpack_reg(r, child_interrupt_cells);
+					assert!(r.is_empty());
+					driver::InterruptMapMask {
+						child_address,
+						child_interrupt,
 					}
-
-					let interrupt_map_mask = if !interrupt_map[..im_i].is_empty() {
-						let raw_interrupt_map_mask = node
-							.properties()
-							.find(|p| p.name == b"interrupt-map-mask")
-							.map(|p| p.value)
-							.unwrap();
-						let (child_address, r) =
-							unpack_reg(raw_interrupt_map_mask, child_address_cells);
-						let (child_interrupt, r) = unpack_reg(r, child_interrupt_cells);
-						assert!(r.is_empty());
-						driver::InterruptMapMask {
-							child_address,
-							child_interrupt,
-						}
-					} else {
-						driver::InterruptMapMask {
-							child_address: 0,
-							child_interrupt: 0,
-						}
-					};
-
-					f(Device {
-						name,
-						reg: &addr_size[..as_i],
-						compatible: &compatible[..c_i],
-						ranges: &ranges[..r_i],
-						interrupt_map: &interrupt_map[..im_i],
-						interrupt_map_mask,
-					});
-				}
+				} else {
+					driver::InterruptMapMask {
+						child_address: 0,
+						child_interrupt: 0,
+					}
+				};
+
+				f(Device {
+					name,
+					reg: &addr_size[..as_i],
+					compatible: &compatible[..c_i],
+					ranges: &ranges[..r_i],
+					interrupt_map: &interrupt_map[..im_i],
+					interrupt_map_mask,
+				});
 			}
 		}
 	}
@@ -26,173 +26,182 @@ include!(concat!(env!("OUT_DIR"), "/list.rs"));
 
 use kernel::sys_log;
 
+/// Compatibles of binaries that are started regardless of the devices that are present.
+const SERVICES: &[&str] = &["fs", "console", "trace", "bench"];
+
+/// Binaries are started as soon as all of their dependencies are in the registry, without
+/// waiting on binaries they don't depend on. Whenever an entry is added to the registry, the
+/// binaries that are still waiting are checked again.
 #[export_name = "main"]
 fn main() {
 	unsafe { dux::init() };
 
-	device_tree::iter_devices(|dev| {
-		for bin in BINARIES.iter() {
-			if !dev.compatible.contains(&bin.compatible.as_bytes()) {
-				continue;
-			}
+	let devices = device_tree::load();
 
-			sys_log!(
-				"Using driver {:?} for {:?}",
-				bin.name,
-				core::str::from_utf8(dev.name).unwrap()
-			);
-
-			// FIXME completely, utterly unsound
-			let data = unsafe {
-				core::slice::from_raw_parts(
-					bin.data.as_ptr().cast(),
-					(bin.data.len() + dux::Page::OFFSET_MASK) / dux::Page::SIZE,
-				)
-			};
-
-			// Push arguments
-			let mut buf = [0u8; 4096];
-			let mut buf = &mut buf[..];
-			let mut args = [&[][..]; 128];
-			let mut argc = 0;
-
-			fn alloc<'a>(
-				buf: &'a mut [u8],
-				size: usize,
-			) -> Result<(&'a mut [u8], &'a mut [u8]), driver::OutOfMemory> {
-				if size <= buf.len() {
-					Ok(buf.split_at_mut(size))
-				} else {
-					Err(driver::OutOfMemory)
-				}
+	let mut started = [false; BINARIES.len()];
+	let mut first_pass = true;
+	loop {
+		// The generation of the registry if any binary is still waiting on a dependency.
+		let mut waiting = None;
+		let mut check = |bin: &Binary| match dependencies_ready(bin) {
+			Ok(()) => true,
+			Err(generation) => {
+				waiting.get_or_insert(generation);
+				false
 			}
-			let mut add_arg = |arg| {
-				*args.get_mut(argc).ok_or(driver::OutOfMemory)? = str::as_bytes(arg);
-				argc += 1;
-				Ok(())
-			};
-
-			for &r in dev.reg.iter() {
-				buf = r.to_args(buf, alloc, &mut add_arg).unwrap();
+		};
+
+		device_tree::iter_devices(&devices, |dev| {
+			let found = BINARIES
+				.iter()
+				.enumerate()
+				.find(|(_, bin)| dev.compatible.contains(&bin.compatible.as_bytes()));
+			match found {
+				Some((i, bin)) if !started[i] && check(bin) => {
+					spawn_driver(bin, &dev);
+					started[i] = true;
+				}
+				Some(_) => (),
+				None if first_pass => log_no_driver(&dev),
+				None => (),
 			}
-			for &r in dev.ranges {
-				buf = r.to_args(buf, alloc, &mut add_arg).unwrap();
+		});
+
+		for (i, bin) in BINARIES.iter().enumerate() {
+			if started[i] || !(SERVICES.contains(&bin.compatible) || bin.compatible == "init") {
+				continue;
 			}
-			for &im in dev.interrupt_map {
-				buf = im.to_args(buf, alloc, &mut add_arg).unwrap();
+			if !check(bin) {
+				continue;
 			}
-			if !dev.interrupt_map.is_empty() {
-				dev.interrupt_map_mask
-					.to_args(buf, alloc, &mut add_arg)
-					.unwrap();
+			if bin.compatible == "init" {
+				spawn_init(bin);
+			} else {
+				// TODO which terminology to use? Ports seems... wrong?
+				let ports = [];
+				let ports = &mut ports.iter().copied();
+				dux::task::spawn_elf(pages(bin), ports, &[]).expect("failed to spawn task");
 			}
+			started[i] = true;
+		}
 
-			// Spawn
-			let address = dux::task::spawn_elf(data, &mut [].iter().copied(), &args[..argc])
-				.expect("failed to spawn task");
-
-			sys_log!("Registering task {} as {:?}", address, bin.name);
+		first_pass = false;
+		match waiting {
+			Some(generation) => dux::task::registry::wait(generation),
+			None => break,
+		}
+	}
 
-			// Add to registry
-			dux::task::registry::add(bin.name.as_bytes(), address)
-				.expect("failed to add registry entry");
+	loop {
+		// Do nothing as we can't exit
+		unsafe { kernel::io_wait(u64::MAX) };
+	}
+}
 
-			return;
+/// Check whether all dependencies of a binary are in the registry. If not, return the
+/// generation of the registry to wait on.
+fn dependencies_ready(bin: &Binary) -> Result<(), usize> {
+	for dep in bin.dependencies {
+		if let Err(dux::task::registry::GetError::NotFound { generation }) =
+			dux::task::registry::get(dep.as_bytes())
+		{
+			return Err(generation);
 		}
+	}
+	Ok(())
+}
 
-		let _ = core::str::from_utf8(dev.name)
-			.map(|name| sys_log!("No driver found for {:?}", name))
-			.map_err(|_| sys_log!("No driver found for {:?}", dev.name));
-		for c in dev.compatible {
-			let _ = core::str::from_utf8(c)
-				.map(|c| sys_log!("  {:?}", c))
-				.map_err(|_| sys_log!("  {:?}", c));
-		}
-	});
-
-	BINARIES
-		.iter()
-		.filter(|e| ["fs", "console"].contains(&e.compatible))
-		.for_each(|e| {
-			// FIXME completely, utterly unsound
-			let data = unsafe {
-				core::slice::from_raw_parts(
-					e.data.as_ptr().cast(),
-					(e.data.len() + dux::Page::OFFSET_MASK) / dux::Page::SIZE,
-				)
-			};
-			// TODO which terminology to use? Ports seems... wrong?
-			let ports = [];
-			let ports = &mut ports.iter().copied();
-			dux::task::spawn_elf(data, ports, &[]).expect("failed to spawn task");
-		});
+fn pages(bin: &Binary) -> &'static [kernel::Page] {
+	// FIXME completely, utterly unsound
+	unsafe {
+		core::slice::from_raw_parts(
+			bin.data.as_ptr().cast(),
+			(bin.data.len() + dux::Page::OFFSET_MASK) / dux::Page::SIZE,
+		)
+	}
+}
 
-	// Wait for fatfs to come online
-	let fatfs_addr = loop {
-		let name = b"fatfs";
-		let ret = unsafe { kernel::sys_registry_get(name.as_ptr(), name.len()) };
-		if ret.status == 0 {
-			break ret.value;
+/// Spawn the driver for a device with the resources of the device as arguments and add it to
+/// the registry.
+fn spawn_driver(bin: &Binary, dev: &device_tree::Device) {
+	sys_log!(
+		"Using driver {:?} for {:?}",
+		bin.name,
+		core::str::from_utf8(dev.name).unwrap()
+	);
+
+	// Push arguments
+	let mut buf = [0u8; 4096];
+	let mut buf = &mut buf[..];
+	let mut args = [&[][..]; 128];
+	let mut argc = 0;
+
+	fn alloc<'a>(
+		buf: &'a mut [u8],
+		size: usize,
+	) -> Result<(&'a mut [u8], &'a mut [u8]), driver::OutOfMemory> {
+		if size <= buf.len() {
+			Ok(buf.split_at_mut(size))
+		} else {
+			Err(driver::OutOfMemory)
 		}
-		unsafe { kernel::io_wait(0) };
+	}
+	let mut add_arg = |arg| {
+		*args.get_mut(argc).ok_or(driver::OutOfMemory)? = str::as_bytes(arg);
+		argc += 1;
+		Ok(())
 	};
 
-	// Wait for uart / console to come online
-	let uart_addr = loop {
-		let name = b"QEMU Virtio Keyboard";
-		let ret = unsafe { kernel::sys_registry_get(name.as_ptr(), name.len()) };
-		if ret.status == 0 {
-			break ret.value;
-		}
-		unsafe { kernel::io_wait(0) };
-	};
+	for &r in dev.reg.iter() {
+		buf = r.to_args(buf, alloc, &mut add_arg).unwrap();
+	}
+	for &r in dev.ranges {
+		buf = r.to_args(buf, alloc, &mut add_arg).unwrap();
+	}
+	for &im in dev.interrupt_map {
+		buf = im.to_args(buf, alloc, &mut add_arg).unwrap();
+	}
+	if !dev.interrupt_map.is_empty() {
+		dev.interrupt_map_mask
+			.to_args(buf, alloc, &mut add_arg)
+			.unwrap();
+	}
 
-	// Wait for uart / console to come online
-	let console_addr = loop {
-		let name = b"console";
-		let ret = unsafe { kernel::sys_registry_get(name.as_ptr(), name.len()) };
-		if ret.status == 0 {
-			break ret.value;
-		}
-		unsafe { kernel::io_wait(0) };
-	};
+	// Spawn
+	let address = dux::task::spawn_elf(pages(bin), &mut [].iter().copied(), &args[..argc])
+		.expect("failed to spawn task");
 
-	BINARIES
-		.iter()
-		.filter(|e| e.compatible == "init")
-		.for_each(|e| {
-			// FIXME completely, utterly unsound
-			let data = unsafe {
-				core::slice::from_raw_parts(
-					e.data.as_ptr().cast(),
-					(e.data.len() + dux::Page::OFFSET_MASK) / dux::Page::SIZE,
-				)
-			};
-			// TODO which terminology to use? Ports seems... wrong?
-			let ports = [
-				(
-					dux::task::Address::from(uart_addr),
-					kernel::ipc::UUID::from(0x0),
-				),
-				(
-					dux::task::Address::from(console_addr),
-					kernel::ipc::UUID::from(0x0),
-				),
-				(
-					dux::task::Address::from(console_addr),
-					kernel::ipc::UUID::from(0x0),
-				),
-				(
-					dux::task::Address::from(fatfs_addr),
-					kernel::ipc::UUID::from(0x0),
-				),
-			];
-			let ports = &mut ports.iter().copied();
-			dux::task::spawn_elf(data, ports, &[]).expect("failed to spawn task");
-		});
+	sys_log!("Registering task {} as {:?}", address, bin.name);
 
-	loop {
-		// Do nothing as we can't exit
-		unsafe { kernel::io_wait(u64::MAX) };
+	// Add to registry
+	dux::task::registry::add(bin.name.as_bytes(), address).expect("failed to add registry entry");
+}
+
+/// Spawn init with the input, output and filesystem services as ports. Its dependencies must
+/// include them.
+fn spawn_init(bin: &Binary) {
+	let get = |name: &[u8]| dux::task::registry::get(name).expect("init dependency missing");
+	let fatfs_addr = get(b"fatfs");
+	let uart_addr = get(b"QEMU Virtio Keyboard");
+	let console_addr = get(b"console");
+	// TODO which terminology to use? Ports seems... wrong?
+	let ports = [
+		(uart_addr, kernel::ipc::UUID::from(0x0)),
+		(console_addr, kernel::ipc::UUID::from(0x0)),
+		(console_addr, kernel::ipc::UUID::from(0x0)),
+		(fatfs_addr, kernel::ipc::UUID::from(0x0)),
+	];
+	let ports = &mut ports.iter().copied();
+	dux::task::spawn_elf(pages(bin), ports, &[]).expect("failed to spawn task");
+}
+
+fn log_no_driver(dev: &device_tree::Device) {
+	let _ = core::str::from_utf8(dev.name)
+		.map(|name| sys_log!("No driver found for {:?}", name))
+		.map_err(|_| sys_log!("No driver found for {:?}", dev.name));
+	for c in dev.compatible {
+		let _ = core::str::from_utf8(c)
+			.map(|c| sys_log!("  {:?}", c))
+			.map_err(|_| sys_log!("  {:?}", c));
 	}
 }
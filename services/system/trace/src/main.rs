@@ -0,0 +1,197 @@
+//! # Trace drain
+//!
+//! Moves events out of the kernel's trace buffers before they are overwritten and periodically
+//! summarizes them in the kernel log: the amount of events of each kind, the most frequent
+//! syscalls, the time between interrupts and the next context switch and the counters of all
+//! tasks that ran.
+
+#![no_std]
+#![no_main]
+#![feature(asm)]
+#![feature(global_asm)]
+#![feature(panic_info_message)]
+
+#[panic_handler]
+fn panic_handler(info: &core::panic::PanicInfo) -> ! {
+	kernel::sys_log!("Panic!");
+	if let Some(m) = info.message() {
+		kernel::sys_log!("  Message: {}", m);
+	}
+	if let Some(l) = info.location() {
+		kernel::sys_log!("  Location: {}", l);
+	}
+	loop {}
+}
+
+mod rtbegin;
+
+use core::mem;
+use kernel::{sys_log, trace, TraceEvent};
+
+/// The amount of pages used to hold events read from the kernel.
+const BUFFER_PAGES: usize = 4;
+
+/// The amount of events read at once.
+const BUFFER_EVENTS: usize = BUFFER_PAGES * dux::Page::SIZE / mem::size_of::<TraceEvent>();
+
+/// How often the buffers of the kernel are drained, in microseconds.
+///
+/// Each hart has room for about 500 events, so this must be short enough that busy harts don't
+/// overwrite events before they are read.
+const DRAIN_INTERVAL: u64 = 100_000;
+
+/// How often a summary is logged, in microseconds.
+const REPORT_INTERVAL: u64 = 10_000_000;
+
+/// The amount of syscalls that are counted separately.
+const MAX_SYSCALLS: usize = 32;
+
+/// The amount of most frequent syscalls that are reported.
+const TOP_SYSCALLS: usize = 4;
+
+/// The amount of tasks whose counters are reported.
+const MAX_TASKS: usize = 16;
+
+/// The amount of harts whose interrupt latency is tracked.
+const MAX_HARTS: usize = 64;
+
+#[derive(Default)]
+struct Summary {
+	kinds: [u64; trace::COUNT],
+	syscalls: [u64; MAX_SYSCALLS],
+	lost: u64,
+	/// The total and maximum time between an interrupt and the next context switch on the
+	/// same hart, and the amount of such pairs.
+	irq_latency: (u64, u64, u64),
+}
+
+struct State {
+	summary: Summary,
+	/// The time of the last interrupt of each hart that wasn't followed by a switch yet.
+	interrupted: [Option<u64>; MAX_HARTS],
+	/// The tasks that ran since the start.
+	tasks: [Option<usize>; MAX_TASKS],
+}
+
+impl State {
+	fn add(&mut self, e: &TraceEvent) {
+		let s = &mut self.summary;
+		if let Some(k) = s.kinds.get_mut(usize::from(e.kind)) {
+			*k += 1;
+		}
+		match e.kind {
+			trace::SYSCALL => {
+				if let Some(c) = s.syscalls.get_mut(e.a) {
+					*c += 1;
+				}
+			}
+			trace::INTERRUPT => {
+				if let Some(t) = self.interrupted.get_mut(usize::from(e.hart)) {
+					t.get_or_insert(e.time);
+				}
+			}
+			trace::SWITCH => {
+				if let Some(t) = self.interrupted.get_mut(usize::from(e.hart)) {
+					if let Some(t) = t.take() {
+						let d = e.time.saturating_sub(t);
+						s.irq_latency.0 += d;
+						s.irq_latency.1 = s.irq_latency.1.max(d);
+						s.irq_latency.2 += 1;
+					}
+				}
+				if e.task != usize::MAX && !self.tasks.contains(&Some(e.task)) {
+					if let Some(slot) = self.tasks.iter_mut().find(|t| t.is_none()) {
+						*slot = Some(e.task);
+					}
+				}
+			}
+			trace::LOST => s.lost += u64::from(e.b),
+			_ => (),
+		}
+	}
+
+	fn report(&mut self) {
+		let s = mem::take(&mut self.summary);
+		if s.kinds.iter().all(|&k| k == 0) {
+			return;
+		}
+		sys_log!(
+			"trace: {} syscalls, {} ipc, {} switches, {} faults, {} interrupts, {} lost",
+			s.kinds[usize::from(trace::SYSCALL)],
+			s.kinds[usize::from(trace::IPC)],
+			s.kinds[usize::from(trace::SWITCH)],
+			s.kinds[usize::from(trace::PAGE_FAULT)],
+			s.kinds[usize::from(trace::INTERRUPT)],
+			s.lost,
+		);
+
+		let mut top = [(0, 0); TOP_SYSCALLS];
+		for (id, &n) in s.syscalls.iter().enumerate() {
+			if let Some(i) = top.iter().position(|&(_, m)| n > m) {
+				top[i..].rotate_right(1);
+				top[i] = (id, n);
+			}
+		}
+		for &(id, n) in top.iter().filter(|&&(_, n)| n > 0) {
+			sys_log!("trace:   syscall {:>2}: {}", id, n);
+		}
+
+		let (total, max, count) = s.irq_latency;
+		if count > 0 {
+			sys_log!(
+				"trace: interrupt to switch: avg {}us, max {}us",
+				total / count,
+				max
+			);
+		}
+
+		for &task in self.tasks.iter().flatten() {
+			let mut c = kernel::TaskCounters::default();
+			let ret = unsafe { kernel::task_counters(task, &mut c) };
+			if ret.status == kernel::Return::OK {
+				sys_log!(
+					"trace:   task {}: run {}us, ipc sent {} received {}, pages {}",
+					dux::task::Address::from(task),
+					c.run_time,
+					c.ipc_sent,
+					c.ipc_received,
+					c.pages_mapped,
+				);
+			}
+		}
+	}
+}
+
+#[export_name = "main"]
+fn main() {
+	unsafe { dux::init() };
+
+	let buffer = dux::mem::allocate_range(None, BUFFER_PAGES, dux::RWX::RW)
+		.expect("failed to allocate event buffer");
+	// SAFETY: the range is large enough and only accessed through this slice.
+	let buffer = unsafe {
+		core::slice::from_raw_parts_mut(buffer.as_ptr().cast::<TraceEvent>(), BUFFER_EVENTS)
+	};
+
+	let mut state = State {
+		summary: Summary::default(),
+		interrupted: [None; MAX_HARTS],
+		tasks: [None; MAX_TASKS],
+	};
+	let mut next_report = dux::time::now().saturating_add(REPORT_INTERVAL);
+	loop {
+		loop {
+			let ret = unsafe { kernel::sys_trace_read(buffer.as_mut_ptr(), buffer.len()) };
+			assert_eq!(ret.status, kernel::Return::OK, "failed to read trace");
+			buffer[..ret.value].iter().for_each(|e| state.add(e));
+			if ret.value < buffer.len() {
+				break;
+			}
+		}
+		if dux::time::now() >= next_report {
+			state.report();
+			next_report = dux::time::now().saturating_add(REPORT_INTERVAL);
+		}
+		unsafe { kernel::io_wait(DRAIN_INTERVAL) };
+	}
+}
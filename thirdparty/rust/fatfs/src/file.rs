@@ -9,6 +9,81 @@ use crate::time::{Date, DateTime, TimeProvider};
 
 const MAX_FILE_SIZE: u32 = core::u32::MAX;
 
+// Maximal number of cluster runs remembered for each file
+const MAX_EXTENTS: usize = 16;
+
+/// A run of clusters of a file that are consecutive on the disk.
+#[derive(Copy, Clone, Default, Debug)]
+struct Extent {
+    // index of the first cluster of the run in the file
+    index: u32,
+    // first cluster of the run on the disk
+    cluster: u32,
+    // number of clusters in the run
+    len: u32,
+}
+
+/// A map from cluster indices in a file to clusters on the disk.
+///
+/// The map is filled while the cluster chain is walked and always describes a prefix of the chain, so seeking inside
+/// the known part of a file does not need to read the FAT. Only the part after the prefix has to be walked. Once all
+/// extents are used the prefix stops growing.
+#[derive(Clone, Default, Debug)]
+struct ExtentMap {
+    extents: [Extent; MAX_EXTENTS],
+    len: usize,
+}
+
+impl ExtentMap {
+    // Number of clusters at the start of the file that are known
+    fn known_clusters(&self) -> u32 {
+        self.last().map_or(0, |(index, _)| index + 1)
+    }
+
+    // Returns the index and disk cluster of the last known cluster
+    fn last(&self) -> Option<(u32, u32)> {
+        self.extents[..self.len]
+            .last()
+            .map(|e| (e.index + e.len - 1, e.cluster + e.len - 1))
+    }
+
+    fn get(&self, index: u32) -> Option<u32> {
+        self.extents[..self.len]
+            .iter()
+            .find(|e| index >= e.index && index - e.index < e.len)
+            .map(|e| e.cluster + (index - e.index))
+    }
+
+    // Records the disk cluster of the given cluster index. Clusters not directly following the known prefix are ignored.
+    fn push(&mut self, index: u32, cluster: u32) {
+        if index != self.known_clusters() {
+            return;
+        }
+        if let Some(e) = self.extents[..self.len].last_mut() {
+            if e.cluster + e.len == cluster {
+                e.len += 1;
+                return;
+            }
+        }
+        if self.len < MAX_EXTENTS {
+            self.extents[self.len] = Extent { index, cluster, len: 1 };
+            self.len += 1;
+        }
+    }
+
+    // Forgets all clusters starting at the given index
+    fn truncate(&mut self, index: u32) {
+        while let Some(e) = self.extents[..self.len].last_mut() {
+            if e.index >= index {
+                self.len -= 1;
+            } else {
+                e.len = cmp::min(e.len, index - e.index);
+                break;
+            }
+        }
+    }
+}
+
 /// A FAT filesystem file object used for reading and writing data.
 ///
 /// This struct is created by the `open_file` or `create_file` methods on `Dir`.
@@ -21,6 +96,8 @@ pub struct File<'a, IO: ReadWriteSeek, TP, OCC> {
     offset: u32,
     // file dir entry editor - None for root dir
     entry: Option<DirEntryEditor>,
+    // known runs of the cluster chain
+    extents: ExtentMap,
     // file-system reference
     fs: &'a FileSystem<IO, TP, OCC>,
 }
@@ -37,6 +114,7 @@ impl<'a, IO: ReadWriteSeek, TP, OCC> File<'a, IO, TP, OCC> {
             fs,
             current_cluster: None, // cluster before first one
             offset: 0,
+            extents: ExtentMap::default(),
         }
     }
 
@@ -60,6 +138,8 @@ impl<'a, IO: ReadWriteSeek, TP, OCC> File<'a, IO, TP, OCC> {
             // Note: we cannot handle this case because there is no size field
             panic!("Trying to truncate a file without an entry");
         }
+        let clusters = self.fs.clusters_from_bytes(u64::from(self.offset));
+        self.extents.truncate(clusters);
         if let Some(current_cluster) = self.current_cluster {
             // current cluster is none only if offset is 0
             debug_assert!(self.offset > 0);
@@ -165,6 +245,44 @@ impl<'a, IO: ReadWriteSeek, TP, OCC> File<'a, IO, TP, OCC> {
         self.first_cluster
     }
 
+    // Returns the cluster following the current cluster. Must only be called if offset points to a cluster boundary.
+    fn next_cluster(&mut self) -> Result<Option<u32>, Error<IO::Error>> {
+        let index = self.offset / self.fs.cluster_size();
+        let next_cluster = match self.current_cluster {
+            None => self.first_cluster,
+            Some(n) => match self.extents.get(index) {
+                Some(n) => Some(n),
+                None => self.fs.cluster_iter(n).next().transpose()?,
+            },
+        };
+        if let Some(n) = next_cluster {
+            self.extents.push(index, n);
+        }
+        Ok(next_cluster)
+    }
+
+    // Returns the index and cluster of the cluster with the given index in the file, or of the last cluster if the
+    // chain is shorter.
+    fn find_cluster(&mut self, first_cluster: u32, index: u32) -> Result<(u32, u32), Error<IO::Error>> {
+        if let Some(n) = self.extents.get(index) {
+            return Ok((index, n));
+        }
+        // walk the chain starting at the end of the known prefix
+        let (mut i, mut cluster) = self.extents.last().unwrap_or((0, first_cluster));
+        self.extents.push(0, first_cluster);
+        let fs = self.fs;
+        let mut iter = fs.cluster_iter(cluster);
+        while i < index {
+            cluster = match iter.next() {
+                Some(r) => r?,
+                None => break,
+            };
+            i += 1;
+            self.extents.push(i, cluster);
+        }
+        Ok((i, cluster))
+    }
+
     fn flush(&mut self) -> Result<(), Error<IO::Error>> {
         self.flush_dir_entry()?;
         let mut disk = self.fs.disk.borrow_mut();
@@ -202,6 +320,7 @@ impl<IO: ReadWriteSeek, TP, OCC> Clone for File<'_, IO, TP, OCC> {
             current_cluster: self.current_cluster,
             offset: self.offset,
             entry: self.entry.clone(),
+            extents: self.extents.clone(),
             fs: self.fs,
         }
     }
@@ -217,17 +336,7 @@ impl<IO: ReadWriteSeek, TP: TimeProvider, OCC> Read for File<'_, IO, TP, OCC> {
         let cluster_size = self.fs.cluster_size();
         let current_cluster_opt = if self.offset % cluster_size == 0 {
             // next cluster
-            match self.current_cluster {
-                None => self.first_cluster,
-                Some(n) => {
-                    let r = self.fs.cluster_iter(n).next();
-                    match r {
-                        Some(Err(err)) => return Err(err),
-                        Some(Ok(n)) => Some(n),
-                        None => None,
-                    }
-                }
-            }
+            self.next_cluster()?
         } else {
             self.current_cluster
         };
@@ -293,17 +402,7 @@ impl<IO: ReadWriteSeek, TP: TimeProvider, OCC> Write for File<'_, IO, TP, OCC> {
         // Get cluster for write possibly allocating new one
         let current_cluster = if self.offset % cluster_size == 0 {
             // next cluster
-            let next_cluster = match self.current_cluster {
-                None => self.first_cluster,
-                Some(n) => {
-                    let r = self.fs.cluster_iter(n).next();
-                    match r {
-                        Some(Err(err)) => return Err(err),
-                        Some(Ok(n)) => Some(n),
-                        None => None,
-                    }
-                }
-            };
+            let next_cluster = self.next_cluster()?;
             if let Some(n) = next_cluster {
                 n
             } else {
@@ -313,6 +412,7 @@ impl<IO: ReadWriteSeek, TP: TimeProvider, OCC> Write for File<'_, IO, TP, OCC> {
                 if self.first_cluster.is_none() {
                     self.set_first_cluster(new_cluster);
                 }
+                self.extents.push(self.offset / cluster_size, new_cluster);
                 new_cluster
             }
         } else {
@@ -404,16 +504,10 @@ impl<IO: ReadWriteSeek, TP, OCC> Seek for File<'_, IO, TP, OCC> {
             // Note: new_offset_in_clusters cannot be 0 here because new_offset is not 0
             debug_assert!(new_offset_in_clusters > 0);
             let clusters_to_skip = new_offset_in_clusters - 1;
-            let mut cluster = first_cluster;
-            let mut iter = self.fs.cluster_iter(first_cluster);
-            for i in 0..clusters_to_skip {
-                cluster = if let Some(r) = iter.next() {
-                    r?
-                } else {
-                    // cluster chain ends before the new position - seek to the end of the last cluster
-                    new_offset = self.fs.bytes_from_clusters(i + 1) as u32;
-                    break;
-                };
+            let (i, cluster) = self.find_cluster(first_cluster, clusters_to_skip)?;
+            if i < clusters_to_skip {
+                // cluster chain ends before the new position - seek to the end of the last cluster
+                new_offset = self.fs.bytes_from_clusters(i + 1) as u32;
             }
             Some(cluster)
         } else {